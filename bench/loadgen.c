@@ -0,0 +1,725 @@
+#include "loadgen.h"
+
+int main(int argc, char * argv[])
+{
+	lg_config_t config = {
+		.host = LG_DEFAULT_HOST,
+		.port = PORT_NUM,
+		.msgs = LG_DEFAULT_MSGS,
+		.pubs = { 1, 4 }, .num_pubs = 2,
+		.subs = { 1, 16 }, .num_subs = 2,
+		.topics = { 1 }, .num_topics = 1,
+		.sizes = { 64, 1024 }, .num_sizes = 2,
+		.data = { LG_DATA_TEXT }, .num_data = 1,
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:f:u:mg:azk:w:F:n:P:S:T:s:c:h")) != -1) {
+		switch (opt) {
+			case 'H':
+				config.host = optarg;
+				break;
+			case 'p':
+				config.port = atoi(optarg);
+				break;
+			case 'f':
+				config.sub_port = atoi(optarg);
+				break;
+			case 'u':
+				config.uds_path = optarg;
+				break;
+			case 'm':
+				config.shm = true;
+				break;
+			case 'g':
+				config.mcast_if = optarg;
+				break;
+			case 'a':
+				config.alias = true;
+				break;
+			case 'z':
+				config.compress = true;
+				break;
+			case 'k':
+				config.tune = sscanf(optarg, "%u:%u", &config.flush_bytes, &config.flush_usec) == 2;
+				if (!config.tune) {
+					usage(argv[0]);
+					return ERR;
+				}
+				break;
+			case 'w':
+				config.window = sscanf(optarg, "%u:%u", &config.win_bytes, &config.win_msgs) == 2;
+				if (!config.window) {
+					usage(argv[0]);
+					return ERR;
+				}
+				break;
+			case 'F':
+				config.classes = atoi(optarg);
+				if (config.classes <= 0 || config.classes > UINT8_MAX + 1) {
+					usage(argv[0]);
+					return ERR;
+				}
+				break;
+			case 'n':
+				config.msgs = atoi(optarg);
+				break;
+			case 'P':
+				config.num_pubs = parse_list(optarg, config.pubs);
+				break;
+			case 'S':
+				config.num_subs = parse_list(optarg, config.subs);
+				break;
+			case 'T':
+				config.num_topics = parse_list(optarg, config.topics);
+				break;
+			case 's':
+				config.num_sizes = parse_list(optarg, config.sizes);
+				break;
+			case 'c':
+				config.num_data = parse_data(optarg, config.data);
+				break;
+			default:
+				usage(argv[0]);
+				return ERR;
+		}
+	}
+	if (config.msgs <= 0 || config.num_pubs <= 0 || config.num_subs <= 0 ||
+		config.num_topics <= 0 || config.num_sizes <= 0 || config.num_data <= 0 || (config.shm && config.uds_path == NULL) ||
+		(config.shm && config.mcast_if != NULL) || ((config.compress || config.classes > 0) && (config.shm || config.mcast_if != NULL))) {
+		usage(argv[0]);
+		return ERR;
+	}
+
+	config.addr = (bridge_addr_t) { .host = config.host, .port = config.port, .path = config.uds_path };
+	config.sub_addr = config.addr;
+	if (config.sub_port != 0) {
+		config.sub_addr.port = config.sub_port;
+	}
+
+	/* Broken connections are handled where they are written to */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Every combination is one row, in a stable order so outputs can be diffed */
+	int min_size = config.classes > 0 ? LG_CLASS_OFF + 1 : LG_STAMP_LEN;
+	printf("%s\n", LG_CSV_HEADER);
+	int id = 0;
+	for (int p = 0; p < config.num_pubs; p++) {
+		for (int s = 0; s < config.num_subs; s++) {
+			for (int t = 0; t < config.num_topics; t++) {
+				for (int z = 0; z < config.num_sizes; z++) {
+					for (int d = 0; d < config.num_data; d++) {
+						lg_run_t run = {
+							.config = &config,
+							.id = id++,
+							.pubs = config.pubs[p],
+							.subs = config.subs[s],
+							.topics = config.topics[t],
+							.size = config.sizes[z] < min_size ? min_size : config.sizes[z],
+							.data = config.data[d],
+						};
+						if (run_bench(&run) != OK) {
+							fprintf(stderr, "Error : failed to run against %s:%u\n", config.host, config.port);
+							return ERR;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return OK;
+}
+
+int parse_list(const char * str, int * list)
+{
+	int num = 0;
+	while (*str != '\0') {
+		char * end;
+		long val = strtol(str, &end, 10);
+		if (end == str || val <= 0 || num >= LG_MAX_SWEEP) {
+			return ERR;
+		}
+		list[num++] = val;
+		str = (*end == ',') ? end + 1 : end;
+		if (*end != ',' && *end != '\0') {
+			return ERR;
+		}
+	}
+	return num > 0 ? num : ERR;
+}
+
+int parse_data(const char * str, int * list)
+{
+	int num = 0;
+	while (*str != '\0') {
+		size_t len = strcspn(str, ",");
+		if (num >= LG_MAX_SWEEP) {
+			return ERR;
+		}
+		if (len == strlen("text") && strncmp(str, "text", len) == 0) {
+			list[num++] = LG_DATA_TEXT;
+		} else if (len == strlen("random") && strncmp(str, "random", len) == 0) {
+			list[num++] = LG_DATA_RANDOM;
+		} else {
+			return ERR;
+		}
+		str += len;
+		if (*str == ',') {
+			str++;
+		}
+	}
+	return num > 0 ? num : ERR;
+}
+
+void lg_fill(const lg_run_t * run, char * buf, size_t len)
+{
+	if (run->data == LG_DATA_TEXT) {
+		for (size_t i = 0; i < len; i++) {
+			buf[i] = LG_TEXT[i % strlen(LG_TEXT)];
+		}
+		return;
+	}
+
+	/* xorshift64, seeded per run */
+	uint64_t x = 0x9E3779B97F4A7C15ull ^ run->id;
+	for (size_t i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = x >> 56;
+	}
+}
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void lg_topic(const lg_run_t * run, int index, char * topic)
+{
+	/* New topics every run so that subscribers of previous runs are not hit */
+	snprintf(topic, P_TOPIC_LEN+1, "b%02u%04u", (unsigned) run->id % 100, (unsigned) index % 10000);
+}
+
+int lg_read(lg_reader_t * reader, char * buf, size_t len)
+{
+	while (len > 0) {
+		if (reader->pos == reader->len) {
+			ssize_t ret = recv(reader->sock, reader->buf, LG_READ_BUF, 0);
+			if (ret <= 0) {
+				return ERR;
+			}
+			reader->pos = 0;
+			reader->len = ret;
+		}
+
+		size_t n = MIN(len, reader->len - reader->pos);
+		memcpy(buf, reader->buf + reader->pos, n);
+		reader->pos += n;
+		buf += n;
+		len -= n;
+	}
+	return OK;
+}
+
+int lg_tune(lg_run_t * run, int topic)
+{
+	char name[P_TOPIC_LEN+1];
+	lg_topic(run, topic, name);
+	return bridge_tune(&run->config->addr, name, run->config->flush_bytes, run->config->flush_usec);
+}
+
+void * run_sub(void * args)
+{
+	lg_sub_t * sub = args;
+
+	/* The send time is split over frames if the first one is short */
+	char stamp[LG_STAMP_LEN];
+	size_t stamp_len = 0;
+	bridge_view_t view;
+	while (sub->received < sub->expected && now_ns() < sub->run->deadline) {
+		if (bridge_next(sub->client, &view, LG_WAIT_MS) != OK) {
+			continue;
+		}
+
+		if (view.type == BRIDGE_END) {
+			lg_received(sub, stamp, stamp_len);
+			stamp_len = 0;
+			continue;
+		}
+
+		/* The rest of the message is lost, it is not counted */
+		if (view.type == BRIDGE_CUT) {
+			stamp_len = 0;
+			continue;
+		}
+
+		size_t n = MIN(view.len, LG_STAMP_LEN - stamp_len);
+		memcpy(stamp + stamp_len, view.data, n);
+		stamp_len += n;
+		sub->bytes += view.len;
+	}
+
+	return NULL;
+}
+
+void * run_shm_sub(void * args)
+{
+	lg_sub_t * sub = args;
+
+	char stamp[LG_STAMP_LEN];
+	size_t stamp_len = 0;
+	char data[SHM_SLOT_DATA];
+	while (sub->received < sub->expected && now_ns() < sub->run->deadline) {
+		uint32_t len, flags;
+		if (shm_read(&sub->shm, data, &len, &flags) != OK) {
+			sched_yield();
+			continue;
+		}
+
+		if (flags & SHM_FLAG_END) {
+			lg_received(sub, stamp, stamp_len);
+			stamp_len = 0;
+			continue;
+		}
+
+		size_t n = MIN(len, LG_STAMP_LEN - stamp_len);
+		memcpy(stamp + stamp_len, data, n);
+		stamp_len += n;
+		sub->bytes += len;
+	}
+
+	/* Overwritten slots never arrive, so they count as lost */
+	shm_detach(&sub->shm);
+	return NULL;
+}
+
+void * run_mcast_sub(void * args)
+{
+	lg_sub_t * sub = args;
+	lg_reader_t * reader = &sub->reader;
+
+	char stamp[LG_STAMP_LEN];
+	size_t stamp_len = 0;
+	char dgram[MCAST_DGRAM_LEN];
+	while (sub->received < sub->expected && now_ns() < sub->run->deadline) {
+
+		/* Deliver the chunks that are next in sequence */
+		lg_chunk_t * chunk = &sub->chunks[sub->next & (MCAST_REPAIR_SLOTS - 1)];
+		if (chunk->seq == sub->next) {
+			if (chunk->flags & MCAST_FLAG_END) {
+				lg_received(sub, stamp, stamp_len);
+				stamp_len = 0;
+			} else if (!(chunk->flags & LG_FLAG_LOST)) {
+				size_t n = MIN(chunk->len, LG_STAMP_LEN - stamp_len);
+				memcpy(stamp + stamp_len, chunk->data, n);
+				stamp_len += n;
+				sub->bytes += chunk->len;
+			}
+			sub->next++;
+			continue;
+		}
+
+		/* Repairs may already be buffered */
+		struct pollfd fds[2] = {
+			{ .fd = sub->udp, .events = POLLIN },
+			{ .fd = reader->sock, .events = POLLIN },
+		};
+		int ret = reader->pos < reader->len ? 1 : poll(fds, 2, LG_NAK_IDLE_MS);
+		if (ret == 0) {
+			/* Nothing for a while, the last datagrams may have been lost */
+			lg_nak(sub, sub->next, MCAST_MAX_NAK);
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			ssize_t len = recv(sub->udp, dgram, sizeof(dgram), 0);
+			if (len >= MCAST_HDR_LEN && proto_get32(dgram) == sub->topic_id) {
+				lg_chunk(sub, dgram, len);
+			}
+		}
+
+		if (reader->pos < reader->len || (fds[1].revents & POLLIN)) {
+			char type, buf[8];
+			if (lg_read(reader, &type, 1) != OK) {
+				break;
+			}
+			if (type == MCAST_MSG_REPAIR) {
+				if (lg_read(reader, buf, 2) != OK) {
+					break;
+				}
+				size_t len = ((uint8_t) buf[0] << 8) | (uint8_t) buf[1];
+				if (len < MCAST_HDR_LEN || len > MCAST_DGRAM_LEN || lg_read(reader, dgram, len) != OK) {
+					break;
+				}
+				sub->repaired++;
+				lg_chunk(sub, dgram, len);
+			} else if (type == MCAST_MSG_LOST) {
+				if (lg_read(reader, buf, 8) != OK) {
+					break;
+				}
+				uint64_t seq = proto_get64(buf);
+				lg_chunk_t * lost = &sub->chunks[seq & (MCAST_REPAIR_SLOTS - 1)];
+				if (seq >= sub->next && lost->seq != seq) {
+					*lost = (lg_chunk_t) { .seq = seq, .flags = LG_FLAG_LOST };
+				}
+			}
+		}
+	}
+
+	close(sub->udp);
+	return NULL;
+}
+
+int lg_join(lg_sub_t * sub, const char * resp)
+{
+	struct ip_mreq mreq;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	memcpy(&addr.sin_addr.s_addr, resp, 4);
+	memcpy(&addr.sin_port, resp + 4, 2);
+	mreq.imr_multiaddr = addr.sin_addr;
+	sub->next = proto_get64(resp + 6) + 1;
+	sub->nak_upto = sub->next - 1;
+	sub->topic_id = proto_get32(resp + 14);
+
+	/* Bound to the group so that only its datagrams are received */
+	int opt = 1, rcvbuf = LG_UDP_RCVBUF;
+	sub->udp = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sub->udp < 0 || inet_pton(AF_INET, sub->run->config->mcast_if, &mreq.imr_interface) != 1 ||
+		setsockopt(sub->udp, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+		bind(sub->udp, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		setsockopt(sub->udp, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		if (sub->udp >= 0) {
+			close(sub->udp);
+		}
+		return ERR;
+	}
+	setsockopt(sub->udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	sub->chunks = calloc(MCAST_REPAIR_SLOTS, sizeof(lg_chunk_t));
+	return sub->chunks == NULL ? ERR : OK;
+}
+
+void lg_chunk(lg_sub_t * sub, const char * dgram, size_t len)
+{
+	uint64_t seq = proto_get64(dgram + MCAST_TOPIC_LEN + 1);
+
+	/* Already delivered, or too far ahead to be kept */
+	if (seq < sub->next || seq >= sub->next + MCAST_REPAIR_SLOTS) {
+		return;
+	}
+
+	lg_chunk_t * chunk = &sub->chunks[seq & (MCAST_REPAIR_SLOTS - 1)];
+	chunk->seq = seq;
+	chunk->flags = dgram[MCAST_TOPIC_LEN];
+	chunk->len = len - MCAST_HDR_LEN;
+	memcpy(chunk->data, dgram + MCAST_HDR_LEN, chunk->len);
+
+	/* A gap before it, ask once for the missing ones */
+	if (seq > sub->nak_upto + 1) {
+		uint64_t first = sub->next > sub->nak_upto + 1 ? sub->next : sub->nak_upto + 1;
+		lg_nak(sub, first, seq - first);
+	}
+	if (seq > sub->nak_upto) {
+		sub->nak_upto = seq;
+	}
+}
+
+void lg_nak(lg_sub_t * sub, uint64_t first, uint64_t count)
+{
+	char nak[MCAST_NAK_LEN];
+	count = MIN(count, MCAST_MAX_NAK);
+	nak[0] = MCAST_MSG_NAK;
+	proto_put64(nak + 1, first);
+	nak[9] = (count >> 8) & 0xFF;
+	nak[10] = count & 0xFF;
+	bridge_write(sub->reader.sock, nak, sizeof(nak));
+}
+
+int lg_subscribe(lg_sub_t * sub, int topic)
+{
+	const lg_config_t * config = sub->run->config;
+	char req[P_CMD_LEN + P_TOPIC_LEN + 1];
+	lg_topic(sub->run, topic, req + P_CMD_LEN);
+	if (!config->shm && config->mcast_if == NULL) {
+		bridge_filter_t filter = { .kind = BRIDGE_PREFIX, .offset = LG_CLASS_OFF, .len = 1, .value = { sub->class_id } };
+		sub->client = bridge_subscribe(&config->sub_addr, req + P_CMD_LEN, config->compress,
+			config->classes > 0 ? &filter : NULL);
+		return sub->client != NULL ? OK : ERR;
+	}
+
+	req[0] = config->shm ? P_CMD_MAP : P_CMD_GROUP;
+	sub->reader.sock = bridge_connect(&config->sub_addr);
+	if (sub->reader.sock == ERR || bridge_write(sub->reader.sock, req, P_CMD_LEN + P_TOPIC_LEN) != OK) {
+		return ERR;
+	}
+
+	/* The ring comes with the OK, the connection is not needed afterwards */
+	char resp;
+	if (config->shm) {
+		int fd;
+		int ret = uds_recv_fd(sub->reader.sock, &fd, &resp, 1) == 1 && resp == SERVER_MSG_OK[0] &&
+			fd != ERR && shm_attach(&sub->shm, fd) == OK ? OK : ERR;
+		if (fd != ERR) {
+			close(fd);
+		}
+		return ret;
+	}
+
+	/* The group, port, sequence and topic id come with the OK */
+	char group[4 + 2 + 8 + 4];
+	return (lg_read(&sub->reader, &resp, 1) == OK && resp == SERVER_MSG_OK[0] &&
+		lg_read(&sub->reader, group, sizeof(group)) == OK && lg_join(sub, group) == OK) ? OK : ERR;
+}
+
+void lg_received(lg_sub_t * sub, const char * stamp, size_t stamp_len)
+{
+	uint64_t sent, now = now_ns();
+	memcpy(&sent, stamp, sizeof(sent));
+	if (stamp_len == LG_STAMP_LEN && sent >= sub->run->start && sent <= now) {
+		sub->lat[sub->samples++] = now - sent;
+	}
+	sub->received++;
+}
+
+void * run_pub(void * args)
+{
+	lg_pub_t * pub = args;
+	lg_run_t * run = pub->run;
+
+	char * data = malloc(run->size);
+	if (data == NULL) {
+		return NULL;
+	}
+	char topic[P_TOPIC_LEN+1];
+	lg_topic(run, pub->topic, topic);
+	lg_fill(run, data, run->size);
+
+	for (int i = 0; i < run->config->msgs; i++) {
+		uint64_t sent = now_ns();
+		memcpy(data, &sent, sizeof(sent));
+		if (run->config->classes > 0) {
+			data[LG_CLASS_OFF] = i % run->config->classes;
+		}
+		if (bridge_send(&run->config->addr, topic, data, run->size, run->config->window) == OK) {
+			pub->sent++;
+		}
+	}
+
+	free(data);
+	return NULL;
+}
+
+void * run_alias_pub(void * args)
+{
+	lg_pub_t * pub = args;
+	lg_run_t * run = pub->run;
+
+	/* Without a window, every message is acknowledged and waited for */
+	const lg_config_t * config = run->config;
+	bridge_pub_t * client = bridge_publisher(&config->addr, config->window ? config->win_bytes : 0,
+		config->window ? config->win_msgs : 0);
+	char * data = malloc(run->size);
+	char topic[P_TOPIC_LEN+1];
+	lg_topic(run, pub->topic, topic);
+	if (client == NULL || data == NULL || run->size > BRIDGE_MSG_MAX || bridge_topic(client, topic) == ERR) {
+		bridge_close(client);
+		free(data);
+		return NULL;
+	}
+	lg_fill(run, data, run->size);
+
+	for (int i = 0; i < config->msgs; i++) {
+		uint64_t sent = now_ns();
+		memcpy(data, &sent, sizeof(sent));
+		if (config->classes > 0) {
+			data[LG_CLASS_OFF] = i % config->classes;
+		}
+		if (bridge_publish(client, 0, data, run->size) != OK || (!config->window && bridge_drain(client) != OK)) {
+			break;
+		}
+	}
+
+	/* Only what the broker acknowledged counts as sent */
+	bridge_drain(client);
+	pub->sent = client->acked;
+	bridge_close(client);
+	free(data);
+	return NULL;
+}
+
+int compare_lat(const void * a, const void * b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+int run_bench(lg_run_t * run)
+{
+	lg_sub_t * subs = calloc(run->subs, sizeof(lg_sub_t));
+	lg_pub_t * pubs = calloc(run->pubs, sizeof(lg_pub_t));
+	pthread_t * sub_thrs = calloc(run->subs, sizeof(pthread_t));
+	pthread_t * pub_thrs = calloc(run->pubs, sizeof(pthread_t));
+	if (subs == NULL || pubs == NULL || sub_thrs == NULL || pub_thrs == NULL) {
+		return ERR;
+	}
+
+	/* Publishers and subscribers are spread evenly over the topics */
+	for (int i = 0; i < run->pubs; i++) {
+		pubs[i].run = run;
+		pubs[i].topic = i % run->topics;
+	}
+
+	/* Tune the topics on the publishers' broker before anything is sent */
+	int ret = OK;
+	for (int i = 0; i < run->topics && run->config->tune; i++) {
+		if (lg_tune(run, i) != OK) {
+			ret = ERR;
+		}
+	}
+
+	/* Subscribe everyone before publishing so that no message is missed */
+	int subscribed = 0;
+	for (int i = 0; i < run->subs && ret == OK; i++) {
+		lg_sub_t * sub = &subs[i];
+		sub->run = run;
+		int topic = i % run->topics;
+
+		/* With classes, the subscribers of a topic take them in turn */
+		int msgs = run->config->msgs;
+		if (run->config->classes > 0) {
+			sub->class_id = (i / run->topics) % run->config->classes;
+			msgs = msgs / run->config->classes + (sub->class_id < msgs % run->config->classes);
+		}
+		for (int j = 0; j < run->pubs; j++) {
+			sub->expected += (pubs[j].topic == topic) ? msgs : 0;
+		}
+		sub->lat = malloc(sizeof(uint64_t) * (sub->expected + 1));
+		sub->reader.sock = ERR;
+		if (sub->lat == NULL || lg_subscribe(sub, topic) != OK) {
+			if (sub->reader.sock != ERR) {
+				close(sub->reader.sock);
+			}
+			bridge_unsubscribe(sub->client);
+			ret = ERR;
+			break;
+		}
+		subscribed++;
+	}
+
+	/* Subscriptions on another broker take a moment to reach this one */
+	if (ret == OK && run->config->sub_port != 0) {
+		usleep(LG_FED_SETTLE_MS * 1000);
+	}
+
+	/* Time from the first publish to the last delivery */
+	run->start = now_ns();
+	run->deadline = run->start + (uint64_t) LG_TIMEOUT_SEC * 1000000000;
+	int sub_started = 0, pub_started = 0;
+	if (ret == OK) {
+		for (; sub_started < run->subs; sub_started++) {
+			void * (* run_fn)(void *) = run->config->shm ? run_shm_sub : (run->config->mcast_if != NULL ? run_mcast_sub : run_sub);
+			if (pthread_create(&sub_thrs[sub_started], NULL, run_fn, &subs[sub_started])) {
+				break;
+			}
+		}
+		for (; pub_started < run->pubs; pub_started++) {
+			if (pthread_create(&pub_thrs[pub_started], NULL, run->config->alias ? run_alias_pub : run_pub, &pubs[pub_started])) {
+				break;
+			}
+		}
+	}
+	for (int i = 0; i < pub_started; i++) {
+		pthread_join(pub_thrs[i], NULL);
+	}
+	for (int i = 0; i < sub_started; i++) {
+		pthread_join(sub_thrs[i], NULL);
+	}
+	double secs = (now_ns() - run->start) / 1e9;
+
+	/* Gather the results */
+	uint64_t sent = 0, expected = 0, delivered = 0, samples = 0, bytes = 0;
+	for (int i = 0; i < run->pubs; i++) {
+		sent += pubs[i].sent;
+	}
+	uint64_t * lat = malloc(sizeof(uint64_t) * (run->subs * (uint64_t) run->pubs * run->config->msgs + 1));
+	for (int i = 0; i < run->subs; i++) {
+		expected += subs[i].expected;
+		if (lat != NULL) {
+			memcpy(lat + samples, subs[i].lat, sizeof(uint64_t) * subs[i].samples);
+		}
+		samples += subs[i].samples;
+		delivered += subs[i].received;
+		bytes += subs[i].bytes;
+	}
+	double p50 = 0, p99 = 0, p999 = 0;
+	if (lat != NULL && samples > 0) {
+		qsort(lat, samples, sizeof(uint64_t), compare_lat);
+		p50 = lat[(uint64_t) (samples * 0.5)] / 1e3;
+		p99 = lat[(uint64_t) (samples * 0.99)] / 1e3;
+		p999 = lat[(uint64_t) (samples * 0.999)] / 1e3;
+	}
+
+	if (ret == OK) {
+		printf("%d,%d,%d,%d,%s,%lu,%lu,%lu,%.3f,%.1f,%.3f,%.1f,%.1f,%.1f\n",
+			run->pubs, run->subs, run->topics, run->size, run->data == LG_DATA_TEXT ? "text" : "random", sent, delivered, expected - delivered,
+			secs, sent / secs, bytes / secs / 1e6, p50, p99, p999);
+		fflush(stdout);
+	}
+
+	/* Closing the subscriber connections, the broker drops them on next use */
+	for (int i = 0; i < subscribed; i++) {
+		if (subs[i].reader.sock != ERR) {
+			close(subs[i].reader.sock);
+		}
+		bridge_unsubscribe(subs[i].client);
+	}
+	for (int i = 0; i < run->subs; i++) {
+		free(subs[i].lat);
+		free(subs[i].chunks);
+	}
+	free(lat);
+	free(subs);
+	free(pubs);
+	free(sub_thrs);
+	free(pub_thrs);
+	return ret;
+}
+
+void usage(const char * prog)
+{
+	fprintf(stderr,
+		"Usage : %s [-H host] [-p port] [-f port] [-u path] [-a] [-z] [-k bytes:usec] [-w bytes:msgs] [-F classes] [-n msgs] [-P pubs] [-S subs] [-T topics] [-s sizes] [-c data]\n"
+		"  -H host    IPv4 address of the broker (default %s)\n"
+		"  -p port    Port of the broker (default %u)\n"
+		"  -f port    Subscribers connect to the broker at this port instead, which\n"
+		"             is linked to the publishers' broker (bridge -f)\n"
+		"  -u path    Unix domain socket of the broker, instead of host and port\n"
+		"  -m         Subscribers read the shared-memory rings of the topics (needs -u)\n"
+		"  -g ifaddr  Subscribers subscribe over multicast, joining on the interface\n"
+		"             at ifaddr (the broker must run with -g)\n"
+		"  -a         Publishers publish by alias over one session each\n"
+		"  -z         Subscribers accept compressed frames\n"
+		"  -k bytes:usec  Have the broker hold back up to bytes of output per\n"
+		"             message for up to usec microseconds on the topics (0:0 to\n"
+		"             send each chunk as it comes)\n"
+		"  -w bytes:msgs  Have the broker acknowledge the publishers once per bytes\n"
+		"             or msgs (0 for none, 0:0 once per message), sessions (-a)\n"
+		"             sending their messages without waiting\n"
+		"  -F classes Messages are given classes in turn, and subscribers only get\n"
+		"             those of one class, filtered by the broker\n"
+		"  -n msgs    Messages sent by each publisher per run (default %d)\n"
+		"  -P pubs    Comma separated numbers of publishers to sweep (default 1,4)\n"
+		"  -S subs    Comma separated numbers of subscribers to sweep (default 1,16)\n"
+		"  -T topics  Comma separated numbers of topics to sweep (default 1)\n"
+		"  -s sizes   Comma separated payload sizes in bytes to sweep (default 64,1024)\n"
+		"  -c data    Comma separated payload contents to sweep, text or random\n"
+		"             (default text)\n"
+		"Prints one CSV row per combination: %s\n",
+		prog, LG_DEFAULT_HOST, PORT_NUM, LG_DEFAULT_MSGS, LG_CSV_HEADER);
+}
@@ -0,0 +1,400 @@
+#ifndef BRIDGE_LOADGEN_H
+#define BRIDGE_LOADGEN_H
+
+#include <arpa/inet.h>  /* inet_pton(), htons() */
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>      /* sched_yield() */
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>   /* struct timeval */
+#include <sys/un.h>     /* sockaddr_un */
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "mcast.h"
+#include "proto.h"      /* Protocol constants */
+#include "shm.h"
+#include "tcp.h"        /* PORT_NUM */
+#include "uds.h"
+
+#define LG_DEFAULT_HOST  "127.0.0.1"
+#define LG_DEFAULT_MSGS  (200)  /* Messages sent by each publisher per run */
+#define LG_MAX_SWEEP     (16)   /* Maximum number of values in a sweep list */
+#define LG_STAMP_LEN     (8)    /* Send time (ns) at the start of each payload */
+#define LG_CLASS_OFF     (LG_STAMP_LEN) /* Class of the message, after the send time */
+#define LG_TIMEOUT_SEC   (30)   /* Give up on deliveries after this long */
+#define LG_READ_BUF      (4096)
+#define LG_WAIT_MS       (1000) /* Subscribers wake up this often to check the deadline */
+#define LG_UDP_RCVBUF    (4 << 20) /* Socket buffer for multicast bursts */
+#define LG_NAK_IDLE_MS   (20)   /* Ask for the next datagrams after this long idle */
+#define LG_FLAG_LOST     (0x80) /* The chunk could not be repaired */
+#define LG_FED_SETTLE_MS (250)  /* Time for the interest to reach the publishers' broker */
+#define LG_DATA_TEXT     (0)    /* Payload of repeated readings, compresses well */
+#define LG_DATA_RANDOM   (1)    /* Payload of random bytes, does not compress */
+#define LG_TEXT          "temp=21.5;hum=40;pres=1013;" /* Repeated in text payloads */
+#define LG_CSV_HEADER    "pubs,subs,topics,payload,data,msgs,delivered,lost,secs,msgs_per_sec,mb_per_sec,p50_us,p99_us,p999_us"
+
+/**
+ * @brief Options of the load generator. Each list is swept over, running every
+ * combination of publishers, subscribers, topics, payload sizes, and payload
+ * contents.
+ *
+ * @param host IPv4 address of the broker
+ * @param port Port number of the broker
+ * @param sub_port If not 0, port number of the broker the subscribers connect
+ * to, linked to the publishers' broker
+ * @param uds_path Unix domain socket of the broker, used instead of host and
+ * port if not NULL
+ * @param shm If set, subscribers map the shared-memory rings of the topics
+ * (over uds_path) instead of subscribing
+ * @param mcast_if If not NULL, subscribers subscribe over multicast and join
+ * the groups on the interface at this address
+ * @param alias If set, each publisher opens one publish session and publishes
+ * by alias instead of connecting for every message
+ * @param compress If set, subscribers accept compressed frames
+ * @param tune If set, the topics are tuned with flush_bytes and flush_usec
+ * before publishing
+ * @param flush_bytes Output held back per delivery by the broker
+ * @param flush_usec Microseconds the output is held back at most
+ * @param window If set, publishers ask to be acknowledged by window, and
+ * sessions send their messages without waiting for each
+ * @param win_bytes Bytes acknowledged at once (0 for no byte window)
+ * @param win_msgs Messages acknowledged at once (0 for no message window)
+ * @param classes If not 0, messages are given classes in turn, and each
+ * subscriber only gets those of its class with a filter
+ * @param addr Address of the broker the publishers connect to
+ * @param sub_addr Address of the broker the subscribers connect to
+ * @param msgs Messages sent by each publisher per run
+ * @param pubs List of number of publishers
+ * @param num_pubs Number of values in pubs
+ * @param subs List of number of subscribers
+ * @param num_subs Number of values in subs
+ * @param topics List of number of topics
+ * @param num_topics Number of values in topics
+ * @param sizes List of payload sizes in bytes
+ * @param num_sizes Number of values in sizes
+ * @param data List of payload contents (LG_DATA_*)
+ * @param num_data Number of values in data
+ */
+typedef struct lg_config {
+    const char * host;
+    uint16_t port;
+    uint16_t sub_port;
+    const char * uds_path;
+    bool shm;
+    const char * mcast_if;
+    bool alias;
+    bool compress;
+    bool tune;
+    uint32_t flush_bytes;
+    uint32_t flush_usec;
+    bool window;
+    uint32_t win_bytes;
+    uint32_t win_msgs;
+    int classes;
+    bridge_addr_t addr;
+    bridge_addr_t sub_addr;
+    int msgs;
+    int pubs[LG_MAX_SWEEP];
+    int num_pubs;
+    int subs[LG_MAX_SWEEP];
+    int num_subs;
+    int topics[LG_MAX_SWEEP];
+    int num_topics;
+    int sizes[LG_MAX_SWEEP];
+    int num_sizes;
+    int data[LG_MAX_SWEEP];
+    int num_data;
+} lg_config_t;
+
+/**
+ * @brief One combination of the sweep.
+ *
+ * @param config Options of the load generator
+ * @param id Index of the run, used to pick topics that were never used before
+ * @param pubs Number of publishers
+ * @param subs Number of subscribers
+ * @param topics Number of topics, publishers and subscribers are spread evenly
+ * @param size Payload size in bytes
+ * @param data Payload contents (LG_DATA_*)
+ * @param start Monotonic time (ns) at which publishing started
+ * @param deadline Monotonic time (ns) after which subscribers give up
+ */
+typedef struct lg_run {
+    const lg_config_t * config;
+    int id;
+    int pubs;
+    int subs;
+    int topics;
+    int size;
+    int data;
+    uint64_t start;
+    uint64_t deadline;
+} lg_run_t;
+
+/**
+ * @brief Buffered reader over a socket.
+ *
+ * @param sock Socket to read from
+ * @param buf Bytes read but not consumed yet
+ * @param pos Index of the next byte to consume
+ * @param len Number of bytes in buf
+ */
+typedef struct lg_reader {
+    int sock;
+    char buf[LG_READ_BUF];
+    size_t pos;
+    size_t len;
+} lg_reader_t;
+
+/**
+ * @brief Multicast chunk waiting for the ones before it.
+ *
+ * @param seq Sequence number of the chunk (0 if none)
+ * @param len Length of the chunk
+ * @param flags MCAST_FLAG_* or LG_FLAG_LOST
+ * @param data Chunk of the message
+ */
+typedef struct lg_chunk {
+    uint64_t seq;
+    uint16_t len;
+    uint8_t flags;
+    char data[MCAST_DATA_LEN];
+} lg_chunk_t;
+
+/**
+ * @brief State of a subscriber thread.
+ *
+ * @param run Run the subscriber is part of
+ * @param client Subscriber of the client library (subscribed over TCP only)
+ * @param reader Reader over the subscribed connection (shm and multicast modes
+ * only)
+ * @param class_id Class of the messages the subscriber filters on (classes
+ * only)
+ * @param expected Number of messages to receive
+ * @param received Number of messages received
+ * @param bytes Number of payload bytes received
+ * @param lat Delivery latency (ns) of the received messages
+ * @param samples Number of latencies in lat. Messages of publishers sharing a
+ * topic may interleave, and those whose send time got mixed up are skipped.
+ * @param shm Reader of the topic's shared-memory ring (shm mode only)
+ * @param udp Socket joined to the topic's group (multicast mode only)
+ * @param topic_id Id of the topic in the datagrams (multicast mode only)
+ * @param next Sequence number of the next chunk to deliver (multicast mode only)
+ * @param nak_upto Highest sequence number asked for again (multicast mode only)
+ * @param chunks Chunks received out of order, MCAST_REPAIR_SLOTS of them
+ * (multicast mode only)
+ * @param repaired Number of chunks received as repairs (multicast mode only)
+ */
+typedef struct lg_sub {
+    lg_run_t * run;
+    bridge_sub_t * client;
+    lg_reader_t reader;
+    int class_id;
+    uint64_t expected;
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t * lat;
+    uint64_t samples;
+    shm_reader_t shm;
+    int udp;
+    uint32_t topic_id;
+    uint64_t next;
+    uint64_t nak_upto;
+    lg_chunk_t * chunks;
+    uint64_t repaired;
+} lg_sub_t;
+
+/**
+ * @brief State of a publisher thread.
+ *
+ * @param run Run the publisher is part of
+ * @param topic Index of the topic to publish to
+ * @param sent Number of messages published
+ */
+typedef struct lg_pub {
+    lg_run_t * run;
+    int topic;
+    uint64_t sent;
+} lg_pub_t;
+
+/**
+ * @brief Parse a comma separated list of positive integers.
+ *
+ * @param str List to parse (ex. "1,4,16")
+ * @param list Array of LG_MAX_SWEEP integers to fill
+ *
+ * @returns Number of values parsed or ERR on a malformed list.
+ */
+int parse_list(const char * str, int * list);
+
+/**
+ * @brief Parse a comma separated list of payload contents.
+ *
+ * @param str List to parse (ex. "text,random")
+ * @param list Array of LG_MAX_SWEEP LG_DATA_* to fill
+ *
+ * @returns Number of values parsed or ERR on a malformed list.
+ */
+int parse_data(const char * str, int * list);
+
+/**
+ * @brief Fill a payload with the contents of the run: LG_TEXT repeated, or
+ * random bytes (the same for every message, compressing them is not cheaper).
+ *
+ * @param run Run the payload belongs to
+ * @param buf Payload to fill
+ * @param len Length of the payload
+ */
+void lg_fill(const lg_run_t * run, char * buf, size_t len);
+
+/**
+ * @brief Get the monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+/**
+ * @brief Write the topic of the given run and index, padded to P_TOPIC_LEN.
+ *
+ * @param run Run the topic belongs to
+ * @param index Index of the topic in the run
+ * @param topic Buffer of at least P_TOPIC_LEN+1 bytes
+ */
+void lg_topic(const lg_run_t * run, int index, char * topic);
+
+/**
+ * @brief Read exactly len bytes from the reader.
+ *
+ * @returns OK on success. ERR on error, timeout, or EOF.
+ */
+int lg_read(lg_reader_t * reader, char * buf, size_t len);
+
+/**
+ * @brief Set how the broker holds back the output of a topic of the run.
+ *
+ * @param run Run the topic belongs to
+ * @param topic Index of the topic
+ *
+ * @returns OK on success. ERR on failure or if refused.
+ */
+int lg_tune(lg_run_t * run, int topic);
+
+/**
+ * @brief Receive the published messages through the client library, until the
+ * expected number of messages arrived or the run deadline passed.
+ *
+ * @param args Subscriber state
+ */
+void * run_sub(void * args);
+
+/**
+ * @brief Same as run_sub(), reading the shared-memory ring of the topic.
+ * Polls the ring, yielding the CPU when there is nothing new.
+ *
+ * @param args Subscriber state
+ */
+void * run_shm_sub(void * args);
+
+/**
+ * @brief Same as run_sub(), receiving the datagrams of the topic's multicast
+ * group. Missing chunks are asked for again (NAK) over the subscription
+ * connection, and chunks are delivered in sequence order.
+ *
+ * @param args Subscriber state
+ */
+void * run_mcast_sub(void * args);
+
+/**
+ * @brief Join the multicast group given in the answer to the subscription.
+ *
+ * @param sub Subscriber state
+ * @param resp Answer after the OK: group (4), port (2), sequence (8), topic id (4)
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int lg_join(lg_sub_t * sub, const char * resp);
+
+/**
+ * @brief Keep a multicast chunk (datagram or repair) until its turn, asking
+ * for the ones missing before it.
+ *
+ * @param sub Subscriber state
+ * @param dgram Datagram, header included
+ * @param len Length of the datagram
+ */
+void lg_chunk(lg_sub_t * sub, const char * dgram, size_t len);
+
+/**
+ * @brief Ask for the given chunks again over the subscription connection.
+ *
+ * @param sub Subscriber state
+ * @param first Sequence number of the first chunk
+ * @param count Number of chunks, at most MCAST_MAX_NAK
+ */
+void lg_nak(lg_sub_t * sub, uint64_t first, uint64_t count);
+
+/**
+ * @brief Subscribe to the topic, or map its ring in shm mode.
+ *
+ * @param sub Subscriber state
+ * @param topic Index of the topic in the run
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int lg_subscribe(lg_sub_t * sub, int topic);
+
+/**
+ * @brief Account a received message from its first bytes (send time).
+ *
+ * @param sub Subscriber state
+ * @param stamp First bytes of the message
+ * @param stamp_len Number of bytes in stamp
+ */
+void lg_received(lg_sub_t * sub, const char * stamp, size_t stamp_len);
+
+/**
+ * @brief Publish the configured number of messages, one connection each,
+ * waiting for each to be acknowledged.
+ *
+ * @param args Publisher state
+ */
+void * run_pub(void * args);
+
+/**
+ * @brief Same as run_pub(), publishing over a publisher of the client library.
+ * With a window, messages are sent without waiting for the acks, otherwise
+ * each is waited for.
+ *
+ * @param args Publisher state
+ */
+void * run_alias_pub(void * args);
+
+/**
+ * @brief Compare two latencies for qsort().
+ */
+int compare_lat(const void * a, const void * b);
+
+/**
+ * @brief Run one combination of the sweep and print its CSV row.
+ *
+ * @param run Combination to run
+ *
+ * @returns OK on success. ERR if the broker could not be reached.
+ */
+int run_bench(lg_run_t * run);
+
+/**
+ * @brief Print the available options.
+ *
+ * @param prog Name of the program
+ */
+void usage(const char * prog);
+
+#endif
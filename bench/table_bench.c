@@ -0,0 +1,349 @@
+#include "table_bench.h"
+
+int main(int argc, char * argv[])
+{
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	tb_config_t config = {
+		.topics = TB_DEFAULT_TOPICS,
+		.ops = TB_DEFAULT_OPS,
+		.threads = nproc > 0 ? (nproc < TB_MAX_THREADS ? nproc : TB_MAX_THREADS) : 1,
+		.len = TB_DEFAULT_LEN,
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:o:t:l:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				config.topics = strtoull(optarg, NULL, 10);
+				break;
+			case 'o':
+				config.ops = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				config.threads = atoi(optarg);
+				break;
+			case 'l':
+				config.len = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return ERR;
+		}
+	}
+	if (config.topics == 0 || config.ops == 0 || config.threads <= 0 || config.threads > TB_MAX_THREADS ||
+		config.len < TB_MIN_LEN || config.len > TABLE_TOPIC_LEN) {
+		usage(argv[0]);
+		return ERR;
+	}
+
+	table_t * table = init_table();
+	if (table == NULL) {
+		fprintf(stderr, "Error : failed to initialize table\n");
+		return ERR;
+	}
+
+	printf("%s\n", TB_CSV_HEADER);
+	bench_hash(&config);
+	bench_insert(table, &config);
+	bench_lookup(table, &config);
+	bench_churn(table, &config);
+	bench_mixed(table, &config);
+	bench_probe(table);
+
+	cleanup_table(table);
+	return OK;
+}
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void tb_topic(uint64_t index, char * topic, size_t len)
+{
+	/* 7 base-32 digits, which is more than enough topics */
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuv";
+	for (size_t i = len; i > len - TB_MIN_LEN; i--) {
+		topic[i - 1] = digits[index & 31];
+		index >>= 5;
+	}
+
+	/* Prefixed with levels such as "level/" */
+	static const char prefix[] = "level/";
+	for (size_t i = 0; i < len - TB_MIN_LEN; i++) {
+		topic[i] = prefix[i % (sizeof(prefix) - 1)];
+	}
+	topic[len] = '\0';
+}
+
+uint64_t tb_rand(uint64_t * state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+void tb_report(const char * name, uint64_t topics, int threads, uint64_t ops, uint64_t ns)
+{
+	printf("%s,%lu,%d,%lu,%.2f,%.3f\n", name, topics, threads, ops,
+		(double) ns / ops, ns > 0 ? ops * 1e3 / ns : 0);
+	fflush(stdout);
+}
+
+void bench_hash(const tb_config_t * config)
+{
+	char topic[TABLE_TOPIC_LEN+1];
+	uint64_t sum = 0;
+
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < config->ops; i++) {
+		tb_topic(i, topic, config->len);
+		sum += hash(topic, config->len);
+	}
+	uint64_t ns = now_ns() - start;
+
+	/* Use the result so that the loop is not optimized out */
+	if (sum == 0) {
+		fprintf(stderr, "\n");
+	}
+	tb_report("hash", config->topics, 1, config->ops, ns);
+}
+
+void bench_insert(table_t * table, const tb_config_t * config)
+{
+	char topic[TABLE_TOPIC_LEN+1];
+	uint64_t slowest = 0;
+
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < config->topics; i++) {
+		tb_topic(i * 2, topic, config->len);
+		uint64_t before = now_ns();
+		if (set_topic(table, topic, config->len) == NULL) {
+			fprintf(stderr, "Error : failed to insert topic %lu\n", i);
+			return;
+		}
+		uint64_t took = now_ns() - before;
+		if (took > slowest) {
+			slowest = took;
+		}
+	}
+	uint64_t ns = now_ns() - start;
+
+	tb_report("set_topic_insert", config->topics, 1, config->topics, ns);
+	tb_report("set_topic_slowest", config->topics, 1, 1, slowest);
+}
+
+void bench_lookup(table_t * table, const tb_config_t * config)
+{
+	char topic[TABLE_TOPIC_LEN+1];
+	uint64_t state = 0x9e3779b97f4a7c15;
+	uint64_t found = 0;
+
+	/* Random existing topics */
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < config->ops; i++) {
+		tb_topic((tb_rand(&state) % config->topics) * 2, topic, config->len);
+		found += get_topic(table, topic, config->len) != NULL;
+	}
+	tb_report("get_topic_hit", config->topics, 1, config->ops, now_ns() - start);
+
+	/* Random missing topics, which probe until an empty slot */
+	start = now_ns();
+	for (uint64_t i = 0; i < config->ops; i++) {
+		tb_topic((tb_rand(&state) % config->topics) * 2 + 1, topic, config->len);
+		found += get_topic(table, topic, config->len) != NULL;
+	}
+	tb_report("get_topic_miss", config->topics, 1, config->ops, now_ns() - start);
+
+	if (found != config->ops) {
+		fprintf(stderr, "Error : %lu lookups found, expected %lu\n", found, config->ops);
+	}
+
+	/* set_topic() on an existing topic is a lookup too */
+	start = now_ns();
+	for (uint64_t i = 0; i < config->ops; i++) {
+		tb_topic((tb_rand(&state) % config->topics) * 2, topic, config->len);
+		set_topic(table, topic, config->len);
+	}
+	tb_report("set_topic_existing", config->topics, 1, config->ops, now_ns() - start);
+}
+
+void bench_probe(table_t * table)
+{
+	uint64_t buckets[TB_PROBE_BUCKETS] = {0};
+	uint64_t sum = 0, longest = 0;
+
+	lock_table(table);
+	for (uint64_t i = 0; i < table->map_size; i++) {
+		if (table->map[i] == NULL) {
+			continue;
+		}
+
+		/* Linear probing only moves forward, wrapping around the map */
+		uint64_t home = table->map[i]->hash % table->map_size;
+		uint64_t probe = (i + table->map_size - home) % table->map_size;
+		sum += probe;
+		longest = probe > longest ? probe : longest;
+
+		/* 0, 1, 2, 3 then powers of 2 */
+		int bucket = 0;
+		if (probe < 4) {
+			bucket = probe;
+		} else {
+			bucket = 2;
+			for (uint64_t p = probe; p > 1 && bucket < TB_PROBE_BUCKETS - 1; p >>= 1) {
+				bucket++;
+			}
+		}
+		buckets[bucket]++;
+	}
+	uint64_t num_topics = table->num_topics;
+	uint64_t map_size = table->map_size;
+	unlock_table(table);
+
+	printf("\nprobe,topics,map_size,count\n");
+	static const char * names[TB_PROBE_BUCKETS] = { "0", "1", "2", "3", "4-7", "8-15", "16-31", "32+" };
+	for (int i = 0; i < TB_PROBE_BUCKETS; i++) {
+		printf("%s,%lu,%lu,%lu\n", names[i], num_topics, map_size, buckets[i]);
+	}
+	printf("avg,%lu,%lu,%.3f\n", num_topics, map_size, num_topics > 0 ? (double) sum / num_topics : 0);
+	printf("max,%lu,%lu,%lu\n", num_topics, map_size, longest);
+}
+
+void bench_churn(table_t * table, const tb_config_t * config)
+{
+	static const int sizes[] = { 0, 16, 256 };
+	char topic[TABLE_TOPIC_LEN+1];
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		/* A topic of its own with the given number of subscribers */
+		tb_topic(s * 2, topic, config->len);
+		topic_t * entry = set_topic(table, topic, config->len);
+		if (entry == NULL) {
+			return;
+		}
+		for (int i = 0; i < sizes[s]; i++) {
+			subscriber_t * sub = calloc(1, sizeof(subscriber_t));
+			sub->csock = i;
+			insert_sub(table, entry->id, sub);
+		}
+
+		/* The list is walked to the end on insert and on remove */
+		uint64_t ops = config->ops / (sizes[s] + 1);
+		subscriber_t temp = { .csock = -1 };
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < ops; i++) {
+			subscriber_t * sub = calloc(1, sizeof(subscriber_t));
+			sub->csock = -1;
+			insert_sub(table, entry->id, sub);
+			remove_sub(table, entry->id, temp);
+		}
+		uint64_t ns = now_ns() - start;
+
+		char name[64];
+		snprintf(name, sizeof(name), "sub_churn_%d", sizes[s]);
+		tb_report(name, config->topics, 1, ops, ns);
+
+		for (int i = 0; i < sizes[s]; i++) {
+			temp.csock = i;
+			remove_sub(table, entry->id, temp);
+		}
+	}
+}
+
+void * run_worker(void * args)
+{
+	tb_worker_t * worker = args;
+	table_t * table = worker->table;
+	const tb_config_t * config = worker->config;
+	char topic[TABLE_TOPIC_LEN+1];
+	uint64_t state = 0x9e3779b97f4a7c15 * (worker->id + 1);
+
+	/* Each thread churns a subscriber of its own */
+	subscriber_t temp = { .csock = -(worker->id + 2) };
+	topic_t * sub_topic = NULL;
+
+	worker->start = now_ns();
+	for (uint64_t i = 0; i < config->ops; i++) {
+		uint64_t r = tb_rand(&state);
+		uint64_t pick = r % 100;
+		uint64_t index = (r >> 8) % config->topics;
+
+		if (pick < TB_MIX_HIT) {
+			tb_topic(index * 2, topic, config->len);
+			get_topic(table, topic, config->len);
+		} else if (pick < TB_MIX_HIT + TB_MIX_MISS) {
+			tb_topic(index * 2 + 1, topic, config->len);
+			get_topic(table, topic, config->len);
+		} else if (sub_topic == NULL) {
+			tb_topic(index * 2, topic, config->len);
+			subscriber_t * sub = calloc(1, sizeof(subscriber_t));
+			sub->csock = temp.csock;
+			if ((sub_topic = get_topic(table, topic, config->len)) == NULL || insert_sub(table, sub_topic->id, sub) != OK) {
+				free(sub);
+				sub_topic = NULL;
+			}
+		} else {
+			remove_sub(table, sub_topic->id, temp);
+			sub_topic = NULL;
+		}
+	}
+	worker->end = now_ns();
+
+	if (sub_topic != NULL) {
+		remove_sub(table, sub_topic->id, temp);
+	}
+	return NULL;
+}
+
+void bench_mixed(table_t * table, const tb_config_t * config)
+{
+	for (int threads = 1; threads <= config->threads; threads *= 2) {
+		tb_worker_t workers[TB_MAX_THREADS];
+		pthread_t thrs[TB_MAX_THREADS];
+		int started = 0;
+		for (; started < threads; started++) {
+			workers[started] = (tb_worker_t) {
+				.table = table,
+				.config = config,
+				.id = started,
+			};
+			if (pthread_create(&thrs[started], NULL, run_worker, &workers[started])) {
+				break;
+			}
+		}
+
+		/* Wall time from the first thread starting to the last finishing */
+		uint64_t start = UINT64_MAX, end = 0;
+		for (int i = 0; i < started; i++) {
+			pthread_join(thrs[i], NULL);
+			start = workers[i].start < start ? workers[i].start : start;
+			end = workers[i].end > end ? workers[i].end : end;
+		}
+		if (started > 0) {
+			tb_report("mixed", config->topics, started, config->ops * started, end - start);
+		}
+
+		/* Always measure the configured number of threads last */
+		if (threads < config->threads && threads * 2 > config->threads) {
+			threads = config->threads / 2;
+		}
+	}
+}
+
+void usage(const char * prog)
+{
+	fprintf(stderr,
+		"Usage : %s [-n topics] [-o ops] [-t threads] [-l length]\n"
+		"  -n topics   Topics in the table for the lookups (default %d)\n"
+		"  -o ops      Operations per measurement and per thread (default %d)\n"
+		"  -t threads  Highest number of threads for the mixed workload (default cores)\n"
+		"  -l length   Length of the topic names, %d to %d (default %d)\n"
+		"Prints CSV rows: %s\n"
+		"followed by the probe length distribution.\n",
+		prog, TB_DEFAULT_TOPICS, TB_DEFAULT_OPS, TB_MIN_LEN, TABLE_TOPIC_LEN, TB_DEFAULT_LEN, TB_CSV_HEADER);
+}
@@ -0,0 +1,141 @@
+#ifndef BRIDGE_TABLE_BENCH_H
+#define BRIDGE_TABLE_BENCH_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "table.h"
+
+#define TB_DEFAULT_TOPICS  (100000)  /* Topics inserted before lookups */
+#define TB_DEFAULT_OPS     (1000000) /* Operations per measurement (and thread) */
+#define TB_MIN_LEN         (7)       /* Base-32 digits at the end of every topic */
+#define TB_DEFAULT_LEN     (TB_MIN_LEN)
+#define TB_MAX_THREADS     (64)
+#define TB_PROBE_BUCKETS   (8)       /* 0, 1, 2, 3, 4-7, 8-15, 16-31, 32+ */
+#define TB_MIX_HIT         (80)      /* Percent of lookups of existing topics */
+#define TB_MIX_MISS        (10)      /* Percent of lookups of missing topics */
+#define TB_CSV_HEADER      "name,topics,threads,ops,ns_per_op,mops_per_sec"
+
+/**
+ * @brief Options of the table benchmark.
+ *
+ * @param topics Number of topics in the table for the lookups
+ * @param ops Operations per measurement (and per thread for the mixed workload)
+ * @param threads Highest number of threads for the mixed workload
+ * @param len Length of the topic names
+ */
+typedef struct tb_config {
+    uint64_t topics;
+    uint64_t ops;
+    int threads;
+    size_t len;
+} tb_config_t;
+
+/**
+ * @brief State of a thread running the mixed workload.
+ *
+ * @param table Table shared by the threads
+ * @param config Options of the benchmark
+ * @param id Index of the thread, used for its subscriber and random seed
+ * @param start Time (ns) at which the thread started its operations
+ * @param end Time (ns) at which the thread finished its operations
+ */
+typedef struct tb_worker {
+    table_t * table;
+    const tb_config_t * config;
+    int id;
+    uint64_t start;
+    uint64_t end;
+} tb_worker_t;
+
+/**
+ * @brief Get the monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+/**
+ * @brief Write the topic of the given index. Existing topics are even and
+ * missing ones are odd, so that both can be generated without lookups. Topics
+ * longer than TB_MIN_LEN share a prefix, as hierarchical names do, so that
+ * comparing them has to go through the whole name.
+ *
+ * @param index Index of the topic
+ * @param topic Buffer of at least len+1 bytes
+ * @param len Length of the topic, at least TB_MIN_LEN
+ */
+void tb_topic(uint64_t index, char * topic, size_t len);
+
+/**
+ * @brief Fast pseudo-random number generator (xorshift64).
+ *
+ * @param state Non-zero state, updated
+ *
+ * @returns The next number.
+ */
+uint64_t tb_rand(uint64_t * state);
+
+/**
+ * @brief Print a CSV row of the measurement.
+ *
+ * @param name Name of the measurement
+ * @param topics Number of topics in the table
+ * @param threads Number of threads
+ * @param ops Number of operations (total)
+ * @param ns Time taken (ns)
+ */
+void tb_report(const char * name, uint64_t topics, int threads, uint64_t ops, uint64_t ns);
+
+/**
+ * @brief Measure hash() over the topic strings.
+ */
+void bench_hash(const tb_config_t * config);
+
+/**
+ * @brief Measure set_topic() from an empty table, including every resize, and
+ * the slowest single insert (the last resize). Leaves the topics in the table.
+ */
+void bench_insert(table_t * table, const tb_config_t * config);
+
+/**
+ * @brief Measure get_topic() on existing and on missing topics.
+ */
+void bench_lookup(table_t * table, const tb_config_t * config);
+
+/**
+ * @brief Print the distribution of the distance of each topic from its home
+ * slot, and the average and longest probe.
+ */
+void bench_probe(table_t * table);
+
+/**
+ * @brief Measure insert_sub() followed by remove_sub() on topics with a growing
+ * number of subscribers already in the list.
+ */
+void bench_churn(table_t * table, const tb_config_t * config);
+
+/**
+ * @brief Run the mixed workload (lookup hits, misses, subscriber churn).
+ *
+ * @param args Worker state
+ */
+void * run_worker(void * args);
+
+/**
+ * @brief Measure the mixed workload from 1 to the configured number of threads,
+ * doubling each time.
+ */
+void bench_mixed(table_t * table, const tb_config_t * config);
+
+/**
+ * @brief Print the available options.
+ *
+ * @param prog Name of the program
+ */
+void usage(const char * prog);
+
+#endif
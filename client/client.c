@@ -0,0 +1,689 @@
+#include "client.h"
+#include "lz.h"         /* lz_decompress() */
+#include "proto.h"      /* Protocol constants, proto_put32(), proto_get64() */
+
+int bridge_connect(const bridge_addr_t * addr)
+{
+	if (addr->path != NULL) {
+		int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock < 0) {
+			return ERR;
+		}
+
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, addr->path, sizeof(sun.sun_path) - 1);
+		if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+			close(sock);
+			return ERR;
+		}
+		return sock;
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return ERR;
+	}
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(addr->port);
+	if (inet_pton(AF_INET, addr->host, &sin.sin_addr) != 1 ||
+		connect(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		close(sock);
+		return ERR;
+	}
+
+	/* Heartbeat replies and batches are sized already, Nagle only delays them */
+	int opt = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	return sock;
+}
+
+int bridge_write(int sock, const char * buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = send(sock, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return ERR;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return OK;
+}
+
+int bridge_writev(int sock, struct iovec * iov, int cnt)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+	while (msg.msg_iovlen > 0) {
+		ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			return ERR;
+		}
+
+		/* Skip what was written, the rest goes out with the next call */
+		while (msg.msg_iovlen > 0 && (size_t) ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+	}
+	return OK;
+}
+
+int bridge_read(int sock, char * buf, size_t len, int timeout_ms)
+{
+	while (len > 0) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		int ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return ERR;
+		}
+
+		ssize_t n = recv(sock, buf, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return ERR;
+		}
+		buf += n;
+		len -= n;
+	}
+	return OK;
+}
+
+int bridge_request(int sock, char cmd, const char * topic, size_t len)
+{
+	if (len == 0 || len > BRIDGE_TOPIC_MAX) {
+		return ERR;
+	}
+
+	char req[P_CMD_LEN + 1 + BRIDGE_TOPIC_MAX];
+	req[0] = cmd | P_CMD_NAMED;
+	req[1] = len;
+	memcpy(req + 2, topic, len);
+	return bridge_write(sock, req, 2 + len);
+}
+
+bridge_sub_t * bridge_subscribe(const bridge_addr_t * addr, const char * topic, bool compress,
+	const bridge_filter_t * filter)
+{
+	size_t len = strlen(topic);
+	if (len == 0 || len > BRIDGE_TOPIC_MAX || (filter != NULL && ((filter->kind != BRIDGE_PREFIX &&
+		filter->kind != BRIDGE_MASK) || filter->len == 0 || filter->offset + filter->len > BRIDGE_FILTER_LEN))) {
+		return NULL;
+	}
+
+	bridge_sub_t * sub = calloc(1, sizeof(bridge_sub_t));
+	if (sub == NULL) {
+		return NULL;
+	}
+	sub->addr = *addr;
+	memcpy(sub->topic, topic, len);
+	sub->topic_len = len;
+	sub->compress = compress;
+	sub->sock = ERR;
+
+	/* X | Kind | Offset | Length | Value [| Mask], sent on every subscription */
+	if (filter != NULL) {
+		sub->filter[0] = P_CMD_FILTER;
+		sub->filter[1] = filter->kind;
+		sub->filter[2] = filter->offset;
+		sub->filter[3] = filter->len;
+		sub->filter_len = 4;
+		memcpy(sub->filter + sub->filter_len, filter->value, filter->len);
+		sub->filter_len += filter->len;
+		if (filter->kind == BRIDGE_MASK) {
+			memcpy(sub->filter + sub->filter_len, filter->mask, filter->len);
+			sub->filter_len += filter->len;
+		}
+	}
+
+	/* Compressed blocks are decompressed next to the ring */
+	sub->ring = bridge_map_ring();
+	if (compress) {
+		sub->block = malloc(BRIDGE_BLOCK_LEN);
+	}
+	if (sub->ring == NULL || (compress && sub->block == NULL) || bridge_resubscribe(sub) != OK) {
+		bridge_unsubscribe(sub);
+		return NULL;
+	}
+
+	sub->reconnects = 0;
+	return sub;
+}
+
+char * bridge_map_ring(void)
+{
+	int fd = memfd_create("bridge-sub", MFD_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, BRIDGE_RING_LEN) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Reserve both halves first, then map the same pages into each */
+	char * ring = mmap(NULL, 2 * BRIDGE_RING_LEN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (mmap(ring, BRIDGE_RING_LEN, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+		mmap(ring + BRIDGE_RING_LEN, BRIDGE_RING_LEN, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(ring, 2 * BRIDGE_RING_LEN);
+		close(fd);
+		return NULL;
+	}
+
+	/* The mappings keep the pages */
+	close(fd);
+	return ring;
+}
+
+int bridge_resubscribe(bridge_sub_t * sub)
+{
+	if (sub->retry_ms > 0) {
+		usleep(sub->retry_ms * 1000);
+	}
+
+	char resp;
+	char cmd = sub->compress ? P_CMD_COMPRESS : P_CMD_SUBSCRIBE;
+	int sock = bridge_connect(&sub->addr);
+	if (sock == ERR || (sub->filter_len > 0 && bridge_write(sock, sub->filter, sub->filter_len) != OK) ||
+		bridge_request(sock, cmd, sub->topic, sub->topic_len) != OK ||
+		bridge_read(sock, &resp, 1, BRIDGE_RETRY_MAX_MS) != OK || resp != SERVER_MSG_OK[0]) {
+		if (sock != ERR) {
+			close(sock);
+		}
+		sub->retry_ms = sub->retry_ms == 0 ? BRIDGE_RETRY_MS : MIN(sub->retry_ms * 2, BRIDGE_RETRY_MAX_MS);
+		return ERR;
+	}
+
+	sub->sock = sock;
+	sub->head = 0;
+	sub->tail = 0;
+	sub->viewed = 0;
+	sub->retry_ms = 0;
+	sub->reconnects++;
+	return OK;
+}
+
+int bridge_next(bridge_sub_t * sub, bridge_view_t * view, int timeout_ms)
+{
+	/* The previous view is done with, its bytes can be received over */
+	sub->tail += sub->viewed;
+	sub->viewed = 0;
+
+	uint64_t deadline = bridge_now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+	for (;;) {
+		if (sub->sock == ERR) {
+			if (bridge_resubscribe(sub) != OK) {
+				return BRIDGE_AGAIN;
+			}
+			continue;
+		}
+
+		int ret = bridge_parse(sub, view);
+		if (ret == OK) {
+			return OK;
+		}
+
+		/* Receive as much as fits, straight into the ring */
+		if (ret == BRIDGE_AGAIN) {
+			uint64_t now = bridge_now_ms();
+			int wait = timeout_ms < 0 ? -1 : (now < deadline ? (int) (deadline - now) : 0);
+			struct pollfd pfd = { .fd = sub->sock, .events = POLLIN };
+			int ready = poll(&pfd, 1, wait);
+			if (ready == 0) {
+				return BRIDGE_AGAIN;
+			}
+			if (ready < 0 && errno == EINTR) {
+				continue;
+			}
+			if (ready > 0) {
+				size_t room = BRIDGE_RING_LEN - (sub->head - sub->tail);
+				ssize_t n = recv(sub->sock, sub->ring + (sub->head & (BRIDGE_RING_LEN - 1)), room, 0);
+				if (n > 0) {
+					sub->head += n;
+					continue;
+				}
+				if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+					continue;
+				}
+			}
+		}
+
+		/* Broken or malformed, the rest of the message is not coming */
+		close(sub->sock);
+		sub->sock = ERR;
+		if (sub->in_msg) {
+			sub->in_msg = false;
+			*view = (bridge_view_t) { .type = BRIDGE_CUT };
+			return OK;
+		}
+	}
+}
+
+int bridge_parse(bridge_sub_t * sub, bridge_view_t * view)
+{
+	for (;;) {
+		uint64_t avail = sub->head - sub->tail;
+		if (avail == 0) {
+			return BRIDGE_AGAIN;
+		}
+
+		/* The first byte of a length is at most 0x10 (4096 bytes), or 0x80 */
+		/* to 0x90 if compressed, so an H at a frame boundary is a heartbeat */
+		char * frame = sub->ring + (sub->tail & (BRIDGE_RING_LEN - 1));
+		if (frame[0] == SERVER_MSG_HB[0]) {
+			bridge_write(sub->sock, SERVER_MSG_HB, strlen(SERVER_MSG_HB));
+			sub->heartbeats++;
+			sub->tail++;
+			continue;
+		}
+		if (avail < SERVER_PF_SIZE) {
+			return BRIDGE_AGAIN;
+		}
+
+		size_t len = ((uint8_t) frame[0] << 8) | (uint8_t) frame[1];
+		bool compressed = len & SERVER_Z_FLAG;
+		len &= ~SERVER_Z_FLAG;
+		if (len > BRIDGE_BLOCK_LEN || (compressed && !sub->compress)) {
+			return ERR;
+		}
+		if (avail < SERVER_PF_SIZE + len) {
+			return BRIDGE_AGAIN;
+		}
+		sub->viewed = SERVER_PF_SIZE + len;
+		char * data = frame + SERVER_PF_SIZE;
+
+		if (compressed) {
+			int n = lz_decompress(data, len, sub->block, BRIDGE_BLOCK_LEN);
+			if (n == ERR) {
+				return ERR;
+			}
+			*view = (bridge_view_t) { .type = BRIDGE_DATA, .data = sub->block, .len = n };
+			sub->in_msg = true;
+			return OK;
+		}
+
+		/* The payload is never made of \r\n, so this is the end */
+		if (len == strlen(SERVER_MSG_END) && memcmp(data, SERVER_MSG_END, len) == 0) {
+			*view = (bridge_view_t) { .type = BRIDGE_END };
+			sub->in_msg = false;
+			return OK;
+		}
+
+		*view = (bridge_view_t) { .type = BRIDGE_DATA, .data = data, .len = len };
+		sub->in_msg = true;
+		return OK;
+	}
+}
+
+void bridge_unsubscribe(bridge_sub_t * sub)
+{
+	if (sub == NULL) {
+		return;
+	}
+
+	if (sub->sock != ERR) {
+		close(sub->sock);
+	}
+	if (sub->ring != NULL) {
+		munmap(sub->ring, 2 * BRIDGE_RING_LEN);
+	}
+	free(sub->block);
+	free(sub);
+}
+
+bridge_pub_t * bridge_publisher(const bridge_addr_t * addr, uint32_t win_bytes, uint32_t win_msgs)
+{
+	bridge_pub_t * pub = calloc(1, sizeof(bridge_pub_t));
+	if (pub == NULL) {
+		return NULL;
+	}
+	pub->addr = *addr;
+	pub->sock = ERR;
+	pub->win_bytes = win_bytes;
+	pub->win_msgs = win_msgs;
+	return pub;
+}
+
+int bridge_topic(bridge_pub_t * pub, const char * topic)
+{
+	size_t len = strlen(topic);
+	if (pub->num_topics >= BRIDGE_MAX_TOPICS || len == 0 || len > BRIDGE_TOPIC_MAX) {
+		return ERR;
+	}
+	int index = pub->num_topics;
+	pub->topics[index] = strdup(topic);
+	if (pub->topics[index] == NULL) {
+		return ERR;
+	}
+	pub->aliases[index] = ERR;
+	pub->num_topics++;
+
+	/* The first topic opens the session, the others are aliased in it */
+	int ret;
+	if (pub->sock == ERR) {
+		ret = bridge_open(pub);
+	} else {
+		char resp[1 + P_ALIAS_LEN];
+		ret = bridge_drain(pub) == OK && bridge_request(pub->sock, P_CMD_ALIAS, topic, len) == OK &&
+			bridge_read(pub->sock, resp, 1, BRIDGE_RETRY_MAX_MS) == OK ? OK : ERR;
+		if (ret == OK && resp[0] == SERVER_MSG_OK[0] &&
+			bridge_read(pub->sock, resp + 1, P_ALIAS_LEN, BRIDGE_RETRY_MAX_MS) == OK) {
+			pub->aliases[index] = ((uint8_t) resp[1] << 8) | (uint8_t) resp[2];
+		} else if (ret == OK && resp[0] == SERVER_MSG_FAIL[0]) {
+			ret = ERR;
+		} else {
+			bridge_disconnect(pub);
+			ret = ERR;
+		}
+	}
+
+	if (ret != OK) {
+		pub->num_topics--;
+		free(pub->topics[index]);
+		pub->topics[index] = NULL;
+		return ERR;
+	}
+	return index;
+}
+
+int bridge_open(bridge_pub_t * pub)
+{
+	if (pub->num_topics == 0) {
+		return ERR;
+	}
+	if (pub->sock != ERR) {
+		bridge_disconnect(pub);
+	}
+	pub->sock = bridge_connect(&pub->addr);
+	if (pub->sock == ERR) {
+		return ERR;
+	}
+	pub->sessions++;
+
+	/* The window, then every topic at once, the answers come in order */
+	char req[P_CMD_LEN + P_WINDOW_LEN];
+	req[0] = P_CMD_WINDOW;
+	proto_put32(req + P_CMD_LEN, pub->win_bytes);
+	proto_put32(req + P_CMD_LEN + 4, pub->win_msgs);
+	int ret = bridge_write(pub->sock, req, sizeof(req));
+	for (int i = 0; i < pub->num_topics && ret == OK; i++) {
+		ret = bridge_request(pub->sock, P_CMD_ALIAS, pub->topics[i], strlen(pub->topics[i]));
+	}
+	for (int i = 0; i < pub->num_topics && ret == OK; i++) {
+		char resp[1 + P_ALIAS_LEN];
+		if (bridge_read(pub->sock, resp, 1, BRIDGE_RETRY_MAX_MS) != OK || resp[0] != SERVER_MSG_OK[0] ||
+			bridge_read(pub->sock, resp + 1, P_ALIAS_LEN, BRIDGE_RETRY_MAX_MS) != OK) {
+			ret = ERR;
+			break;
+		}
+		pub->aliases[i] = ((uint8_t) resp[1] << 8) | (uint8_t) resp[2];
+	}
+
+	if (ret != OK) {
+		bridge_disconnect(pub);
+	}
+	return ret;
+}
+
+int bridge_publish(bridge_pub_t * pub, int topic, const char * data, size_t len)
+{
+	if (topic < 0 || topic >= pub->num_topics || len > BRIDGE_MSG_MAX) {
+		return ERR;
+	}
+	if (pub->sock == ERR && bridge_open(pub) != OK) {
+		return ERR;
+	}
+
+	/* Q | Alias (2) | Length (2) | Data */
+	char hdr[P_CMD_LEN + P_SEND_LEN];
+	hdr[0] = P_CMD_SEND;
+	hdr[1] = (pub->aliases[topic] >> 8) & 0xFF;
+	hdr[2] = pub->aliases[topic] & 0xFF;
+	hdr[3] = (len >> 8) & 0xFF;
+	hdr[4] = len & 0xFF;
+	if (pub->blen + sizeof(hdr) + len > BRIDGE_BATCH_LEN && bridge_flush(pub) != OK) {
+		return ERR;
+	}
+	pub->sent++;
+	pub->conn_sent++;
+
+	/* A message larger than the batch is written from where it is */
+	if (sizeof(hdr) + len > BRIDGE_BATCH_LEN) {
+		struct iovec iov[2] = {
+			{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+			{ .iov_base = (char *) data, .iov_len = len },
+		};
+		if (bridge_writev(pub->sock, iov, 2) != OK) {
+			bridge_disconnect(pub);
+			return ERR;
+		}
+		return OK;
+	}
+
+	memcpy(pub->batch + pub->blen, hdr, sizeof(hdr));
+	memcpy(pub->batch + pub->blen + sizeof(hdr), data, len);
+	pub->blen += sizeof(hdr) + len;
+	return OK;
+}
+
+int bridge_flush(bridge_pub_t * pub)
+{
+	if (pub->sock == ERR) {
+		return ERR;
+	}
+
+	/* Acks are read along, so that they never pile up on the broker */
+	if ((pub->blen > 0 && bridge_write(pub->sock, pub->batch, pub->blen) != OK) ||
+		bridge_read_acks(pub, false) != OK) {
+		bridge_disconnect(pub);
+		return ERR;
+	}
+	pub->blen = 0;
+	return OK;
+}
+
+int bridge_drain(bridge_pub_t * pub)
+{
+	if (bridge_flush(pub) != OK) {
+		return ERR;
+	}
+	if (pub->conn_acked == pub->conn_sent) {
+		return OK;
+	}
+
+	/* Asking for the window again has what is left of it acknowledged, */
+	/* which a window of one message does anyway                        */
+	bool each = pub->win_msgs == 1 || (pub->win_msgs == 0 && pub->win_bytes == 0);
+	if (!each) {
+		char req[P_CMD_LEN + P_WINDOW_LEN];
+		req[0] = P_CMD_WINDOW;
+		proto_put32(req + P_CMD_LEN, pub->win_bytes);
+		proto_put32(req + P_CMD_LEN + 4, pub->win_msgs);
+		if (bridge_write(pub->sock, req, sizeof(req)) != OK) {
+			bridge_disconnect(pub);
+			return ERR;
+		}
+	}
+	while (pub->conn_acked < pub->conn_sent) {
+		if (bridge_read_acks(pub, true) != OK) {
+			bridge_disconnect(pub);
+			return ERR;
+		}
+	}
+	return OK;
+}
+
+int bridge_read_acks(bridge_pub_t * pub, bool wait)
+{
+	for (;;) {
+		ssize_t n = recv(pub->sock, pub->rec + pub->got, BRIDGE_ACK_LEN - pub->got, wait ? 0 : MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return OK;
+		}
+		if (n <= 0) {
+			return ERR;
+		}
+		pub->got += n;
+		if (pub->got < BRIDGE_ACK_LEN) {
+			continue;
+		}
+		pub->got = 0;
+
+		/* K | Messages (8) | Bytes (8), the totals of the session */
+		if (pub->rec[0] != SERVER_MSG_ACK[0]) {
+			return ERR;
+		}
+		uint64_t msgs = proto_get64(pub->rec + 1);
+		if (msgs > pub->conn_acked) {
+			pub->acked += msgs - pub->conn_acked;
+			pub->conn_acked = msgs;
+		}
+		if (wait) {
+			return OK;
+		}
+	}
+}
+
+void bridge_disconnect(bridge_pub_t * pub)
+{
+	if (pub->sock != ERR) {
+		close(pub->sock);
+	}
+	pub->sock = ERR;
+	pub->lost += pub->conn_sent - pub->conn_acked;
+	pub->conn_sent = 0;
+	pub->conn_acked = 0;
+	pub->blen = 0;
+	pub->got = 0;
+	for (int i = 0; i < pub->num_topics; i++) {
+		pub->aliases[i] = ERR;
+	}
+}
+
+int bridge_close(bridge_pub_t * pub)
+{
+	if (pub == NULL) {
+		return ERR;
+	}
+
+	if (pub->sock != ERR) {
+		bridge_drain(pub);
+	}
+	bridge_disconnect(pub);
+	int ret = pub->acked == pub->sent ? OK : ERR;
+	for (int i = 0; i < pub->num_topics; i++) {
+		free(pub->topics[i]);
+	}
+	free(pub);
+	return ret;
+}
+
+int bridge_send(const bridge_addr_t * addr, const char * topic, const char * data, size_t len, bool window)
+{
+	size_t topic_len = strlen(topic);
+	if (topic_len == 0 || topic_len > BRIDGE_TOPIC_MAX) {
+		return ERR;
+	}
+	int sock = bridge_connect(addr);
+	if (sock == ERR) {
+		return ERR;
+	}
+
+	/* [W | 0 | 0] p | Length | Topic | Data, all in one write */
+	char req[P_CMD_LEN + P_WINDOW_LEN + P_CMD_LEN + 1 + BRIDGE_TOPIC_MAX];
+	size_t req_len = 0;
+	if (window) {
+		req[req_len++] = P_CMD_WINDOW;
+		proto_put32(req + req_len, 0);
+		proto_put32(req + req_len + 4, 0);
+		req_len += P_WINDOW_LEN;
+	}
+	req[req_len++] = P_CMD_PUBLISH | P_CMD_NAMED;
+	req[req_len++] = topic_len;
+	memcpy(req + req_len, topic, topic_len);
+	req_len += topic_len;
+	struct iovec iov[2] = {
+		{ .iov_base = req, .iov_len = req_len },
+		{ .iov_base = (char *) data, .iov_len = len },
+	};
+
+	/* Closing the write side is the end of the message, the broker closes */
+	/* once it is done with it                                             */
+	int ret = bridge_writev(sock, iov, 2) == OK && shutdown(sock, SHUT_WR) == OK ? OK : ERR;
+	bool acked = false;
+	while (ret == OK) {
+		char resp[BRIDGE_ACK_LEN];
+		ssize_t n = recv(sock, resp, 1, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		if (resp[0] == SERVER_MSG_OK[0] && !window) {
+			acked = true;
+		} else if (resp[0] == SERVER_MSG_ACK[0] && window &&
+			bridge_read(sock, resp + 1, BRIDGE_ACK_LEN - 1, BRIDGE_RETRY_MAX_MS) == OK) {
+			acked = proto_get64(resp + 1) == 1;
+		} else {
+			ret = ERR;
+		}
+	}
+	close(sock);
+
+	return ret == OK && acked ? OK : ERR;
+}
+
+int bridge_tune(const bridge_addr_t * addr, const char * topic, uint32_t bytes, uint32_t usec)
+{
+	int sock = bridge_connect(addr);
+	if (sock == ERR) {
+		return ERR;
+	}
+
+	char args[P_TUNE_LEN], resp;
+	proto_put32(args, bytes);
+	proto_put32(args + 4, usec);
+	int ret = bridge_request(sock, P_CMD_TUNE, topic, strlen(topic)) == OK &&
+		bridge_write(sock, args, sizeof(args)) == OK &&
+		bridge_read(sock, &resp, 1, BRIDGE_RETRY_MAX_MS) == OK && resp == SERVER_MSG_OK[0] ? OK : ERR;
+	close(sock);
+	return ret;
+}
+
+uint64_t bridge_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
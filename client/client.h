@@ -0,0 +1,435 @@
+#ifndef BRIDGE_CLIENT_H
+#define BRIDGE_CLIENT_H
+
+#include <arpa/inet.h>  /* inet_pton(), htons() */
+#include <errno.h>
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>   /* mmap(), memfd_create() */
+#include <sys/socket.h>
+#include <sys/uio.h>    /* writev() */
+#include <sys/un.h>     /* sockaddr_un */
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/*
+ * Client library of the broker (libbridge.a), so that applications do not
+ * have to speak the protocol themselves. Each handle is used by one thread at
+ * a time.
+ *
+ * A subscriber receives into a ring mapped twice back to back, so that any
+ * frame in it is contiguous, and hands out views of the frames where they were
+ * received. Heartbeats are answered as they are read, and a broken connection
+ * is connected again and the topic subscribed to again. A filter given at
+ * subscribe time is evaluated by the broker, which then only sends the
+ * messages that match.
+ *
+ * A publisher publishes over a publish session acknowledged by window. Its
+ * requests are gathered in a batch written at once, and sent without waiting
+ * for the acks, which are read as they come.
+ */
+
+#define BRIDGE_TOPIC_MAX    (255)     /* Longest topic */
+#define BRIDGE_MSG_MAX      (65535)   /* Longest message of a publisher */
+#define BRIDGE_RING_LEN     (1 << 16) /* Receive ring, a multiple of the page size */
+#define BRIDGE_BLOCK_LEN    (4096)    /* Longest frame, decompressed */
+#define BRIDGE_BATCH_LEN    (16384)   /* Requests of a publisher gathered before writing */
+#define BRIDGE_MAX_TOPICS   (1024)    /* Topics of a publisher */
+#define BRIDGE_ACK_LEN      (1 + 8 + 8) /* K | Messages (8) | Bytes (8) */
+#define BRIDGE_RETRY_MS     (100)     /* First wait before connecting again */
+#define BRIDGE_RETRY_MAX_MS (2000)    /* Longest wait before connecting again */
+#define BRIDGE_AGAIN        (1)       /* Nothing arrived in time */
+#define BRIDGE_FILTER_LEN   (64)      /* Bytes of the head of a message filters look at */
+#define BRIDGE_FILTER_REQ   (1 + 3 + 2 * BRIDGE_FILTER_LEN) /* Longest filter request */
+#define BRIDGE_PREFIX       'P'       /* Filter on the bytes at an offset */
+#define BRIDGE_MASK         'M'       /* Filter on the bytes at an offset, masked */
+
+/**
+ * Views handed out by a subscriber
+ */
+enum BRIDGE_VIEW {
+	BRIDGE_DATA, /* Data of the message */
+	BRIDGE_END,  /* End of the message */
+	BRIDGE_CUT,  /* The connection broke in the middle of the message */
+};
+
+/**
+ * @brief Address of the broker.
+ *
+ * @param host IPv4 address of the broker
+ * @param port Port number of the broker
+ * @param path Unix domain socket of the broker, used instead of host and port
+ * if not NULL
+ */
+typedef struct bridge_addr {
+    const char * host;
+    uint16_t port;
+    const char * path;
+} bridge_addr_t;
+
+/**
+ * @brief Filter of a subscriber. A message matches if it is at least offset +
+ * len bytes long and its bytes there are value, under mask for BRIDGE_MASK (a
+ * prefix is BRIDGE_PREFIX at offset 0).
+ *
+ * @param kind BRIDGE_PREFIX or BRIDGE_MASK
+ * @param offset Offset of the compared bytes in the message
+ * @param len Number of compared bytes, offset + len at most BRIDGE_FILTER_LEN
+ * @param value Bytes to compare to
+ * @param mask Bits compared (BRIDGE_MASK only)
+ */
+typedef struct bridge_filter {
+    char kind;
+    uint8_t offset;
+    uint8_t len;
+    uint8_t value[BRIDGE_FILTER_LEN];
+    uint8_t mask[BRIDGE_FILTER_LEN];
+} bridge_filter_t;
+
+/**
+ * @brief Frame of a message, in the receive ring of the subscriber (or its
+ * block once decompressed). Valid until the next call on the subscriber.
+ *
+ * @param type BRIDGE_* of the view
+ * @param data Bytes of the frame (BRIDGE_DATA)
+ * @param len Number of bytes in data
+ */
+typedef struct bridge_view {
+    enum BRIDGE_VIEW type;
+    const char * data;
+    size_t len;
+} bridge_view_t;
+
+/**
+ * @brief Subscriber of a topic.
+ *
+ * @param addr Address of the broker
+ * @param topic Topic subscribed to
+ * @param topic_len Length of the topic
+ * @param compress If set, the broker sends compressed blocks
+ * @param filter Filter request sent before subscribing
+ * @param filter_len Length of the filter request (0 if none)
+ * @param sock Connection to the broker (ERR while disconnected)
+ * @param ring Receive ring, mapped twice back to back
+ * @param head Number of bytes received into the ring
+ * @param tail Number of bytes of the ring consumed
+ * @param viewed Bytes of the last view, consumed on the next call
+ * @param block Last compressed block, decompressed (compress only)
+ * @param in_msg If set, part of a message was handed out
+ * @param retry_ms Wait before connecting again
+ * @param reconnects Number of times the subscriber connected again
+ * @param heartbeats Number of heartbeats answered
+ */
+typedef struct bridge_sub {
+    bridge_addr_t addr;
+    char topic[BRIDGE_TOPIC_MAX+1];
+    size_t topic_len;
+    bool compress;
+    char filter[BRIDGE_FILTER_REQ];
+    size_t filter_len;
+    int sock;
+    char * ring;
+    uint64_t head;
+    uint64_t tail;
+    size_t viewed;
+    char * block;
+    bool in_msg;
+    int retry_ms;
+    uint64_t reconnects;
+    uint64_t heartbeats;
+} bridge_sub_t;
+
+/**
+ * @brief Publisher over a publish session.
+ *
+ * @param addr Address of the broker
+ * @param sock Connection to the broker (ERR while disconnected)
+ * @param win_bytes Bytes acknowledged at once (0 for no byte window)
+ * @param win_msgs Messages acknowledged at once (0 for no message window)
+ * @param topics Topics added, in order
+ * @param aliases Alias of each topic in the session (ERR until aliased)
+ * @param num_topics Number of topics added
+ * @param batch Requests not written yet
+ * @param blen Number of bytes in batch
+ * @param rec Ack being read
+ * @param got Number of bytes of rec read so far
+ * @param conn_sent Messages sent in the session
+ * @param conn_acked Messages acknowledged in the session
+ * @param sent Messages sent
+ * @param acked Messages acknowledged
+ * @param lost Messages sent in sessions that broke before acknowledging them
+ * @param sessions Number of sessions opened
+ */
+typedef struct bridge_pub {
+    bridge_addr_t addr;
+    int sock;
+    uint32_t win_bytes;
+    uint32_t win_msgs;
+    char * topics[BRIDGE_MAX_TOPICS];
+    int aliases[BRIDGE_MAX_TOPICS];
+    int num_topics;
+    char batch[BRIDGE_BATCH_LEN];
+    size_t blen;
+    char rec[BRIDGE_ACK_LEN];
+    size_t got;
+    uint64_t conn_sent;
+    uint64_t conn_acked;
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t lost;
+    uint64_t sessions;
+} bridge_pub_t;
+
+/**
+ * @brief Connect to the broker, over TCP or its Unix domain socket.
+ *
+ * @param addr Address of the broker
+ *
+ * @returns Connected socket on success. ERR on failure.
+ */
+int bridge_connect(const bridge_addr_t * addr);
+
+/**
+ * @brief Write all the bytes to the socket.
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int bridge_write(int sock, const char * buf, size_t len);
+
+/**
+ * @brief Write all the bytes of several buffers to the socket at once.
+ *
+ * @param sock Socket to write to
+ * @param iov Buffers to write, advanced past what is written
+ * @param cnt Number of buffers
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int bridge_writev(int sock, struct iovec * iov, int cnt);
+
+/**
+ * @brief Read exactly len bytes from the socket.
+ *
+ * @param sock Socket to read from
+ * @param buf Buffer to fill
+ * @param len Number of bytes to read
+ * @param timeout_ms Milliseconds to wait at most for each part
+ *
+ * @returns OK on success. ERR on error, timeout, or EOF.
+ */
+int bridge_read(int sock, char * buf, size_t len, int timeout_ms);
+
+/**
+ * @brief Write a request and its topic, length-prefixed:
+ *
+ *   Command (1 byte, lower-case) | Length (1 byte) | Topic
+ *
+ * @param sock Connection to the broker
+ * @param cmd Upper-case command
+ * @param topic Topic of the request
+ * @param len Length of the topic, at most BRIDGE_TOPIC_MAX
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int bridge_request(int sock, char cmd, const char * topic, size_t len);
+
+/**
+ * @brief Subscribe to a topic.
+ *
+ * @param addr Address of the broker, copied (the strings are not)
+ * @param topic Topic to subscribe to
+ * @param compress If set, accept compressed blocks
+ * @param filter Only receive the messages that match it (NULL for all)
+ *
+ * @returns The subscriber on success. NULL if it could not be subscribed, or
+ * the filter is malformed.
+ */
+bridge_sub_t * bridge_subscribe(const bridge_addr_t * addr, const char * topic, bool compress,
+	const bridge_filter_t * filter);
+
+/**
+ * @brief Map a receive ring of BRIDGE_RING_LEN bytes twice back to back, so
+ * that the bytes from any position on are contiguous up to BRIDGE_RING_LEN.
+ *
+ * @returns The ring on success. NULL on failure.
+ */
+char * bridge_map_ring(void);
+
+/**
+ * @brief Connect and subscribe again, after waiting retry_ms (doubled on
+ * failure, up to BRIDGE_RETRY_MAX_MS).
+ *
+ * @param sub Subscriber whose connection broke
+ *
+ * @returns OK on success. ERR if it failed, to be tried again later.
+ */
+int bridge_resubscribe(bridge_sub_t * sub);
+
+/**
+ * @brief Hand out the next frame, answering the heartbeats read before it.
+ * The frame of the previous call is consumed. If the connection breaks, the
+ * subscriber connects and subscribes again, and a message in the middle is
+ * handed out as BRIDGE_CUT.
+ *
+ * @param sub Subscriber
+ * @param view View to fill
+ * @param timeout_ms Milliseconds to wait at most (-1 to wait forever)
+ *
+ * @returns OK with a view. BRIDGE_AGAIN if nothing arrived in time.
+ */
+int bridge_next(bridge_sub_t * sub, bridge_view_t * view, int timeout_ms);
+
+/**
+ * @brief Parse the frame at the tail of the ring, answering heartbeats.
+ *
+ * @param sub Subscriber
+ * @param view View to fill
+ *
+ * @returns OK with a view. BRIDGE_AGAIN if the frame is not received whole.
+ * ERR if the stream is malformed.
+ */
+int bridge_parse(bridge_sub_t * sub, bridge_view_t * view);
+
+/**
+ * @brief Close the subscriber, which unsubscribes, and free it.
+ *
+ * @param sub Subscriber to close (NULL for none)
+ */
+void bridge_unsubscribe(bridge_sub_t * sub);
+
+/**
+ * @brief Create a publisher, connected once its first topic is added.
+ *
+ * @param addr Address of the broker, copied (the strings are not)
+ * @param win_bytes Bytes acknowledged at once (0 for no byte window)
+ * @param win_msgs Messages acknowledged at once (0 for no message window,
+ * both 0 for once per message)
+ *
+ * @returns The publisher on success. NULL on failure.
+ */
+bridge_pub_t * bridge_publisher(const bridge_addr_t * addr, uint32_t win_bytes, uint32_t win_msgs);
+
+/**
+ * @brief Add a topic to publish to, aliased in the session. The messages in
+ * flight are drained first, so that the answer comes alone.
+ *
+ * @param pub Publisher
+ * @param topic Topic to add
+ *
+ * @returns Index of the topic on success. ERR if there are BRIDGE_MAX_TOPICS
+ * or the broker refused it.
+ */
+int bridge_topic(bridge_pub_t * pub, const char * topic);
+
+/**
+ * @brief Open the session, asking for the window, and alias the topics in
+ * it, waiting for the answers. Messages not acknowledged by the session
+ * before are counted as lost.
+ *
+ * @param pub Publisher
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int bridge_open(bridge_pub_t * pub);
+
+/**
+ * @brief Publish a message, gathered with the next ones unless it does not
+ * fit the batch. Connects again first if the session broke.
+ *
+ * @param pub Publisher
+ * @param topic Index of the topic, from bridge_topic()
+ * @param data Message
+ * @param len Length of the message, at most BRIDGE_MSG_MAX
+ *
+ * @returns OK on success. ERR if the session broke.
+ */
+int bridge_publish(bridge_pub_t * pub, int topic, const char * data, size_t len);
+
+/**
+ * @brief Write the gathered requests and read the acks that arrived.
+ *
+ * @param pub Publisher
+ *
+ * @returns OK on success. ERR if the session broke.
+ */
+int bridge_flush(bridge_pub_t * pub);
+
+/**
+ * @brief Write the gathered requests and wait until every message is
+ * acknowledged. The window is asked for again, which has the broker
+ * acknowledge what it has so far.
+ *
+ * @param pub Publisher
+ *
+ * @returns OK on success. ERR if the session broke.
+ */
+int bridge_drain(bridge_pub_t * pub);
+
+/**
+ * @brief Read acks, keeping the counts of the last.
+ *
+ * @param pub Publisher
+ * @param wait If set, wait for the next ack, otherwise only read those that
+ * arrived
+ *
+ * @returns OK on success. ERR if the session broke or another answer came.
+ */
+int bridge_read_acks(bridge_pub_t * pub, bool wait);
+
+/**
+ * @brief Drop the session of the publisher, counting the messages not
+ * acknowledged as lost.
+ *
+ * @param pub Publisher
+ */
+void bridge_disconnect(bridge_pub_t * pub);
+
+/**
+ * @brief End the session once every message is acknowledged, and free the
+ * publisher.
+ *
+ * @param pub Publisher to close (NULL for none)
+ *
+ * @returns OK if every message was acknowledged. ERR otherwise.
+ */
+int bridge_close(bridge_pub_t * pub);
+
+/**
+ * @brief Publish a message on a connection of its own, and wait for the
+ * broker to be done with it.
+ *
+ * @param addr Address of the broker
+ * @param topic Topic to publish to
+ * @param data Message
+ * @param len Length of the message
+ * @param window If set, the message is acknowledged once as a whole instead of
+ * per chunk
+ *
+ * @returns OK once acknowledged whole. ERR on failure.
+ */
+int bridge_send(const bridge_addr_t * addr, const char * topic, const char * data, size_t len, bool window);
+
+/**
+ * @brief Set how the broker holds back the output of a topic.
+ *
+ * @param addr Address of the broker
+ * @param topic Topic to tune
+ * @param bytes Bytes held back per message
+ * @param usec Microseconds they are held back at most
+ *
+ * @returns OK on success. ERR on failure or if refused.
+ */
+int bridge_tune(const bridge_addr_t * addr, const char * topic, uint32_t bytes, uint32_t usec);
+
+/**
+ * @brief Get the monotonic time in milliseconds.
+ */
+uint64_t bridge_now_ms(void);
+
+#endif
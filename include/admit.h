@@ -0,0 +1,115 @@
+#ifndef BRIDGE_ADMIT_H
+#define BRIDGE_ADMIT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "util.h"
+
+/*
+ * Admission control. Connections are counted from accept to close and each is
+ * charged a nominal cost against the memory budget, as are the optional buffers
+ * of a delivery (coalescing, compression) and publish sessions. Past a limit,
+ * new connections are answered F and closed by the accept thread right away,
+ * and deliveries go without the optional buffers, so that the broker sheds
+ * load instead of running out of threads or memory. A limit of 0 means none.
+ */
+
+#define ADMIT_CONN_BASE   (32768) /* Receive buffer and stack of a handler */
+#define ADMIT_SOCK_BUF    (65536) /* Kernel buffer assumed when not set with -w */
+
+/**
+ * @brief Limits and current usage. The limits are set once at startup, the
+ * usage is updated with atomics.
+ *
+ * @param max_conns Most client connections at once
+ * @param max_subs Most subscribers of a topic
+ * @param conn_bytes Send and receive buffer size of each connection (SO_SNDBUF
+ * and SO_RCVBUF), 0 to keep the kernel's
+ * @param budget Most bytes charged at once
+ * @param conn_cost Bytes charged for each connection
+ * @param conns Number of client connections open
+ * @param mem Number of bytes charged
+ * @param rejected Number of connections refused at accept
+ * @param full Number of subscriptions refused because the topic was full
+ * @param shed Number of buffers refused because of the budget
+ */
+typedef struct admit {
+    uint64_t max_conns;
+    uint64_t max_subs;
+    uint64_t conn_bytes;
+    uint64_t budget;
+    uint64_t conn_cost;
+    uint64_t conns;
+    uint64_t mem;
+    uint64_t rejected;
+    uint64_t full;
+    uint64_t shed;
+} admit_t;
+
+/**
+ * @brief Set the limits from the config and clear the usage.
+ *
+ * @param admit Admission state to set
+ * @param config Options with the limits
+ */
+void set_admit(admit_t * admit, const config_t * config);
+
+/**
+ * @brief Count a new connection and charge its cost, unless a limit would be
+ * exceeded.
+ *
+ * @param admit Admission state
+ *
+ * @returns OK if admitted. ERR if it should be refused (counted as rejected).
+ */
+int admit_conn(admit_t * admit);
+
+/**
+ * @brief Uncount a connection admitted with admit_conn().
+ *
+ * @param admit Admission state
+ */
+void release_conn(admit_t * admit);
+
+/**
+ * @brief Charge bytes against the budget, unless it would be exceeded.
+ *
+ * @param admit Admission state
+ * @param bytes Number of bytes to charge
+ *
+ * @returns OK if charged. ERR if over the budget (counted as shed).
+ */
+int admit_mem(admit_t * admit, size_t bytes);
+
+/**
+ * @brief Give back bytes charged with admit_mem().
+ *
+ * @param admit Admission state
+ * @param bytes Number of bytes charged
+ */
+void release_mem(admit_t * admit, size_t bytes);
+
+/**
+ * @brief Set the send and receive buffer sizes of a socket to the configured
+ * ones. Connections accepted from a listening socket inherit them.
+ *
+ * @param admit Admission state
+ * @param sock Socket to set
+ *
+ * @returns OK on success or if not configured. ERR on failure.
+ */
+int admit_sock(const admit_t * admit, int sock);
+
+/**
+ * @brief Copy the limits and the usage.
+ *
+ * @param admit Admission state
+ * @param copy Copy to fill
+ */
+void snapshot_admit(const admit_t * admit, admit_t * copy);
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef BRIDGE_CONFIG_H
+#define BRIDGE_CONFIG_H
+
+#include <arpa/inet.h>  /* inet_pton() */
+#include <errno.h>
+#include <limits.h>     /* INT_MAX */
+#include <sched.h>      /* CPU_SETSIZE */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>     /* getopt() */
+
+#include "tcp.h"      /* SOCK_LISTEN_Q_LEN */
+#include "util.h"
+#include "work.h"      /* WORK_MAX_THREADS, WORK_THRESHOLD */
+
+#define CONFIG_OPTS "dl:a:b:c:u:g:p:s:f:n:k:w:m:r:j:x:q:h"
+#define CONFIG_MAX_LISTENERS (64)
+#define CONFIG_MAX_PEERS     (16) /* Brokers to link to with -f */
+#define CONFIG_MAX_CONN_BYTES (16777216) /* Largest socket buffer with -w */
+
+/**
+ * @brief Options given on the command line.
+ *
+ * @param headless If set, run without ncurses and stop on SIGINT or SIGTERM
+ * @param log_path File to append the logs to (stderr if NULL and headless)
+ * @param listeners Number of listening sockets on the port, each with its own
+ * accept loop (SO_REUSEPORT)
+ * @param backlog Length of the accept queue of each listening socket
+ * @param cpus CPUs to pin the accept threads to, in order (cycled through)
+ * @param num_cpus Number of CPUs in cpus, 0 to leave the threads unpinned
+ * @param uds_path Path of the Unix domain socket to also listen on (none if NULL)
+ * @param mcast_group First multicast group of the topics in host byte order
+ * (0 to disable multicast)
+ * @param mcast_port Port of the multicast groups
+ * @param mcast_if Address of the interface to send the datagrams from in host
+ * byte order (INADDR_ANY to follow the routes)
+ * @param port Port to listen on (0 for one chosen by the kernel)
+ * @param stats_port Port of the stats server on loopback (0 for one chosen by
+ * the kernel)
+ * @param peer_ips Addresses of the brokers to link to in host byte order
+ * @param peer_ports Ports of the brokers to link to
+ * @param num_peers Number of brokers to link to
+ * @param max_conns Most client connections at once (0 for no limit)
+ * @param max_subs Most subscribers of a topic (0 for no limit)
+ * @param conn_bytes Send and receive buffer size of each connection (0 to keep
+ * the kernel's)
+ * @param budget_mb Memory budget of the connections and delivery buffers in
+ * MiB (0 for no limit)
+ * @param handoff_path Path of the Unix domain socket to take over from the
+ * running broker and hand off to the next one (hot restart disabled if NULL)
+ * @param workers Number of worker threads large fan-outs are spread over (0 to
+ * always deliver from the publishing thread)
+ * @param fan_threshold Subscribers of a topic from which its fan-out is spread
+ * @param actors Number of threads delivering the queued messages of the topics
+ * (0 for the publishers to deliver themselves)
+ */
+typedef struct config {
+    bool headless;
+    const char * log_path;
+    int listeners;
+    int backlog;
+    int cpus[CONFIG_MAX_LISTENERS];
+    int num_cpus;
+    const char * uds_path;
+    uint32_t mcast_group;
+    uint16_t mcast_port;
+    uint32_t mcast_if;
+    uint16_t port;
+    uint16_t stats_port;
+    uint32_t peer_ips[CONFIG_MAX_PEERS];
+    uint16_t peer_ports[CONFIG_MAX_PEERS];
+    int num_peers;
+    int max_conns;
+    int max_subs;
+    int conn_bytes;
+    int budget_mb;
+    const char * handoff_path;
+    int workers;
+    int fan_threshold;
+    int actors;
+} config_t;
+
+/**
+ * @brief Parse the command line options into the config. Options that are not
+ * given are set to their defaults.
+ *
+ * @param config Config to fill
+ * @param argc Number of arguments
+ * @param argv Arguments given to main()
+ *
+ * @returns OK on success. ERR on an unknown or malformed option, or if the
+ * help was requested.
+ */
+int parse_config(config_t * config, int argc, char * argv[]);
+
+/**
+ * @brief Parse a decimal integer option within the given bounds.
+ *
+ * @param str Option argument
+ * @param min Smallest value accepted
+ * @param max Largest value accepted
+ * @param value Set to the parsed value on success
+ *
+ * @returns OK on success. ERR if malformed or out of bounds.
+ */
+int parse_int(const char * str, long min, long max, int * value);
+
+/**
+ * @brief Parse a list of CPUs such as "0-3,8,10-11" into the config.
+ *
+ * @param str Option argument
+ * @param config Config to fill the cpus of
+ *
+ * @returns OK on success. ERR if malformed, out of bounds, or more than
+ * CONFIG_MAX_LISTENERS CPUs.
+ */
+int parse_cpus(const char * str, config_t * config);
+
+/**
+ * @brief Parse the multicast option "group:port[/ifaddr]" into the config.
+ *
+ * @param str Option argument (ex. 239.255.0.1:56000/127.0.0.1)
+ * @param config Config to fill the multicast options of
+ *
+ * @returns OK on success. ERR if malformed or not a multicast group.
+ */
+int parse_mcast(const char * str, config_t * config);
+
+/**
+ * @brief Parse a broker to link to, "host:port" with an IPv4 host, into the
+ * config.
+ *
+ * @param str Option argument (ex. 127.0.0.1:55565)
+ * @param config Config to add the broker to
+ *
+ * @returns OK on success. ERR if malformed or more than CONFIG_MAX_PEERS.
+ */
+int parse_peer(const char * str, config_t * config);
+
+/**
+ * @brief Print the available options.
+ *
+ * @param prog Name of the program
+ */
+void usage(const char * prog);
+
+#endif
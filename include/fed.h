@@ -0,0 +1,276 @@
+#ifndef BRIDGE_FED_H
+#define BRIDGE_FED_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h> /* getrandom() */
+#include <sys/socket.h>
+#include <sys/time.h>   /* struct timeval */
+#include <unistd.h>
+
+#include "config.h"
+#include "proto.h"    /* proto_put32(), proto_get32() */
+#include "table.h"
+#include "tcp.h"
+#include "util.h"
+
+/*
+ * Federation of brokers. Brokers link to each other over one TCP connection
+ * per pair, and each sends over it the topics its local clients subscribe to
+ * (interest). A message published to a broker is forwarded once over each link
+ * whose broker wants the topic, multiplexed with the other messages in flight:
+ *
+ *   L | Id (8)                              Link request, answered O | Id (8) or F
+ *   S | Length (1) | Topic                  The broker wants the topic
+ *   U | Length (1) | Topic                  The broker no longer wants the topic
+ *   B | Message (4) | Length (1) | Topic    A message starts
+ *   D | Message (4) | Length (2) | Data (at maximum 128 bytes)
+ *   E | Message (4)                         The message ends
+ *
+ * Topics are sent by name since topic ids are local to each broker. Integers
+ * are big-endian. Loops are prevented by construction: messages received over
+ * a link are only delivered to local clients, interest received over a link is
+ * not passed on, a broker refuses links to itself, and there is at most one
+ * link between two brokers. Brokers that should exchange messages
+ * must therefore be linked directly (full mesh).
+ */
+
+#define FED_MAX_PEERS     (32)   /* Links at once, bits of topic_t.peers */
+#define FED_ID_LEN        (8)
+#define FED_MSG_LEN       (4)
+#define FED_DATA_LEN      (128)  /* Same as SERVER_PF_DATA */
+#define FED_MAX_INFLIGHT  (64)   /* Messages in flight per link, more are dropped */
+#define FED_CONNECT_SEC   (1)    /* Seconds to wait for a link to be established */
+#define FED_RETRY_MS      (1000) /* Milliseconds between dials of a broker */
+#define FED_SYNC_MS       (50)   /* Milliseconds between checks of the interest */
+
+#define FED_MSG_LINK      'L'
+#define FED_MSG_SUB       'S'
+#define FED_MSG_UNSUB     'U'
+#define FED_MSG_BEGIN     'B'
+#define FED_MSG_DATA      'D'
+#define FED_MSG_END       'E'
+
+/**
+ * @brief Slot of a link to another broker.
+ *
+ * @param index Index of the slot, its bit in topic_t.peers
+ * @param sock Connection to the broker (ERR if down)
+ * @param id Identifier of the broker
+ * @param initiator Identifier of the broker that dialed the link
+ * @param ip IP address of the broker
+ * @param port Port number of the broker
+ * @param outbound If set, the slot of a broker given with -f that is dialed
+ * @param retry_at Monotonic time (ms) of the next dial (federation thread only)
+ * @param gen Incremented on every new link in the slot
+ * @param synced_gen Value of gen when the interest was last sent in full
+ * (federation thread only)
+ * @param lock Mutex lock so that frames are written whole
+ */
+typedef struct fed_peer {
+    int index;
+    int sock;
+    uint64_t id;
+    uint64_t initiator;
+    uint32_t ip;
+    uint16_t port;
+    bool outbound;
+    uint64_t retry_at;
+    uint64_t gen;
+    uint64_t synced_gen;
+    pthread_mutex_t * lock;
+} fed_peer_t;
+
+/**
+ * @brief Federation state of the broker.
+ *
+ * @param id Random identifier of the broker
+ * @param next_msg Identifier of the last message forwarded
+ * @param synced_version Table version when the interest was last sent
+ * (federation thread only)
+ * @param num_outbound Number of brokers to dial, in the first slots
+ * @param peers Link slots
+ * @param lock Mutex lock for taking and releasing slots
+ */
+typedef struct fed {
+    uint64_t id;
+    uint32_t next_msg;
+    uint64_t synced_version;
+    int num_outbound;
+    fed_peer_t peers[FED_MAX_PEERS];
+    pthread_mutex_t * lock;
+} fed_t;
+
+/**
+ * @brief Frame read from a link.
+ *
+ * @param type FED_MSG_* of the frame
+ * @param msg Message the frame belongs to (B, D, and E)
+ * @param topic Topic name, null-terminated (S, U, and B)
+ * @param topic_len Length of the topic name (S, U, and B)
+ * @param len Length of the data (D)
+ * @param data Chunk of the message (D)
+ */
+typedef struct fed_frame {
+    char type;
+    uint32_t msg;
+    char topic[TABLE_TOPIC_LEN+1];
+    uint8_t topic_len;
+    uint16_t len;
+    char data[FED_DATA_LEN];
+} fed_frame_t;
+
+/**
+ * @brief Initialize the federation state with a random identifier and a slot
+ * for each broker given in the config.
+ *
+ * @param config Options with the brokers to link to
+ *
+ * @returns The federation state on success. NULL on failure.
+ */
+fed_t * init_fed(const config_t * config);
+
+/**
+ * @brief Dial the broker of an outbound slot and link to it.
+ *
+ * @param fed Federation state
+ * @param peer Outbound slot, down
+ *
+ * @returns OK if linked. ERR on failure or if refused.
+ */
+int fed_dial(fed_t * fed, fed_peer_t * peer);
+
+/**
+ * @brief Take a slot for a new link. Links to itself are refused. If there is
+ * another link to the same broker, the one dialed by the broker with the
+ * smaller identifier is kept (both sides decide the same), and a broker dialing
+ * again replaces its previous link. For inbound links, the OK is written before
+ * any other frame can be.
+ *
+ * @param fed Federation state
+ * @param slot Outbound slot, or NULL to take a free inbound slot
+ * @param sock Connection of the broker
+ * @param id Identifier of the broker
+ * @param initiator Identifier of the broker that dialed
+ * @param ip IP address of the broker
+ * @param port Port number of the broker
+ *
+ * @returns The slot on success. NULL if refused or no slot is free.
+ */
+fed_peer_t * fed_link(fed_t * fed, fed_peer_t * slot, int sock, uint64_t id, uint64_t initiator, uint32_t ip, uint16_t port);
+
+/**
+ * @brief Check whether there is a link to the given broker.
+ *
+ * @param fed Federation state
+ * @param id Identifier of the broker
+ *
+ * @returns true if linked, false otherwise.
+ */
+bool fed_linked(fed_t * fed, uint64_t id);
+
+/**
+ * @brief Release the slot of a link that went down: forget the topics the
+ * broker wanted, then close the connection. Only called by the link's reader.
+ *
+ * @param fed Federation state
+ * @param table Table containing all topic entries
+ * @param peer Slot of the link
+ */
+void fed_unlink(fed_t * fed, table_t * table, fed_peer_t * peer);
+
+/**
+ * @brief Read one frame from a link.
+ *
+ * @param sock Connection of the broker
+ * @param frame Frame to fill
+ *
+ * @returns OK on success. ERR if the link is closed, broken, or the frame is
+ * malformed.
+ */
+int fed_read(int sock, fed_frame_t * frame);
+
+/**
+ * @brief Write a whole frame to a link. A link that fails is shut down so that
+ * its reader unlinks it.
+ *
+ * @param peer Slot of the link
+ * @param frame Frame to write
+ * @param len Length of the frame
+ *
+ * @returns OK on success. ERR if the link is down or failed.
+ */
+int fed_send(fed_peer_t * peer, const char * frame, size_t len);
+
+/**
+ * @brief Send the changes of interest to the linked brokers, or all the topics
+ * wanted to the newly linked ones. A topic is wanted while it has local
+ * subscribers or a shared-memory ring. Does nothing if neither the table nor
+ * the links changed since the last call. Federation thread only.
+ *
+ * @param fed Federation state
+ * @param table Table containing all topic entries
+ */
+void fed_sync(fed_t * fed, table_t * table);
+
+/**
+ * @brief Start forwarding a message to the brokers that want its topic.
+ *
+ * @param fed Federation state
+ * @param peers Bits of the slots to forward to (topic_t.peers)
+ * @param topic Topic name
+ * @param len Length of the topic name
+ *
+ * @returns Identifier of the message for fed_data() and fed_end().
+ */
+uint32_t fed_begin(fed_t * fed, uint32_t peers, const char * topic, uint8_t len);
+
+/**
+ * @brief Forward a chunk of a message.
+ *
+ * @param fed Federation state
+ * @param peers Bits of the slots given to fed_begin()
+ * @param msg Identifier of the message
+ * @param data Chunk of the message
+ * @param len Length of the chunk, at most FED_DATA_LEN
+ */
+void fed_data(fed_t * fed, uint32_t peers, uint32_t msg, const char * data, size_t len);
+
+/**
+ * @brief End a forwarded message.
+ *
+ * @param fed Federation state
+ * @param peers Bits of the slots given to fed_begin()
+ * @param msg Identifier of the message
+ */
+void fed_end(fed_t * fed, uint32_t peers, uint32_t msg);
+
+/**
+ * @brief Write a frame to each of the given links.
+ *
+ * @param fed Federation state
+ * @param peers Bits of the slots to write to
+ * @param frame Frame to write
+ * @param len Length of the frame
+ */
+void fed_forward(fed_t * fed, uint32_t peers, const char * frame, size_t len);
+
+/**
+ * @brief Shut down every link so that their readers unlink them, ex. before
+ * handing off to another broker. Outbound links are dialed again as usual.
+ *
+ * @param fed Federation state
+ */
+void fed_shutdown(fed_t * fed);
+
+/**
+ * @brief Free the federation state. Links must be down.
+ *
+ * @param fed Federation state to clean
+ */
+void cleanup_fed(fed_t * fed);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef BRIDGE_FILTER_H
+#define BRIDGE_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * Content filters. A subscriber may attach a filter to its subscription so
+ * that it is only sent the messages whose head (first FILTER_LEN bytes)
+ * matches: a prefix, or bytes compared under a mask at an offset of a fixed
+ * header. Both are kept as a mask and a value over the head, and a message
+ * matches if (head & mask) == value and it is at least need bytes long.
+ *
+ * Subscribers with the same filter share it. The filters of a topic are
+ * interned in a set, laid out word by word over all of them, and a message is
+ * evaluated once against the whole set, whatever the number of subscribers,
+ * which then look up the result of their filter. The first filter of a set
+ * matches everything, it is the one of the subscribers without a filter.
+ */
+
+#define FILTER_LEN     (64)  /* Bytes of the head of a message the filters look at */
+#define FILTER_WORDS   (FILTER_LEN / 8)
+#define FILTER_MAX     (256) /* Distinct filters of a topic, the first matching all */
+#define FILTER_NONE    (0)   /* Filter of the subscribers without one */
+#define FILTER_PREFIX  'P'   /* The bytes at the offset are the value */
+#define FILTER_MASK    'M'   /* The bytes at the offset, masked, are the value */
+
+/**
+ * @brief Filter of a subscriber.
+ *
+ * @param mask Bits of the head that are compared
+ * @param value Bits they must have, 0 where the mask is
+ * @param need Shortest message that can match, the end of the compared bytes
+ */
+typedef struct filter {
+    uint8_t mask[FILTER_LEN];
+    uint8_t value[FILTER_LEN];
+    uint8_t need;
+} filter_t;
+
+/**
+ * @brief Filters of a topic. Filters are only appended, under the table lock,
+ * and never change, so that the fan-outs read them without it.
+ *
+ * @param mask Masks of the filters, by word of the head then by filter
+ * @param value Values of the filters, laid out as mask
+ * @param need Shortest message each filter can match
+ * @param num_filters Number of filters in the set
+ * @param max_need Largest need of the filters, bytes of the head a fan-out waits
+ * for before evaluating them
+ */
+typedef struct filter_set {
+    uint64_t mask[FILTER_WORDS][FILTER_MAX];
+    uint64_t value[FILTER_WORDS][FILTER_MAX];
+    uint8_t need[FILTER_MAX];
+    int num_filters;
+    uint8_t max_need;
+} filter_set_t;
+
+/**
+ * @brief Get the length of the value and mask of a filter request.
+ *
+ * @param args Kind (1) | Offset (1) | Length (1) of the request
+ *
+ * @returns Number of bytes that follow. ERR if the kind is unknown, or the
+ * compared bytes are empty or past FILTER_LEN.
+ */
+int filter_args_len(const char * args);
+
+/**
+ * @brief Make the filter of a request.
+ *
+ * @param args Kind (1) | Offset (1) | Length (1) | Value (Length) [| Mask
+ * (Length)], checked with filter_args_len()
+ * @param filter Filter to set
+ */
+void parse_filter(const char * args, filter_t * filter);
+
+/**
+ * @brief Allocate a set holding only the filter matching everything.
+ *
+ * @returns The set on success. NULL on failure.
+ */
+filter_set_t * init_filters(void);
+
+/**
+ * @brief Intern a filter in the set. Assumes that the table mutex is locked
+ * prior.
+ *
+ * @param set Set of the topic
+ * @param filter Filter to add
+ *
+ * @returns Index of the filter in the set (the same for the same filter). ERR
+ * if the set is full.
+ */
+int add_filter(filter_set_t * set, const filter_t * filter);
+
+/**
+ * @brief Copy a filter out of the set.
+ *
+ * @param set Set of the topic
+ * @param index Index of the filter in the set
+ * @param filter Filter to set
+ */
+void get_filter(const filter_set_t * set, int index, filter_t * filter);
+
+/**
+ * @brief Evaluate all the filters of the set on the head of a message.
+ *
+ * @param set Set of the topic
+ * @param head First bytes of the message
+ * @param len Number of bytes in head, the whole message if it is shorter than
+ * max_need
+ * @param pass Set to whether each filter matches, FILTER_MAX of them
+ *
+ * @returns Number of filters evaluated, those added since are not.
+ */
+int eval_filters(const filter_set_t * set, const char * head, size_t len, bool * pass);
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef BRIDGE_HANDOFF_H
+#define BRIDGE_HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>   /* lstat() */
+#include <sys/time.h>   /* struct timeval */
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "proto.h"      /* proto_put32(), proto_get32() */
+#include "table.h"      /* TABLE_TOPIC_LEN */
+#include "uds.h"        /* uds_send_fd(), uds_recv_fd() */
+#include "util.h"
+
+/*
+ * Hot restart. A broker started with -r path listens there for the broker that
+ * replaces it. A new broker given the same path connects to it first, and the
+ * running broker stops accepting, waits for the requests in progress, and
+ * passes its state as records over the Unix domain (seqpacket) socket, the file
+ * descriptors along with them (SCM_RIGHTS):
+ *
+ *   L | Family (1)                                      A listening socket (fd)
+ *   T | Length (1) | Topic | Bytes (4) | Microseconds (4)
+ *                                                       A topic, in id order
+ *   R                                                   Shared-memory ring of
+ *                                                       the last topic (fd)
+ *   S | Flags (1) | IP (4) | Port (2)                   Subscriber of the last
+ *     [| Length (1) | Mask (Length) | Value (Length)]   topic (fd), and its
+ *                                                       filter if flagged
+ *   E                                                   The end, answered O
+ *
+ * Integers are big-endian. Connections that arrive meanwhile wait in the accept
+ * queues that are handed off, and the subscribers keep their connections, so
+ * that the new broker starts with the same topics and subscribers and nothing
+ * is dropped. The old broker exits once the new one answered.
+ */
+
+#define HANDOFF_LISTENER  'L'
+#define HANDOFF_TOPIC     'T'
+#define HANDOFF_RING      'R'
+#define HANDOFF_SUB       'S'
+#define HANDOFF_END       'E'
+#define HANDOFF_REC_LEN   (1 + 1 + TABLE_TOPIC_LEN + 8) /* Longest record */
+#define HANDOFF_FLAG_COMPRESS (0x01) /* The subscriber accepts compressed frames */
+#define HANDOFF_FLAG_FILTER   (0x02) /* The subscriber has a filter */
+#define HANDOFF_WAIT_SEC  (5)    /* Seconds to wait for a record or the answer */
+
+/**
+ * @brief Hot restart state of the broker.
+ *
+ * @param path Path of the Unix domain socket to hand off on
+ * @param sock Socket listening for the next broker (ERR if none)
+ * @param draining If set, no new request is taken since the broker is handing
+ * off
+ * @param busy Number of requests in progress (accept threads included while
+ * accepting), waited for before handing off
+ */
+typedef struct handoff {
+    const char * path;
+    int sock;
+    bool draining;
+    uint64_t busy;
+} handoff_t;
+
+/**
+ * @brief Record of a handoff.
+ *
+ * @param type HANDOFF_* of the record
+ * @param fd File descriptor passed with the record (ERR if none)
+ * @param family Address family of the listening socket (L)
+ * @param topic Topic name, null-terminated (T)
+ * @param topic_len Length of the topic name (T)
+ * @param flush_bytes Output held back per message of the topic (T)
+ * @param flush_usec How long the output of the topic is held back (T)
+ * @param flags HANDOFF_FLAG_* of the subscriber (S)
+ * @param ip IP address of the subscriber (S)
+ * @param port Port number of the subscriber (S)
+ * @param filter Filter of the subscriber, if flagged (S)
+ */
+typedef struct handoff_rec {
+    char type;
+    int fd;
+    int family;
+    char topic[TABLE_TOPIC_LEN+1];
+    uint8_t topic_len;
+    uint32_t flush_bytes;
+    uint32_t flush_usec;
+    uint8_t flags;
+    uint32_t ip;
+    uint16_t port;
+    filter_t filter;
+} handoff_rec_t;
+
+/**
+ * @brief Initialize the hot restart state.
+ *
+ * @param path Path of the Unix domain socket to hand off on
+ *
+ * @returns The state on success. NULL on failure.
+ */
+handoff_t * init_handoff(const char * path);
+
+/**
+ * @brief Connect to the broker to take over from.
+ *
+ * @param path Path it hands off on
+ *
+ * @returns The connection on success. ERR if there is no broker to take over
+ * from.
+ */
+int handoff_connect(const char * path);
+
+/**
+ * @brief Listen for the next broker, replacing the socket file of the previous
+ * broker if any.
+ *
+ * @param handoff Hot restart state
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int handoff_listen(handoff_t * handoff);
+
+/**
+ * @brief Take a request unless the broker is handing off. Every call that
+ * returns OK is paired with handoff_leave() once the request is done.
+ *
+ * @param handoff Hot restart state (NULL if disabled)
+ *
+ * @returns OK if the request can be handled. ERR if the broker is handing off.
+ */
+int handoff_enter(handoff_t * handoff);
+
+/**
+ * @brief Mark a request taken with handoff_enter() as done.
+ *
+ * @param handoff Hot restart state (NULL if disabled)
+ */
+void handoff_leave(handoff_t * handoff);
+
+/**
+ * @brief Check whether the broker is handing off.
+ *
+ * @param handoff Hot restart state (NULL if disabled)
+ *
+ * @returns true if handing off, false otherwise.
+ */
+bool handoff_draining(handoff_t * handoff);
+
+/**
+ * @brief Write a record, with its file descriptor if any.
+ *
+ * @param sock Connection to the other broker
+ * @param rec Record to write
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int handoff_send(int sock, const handoff_rec_t * rec);
+
+/**
+ * @brief Read a record, with its file descriptor if the type has one.
+ *
+ * @param sock Connection to the other broker
+ * @param rec Record to fill
+ *
+ * @returns OK on success. ERR if closed, broken, timed out, or malformed.
+ */
+int handoff_recv(int sock, handoff_rec_t * rec);
+
+/**
+ * @brief Close the listening socket and free the hot restart state.
+ *
+ * @param handoff Hot restart state to clean
+ */
+void cleanup_handoff(handoff_t * handoff);
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef BRIDGE_LOG_H
+#define BRIDGE_LOG_H
+
+#include <errno.h>
+#include <fcntl.h>      /* open() */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define LOG_RING_SIZE    (4096) /* Number of records, must be a power of 2 */
+#define LOG_TEXT_LEN     (100)  /* Message (or topic) bytes in a record */
+#define LOG_RECENT_LINES (5)    /* Number of formatted lines kept for the UI */
+#define LOG_LINE_LEN     (LOG_TEXT_LEN + 64)
+#define LOG_POLL_NSEC    (10000000) /* Consumer sleeps 10ms when the ring is empty */
+
+/**
+ * Kind of record, which decides how it is formatted
+ */
+enum LOG_TYPE {
+	LOG_TEXT,
+	LOG_SUBSCRIBE,
+	LOG_UNSUBSCRIBE,
+	LOG_PUBLISH,
+	LOG_MAP,
+	LOG_GROUP,
+};
+
+/**
+ * @brief Fixed-size binary log record. Formatting is left to the consumer.
+ *
+ * @param seq Sequence of the slot, used to hand it between producers and consumer
+ * @param time Time the record was produced
+ * @param ip IP address of the requester (connection records)
+ * @param port Port number of the requester (connection records)
+ * @param type Kind of record
+ * @param text Message, or topic for connection records. Not null-terminated if full.
+ */
+typedef struct log_record {
+    uint64_t seq;
+    struct timespec time;
+    uint32_t ip;
+    uint16_t port;
+    uint8_t type;
+    char text[LOG_TEXT_LEN];
+} log_record_t;
+
+/**
+ * @brief Multi-producer single-consumer ring of log records and the state of
+ * the consumer (sink).
+ *
+ * @param ring Array of LOG_RING_SIZE records
+ * @param head Next position to be claimed by a producer
+ * @param tail Next position to be read by the consumer (consumer only)
+ * @param dropped Number of records dropped because the ring was full
+ * @param reported Number of dropped records already reported (consumer only)
+ * @param fd File descriptor to write the formatted logs to or ERR for none
+ * @param finish If set, the consumer drains the ring and stops
+ * @param lock Mutex lock for the recent lines shared with the UI
+ * @param recent Circular buffer of the most recent formatted lines
+ * @param recent_head The index of the next line to overwrite in recent
+ * @param recent_seq Incremented on every line added to recent
+ */
+typedef struct logger {
+    log_record_t * ring;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t reported;
+    int fd;
+    bool finish;
+    pthread_mutex_t * lock;
+    char recent[LOG_RECENT_LINES][LOG_TEXT_LEN+1];
+    int recent_head;
+    uint64_t recent_seq;
+} logger_t;
+
+/**
+ * @brief Open the file to write the logs to. If the path is NULL, stderr is
+ * used instead, left as it is since its file description is shared with the
+ * shell or pipe that started the broker. Only the logger thread writes to it,
+ * so the broker does not wait on it.
+ *
+ * @param path File to append the logs to
+ *
+ * @returns The file descriptor on success. ERR on failure.
+ */
+int open_log(const char * path);
+
+/**
+ * @brief Allocate and initialize the logger.
+ *
+ * @param fd File descriptor to write the formatted logs to or ERR for none
+ *
+ * @returns The newly allocated logger or NULL on error.
+ */
+logger_t * init_logger(int fd);
+
+/**
+ * @brief Claim the next slot in the ring for a producer. The slot must be
+ * published by storing pos+1 to its seq once written.
+ *
+ * @param logger Initialized logger
+ * @param pos Claimed position
+ *
+ * @returns The slot or NULL if the ring is full (counted as dropped).
+ */
+log_record_t * claim_log(logger_t * logger, uint64_t * pos);
+
+/**
+ * @brief Add a message to the logs. Lock-free and never blocks: if the ring is
+ * full, the message is dropped and counted.
+ *
+ * @param logger Initialized logger
+ * @param message Null-terminated message, truncated to LOG_TEXT_LEN
+ *
+ * @returns OK if added. ERR if dropped.
+ */
+int log_msg(logger_t * logger, const char * message);
+
+/**
+ * @brief Add a connection record to the logs. Same as log_msg() but the line
+ * is only formatted by the consumer.
+ *
+ * @param logger Initialized logger
+ * @param type LOG_SUBSCRIBE, LOG_UNSUBSCRIBE, LOG_PUBLISH, LOG_MAP, or LOG_GROUP
+ * @param ip IP address of the requester
+ * @param port Port number of the requester
+ * @param topic Null-terminated topic
+ *
+ * @returns OK if added. ERR if dropped.
+ */
+int log_conn(logger_t * logger, enum LOG_TYPE type, uint32_t ip, uint16_t port, const char * topic);
+
+/**
+ * @brief Take the oldest record out of the ring (consumer only).
+ *
+ * @param logger Initialized logger
+ * @param record Record to copy to
+ *
+ * @returns OK if a record was taken. ERR if the ring is empty.
+ */
+int pop_log(logger_t * logger, log_record_t * record);
+
+/**
+ * @brief Format the record as a line without timestamp or newline.
+ *
+ * @param record Record to format
+ * @param buf Buffer of at least LOG_TEXT_LEN+1 bytes
+ * @param len Size of the buffer
+ */
+void format_log(const log_record_t * record, char * buf, size_t len);
+
+/**
+ * @brief Consume the records, writing them to the log file (if any) and the
+ * recent lines displayed by the UI, until finish is set.
+ *
+ * @param args Initialized logger
+ */
+void * run_logger(void * args);
+
+/**
+ * @brief Add a formatted line to the recent lines displayed by the UI.
+ *
+ * @param logger Initialized logger
+ * @param line Null-terminated line, truncated to LOG_TEXT_LEN
+ */
+void add_recent(logger_t * logger, const char * line);
+
+/**
+ * @brief Write the whole buffer, resuming after short or interrupted writes.
+ *
+ * @param fd File descriptor to write to
+ * @param buf Bytes to write
+ * @param len Number of bytes to write
+ *
+ * @returns OK on success. ERR if a write failed, the rest is not written.
+ */
+int write_log(int fd, const char * buf, size_t len);
+
+/**
+ * @brief Format and write out all the records in the ring (consumer only).
+ *
+ * @param logger Initialized logger
+ *
+ * @returns Number of records consumed.
+ */
+int drain_logger(logger_t * logger);
+
+/**
+ * @brief Free the logger and close the log file (unless stderr). The consumer
+ * must have stopped.
+ *
+ * @param logger Logger to clean
+ */
+void cleanup_logger(logger_t * logger);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef BRIDGE_LZ_H
+#define BRIDGE_LZ_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * Fast LZ77 compression of small blocks, in the LZ4 block format so that
+ * subscribers can decompress with any LZ4 implementation
+ * (LZ4_decompress_safe()). A block is a series of sequences:
+ *
+ *   Token (1 byte) | Literal length (0+ bytes) | Literals | Offset (2 bytes,
+ *   little-endian) | Match length (0+ bytes)
+ *
+ * The high 4 bits of the token are the number of literals and the low 4 bits
+ * the match length minus LZ_MIN_MATCH, 15 meaning that bytes follow (255 to
+ * keep adding). The last sequence has literals only, the last LZ_LAST_LITERALS
+ * bytes are always literals, and no match starts in the last LZ_MF_LIMIT bytes.
+ */
+
+#define LZ_MIN_MATCH      (4)
+#define LZ_LAST_LITERALS  (5)
+#define LZ_MF_LIMIT       (12)
+#define LZ_MAX_OFFSET     (65535)
+#define LZ_HASH_BITS      (12)
+#define LZ_BOUND(len)     ((len) + (len) / 255 + 16) /* Worst case compressed size */
+
+/**
+ * @brief Compress a block.
+ *
+ * @param src Data to compress
+ * @param len Length of the data
+ * @param dst Buffer for the compressed block
+ * @param cap Size of dst, LZ_BOUND(len) is always enough
+ *
+ * @returns Length of the compressed block. ERR if it does not fit in dst or
+ * is not smaller than the data (not worth sending compressed).
+ */
+int lz_compress(const char * src, size_t len, char * dst, size_t cap);
+
+/**
+ * @brief Decompress a block, checking every length and offset against the
+ * buffers so that a malformed block cannot read or write out of them.
+ *
+ * @param src Compressed block
+ * @param len Length of the compressed block
+ * @param dst Buffer for the data
+ * @param cap Size of dst
+ *
+ * @returns Length of the data. ERR if the block is malformed or the data does
+ * not fit in dst.
+ */
+int lz_decompress(const char * src, size_t len, char * dst, size_t cap);
+
+/**
+ * @brief Write the part of a length that does not fit in its token nibble
+ * (which is then 15) as bytes of 255 followed by the remainder.
+ *
+ * @param dst Buffer to write to
+ * @param len Length minus the nibble's 15
+ *
+ * @returns Number of bytes written.
+ */
+size_t lz_put_len(char * dst, size_t len);
+
+/**
+ * @brief Hash the 4 bytes at the given position into LZ_HASH_BITS bits.
+ */
+uint32_t lz_hash(const char * src);
+
+#endif
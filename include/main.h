@@ -2,28 +2,74 @@
 #define BRIDGE_MAIN_H
 
 #include <pthread.h>
+#include <signal.h>
 
+#include "config.h"
+#include "log.h"
 #include "server.h"
+#include "stats.h"
 #include "table.h"
 #include "tui.h"
 
+#define INPUT_WAIT_MS (100) /* Longest wait for a key before checking the status */
+
 /**
  * @brief Arguments to pass to threads
  * 
  * @param table Table containing all topic entries and subscription information
  * @param ui Initialized UI data structure
+ * @param config Options given on the command line
  */
 typedef struct thr_args {
     table_t * table;
     ui_t * ui;
+    const config_t * config;
 } thr_args_t;
 
 /**
- * @brief Block for user input.
+ * @brief Arguments to pass to the signal thread
+ *
+ * @param ui Initialized UI data structure, finished on a signal
+ * @param sigs Signals to stop on
+ */
+typedef struct signal_args {
+    ui_t * ui;
+    sigset_t sigs;
+} signal_args_t;
+
+/**
+ * @brief Block for user input until quit or the UI is finished.
  * 
  * @param table Table containing all topic entries and subscription information
  * @param ui Initialized UI data structure
  */
 void handle_input(table_t * table, ui_t * ui);
 
+/**
+ * @brief Block until one of the given signals is received. The signals must
+ * already be blocked in every thread.
+ *
+ * @param sigs Set of signals to wait for
+ *
+ * @returns The received signal.
+ */
+int wait_signal(const sigset_t * sigs);
+
+/**
+ * @brief Wait for one of the signals, then finish the UI so that handle_input()
+ * returns and the broker shuts down.
+ *
+ * @param args Arguments passed to the thread (signal_args_t)
+ */
+void * run_signals(void * args);
+
+/**
+ * @brief Stop the logger thread once it wrote out the remaining logs, then free
+ * the logger.
+ *
+ * @param logger Logger to stop
+ * @param logger_thr Thread running run_logger()
+ */
+void stop_logger(logger_t * logger, pthread_t logger_thr);
+
 #endif
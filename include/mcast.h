@@ -0,0 +1,154 @@
+#ifndef BRIDGE_MCAST_H
+#define BRIDGE_MCAST_H
+
+#include <arpa/inet.h>  /* sockaddr_in, htonl() */
+#include <netinet/in.h> /* IP_MULTICAST_* */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "proto.h"    /* proto_put32(), proto_put64() */
+#include "util.h"
+
+/*
+ * Multicast fan-out of a topic. Each chunk of a published message is sent once
+ * to the topic's group as a datagram with a sequence number:
+ *
+ *   Topic id (4 bytes) | Flags (1 byte) | Sequence (8 bytes) | Data
+ *
+ * Integers are big-endian. The end of a message is a datagram flagged
+ * MCAST_FLAG_END without data. The last MCAST_REPAIR_SLOTS datagrams of the
+ * topic are kept so that subscribers can ask for the ones they missed (NAK)
+ * over their TCP subscription connection.
+ */
+
+#define MCAST_TOPIC_LEN    (4)   /* Topic id in the header */
+#define MCAST_DATA_LEN     (128) /* Same as SERVER_PF_DATA, one chunk per datagram */
+#define MCAST_HDR_LEN      (MCAST_TOPIC_LEN + 1 + 8)
+#define MCAST_DGRAM_LEN    (MCAST_HDR_LEN + MCAST_DATA_LEN)
+#define MCAST_REPAIR_SLOTS (4096) /* Datagrams kept per topic, must be a power of 2 */
+#define MCAST_FLAG_END     (1)    /* The datagram ends the message, it has no data */
+#define MCAST_TTL          (1)    /* Stay on the LAN segment */
+#define MCAST_MAX_NAK      (256)  /* Most datagrams repaired for one NAK */
+
+/* Messages over the TCP subscription connection */
+#define MCAST_NAK_LEN      (1 + 8 + 2) /* N | First sequence (8) | Count (2) */
+#define MCAST_MSG_NAK      'N' /* Subscriber asks for datagrams again */
+#define MCAST_MSG_REPAIR   'R' /* R | Length (2) | Datagram */
+#define MCAST_MSG_LOST     'X' /* X | Sequence (8), no longer kept */
+
+/**
+ * @brief Multicast sender shared by the topics.
+ *
+ * @param sock UDP socket the datagrams are sent from
+ * @param base First group address (host byte order), topics take the next ones
+ * @param port Port of the groups
+ * @param next_group Offset of the group of the next topic
+ */
+typedef struct mcast {
+    int sock;
+    uint32_t base;
+    uint16_t port;
+    uint32_t next_group;
+} mcast_t;
+
+/**
+ * @brief A datagram kept for repairs.
+ *
+ * @param seq Sequence number of the datagram (0 if none)
+ * @param len Length of the datagram
+ * @param data The datagram, header included
+ */
+typedef struct mcast_slot {
+    uint64_t seq;
+    uint16_t len;
+    char data[MCAST_DGRAM_LEN];
+} mcast_slot_t;
+
+/**
+ * @brief Multicast state of a topic.
+ *
+ * @param sock UDP socket of the sender
+ * @param group Address and port of the topic's group
+ * @param topic Id of the topic
+ * @param seq Sequence number of the last datagram sent
+ * @param slots Last datagrams sent, for repairs
+ * @param lock Mutex lock so that datagrams are numbered and sent in order
+ */
+typedef struct mcast_topic {
+    int sock;
+    struct sockaddr_in group;
+    uint32_t topic;
+    uint64_t seq;
+    mcast_slot_t * slots;
+    pthread_mutex_t * lock;
+} mcast_topic_t;
+
+/**
+ * @brief Create the UDP socket sending to the groups.
+ *
+ * @param base First group address in host byte order (ex. 239.255.0.1)
+ * @param port Port of the groups
+ * @param ifaddr Address of the interface to send from in host byte order
+ * (INADDR_ANY to follow the routes)
+ *
+ * @returns The sender on success. NULL on failure.
+ */
+mcast_t * init_mcast(uint32_t base, uint16_t port, uint32_t ifaddr);
+
+/**
+ * @brief Allocate the multicast state of a topic and give it the next group.
+ *
+ * @param mcast Sender
+ * @param topic Id of the topic
+ *
+ * @returns The topic state on success. NULL on failure.
+ */
+mcast_topic_t * init_mcast_topic(mcast_t * mcast, uint32_t topic);
+
+/**
+ * @brief Number and send one datagram to the topic's group, keeping it for
+ * repairs.
+ *
+ * @param mt Topic state
+ * @param data Chunk of the message
+ * @param len Length of the chunk, at most MCAST_DATA_LEN
+ * @param flags MCAST_FLAG_* of the datagram
+ *
+ * @returns OK on success. ERR if it could not be sent (it can still be repaired).
+ */
+int mcast_send(mcast_topic_t * mt, const char * data, size_t len, uint8_t flags);
+
+/**
+ * @brief Answer a NAK by writing the requested datagrams (or that they are no
+ * longer kept) to the subscriber's TCP connection. Requested datagrams that
+ * were not sent yet are ignored.
+ *
+ * @param mt Topic state
+ * @param csock Subscriber's TCP connection
+ * @param first Sequence number of the first datagram to repair
+ * @param count Number of datagrams to repair, at most MCAST_MAX_NAK
+ *
+ * @returns OK on success. ERR on failure to write.
+ */
+int mcast_repair(mcast_topic_t * mt, int csock, uint64_t first, uint16_t count);
+
+/**
+ * @brief Free the multicast state of a topic.
+ *
+ * @param mt Topic state to clean
+ */
+void cleanup_mcast_topic(mcast_topic_t * mt);
+
+/**
+ * @brief Close the sender.
+ *
+ * @param mcast Sender to clean
+ */
+void cleanup_mcast(mcast_t * mcast);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef BRIDGE_POOL_H
+#define BRIDGE_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>   /* mmap() */
+
+#include "util.h"
+
+#define POOL_ALIGN    (64)   /* Objects do not share cache lines */
+#define POOL_OBJS     (1024) /* Objects in the pool of each accept thread */
+
+/**
+ * @brief Fixed-size object pool in a single mapping. The pages are touched by
+ * the thread that creates the pool, so that under the default (first touch)
+ * NUMA policy they are placed on the node of that thread's CPU.
+ *
+ * @param base Start of the mapping holding the objects
+ * @param len Length of the mapping in bytes
+ * @param obj_size Size of each object, rounded up to POOL_ALIGN
+ * @param free_list Free objects, each starting with the pointer to the next
+ * @param lock Mutex lock for the free list
+ * @param fallbacks Number of objects allocated with malloc() as the pool was empty
+ */
+typedef struct pool {
+    char * base;
+    size_t len;
+    size_t obj_size;
+    void * free_list;
+    pthread_mutex_t * lock;
+    uint64_t fallbacks;
+} pool_t;
+
+/**
+ * @brief Allocate the pool and touch its pages from the calling thread.
+ *
+ * @param obj_size Size of each object
+ * @param num_objs Number of objects in the pool
+ *
+ * @returns The pool on success. NULL on failure.
+ */
+pool_t * init_pool(size_t obj_size, size_t num_objs);
+
+/**
+ * @brief Take an object from the pool, or from malloc() if it is empty.
+ *
+ * @param pool Pool to take from
+ *
+ * @returns Uninitialized object. NULL on failure.
+ */
+void * pool_get(pool_t * pool);
+
+/**
+ * @brief Give back an object taken with pool_get(). Can be called from any
+ * thread.
+ *
+ * @param pool Pool the object was taken from
+ * @param obj Object to give back
+ */
+void pool_put(pool_t * pool, void * obj);
+
+/**
+ * @brief Unmap the pool. Objects still taken from it become invalid.
+ *
+ * @param pool Pool to clean
+ */
+void cleanup_pool(pool_t * pool);
+
+#endif
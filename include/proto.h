@@ -0,0 +1,68 @@
+#ifndef BRIDGE_PROTO_H
+#define BRIDGE_PROTO_H
+
+#include <stdint.h>
+
+#include "util.h"
+
+/*
+ * Wire format shared by the broker and the clients (see the Protocol section
+ * of the README): the commands and their fixed arguments, the answers, and the
+ * frames of the messages. Integers are big-endian.
+ */
+
+/* Frames of the messages */
+#define SERVER_PF_SIZE    (2)   /* Publish format size is 2 bytes */
+#define SERVER_PF_DATA    (128) /* Publish format data is 128 bytes max */
+#define SERVER_Z_BLOCK    (4096)   /* Bytes of a message compressed at once */
+#define SERVER_Z_FLAG     (0x8000) /* Set in the length of a compressed frame */
+
+/* Protocol related constants */
+#define P_CMD_LEN         (1)
+#define P_CMD_SUBSCRIBE   'S'
+#define P_CMD_UNSUBSCRIBE 'U'
+#define P_CMD_PUBLISH     'P'
+#define P_CMD_MAP         'M' /* Get the shared-memory ring of the topic (Unix domain socket only) */
+#define P_CMD_GROUP       'G' /* Subscribe over the topic's multicast group */
+#define P_CMD_ALIAS       'A' /* Open a publish session, or alias another topic in one */
+#define P_CMD_SEND        'Q' /* Publish to an alias of the session */
+#define P_CMD_COMPRESS    'Z' /* Subscribe, accepting compressed frames */
+#define P_CMD_TUNE        'T' /* Set how long the output of a topic is held back */
+#define P_CMD_WINDOW      'W' /* Acknowledge the publishes of the connection by window */
+#define P_CMD_FILTER      'X' /* Filter the messages of the subscription that follows */
+#define P_TUNE_LEN        (8)    /* Bytes (4) | Microseconds (4) of a tune request */
+#define P_WINDOW_LEN      (8)    /* Bytes (4) | Messages (4) of a window request */
+#define P_FILTER_LEN      (3)    /* Kind (1) | Offset (1) | Length (1) of a filter request */
+#define P_SEND_LEN        (P_ALIAS_LEN + 2) /* Alias | Length (2) of a send request */
+#define P_ALIAS_LEN       (2)
+#define P_CMD_NAMED       (0x20) /* Lower-case commands carry a length-prefixed topic */
+#define P_TOPIC_LEN       (7)    /* Topic of the upper-case commands, space-padded */
+
+/* Server response constants */
+#define SERVER_MSG_OK   "O"
+#define SERVER_MSG_FAIL "F"
+#define SERVER_MSG_HB   "H"
+#define SERVER_MSG_ACK  "K"
+#define SERVER_MSG_END  "\r\n\r\n"
+
+/**
+ * @brief Write a 32-bit integer in big-endian.
+ */
+void proto_put32(char * buf, uint32_t value);
+
+/**
+ * @brief Read a 32-bit integer in big-endian.
+ */
+uint32_t proto_get32(const char * buf);
+
+/**
+ * @brief Write a 64-bit integer in big-endian.
+ */
+void proto_put64(char * buf, uint64_t value);
+
+/**
+ * @brief Read a 64-bit integer in big-endian.
+ */
+uint64_t proto_get64(const char * buf);
+
+#endif
@@ -1,37 +1,53 @@
 #ifndef BRIDGE_SERVER_H
 #define BRIDGE_SERVER_H
 
+#include <errno.h>
 #include <ifaddrs.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>     /* kill() */
 #include <string.h>
 #include <sys/time.h>   /* struct timeval */
+#include <time.h>       /* clock_gettime() */
 #include <sys/types.h>  /* getifaddrs() */
 #include <unistd.h>
 
+#include "config.h"
+#include "fed.h"
+#include "handoff.h"
+#include "lz.h"
+#include "mcast.h"
+#include "pool.h"
+#include "proto.h"
 #include "table.h"
 #include "tcp.h"
+#include "trace.h"
+#include "uds.h"
 #include "tui.h"
+#include "work.h"
 
 /* Miscellanous server constants */
 
-#define SERVER_PF_SIZE    (2)   /* Publish format size is 2 bytes */
-#define SERVER_PF_DATA    (128) /* Publish format data is 128 bytes max */
 #define SERVER_WAIT_SEC   (3)   /* Seconds to wait for heartbeat reply */
 #define SERVER_WAIT_USEC  (0)   /* Microseconds to wait for heartbeat reply */
+#define SERVER_MAX_ALIASES (1024) /* Aliases per publish session */
+#define SERVER_FLUSH_MAX  (65536)   /* Most output a topic can hold back */
+#define SERVER_FLUSH_MAX_USEC (1000000) /* Longest a topic can hold back its output */
+#define SERVER_ACK_BATCH  (256)    /* Acks written at once */
+#define SERVER_ACK_LEN    (1 + 8 + 8) /* K | Messages (8) | Bytes (8) of a windowed ack */
+#define SERVER_RECV_BUF   (16384)  /* Receive buffer of a connection */
+#define SERVER_MORE       (1)      /* The buffer ends in the middle of a request */
+#define SERVER_RETRY_MS   (100)    /* Milliseconds to wait before accepting again */
+#define SERVER_FAN_SLICES (4)      /* Ranges of subscribers per worker in a spread fan-out */
+#define SERVER_FAN_MIN    (64)     /* Fewest subscribers in a range */
+#define SERVER_QUEUE_MAX  (1048576) /* Bytes queued on a topic before its publishers wait */
+#define SERVER_QUEUE_TURN (64)     /* Chunks a topic delivers before letting the others run */
 
-/* Protocol related constants */
-#define P_CMD_LEN         (1)
-#define P_CMD_SUBSCRIBE   'S'
-#define P_CMD_UNSUBSCRIBE 'U'
-#define P_CMD_PUBLISH     'P'
-#define P_TOPIC_LEN       (TABLE_TOPIC_LEN)
-
-/* Server response constants */
-#define SERVER_MSG_OK   "O"
-#define SERVER_MSG_FAIL "F"
-#define SERVER_MSG_HB   "H"
-#define SERVER_MSG_END  "\r\n\r\n"
+/* Protocol constants of the broker only, the others are in proto.h */
+#define P_CMD_LINK        FED_MSG_LINK /* Link from another broker, followed by its id */
+#define P_ARGS_LEN        (P_FILTER_LEN + 2 * FILTER_LEN) /* Longest arguments of a request */
 
 /**
  * Commands for the protocol
@@ -41,19 +57,404 @@ enum CMD {
 	CMD_SUBSCRIBE,
 	CMD_UNSUBSCRIBE,
 	CMD_PUBLISH,
+	CMD_MAP,
+	CMD_GROUP,
+	CMD_LINK,
+	CMD_ALIAS,
+	CMD_COMPRESS,
+	CMD_TUNE,
+	CMD_SEND,
+	CMD_WINDOW,
+	CMD_FILTER,
+};
+
+/**
+ * Writes of a fan-out to each of its subscribers
+ */
+enum FAN {
+	FAN_HEARTBEAT, /* Heartbeat, dropping those that do not answer */
+	FAN_CHUNK,     /* Chunk of the message, framed */
+	FAN_FRAME,     /* Compressed frame, to those that accept them */
+	FAN_OUTPUT,    /* Frames held back, to those that do not */
+	FAN_END,       /* End of the message, to those not sent it with the frames */
+};
+
+/**
+ * Subscribers a write of a fan-out is for, so that those without a filter are
+ * not held back by the head of the message the filters wait for
+ */
+enum FAN_SUBS {
+	SUBS_ALL,        /* Every subscriber */
+	SUBS_UNFILTERED, /* Those without a filter, while the head is gathered */
+	SUBS_FILTERED,   /* Those with one, once it is evaluated */
 };
 
+/**
+ * Ways a publisher is acknowledged
+ */
+enum ACK {
+	ACK_CHUNK,   /* O per chunk of SERVER_PF_DATA bytes */
+	ACK_MESSAGE, /* O per message */
+	ACK_WINDOW,  /* K with the totals, once a window of them is confirmed */
+};
+
+/**
+ * Fields of a request, in the order they are parsed
+ */
+enum PARSE {
+	PARSE_CMD,
+	PARSE_LEN,
+	PARSE_TOPIC,
+	PARSE_ARGS,
+};
+
+/**
+ * @brief Receive buffer of a connection. Requests are parsed out of it and
+ * the data of a publish is delivered from it, so that one recv() serves as
+ * many of them as it got.
+ *
+ * @param sock Socket of the connection
+ * @param pos Index of the next byte to parse
+ * @param len Number of bytes in buf
+ * @param buf Bytes received
+ */
+typedef struct conn {
+	int sock;
+	size_t pos;
+	size_t len;
+	char buf[SERVER_RECV_BUF];
+} conn_t;
+
+/**
+ * @brief Request being parsed. Its fields are filled as bytes come in, so that
+ * parsing resumes where the buffer ended.
+ *
+ * @param state Field being parsed
+ * @param cmd Command of the request
+ * @param named If set, the topic is length-prefixed
+ * @param topic Topic, null-terminated once parsed (empty if the command has none)
+ * @param len Length of the topic
+ * @param args Arguments after the topic (P_TUNE_LEN for T, FED_ID_LEN for L,
+ * P_SEND_LEN for Q, P_WINDOW_LEN for W, P_FILTER_LEN and the value and mask
+ * for X)
+ * @param need Length of the field being parsed
+ * @param got Number of bytes of the field parsed so far
+ */
+typedef struct request {
+	enum PARSE state;
+	enum CMD cmd;
+	bool named;
+	char topic[TABLE_TOPIC_LEN+1];
+	size_t len;
+	char args[P_ARGS_LEN];
+	size_t need;
+	size_t got;
+} request_t;
+
+/**
+ * @brief Acknowledgements owed to a publisher. Bytes and messages are counted
+ * as they are confirmed (delivered, or queued with delivery threads), and
+ * acknowledged one by one, or together once a window of them is confirmed.
+ *
+ * @param sock Connection of the publisher
+ * @param mode ACK_* of the connection
+ * @param pending Number of O not written yet (ACK_CHUNK and ACK_MESSAGE)
+ * @param win_bytes Bytes acknowledged at once (0 for no byte window)
+ * @param win_msgs Messages acknowledged at once (0 for no message window)
+ * @param bytes Bytes of the messages confirmed so far
+ * @param msgs Messages confirmed whole so far
+ * @param acked_bytes Bytes in the last K written
+ * @param acked_msgs Messages in the last K written
+ */
+typedef struct acks {
+	int sock;
+	enum ACK mode;
+	size_t pending;
+	uint32_t win_bytes;
+	uint32_t win_msgs;
+	uint64_t bytes;
+	uint64_t msgs;
+	uint64_t acked_bytes;
+	uint64_t acked_msgs;
+} acks_t;
+
 /**
  * @brief Store information to be passed on to the server thread.
  * 
  * @param table Table containing all topic entries and subscription information
  * @param ui Initialized UI data structure
+ * @param config Options given on the command line
  */
 typedef struct server_args {
 	table_t * table;
 	ui_t * ui;
+	const config_t * config;
 } server_args_t;
 
+/**
+ * @brief Store information to be passed on to the multicast repair thread,
+ * also shared with the handlers to register multicast subscribers.
+ *
+ * @param table Table containing all topic entries and subscription information
+ * @param ui Initialized UI data structure
+ * @param mcast Multicast sender
+ * @param epfd epoll instance watching the multicast subscribers' connections
+ */
+typedef struct repair_args {
+	table_t * table;
+	ui_t * ui;
+	mcast_t * mcast;
+	int epfd;
+} repair_args_t;
+
+/**
+ * @brief Multicast subscriber watched by the repair thread.
+ *
+ * @param csock Subscriber's TCP connection
+ * @param ip IP address of the subscriber
+ * @param port Port number of the subscriber
+ * @param topic Topic subscribed to
+ */
+typedef struct repair_sub {
+	int csock;
+	uint32_t ip;
+	uint16_t port;
+	topic_t * topic;
+} repair_sub_t;
+
+/**
+ * @brief Store information to be passed on to the federation thread, and to
+ * the reader threads of the links it dials.
+ *
+ * @param table Table containing all topic entries and subscription information
+ * @param ui Initialized UI data structure
+ * @param fed Federation state
+ * @param peer Slot of the link to read (reader threads only)
+ * @param handoff Hot restart state (NULL if disabled)
+ */
+typedef struct fed_args {
+	table_t * table;
+	ui_t * ui;
+	fed_t * fed;
+	fed_peer_t * peer;
+	handoff_t * handoff;
+} fed_args_t;
+
+/**
+ * @brief Delivery of one message to the subscribers of a topic, from a local
+ * publisher or a linked broker.
+ *
+ * @param topic Topic of the message
+ * @param subs Copy of the subscribers that passed the heartbeat (csock is ERR
+ * for those dropped or not sent to over TCP)
+ * @param num_subs Number of subscribers in subs
+ * @param ring Shared-memory ring of the topic (NULL if not mapped)
+ * @param group Multicast state of the topic (NULL if none)
+ * @param fed Federation state (NULL to not forward to other brokers)
+ * @param peers Bits of the links the message is forwarded over
+ * @param msg Identifier of the message on the links
+ * @param zbuf Block of the message being gathered for the subscribers that
+ * accept compressed frames (NULL if there are none)
+ * @param zlen Number of bytes in zbuf
+ * @param obuf Frames held back for the other subscribers, the same for all of
+ * them (NULL to send each chunk as it comes)
+ * @param olen Number of bytes in obuf
+ * @param flush_bytes Frames are sent once this many bytes are held back
+ * @param flush_usec Microseconds the first held back frame waits at most
+ * @param deadline Monotonic time (us) by which obuf must be sent
+ * @param acks Acknowledgements of the publisher, sent with the frames (NULL if
+ * the chunks are not acknowledged as they are delivered)
+ * @param charged Bytes of zbuf and obuf charged against the memory budget
+ * @param workers Workers the writes are spread over (NULL if inline)
+ * @param jobs Ranges of the subscribers, one per work item (NULL if inline)
+ * @param num_jobs Number of ranges in jobs
+ * @param batch Work items of the write in progress, waited for before the next
+ * @param filters Filters of the subscribers (NULL if none has one)
+ * @param head First bytes of the message, gathered to evaluate the filters
+ * @param hlen Number of bytes in head
+ * @param hneed Bytes of head the filters look at, 0 once they are evaluated
+ * (or if no subscriber has one)
+ * @param to Subscribers the writes are for
+ */
+typedef struct fanout {
+	topic_t * topic;
+	subscriber_t * subs;
+	int num_subs;
+	shm_ring_t * ring;
+	mcast_topic_t * group;
+	fed_t * fed;
+	uint32_t peers;
+	uint32_t msg;
+	char * zbuf;
+	size_t zlen;
+	char * obuf;
+	size_t olen;
+	uint32_t flush_bytes;
+	uint32_t flush_usec;
+	uint64_t deadline;
+	acks_t * acks;
+	size_t charged;
+	workers_t * workers;
+	struct fan_job * jobs;
+	int num_jobs;
+	work_batch_t batch;
+	filter_set_t * filters;
+	char head[FILTER_LEN];
+	size_t hlen;
+	size_t hneed;
+	enum FAN_SUBS to;
+} fanout_t;
+
+/**
+ * @brief Write of a fan-out to a range of its subscribers, run by a worker or
+ * the delivering thread.
+ *
+ * @param table Table to drop the subscribers that fail from
+ * @param fanout Fan-out the subscribers are in
+ * @param step FAN_* write to do
+ * @param buf Bytes to write (chunk, frame, or end)
+ * @param len Number of bytes in buf
+ * @param flags Flags of send() for the held back frames
+ * @param from Index of the first subscriber of the range
+ * @param to Index past the last subscriber of the range
+ */
+typedef struct fan_job {
+	table_t * table;
+	fanout_t * fanout;
+	enum FAN step;
+	char * buf;
+	size_t len;
+	int flags;
+	int from;
+	int to;
+} fan_job_t;
+
+/**
+ * @brief Part of a queued message, as it was received.
+ *
+ * @param next Chunk received after this one
+ * @param len Number of bytes in data
+ * @param data Bytes of the message
+ */
+typedef struct queue_chunk {
+	struct queue_chunk * next;
+	size_t len;
+	char data[];
+} queue_chunk_t;
+
+/**
+ * @brief Message queued on a topic. Its publisher adds the chunks as they are
+ * received, while the topic's actor delivers those already there.
+ *
+ * @param next Message queued after this one
+ * @param queue Queue of the topic the message is on
+ * @param fed Federation state to forward it with (NULL to not forward)
+ * @param head First chunk not delivered yet (NULL if none)
+ * @param tail Last chunk added (NULL if none)
+ * @param closed If set, no more chunks are added
+ * @param ended If set, the message was received whole, and is ended for the
+ * subscribers once delivered (cut otherwise, as for a publisher that left)
+ * @param started If set, its delivery is started (actor only)
+ * @param fanout Delivery of the message (actor only)
+ */
+typedef struct queue_msg {
+	struct queue_msg * next;
+	struct topic_queue * queue;
+	fed_t * fed;
+	queue_chunk_t * head;
+	queue_chunk_t * tail;
+	bool closed;
+	bool ended;
+	bool started;
+	fanout_t fanout;
+} queue_msg_t;
+
+/**
+ * @brief Delivery queue of a topic, its actor. The messages of all publishers
+ * are delivered one after the other in the order they were queued, by one
+ * delivery thread at a time.
+ *
+ * @param table Table containing all topic entries
+ * @param topic Topic of the queue
+ * @param lock Mutex lock for the messages and the counters
+ * @param room Signaled when bytes are delivered or a message is done
+ * @param head Message being delivered (NULL if none)
+ * @param tail Message queued last (NULL if none)
+ * @param bytes Bytes queued and not delivered yet, charged against the budget
+ * @param scheduled If set, the actor is queued on or run by a delivery thread
+ * @param wake Monotonic time (us) the actor is woken at to send the frames held
+ * back (0 if it is not)
+ */
+typedef struct topic_queue {
+	table_t * table;
+	topic_t * topic;
+	pthread_mutex_t * lock;
+	pthread_cond_t * room;
+	queue_msg_t * head;
+	queue_msg_t * tail;
+	size_t bytes;
+	bool scheduled;
+	uint64_t wake;
+} topic_queue_t;
+
+/**
+ * @brief Topic behind an alias of a publish session. The copy of its
+ * subscribers is kept and reused as long as the table does not change, so that
+ * publishing to the alias takes neither a lookup nor the table lock.
+ *
+ * @param topic Topic of the alias
+ * @param subs Copy of the subscribers (NULL until the first message)
+ * @param num_subs Number of subscribers in subs
+ * @param version Table version when subs was copied
+ */
+typedef struct alias {
+	topic_t * topic;
+	subscriber_t * subs;
+	int num_subs;
+	uint64_t version;
+} alias_t;
+
+/**
+ * @brief Message in flight from a linked broker.
+ *
+ * @param active If set, the entry is in use
+ * @param id Identifier of the message on the link
+ * @param fanout Delivery of the message
+ * @param queued Message on the delivery queue of the topic instead (NULL if
+ * delivered by the link thread, or dropped)
+ */
+typedef struct link_msg {
+	bool active;
+	uint32_t id;
+	fanout_t fanout;
+	queue_msg_t * queued;
+} link_msg_t;
+
+/**
+ * @brief Store information to be passed on to an accept thread.
+ *
+ * @param table Table containing all topic entries and subscription information
+ * @param ui Initialized UI data structure
+ * @param sock Listening socket to accept from
+ * @param family AF_INET or AF_UNIX, the kind of listening socket
+ * @param cpu CPU to pin the accept thread to, or ERR to leave it unpinned
+ * @param pool Pool of handler arguments, allocated by the accept thread
+ * @param repair Multicast repair state (NULL if multicast is disabled)
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param handoff Hot restart state (NULL if disabled)
+ */
+typedef struct acceptor_args {
+	table_t * table;
+	ui_t * ui;
+	int sock;
+	int family;
+	int cpu;
+	pool_t * pool;
+	repair_args_t * repair;
+	fed_t * fed;
+	handoff_t * handoff;
+} acceptor_args_t;
+
 /**
  * @brief Store client info to be passed on to the handler thread.
  * 
@@ -61,6 +462,10 @@ typedef struct server_args {
  * @param ip IP address of the requester
  * @param port Port number of the requester
  * @param table Table containing all topic entries
+ * @param pool Pool the arguments were taken from, to give them back
+ * @param repair Multicast repair state (NULL if multicast is disabled)
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param handoff Hot restart state (NULL if disabled)
  */
 typedef struct handler_args {
 	table_t * table;
@@ -68,15 +473,62 @@ typedef struct handler_args {
     uint32_t ip;
     uint16_t port;
 	int csock;
+	pool_t * pool;
+	repair_args_t * repair;
+	fed_t * fed;
+	handoff_t * handoff;
 } handler_args_t;
 
+/**
+ * @brief Store information to be passed on to the hot restart thread.
+ *
+ * @param table Table containing all topic entries and subscription information
+ * @param ui Initialized UI data structure
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param handoff Hot restart state
+ * @param acceptors Listeners to hand off
+ * @param num_acceptors Number of listeners
+ */
+typedef struct handoff_args {
+	table_t * table;
+	ui_t * ui;
+	fed_t * fed;
+	handoff_t * handoff;
+	acceptor_args_t * acceptors;
+	int num_acceptors;
+} handoff_args_t;
+
 /**
  * @brief Initialize the bridge server and start accepting new connections.
+ * Opens the configured number of listening sockets on the port (SO_REUSEPORT),
+ * and the Unix domain socket if configured, and runs an accept loop on each,
+ * one of them on the calling thread.
  *
- * @param args Contains table, UI, socket file descriptor.
+ * @param args Contains table, UI, and config.
  */
 void * run_server(void * args);
 
+/**
+ * @brief Accept connections on the listening socket and spawn a handler
+ * thread for each. Returns only on a fatal error. Connections from the Unix
+ * domain socket have an IP address and port of 0. While the broker hands off,
+ * connections are left in the accept queue for the next broker.
+ *
+ * @param args Contains table, UI, and the listening socket.
+ */
+void * run_acceptor(void * args);
+
+/**
+ * @brief Pin the calling accept thread to its CPU and steer the connections
+ * received by that CPU to its listening socket. Handler threads inherit the
+ * CPU affinity of the accept thread that spawns them.
+ *
+ * @param acceptor Accept thread arguments with the CPU and socket
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int pin_acceptor(acceptor_args_t * acceptor);
+
 /**
  * @brief Get server's IP (interface) and port number to display.
  * 
@@ -94,66 +546,646 @@ void fetch_server_info(ui_t * ui, int sock);
 void * handle(void * args);
 
 /**
- * @brief Log the newly accepted connection and its specifics.
+ * @brief Log the newly accepted connection and its specifics. Only a binary
+ * record is added to the logger, formatting is done by the logger thread.
  * 
  * @param ui Initialized UI data structure
  * @param ip IP address of the requester
  * @param port Port number of the requester
  * @param cmd Parsed command
- * @param topic Parsed topic
+ * @param topic Parsed topic, null-terminated
  */
-void log_connection(ui_t * ui, uint32_t ip, uint16_t port, enum CMD cmd, char * topic);
+void log_connection(ui_t * ui, uint32_t ip, uint16_t port, enum CMD cmd, const char * topic);
 
 /**
- * @brief Read and parse the command from connection.
+ * @brief Map the command byte of a request to its command.
  * 
- * @param csock Client socket file descriptor
+ * @param buf Command byte
+ * @param named Set if the command is in lower-case, followed by a
+ * length-prefixed topic instead of a space-padded one
  *
- * @returns The appropriate command enum for the input. On error or a unknown
- * input given, P_CMD_UNRECOGNIZED is returned.
+ * @returns The appropriate command enum for the input. CMD_UNDEFINED if the
+ * byte is not a command.
  */
-enum CMD parse_cmd(int csock);
+enum CMD parse_cmd(char buf, bool * named);
 
 /**
- * @brief Read and parse the topic with length of P_TOPIC_LEN.
- * 
- * @param csock Client socket file descriptor
- * @param topic 7 bytes long character array to store topic
- * 
- * @returns OK on successfully topic parsed.
+ * @brief Parse the buffered bytes of the connection into the request, from
+ * where the previous call stopped: the command, the topic (P_TOPIC_LEN bytes
+ * padded with trailing spaces, or a length byte followed by that many bytes if
+ * named), then the arguments of the command. The topic is not checked.
+ *
+ * @param conn Connection with the bytes received
+ * @param req Request being parsed, its state is PARSE_CMD for a new one
+ *
+ * @returns OK once the request is complete, the state being PARSE_CMD for the
+ * next one. SERVER_MORE if the bytes ran out first. ERR on an unknown command.
  */
-int parse_topic(int csock, char * topic);
+int parse_request(conn_t * conn, request_t * req);
+
+/**
+ * @brief Parse the next request, receiving more bytes as needed.
+ *
+ * @param conn Connection to read from
+ * @param req Request to parse, its state is PARSE_CMD
+ *
+ * @returns OK on success. ERR on an unknown command, error, or EOF.
+ */
+int read_request(conn_t * conn, request_t * req);
+
+/**
+ * @brief Receive as many bytes as fit after the ones not parsed yet, with one
+ * recv(). The bytes not parsed are moved to the start of the buffer first.
+ *
+ * @param conn Connection to read from
+ *
+ * @returns The result of recv(): the number of bytes received, 0 on EOF, or
+ * -1 on error.
+ */
+ssize_t conn_fill(conn_t * conn);
 
 /**
  * @brief Handle subscribing to a new topic.
  * 
  * @param table Table containing all topic entries
  * @param topic Topic to subscribe to
+ * @param len Length of the topic
  * @param csock Client socket descriptor
  * @param ip IP address of the requester
  * @param port Port number of the requester
+ * @param compress If set, the subscriber gets the messages in compressed
+ * blocks (see flush_fanout())
+ * @param filter Filter of the subscriber, asked for before subscribing with
+ *
+ *   X | Kind (1 byte) | Offset (1 byte) | Length (1 byte) | Value (Length bytes)
+ *     [| Mask (Length bytes), kind M only]
+ *
+ * (NULL if none), see filter_fanout()
  */
-void subscribe(table_t * table, char * topic, int csock, uint32_t ip, uint16_t port);
+void subscribe(table_t * table, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port, bool compress,
+	const filter_t * filter);
 
 /**
  * @brief Handle unsubscribing given subscriber from the list.
  * 
  * @param table Table containing all topic entries
  * @param topic Topic to subscribe to
+ * @param len Length of the topic
  * @param csock Client socket descriptor
  * @param ip IP address of the requester
  * @param port Port number of the requester
  */
-void unsubscribe(table_t * table, char * topic, int csock, uint32_t ip, uint16_t port);
+void unsubscribe(table_t * table, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port);
 
 /**
- * @brief Handle publishing to the subscribers of the given topic.
+ * @brief Handle publishing to the subscribers of the given topic, and to the
+ * linked brokers that want it. With delivery threads, the message is queued on
+ * the topic instead, each chunk acknowledged once queued.
  * 
  * @param table Table containing all topic entries
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param topic Topic to subscribe to
+ * @param len Length of the topic
+ * @param conn Connection of the publisher, the data of the message follows
+ * @param acks Acknowledgements of the publisher, ACK_CHUNK unless a window
+ * was asked for
+ */
+void publish(table_t * table, fed_t * fed, const char * topic, size_t len, conn_t * conn, acks_t * acks);
+
+/**
+ * @brief Handle a publish session. The connection stays open and each topic
+ * named on it is answered with a 2-byte alias, its index in a direct-indexed
+ * array of the session. Messages are then published by alias, without parsing
+ * the topic or looking it up again:
+ *
+ *   A | Topic (7 bytes), or a | Length (1 byte) | Topic
+ *     answered O | Alias (2 bytes), or F if the topic is not valid or the
+ *     session has SERVER_MAX_ALIASES aliases
+ *   Q | Alias (2 bytes) | Length (2 bytes) | Data
+ *     answered O once the message is delivered, or F (closing the session)
+ *     if the alias is unknown
+ *   W | Bytes (4 bytes) | Messages (4 bytes)
+ *     not answered, the messages published afterwards are acknowledged by
+ *     window (see set_window())
+ *
+ * The first request is answered F if the session does not fit the memory budget.
+ *
+ * Integers are big-endian. The session ends when the publisher closes it, or
+ * between two requests when the broker hands off (-r).
+ * Requests received together are handled one after the other, and their
+ * answers are written together once none is left.
+ *
+ * @param table Table containing all topic entries
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param handoff Hot restart state (NULL if disabled), the session ends
+ * between requests when handing off
+ * @param topic Topic of the first alias
+ * @param len Length of the topic
+ * @param conn Connection of the publisher
+ * @param acks Acknowledgements of the publisher, ACK_MESSAGE unless a window
+ * was asked for
+ */
+void publish_session(table_t * table, fed_t * fed, handoff_t * handoff, const char * topic, size_t len, conn_t * conn, acks_t * acks);
+
+/**
+ * @brief Give the topic an alias in the session, or return the one it has.
+ *
+ * @param table Table containing all topic entries
+ * @param aliases Direct-indexed array of SERVER_MAX_ALIASES aliases
+ * @param num_aliases Number of aliases given, incremented
+ * @param topic Topic to alias
+ * @param len Length of the topic
+ *
+ * @returns The alias on success. ERR if the session is full or the topic
+ * could not be created.
+ */
+int add_alias(table_t * table, alias_t * aliases, int * num_aliases, const char * topic, size_t len);
+
+/**
+ * @brief Read a message of the given length and deliver it to the topic of the
+ * alias, copying the subscribers again only if the table changed. With
+ * delivery threads, the message is queued on the topic instead.
+ *
+ * @param table Table containing all topic entries
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param alias Alias to publish to
+ * @param conn Connection of the publisher, the message follows
+ * @param len Length of the message
+ *
+ * @returns OK once delivered. ERR if the subscribers could not be copied or
+ * the publisher went away in the middle of the message.
+ */
+int send_alias(table_t * table, fed_t * fed, alias_t * alias, conn_t * conn, size_t len);
+
+/**
+ * @brief Read a message and queue it on the topic, chunk by chunk as it is
+ * received.
+ *
+ * @param table Table containing all topic entries
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param topic Topic to queue the message on
+ * @param conn Connection of the publisher, the message follows
+ * @param len Length of the message (SIZE_MAX for up to the end of the stream)
+ * @param acks Acknowledgements the bytes queued are counted in, sent before
+ * waiting for more (NULL to not acknowledge them)
+ *
+ * @returns OK once queued whole. ERR if it could not be queued, or the
+ * publisher went away in the middle of the message (cut for the subscribers).
+ */
+int queue_message(table_t * table, fed_t * fed, topic_t * topic, conn_t * conn, size_t len, acks_t * acks);
+
+/**
+ * @brief Get the delivery queue of a topic, creating it on first use.
+ *
+ * @param table Table containing all topic entries
+ * @param topic Topic of the queue
+ *
+ * @returns The queue on success. NULL on failure.
+ */
+topic_queue_t * get_queue(table_t * table, topic_t * topic);
+
+/**
+ * @brief Queue a new message on a topic, behind those of the other publishers.
+ *
+ * @param table Table containing all topic entries
+ * @param fed Federation state to forward it with (NULL to not forward)
+ * @param topic Topic to queue it on
+ *
+ * @returns The message, open for chunks, on success. NULL on failure.
+ */
+queue_msg_t * open_msg(table_t * table, fed_t * fed, topic_t * topic);
+
+/**
+ * @brief Add a chunk to a message opened with open_msg(), charged against the
+ * memory budget until delivered.
+ *
+ * @param table Table containing all topic entries
+ * @param msg Message to add to
+ * @param buf Bytes of the chunk
+ * @param len Number of bytes in buf
+ * @param wait If set, wait while the queue holds SERVER_QUEUE_MAX bytes,
+ * unless the message is the one being delivered
+ *
+ * @returns OK on success. ERR if there is no memory (or budget) for it.
+ */
+int append_msg(table_t * table, queue_msg_t * msg, const char * buf, size_t len, bool wait);
+
+/**
+ * @brief Close a message opened with open_msg(). It is freed once delivered.
+ *
+ * @param table Table containing all topic entries
+ * @param msg Message to close
+ * @param ended If set, the message is whole, cut otherwise
+ */
+void close_msg(table_t * table, queue_msg_t * msg, bool ended);
+
+/**
+ * @brief Make sure the actor of a queue is scheduled on the delivery threads.
+ * Called with the lock of the queue held.
+ *
+ * @param queue Queue that got work
+ *
+ * @returns true if the caller must submit run_queue() for it, false if it
+ * already is.
+ */
+bool schedule_queue(topic_queue_t * queue);
+
+/**
+ * @brief Actor of a topic, run by a delivery thread. Delivers the chunks
+ * queued, a message after the other, until there are none left or its turn is
+ * over.
+ *
+ * @param arg The topic_queue_t
+ */
+void run_queue(void * arg);
+
+/**
+ * @brief Timed wake-up of the actor of a queue, once the frames it holds back
+ * are due. Runs it unless it is already scheduled.
+ *
+ * @param arg The topic_queue_t
+ */
+void wake_queue(void * arg);
+
+/**
+ * @brief Start delivering a message: copy the subscribers of the topic and
+ * begin the delivery with begin_fanout().
+ *
+ * @param table Table containing all topic entries
+ * @param fed Federation state, NULL for messages from a linked broker so that
+ * they are never forwarded again
+ * @param topic Topic of the message
+ * @param fanout Delivery to start
+ *
+ * @returns OK on success. ERR if the subscribers could not be copied.
+ */
+int start_fanout(table_t * table, fed_t * fed, topic_t * topic, fanout_t * fanout);
+
+/**
+ * @brief Start delivering a message to the copy of the subscribers already in
+ * the fanout: send them a heartbeat (dropping those that do not answer), and
+ * start forwarding the message to the linked brokers that want the topic. If
+ * subscribers have filters, their heartbeat waits for the head of the message,
+ * see filter_fanout(), while the others are sent the message as it comes.
+ *
+ * @param table Table containing all topic entries
+ * @param fed Federation state, NULL to not forward the message
+ * @param fanout Delivery with its topic, subs, and num_subs set
+ */
+void begin_fanout(table_t * table, fed_t * fed, fanout_t * fanout);
+
+/**
+ * @brief Deliver a chunk of the message to the shared-memory ring, the
+ * multicast group, the linked brokers, and the subscribers of the topic. The
+ * frames for the subscribers are held back until the topic's flush_bytes are
+ * reached or its flush_usec passed, see wait_output().
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ * @param buf Chunk of the message
+ * @param len Length of the chunk, at most SERVER_PF_DATA
+ */
+void send_fanout(table_t * table, fanout_t * fanout, char * buf, size_t len);
+
+/**
+ * @brief Evaluate the filters of the topic once on the head of the message,
+ * leave out the subscribers whose filter does not match (nothing of the
+ * message, heartbeat included, is sent to them), then send the others the
+ * heartbeat and the bytes the subscribers without a filter already got.
+ * Subscribers sharing a filter share its result.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery whose head is gathered, or whose message ended first
+ * @param sent Bytes of head already sent to the subscribers without a filter
+ */
+void filter_fanout(table_t * table, fanout_t * fanout, size_t sent);
+
+/**
+ * @brief Send a chunk to the subscribers the fan-out writes to, held back or as
+ * it comes.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ * @param buf Chunk of the message
+ * @param len Length of the chunk, at most SERVER_PF_DATA
+ */
+void send_subs(table_t * table, fanout_t * fanout, char * buf, size_t len);
+
+/**
+ * @brief Compress the gathered block once and send it to every subscriber that
+ * accepts compressed frames:
+ *
+ *   Length (2 bytes, SERVER_Z_FLAG set) | LZ4 block of at most SERVER_Z_BLOCK bytes
+ *
+ * A block that does not shrink is sent as a plain frame of up to
+ * SERVER_Z_BLOCK bytes instead.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ */
+void flush_fanout(table_t * table, fanout_t * fanout);
+
+/**
+ * @brief Send the held back frames to every subscriber with one write each,
+ * then the pending acks to the publisher. In the middle of a message, the
+ * frames are sent with MSG_MORE so that the kernel fills whole segments with
+ * them and the next ones.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ * @param more If set, more frames follow right away
+ */
+void flush_output(table_t * table, fanout_t * fanout, bool more);
+
+/**
+ * @brief Initialize the acknowledgements of a publisher.
+ *
+ * @param acks Acknowledgements to initialize
+ * @param sock Connection of the publisher
+ * @param mode ACK_CHUNK or ACK_MESSAGE
+ */
+void init_acks(acks_t * acks, int sock, enum ACK mode);
+
+/**
+ * @brief Acknowledge the publisher by window from now on, as asked with
+ *
+ *   W | Bytes (4 bytes) | Messages (4 bytes)
+ *
+ * A K with the totals of the connection is then written once Bytes more bytes,
+ * or Messages more messages, are confirmed since the last one (0 for no such
+ * window, both 0 for once per message), and when the publisher is done:
+ *
+ *   K | Messages (8 bytes) | Bytes (8 bytes)
+ *
+ * @param acks Acknowledgements of the publisher
+ * @param args Arguments of the request, big-endian
+ */
+void set_window(acks_t * acks, const char * args);
+
+/**
+ * @brief Count bytes of a message as confirmed.
+ *
+ * @param acks Acknowledgements of the publisher (NULL if none)
+ * @param len Number of bytes confirmed
+ * @param end If set, the message is confirmed whole
+ */
+void count_acks(acks_t * acks, size_t len, bool end);
+
+/**
+ * @brief Write the acks owed to a publisher, several at once.
+ *
+ * @param acks Acknowledgements of the publisher (NULL if none)
+ * @param all If set, a window not full yet is acknowledged too, as the
+ * publisher is done or waits for an answer
+ */
+void send_acks(acks_t * acks, bool all);
+
+/**
+ * @brief Wait for the publisher to send more, sending the held back frames if
+ * their deadline passes first, so that they are never late by more than the
+ * topic's flush_usec.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ * @param sock Connection the rest of the message comes from
+ */
+void wait_output(table_t * table, fanout_t * fanout, int sock);
+
+/**
+ * @brief Deliver the end of the message, after the last block.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ */
+void end_fanout(table_t * table, fanout_t * fanout);
+
+/**
+ * @brief Free the copy of the subscribers and the buffers of a delivery, ended
+ * or not, giving back what the buffers were charged.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ */
+void finish_fanout(table_t * table, fanout_t * fanout);
+
+/**
+ * @brief Do a write of the delivery to all its subscribers. Past the threshold
+ * of the workers, the subscribers are split in ranges run by the workers and
+ * the calling thread at once, and all of them are waited for, so that each
+ * subscriber still gets the writes in order.
+ *
+ * @param table Table containing all topic entries
+ * @param fanout Delivery started by start_fanout()
+ * @param step FAN_* write to do
+ * @param buf Bytes to write (chunk, frame, or end)
+ * @param len Number of bytes in buf
+ * @param flags Flags of send() for the held back frames
+ */
+void deliver(table_t * table, fanout_t * fanout, enum FAN step, char * buf, size_t len, int flags);
+
+/**
+ * @brief Do a write of the delivery to a range of its subscribers, dropping
+ * those it fails for.
+ *
+ * @param job Write and range
+ */
+void deliver_range(fan_job_t * job);
+
+/**
+ * @brief Work item of a spread write.
+ *
+ * @param arg The fan_job_t of the range
+ */
+void run_fan_job(void * arg);
+
+/**
+ * @brief Handle mapping the shared-memory ring of the given topic. The ring is
+ * created on the first request, and its memfd is sent along with the OK so
+ * that the client can map it and read the messages without syscalls. Only
+ * possible over the Unix domain socket.
+ *
+ * @param table Table containing all topic entries
+ * @param topic Topic to map
+ * @param len Length of the topic
+ * @param csock Client socket descriptor
+ * @param ip IP address of the requester (0 over the Unix domain socket)
+ * @param port Port number of the requester (0 over the Unix domain socket)
+ */
+void map_topic(table_t * table, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port);
+
+/**
+ * @brief Handle setting how the output of a topic is held back, trading
+ * latency for fewer and larger writes. The topic is followed by the bytes to
+ * hold back (4 bytes, at most SERVER_FLUSH_MAX, 0 to send each chunk as it
+ * comes) and the microseconds a frame may wait (4 bytes, at most
+ * SERVER_FLUSH_MAX_USEC), in network byte order. Applies to the messages
+ * published after it.
+ *
+ * @param table Table containing all topic entries
+ * @param topic Topic to tune
+ * @param len Length of the topic
+ * @param csock Client socket descriptor
+ * @param args The P_TUNE_LEN bytes after the topic
+ */
+void tune_topic(table_t * table, const char * topic, size_t len, int csock, const char * args);
+
+/**
+ * @brief Handle subscribing over the topic's multicast group. The topic gets a
+ * group on the first such subscription. The subscriber is answered OK along
+ * with the group, the sequence number of the last datagram sent, and the id
+ * of the topic found in the header of its datagrams:
+ *
+ *   O | Group (4 bytes) | Port (2 bytes) | Sequence (8 bytes) | Topic id (4 bytes)
+ *
+ * Its connection is then only used for NAKs and repairs, and is watched by
+ * the repair thread instead of being sent heartbeats.
+ *
+ * @param table Table containing all topic entries
+ * @param repair Multicast repair state (NULL if multicast is disabled)
  * @param topic Topic to subscribe to
+ * @param len Length of the topic
  * @param csock Client socket descriptor
+ * @param ip IP address of the requester
+ * @param port Port number of the requester
+ */
+void subscribe_group(table_t * table, repair_args_t * repair, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port);
+
+/**
+ * @brief Answer the NAKs of the multicast subscribers, and drop those whose
+ * connection closed.
+ *
+ * @param args Repair state
+ */
+void * run_repair(void * args);
+
+/**
+ * @brief Keep the links to the brokers given with -f up, and send the topics
+ * wanted here over the links as they change.
+ *
+ * @param args Contains table, UI, and federation state
+ */
+void * run_federation(void * args);
+
+/**
+ * @brief Read the link dialed by the federation thread until it goes down.
+ *
+ * @param args Contains table, UI, federation state, and the slot of the link
+ */
+void * run_link(void * args);
+
+/**
+ * @brief Handle a link request from another broker, and read the link until
+ * it goes down.
+ *
+ * @param table Table containing all topic entries
+ * @param ui Initialized UI data structure
+ * @param fed Federation state (NULL if it failed to initialize)
+ * @param csock Connection of the broker
+ * @param id Identifier of the broker, sent after the command
+ * @param ip IP address of the broker
+ * @param port Port number of the broker
+ */
+void link_broker(table_t * table, ui_t * ui, fed_t * fed, int csock, uint64_t id, uint32_t ip, uint16_t port);
+
+/**
+ * @brief Read the frames of a link: record the topics the broker wants, and
+ * deliver the messages it forwards to the local subscribers only. Messages are
+ * delivered as they come, so a heartbeat waiting on a dead subscriber holds up
+ * the link as it holds up a publisher. Releases the slot once the link is down.
+ *
+ * @param table Table containing all topic entries
+ * @param ui Initialized UI data structure
+ * @param fed Federation state
+ * @param peer Slot of the link
+ */
+void serve_link(table_t * table, ui_t * ui, fed_t * fed, fed_peer_t * peer);
+
+/**
+ * @brief Wait for the next frame of a link, sending the held back frames of
+ * the messages in flight whose deadline passes first (see wait_output()).
+ *
+ * @param table Table containing all topic entries
+ * @param msgs Messages in flight, FED_MAX_INFLIGHT of them
+ * @param sock Connection of the link
+ */
+void wait_link(table_t * table, link_msg_t * msgs, int sock);
+
+/**
+ * @brief Log a change of a link.
+ *
+ * @param ui Initialized UI data structure
+ * @param peer Slot of the link
+ * @param what What happened, ex. "Linked to"
+ */
+void log_link(ui_t * ui, fed_peer_t * peer, const char * what);
+
+/**
+ * @brief Hand off to the brokers that connect to the hot restart socket: stop
+ * taking requests, wait for those in progress, take the links down, and pass
+ * the listeners, topics, and subscribers. Terminates the broker once the new
+ * one answered, or serves again if the handoff failed.
+ *
+ * @param args Contains table, UI, federation, hot restart state, and listeners
+ */
+void * run_handoff(void * args);
+
+/**
+ * @brief Write the state of the broker to the broker taking over, and wait for
+ * its answer.
+ *
+ * @param table Table containing all topic entries
+ * @param acceptors Listeners to pass
+ * @param num_acceptors Number of listeners
+ * @param sock Connection of the broker taking over
+ *
+ * @returns OK if the broker took over. ERR otherwise.
+ */
+int hand_off(table_t * table, acceptor_args_t * acceptors, int num_acceptors, int sock);
+
+/**
+ * @brief Read the state of the broker handing off into the table and the
+ * listeners, and answer it. Subscribers past the limits are closed.
+ *
+ * @param table Table containing all topic entries, empty so that the topics
+ * keep their ids
+ * @param ui Initialized UI data structure
+ * @param sock Connection of the broker handing off
+ * @param acceptors Listeners to fill (socket and family)
+ * @param num_acceptors Set to the number of listeners received
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int take_over(table_t * table, ui_t * ui, int sock, acceptor_args_t * acceptors, int * num_acceptors);
+
+/**
+ * @brief Wait for the next request of a session, giving up if the broker hands
+ * off meanwhile.
+ *
+ * @param handoff Hot restart state (NULL if disabled)
+ * @param sock Connection of the session
+ *
+ * @returns OK once there is something to read. ERR if handing off.
+ */
+int wait_request(handoff_t * handoff, int sock);
+
+/**
+ * @brief Remove the subscriber from the topic and close its connection. If the
+ * subscriber was already removed (ex. by another publisher), do nothing.
+ *
+ * @param table Table containing all topic entries
+ * @param id Id of the topic to remove the subscriber from
+ * @param sub Subscriber info to match when searching
+ */
+void drop_sub(table_t * table, uint32_t id, subscriber_t sub);
+
+/**
+ * @brief Close a client connection admitted at accept, so that it no longer
+ * counts against the limits.
+ *
+ * @param table Table containing all topic entries
+ * @param csock Connection to close
  */
-void publish(table_t * table, char * topic, int csock);
+void close_conn(table_t * table, int csock);
 
 /**
  * @brief Sends a heartbeat message to the subscriber and waits at maximum 
@@ -170,8 +1202,8 @@ int heartbeat(int csock);
  * @brief Used to propagate the publisher's message to each subscribers for the
  * given topic. However, it follows the response format.
  * 
- * Response format : [ 4-bytes length ][ data ]
- * End-of-stream format : [ 4-bytes length ][ \r\n\r\n ]
+ * Response format : [ 2-bytes length (big-endian) ][ data ]
+ * End-of-stream format : [ 2-bytes length (big-endian) ][ \r\n\r\n ]
  * 
  * @param csock Client socket descriptor
  * @param raw_msg Unformatted raw message
@@ -0,0 +1,168 @@
+#ifndef BRIDGE_SHM_H
+#define BRIDGE_SHM_H
+
+#include <fcntl.h>      /* fcntl(), F_ADD_SEALS */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>   /* memfd_create(), mmap() */
+#include <unistd.h>     /* ftruncate() */
+
+#include "util.h"
+
+/*
+ * Shared-memory ring mirroring the messages of a topic, for subscribers on the
+ * same host. The broker is the only writer (one publisher at a time), readers
+ * map the ring read-only and follow the sequence numbers without syscalls.
+ *
+ * Each chunk of a published message is one slot, and the end of the message is
+ * a slot with SHM_FLAG_END. A slot with sequence number s is written in slot
+ * (s - 1) % SHM_SLOTS. Its seq is set to 0 while being written and to s once
+ * done, so that a reader expecting s knows it is not written yet if seq < s,
+ * and that it lagged behind by a whole ring (overrun) if seq > s.
+ */
+
+#define SHM_MAGIC      (0x62726467) /* "brdg" */
+#define SHM_VERSION    (1)
+#define SHM_SLOTS      (4096) /* Slots in a ring, must be a power of 2 */
+#define SHM_SLOT_DATA  (128)  /* Same as SERVER_PF_DATA, one chunk per slot */
+#define SHM_FLAG_END   (1)    /* The slot ends the message, it has no data */
+
+/**
+ * @brief Header at the start of the ring.
+ *
+ * @param magic SHM_MAGIC
+ * @param version SHM_VERSION, incremented on layout changes
+ * @param num_slots SHM_SLOTS
+ * @param slot_size Size of each slot in bytes
+ * @param head Sequence number of the last slot written (0 if none)
+ */
+typedef struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    char pad[48];
+    uint64_t head;
+    char pad2[56];
+} shm_header_t;
+
+/**
+ * @brief One chunk of a message.
+ *
+ * @param seq Sequence number of the slot, 0 while being written
+ * @param len Number of bytes in data
+ * @param flags SHM_FLAG_* of the slot
+ * @param data Chunk of the message
+ */
+typedef struct shm_slot {
+    uint64_t seq;
+    uint32_t len;
+    uint32_t flags;
+    char data[SHM_SLOT_DATA];
+} shm_slot_t;
+
+/**
+ * @brief Writer side of a ring, owned by the broker.
+ *
+ * @param fd memfd of the ring, passed to the readers
+ * @param header Mapped header
+ * @param slots Mapped slots
+ * @param len Length of the mapping
+ * @param lock Mutex lock so that publishers write one at a time
+ */
+typedef struct shm_ring {
+    int fd;
+    shm_header_t * header;
+    shm_slot_t * slots;
+    size_t len;
+    pthread_mutex_t * lock;
+} shm_ring_t;
+
+/**
+ * @brief Reader side of a ring.
+ *
+ * @param header Mapped header
+ * @param slots Mapped slots
+ * @param len Length of the mapping
+ * @param next Sequence number of the next slot to read
+ * @param lost Number of slots that were overwritten before being read
+ */
+typedef struct shm_reader {
+    const shm_header_t * header;
+    const shm_slot_t * slots;
+    size_t len;
+    uint64_t next;
+    uint64_t lost;
+} shm_reader_t;
+
+/**
+ * @brief Create a ring in a sealed (fixed size) memfd and map it.
+ *
+ * @param name Name of the memfd, for debugging (ex. the topic)
+ *
+ * @returns The ring on success. NULL on failure.
+ */
+shm_ring_t * init_shm(const char * name);
+
+/**
+ * @brief Map the writer side of a ring created by another broker (handed off),
+ * so that its readers keep reading it and its sequence goes on.
+ *
+ * @param fd memfd of the ring, owned by the ring on success
+ *
+ * @returns The ring on success. NULL on failure or if the layout differs.
+ */
+shm_ring_t * adopt_shm(int fd);
+
+/**
+ * @brief Write a slot to the ring, overwriting the oldest one.
+ *
+ * @param ring Ring to write to
+ * @param data Chunk of the message
+ * @param len Length of the chunk, at most SHM_SLOT_DATA
+ * @param flags SHM_FLAG_* of the slot
+ */
+void shm_write(shm_ring_t * ring, const char * data, uint32_t len, uint32_t flags);
+
+/**
+ * @brief Unmap and close the ring. Readers keep their own mapping.
+ *
+ * @param ring Ring to clean
+ */
+void cleanup_shm(shm_ring_t * ring);
+
+/**
+ * @brief Map a ring received from the broker, starting after its last slot.
+ *
+ * @param reader Reader to initialize
+ * @param fd memfd of the ring, can be closed afterwards
+ *
+ * @returns OK on success. ERR if the mapping failed or the layout differs.
+ */
+int shm_attach(shm_reader_t * reader, int fd);
+
+/**
+ * @brief Read the next slot without blocking. If the reader fell behind by
+ * more than the ring, it skips to the oldest slot still in the ring and adds
+ * the skipped slots to lost.
+ *
+ * @param reader Reader of the ring
+ * @param data Buffer of at least SHM_SLOT_DATA bytes for the chunk
+ * @param len Set to the length of the chunk
+ * @param flags Set to the SHM_FLAG_* of the slot
+ *
+ * @returns OK if a slot was read. ERR if there is nothing new.
+ */
+int shm_read(shm_reader_t * reader, char * data, uint32_t * len, uint32_t * flags);
+
+/**
+ * @brief Unmap the ring.
+ *
+ * @param reader Reader to clean
+ */
+void shm_detach(shm_reader_t * reader);
+
+#endif
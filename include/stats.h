@@ -0,0 +1,215 @@
+#ifndef BRIDGE_STATS_H
+#define BRIDGE_STATS_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>   /* struct timeval */
+#include <linux/sockios.h> /* SIOCOUTQ */
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "table.h"
+#include "tcp.h"
+#include "trace.h"
+#include "tui.h"
+#include "util.h"
+
+#define STATS_PORT_NUM    (PORT_NUM + 1) /* Default admin port, bound to loopback only */
+#define STATS_REQ_JSON    'j' /* First byte of the request to get JSON instead of text */
+#define STATS_REQ_TRACE   't' /* First byte of the request to get the trace records */
+#define STATS_WAIT_SEC    (1) /* Seconds to wait for the request byte */
+#define STATS_TAKEOVER_SEC (30) /* Seconds to retry the port held by the broker taken over from */
+#define STATS_BUF_INITIAL (4096)
+
+/**
+ * @brief Store information to be passed on to the stats thread.
+ *
+ * @param table Table containing all topic entries and subscription information
+ * @param ui Initialized UI data structure
+ * @param config Options given on the command line
+ */
+typedef struct stats_args {
+	table_t * table;
+	ui_t * ui;
+	const config_t * config;
+} stats_args_t;
+
+/**
+ * @brief Point-in-time copy of a topic's metrics.
+ *
+ * @param id Id of the topic
+ * @param str Topic name, interned in the table so it outlives the snapshot
+ * @param subs Number of subscribers
+ * @param msgs Total number of messages published
+ * @param bytes Total number of bytes published
+ * @param msg_rate Messages per second since the previous snapshot
+ * @param byte_rate Bytes per second since the previous snapshot
+ * @param queued Bytes waiting in the subscribers' socket send queues
+ * @param backlog Bytes queued on the topic and not delivered yet
+ * @param probe Distance of the topic from its home slot in the map
+ * @param shm_seq Sequence number of the last slot of its shared-memory ring
+ * (0 if not mapped)
+ * @param mcast_seq Sequence number of the last datagram sent to the topic's
+ * multicast group (0 if none)
+ * @param peers Number of linked brokers that want the topic
+ * @param comp_in Bytes compressed for the subscribers that accept it
+ * @param comp_out Bytes sent to them once per block
+ * @param filters Number of distinct filters of the subscribers
+ * @param filtered Number of messages not sent to a subscriber because of its
+ * filter
+ */
+typedef struct topic_stats {
+    uint32_t id;
+    const char * str;
+    uint64_t subs;
+    uint64_t msgs;
+    uint64_t bytes;
+    double msg_rate;
+    double byte_rate;
+    uint64_t queued;
+    uint64_t backlog;
+    uint64_t probe;
+    uint64_t shm_seq;
+    uint64_t mcast_seq;
+    uint64_t peers;
+    uint64_t comp_in;
+    uint64_t comp_out;
+    uint64_t filters;
+    uint64_t filtered;
+} topic_stats_t;
+
+/**
+ * @brief Point-in-time copy of the table's metrics.
+ *
+ * @param map_size The size of the map
+ * @param num_topics Number of topics in the map
+ * @param load Load factor of the map
+ * @param probe_avg Average probe length of the topics
+ * @param probe_max Longest probe length of the topics
+ * @param admit Limits of the broker and their usage
+ * @param workers Number of fan-out worker threads (0 if none)
+ * @param threshold Subscribers from which a fan-out is spread over the workers
+ * @param batches Number of fan-out writes spread over the workers
+ * @param items Number of ranges written by the workers
+ * @param inline_items Number of ranges written by the publisher as the workers
+ * were behind
+ * @param actors Number of delivery threads (0 if the publishers deliver)
+ * @param actor_runs Number of turns of the topics run by the delivery threads
+ * @param actor_inline Number of turns run by the publishers as the delivery
+ * threads were behind
+ * @param topics Array of num_topics topic metrics
+ */
+typedef struct table_stats {
+    uint64_t map_size;
+    uint64_t num_topics;
+    double load;
+    double probe_avg;
+    uint64_t probe_max;
+    admit_t admit;
+    uint64_t workers;
+    uint64_t threshold;
+    uint64_t batches;
+    uint64_t items;
+    uint64_t inline_items;
+    uint64_t actors;
+    uint64_t actor_runs;
+    uint64_t actor_inline;
+    topic_stats_t * topics;
+} table_stats_t;
+
+/**
+ * @brief Growable output buffer used to format the snapshot.
+ *
+ * @param data Formatted output
+ * @param len Number of bytes used
+ * @param cap Number of bytes allocated
+ */
+typedef struct stats_buf {
+    char * data;
+    size_t len;
+    size_t cap;
+} stats_buf_t;
+
+/**
+ * @brief Listen on the admin port and serve a snapshot of the broker metrics
+ * to each connection. The snapshot is in text unless the first byte sent by the
+ * client is STATS_REQ_JSON.
+ *
+ * @param args Contains table and UI data structure
+ */
+void * run_stats(void * args);
+
+/**
+ * @brief Take a snapshot of the table metrics. The table lock is only held
+ * once, to copy the topic pointers and their subscribers, whose queues are read
+ * after releasing it.
+ *
+ * @param table Table containing all topic entries
+ * @param stats Snapshot to fill. The topics must be freed by the caller.
+ * @param elapsed Seconds since the previous snapshot, used for the rates
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int snapshot_stats(table_t * table, table_stats_t * stats, double elapsed);
+
+/**
+ * @brief Get the bytes waiting in the send queue of a subscriber copied out of
+ * the table. Its socket may have been closed since and the descriptor reused,
+ * so the queue only counts if the socket is still connected to the subscriber
+ * (same peer address, or a Unix domain socket for local subscribers).
+ *
+ * @param sub Copy of the subscriber
+ * @param queued Set to the bytes not sent yet
+ *
+ * @returns OK on success. ERR if the descriptor is no longer the subscriber's.
+ */
+int queued_bytes(const subscriber_t * sub, int * queued);
+
+/**
+ * @brief Format the snapshot as one "key=value" line for the table, one for the
+ * admission limits, and one per topic.
+ *
+ * @param buf Buffer to append to
+ * @param stats Snapshot to format
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int format_stats_text(stats_buf_t * buf, const table_stats_t * stats);
+
+/**
+ * @brief Format the snapshot as a single JSON object.
+ *
+ * @param buf Buffer to append to
+ * @param stats Snapshot to format
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int format_stats_json(stats_buf_t * buf, const table_stats_t * stats);
+
+/**
+ * @brief Format the records of the trace ring as CSV, oldest first. Only the
+ * header is written unless the broker was built with the ring (make trace).
+ *
+ * @param buf Buffer to append to
+ *
+ * @returns OK on success. ERR on failure to allocate.
+ */
+int format_stats_trace(stats_buf_t * buf);
+
+/**
+ * @brief Append formatted output to the buffer, growing it as needed.
+ *
+ * @param buf Buffer to append to
+ * @param fmt printf() style format
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int stats_printf(stats_buf_t * buf, const char * fmt, ...);
+
+#endif
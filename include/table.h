@@ -1,18 +1,26 @@
 #ifndef BRIDGE_TABLE_H
 #define BRIDGE_TABLE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 
+#include "admit.h"
+#include "filter.h"
+#include "mcast.h"
+#include "shm.h"
+#include "trace.h"
 #include "util.h"
+#include "work.h"
 
-#define MIN(X,Y) (X < Y ? X : Y)
-
-#define TABLE_TOPIC_LEN       (7)
+#define TABLE_TOPIC_LEN       (255)   /* Longest topic name, its length fits a byte */
 #define TABLE_INITIAL_SIZE    (10)
+#define TABLE_ARENA_CHUNK     (65536) /* Bytes of topic names per arena chunk */
+#define TABLE_FLUSH_BYTES     (4096)  /* Default output held back per delivery */
+#define TABLE_FLUSH_USEC      (1000)  /* Default time the output is held back */
 #define TABLE_HASH_FNV_PRIME  (0x100000001b3)
 #define TABLE_HASH_FNS_OFFSET (0xcbf29ce484222325)
 
@@ -24,6 +32,11 @@
  * @param ip IP address of the requester
  * @param port Port number of the requester
  * @param csock Socket file descriptor for the subscribed client
+ * @param mcast If set, the subscriber gets the messages from the topic's
+ * multicast group, and its connection is only used for repairs
+ * @param compress If set, the subscriber accepts compressed frames
+ * @param filter Index of the subscriber's filter in the set of the topic
+ * (FILTER_NONE if it has none)
  */
 typedef struct subscriber {
     struct subscriber * next;
@@ -31,19 +44,85 @@ typedef struct subscriber {
     uint32_t ip;
     uint16_t port;
     int csock;
+    bool mcast;
+    bool compress;
+    int filter;
 } subscriber_t;
 
 /**
  * @brief Intermediate data structure to store the subscriber list at given topic.
  * 
- * @param topic The corresponding topic
+ * @param id Index of the topic in table_t.list, stable for the life of the table
+ * @param len Length of the topic name
+ * @param hash Full FNV-1a hash of the name, kept so that lookups and resizes
+ * do not hash it again
+ * @param str The topic name, null-terminated, interned in the table's arena
  * @param subscriber Linked list of subscriber(s)
+ * @param num_subs Number of subscribers in the list
+ * @param msgs Number of messages published to the topic
+ * @param bytes Number of bytes published to the topic
+ * @param comp_in Bytes of the messages compressed for subscribers
+ * @param comp_out Bytes sent once per block to those subscribers (compressed,
+ * or not if the block did not shrink)
+ * @param backlog Bytes queued on the topic and not delivered yet
+ * @param stat_msgs Value of msgs at the last stats snapshot (stats thread only)
+ * @param stat_bytes Value of bytes at the last stats snapshot (stats thread only)
+ * @param shm Shared-memory ring mirroring the topic for local readers, created
+ * on the first map request (NULL until then)
+ * @param mcast Multicast state of the topic, created on the first multicast
+ * subscription (NULL until then)
+ * @param peers Bits of the federation links whose broker wants the topic
+ * @param announced If set, the linked brokers were told that the topic is
+ * wanted here (federation thread only)
+ * @param flush_bytes Frames held back for the subscribers before they are
+ * sent together (0 to send each chunk as it comes)
+ * @param flush_usec Microseconds a held back frame waits for more at most
+ * @param queue Delivery queue of the topic, created on the first message queued
+ * (NULL until then, or if the publishers deliver themselves)
+ * @param filters Filters of the subscribers, created on the first subscription
+ * with one (NULL until then)
+ * @param filtered Number of messages not sent to a subscriber as they did not
+ * match its filter
  */
 typedef struct topic {
-    char str[TABLE_TOPIC_LEN];
+    uint32_t id;
+    uint8_t len;
+    uint64_t hash;
+    const char * str;
     subscriber_t * subscriber;
+    uint64_t num_subs;
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t comp_in;
+    uint64_t comp_out;
+    uint64_t backlog;
+    uint64_t stat_msgs;
+    uint64_t stat_bytes;
+    shm_ring_t * shm;
+    mcast_topic_t * mcast;
+    uint32_t peers;
+    bool announced;
+    uint32_t flush_bytes;
+    uint32_t flush_usec;
+    struct topic_queue * queue;
+    filter_set_t * filters;
+    uint64_t filtered;
 } topic_t;
 
+/**
+ * @brief Chunk of the arena the topic names are interned in. Names are only
+ * appended and never move, so pointers to them stay valid without the lock.
+ *
+ * @param next The previously filled chunk
+ * @param used Number of bytes of data used
+ * @param data Null-terminated names, back to back
+ */
+typedef struct table_chunk {
+    struct table_chunk * next;
+    size_t used;
+    char data[TABLE_ARENA_CHUNK];
+} table_chunk_t;
+
 /**
  * @brief Table keeping track of subscriber entries.
  * 
@@ -51,12 +130,27 @@ typedef struct topic {
  * @param map The array of entries that correspond to the given topic
  * @param map_size The size of the table (map)
  * @param num_topics Number of entries in the table (map)
+ * @param list Topics in insertion order, indexed by topic id
+ * @param list_size The size of the list
+ * @param version Incremented on every change to the topics or subscribers
+ * @param arena Chunk the next topic names are interned in
+ * @param admit Limits of the broker and their usage (set_admit())
+ * @param workers Worker threads large fan-outs are spread over (NULL if none)
+ * @param actors Threads running the delivery queues of the topics (NULL if the
+ * publishers deliver themselves)
  */
 typedef struct {
 	pthread_mutex_t * lock;
     topic_t ** map;
     uint64_t map_size;
     uint64_t num_topics;
+    topic_t ** list;
+    uint64_t list_size;
+    uint64_t version;
+    table_chunk_t * arena;
+    admit_t admit;
+    workers_t * workers;
+    workers_t * actors;
 } table_t;
 
 /**
@@ -67,39 +161,75 @@ typedef struct {
 table_t * init_table(void);
 
 /**
- * @brief Calculate the hash given the topic string using the FNV-1a hash
- * algorithm.
+ * @brief Calculate the hash given the topic name using the FNV-1a hash
+ * algorithm. The slot in the map is the hash modulo the size of the map.
  * 
  * @see https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function#FNV-1a_hash
  * 
- * @param topic_str The topic string with length less than or equal to set topic size
- * @param map_size The size of the map
+ * @param topic_str The topic name, not necessarily null-terminated
+ * @param len Length of the topic name
  * 
- * @returns An unsigned integer to be used to get the correct topic in the table.
+ * @returns The 64-bit hash of the name.
  */
-uint64_t hash(char * topic_str, uint64_t map_size);
+uint64_t hash(const char * topic_str, size_t len);
+
+/**
+ * @brief Check that a topic name is not empty, at most TABLE_TOPIC_LEN bytes,
+ * and only made of alphanumerical characters and '-', '_', '.', ':', or '/'.
+ * Such names need no escaping in logs, stats, or the UI.
+ *
+ * @param topic_str The topic name
+ * @param len Length of the topic name
+ *
+ * @returns OK if valid. ERR otherwise.
+ */
+int check_topic(const char * topic_str, size_t len);
 
 /**
  * @brief Query the table for the given topic.
  * 
  * @param table Table to query on
- * @param topic_str Topic string
+ * @param topic_str Topic name, not necessarily null-terminated
+ * @param len Length of the topic name
  * 
  * @returns The topic or NULL if the topic does not exist.
  */
-topic_t * get_topic(table_t * table, char * topic_str);
+topic_t * get_topic(table_t * table, const char * topic_str, size_t len);
 
 /**
- * @brief Insert the new topic into the map. If the topic already exists, return
- * the topic. In collision, use linear probing. If the map is full, double the
- * size and re-insert.
+ * @brief Insert the new topic into the map, interning its name and giving it
+ * the next id. If the topic already exists, return the topic. In collision,
+ * use linear probing. If the map is full, double the size and re-insert.
  * 
  * @param table Table to insert to
- * @param topic_str Topic string
+ * @param topic_str Topic name, not necessarily null-terminated
+ * @param len Length of the topic name, at most TABLE_TOPIC_LEN
  * 
  * @returns The topic or NULL if an error has occurred.
 */
-topic_t * set_topic(table_t * table, char * topic_str);
+topic_t * set_topic(table_t * table, const char * topic_str, size_t len);
+
+/**
+ * @brief Get a topic by its id.
+ *
+ * @param table Table to query on
+ * @param id Id of the topic
+ *
+ * @returns The topic or NULL if no topic has the id.
+ */
+topic_t * topic_by_id(table_t * table, uint32_t id);
+
+/**
+ * @brief Copy a topic name to the arena. Assumes that the table mutex is
+ * locked prior.
+ *
+ * @param table Table owning the arena
+ * @param topic_str Topic name
+ * @param len Length of the topic name, at most TABLE_TOPIC_LEN
+ *
+ * @returns The null-terminated copy or NULL if an error has occurred.
+ */
+const char * intern_topic(table_t * table, const char * topic_str, size_t len);
 
 /**
  * @brief A helper function to insert a given topic object into the hash map.
@@ -113,27 +243,78 @@ topic_t * set_topic(table_t * table, char * topic_str);
 void insert_topic(table_t * table, topic_t * topic);
 
 /**
- * @brief Add the subscriber to the topic. If a topic does not exist, insert the
- * new topic and then add the new subscriber.
+ * @brief Mark the table as changed so that readers of snapshots (ex. UI) know
+ * to take a new one. Assumes that the table mutex is locked prior.
+ *
+ * @param table Table that changed
+ */
+void touch_table(table_t * table);
+
+/**
+ * @brief Lock the table mutex, with tracepoints before and after waiting on it.
+ *
+ * @param table Table to lock
+ */
+void lock_table(table_t * table);
+
+/**
+ * @brief Unlock the table mutex.
+ *
+ * @param table Table to unlock
+ */
+void unlock_table(table_t * table);
+
+/**
+ * @brief Add the subscriber to the topic. The topic is created beforehand with
+ * set_topic().
  * 
  * @param table The table to insert to
- * @param topic_str The topic to insert the new subscriber to
+ * @param id Id of the topic to insert the new subscriber to
  * @param new_sub The new subscriber to insert
  * 
- * @returns Positive value if it already exists in the table. OK if successfully
- * inserted. ERR if error while inserting to the table.
+ * @returns Positive value if it already exists in the table, whose filter and
+ * compression are then set to the ones of new_sub. OK if successfully inserted. ERR if the topic
+ * does not exist or already has admit.max_subs.
  */
-int insert_sub(table_t * table, char * topic_str, subscriber_t * new_sub);
+int insert_sub(table_t * table, uint32_t id, subscriber_t * new_sub);
 
 /**
  * @brief Remove the subscriber from the topic. If a topic does not exist or the
  * subscriber does not exist, ignore.
  * 
  * @param table The table to remove from
- * @param topic_str The topic to remove the subscriber from
+ * @param id Id of the topic to remove the subscriber from
  * @param sub Temporary subscriber info to match when searching
+ *
+ * @returns OK if removed. ERR if it was not found (ex. already removed).
 */
-void remove_sub(table_t * table, char * topic_str, subscriber_t sub);
+int remove_sub(table_t * table, uint32_t id, subscriber_t sub);
+
+/**
+ * @brief Intern a filter in the set of the topic, creating the set (charged
+ * against the memory budget) on the first one.
+ *
+ * @param table Table containing the topic
+ * @param topic Topic of the subscription
+ * @param filter Filter of the subscriber
+ *
+ * @returns Index of the filter in the set. ERR if the set is full or could
+ * not be created.
+ */
+int set_filter(table_t * table, topic_t * topic, const filter_t * filter);
+
+/**
+ * @brief Copy the subscribers of the topic so that they can be iterated without
+ * holding the table lock while the list changes.
+ *
+ * @param table Table containing the topic
+ * @param topic Topic to copy the subscribers of
+ * @param subs Set to a newly allocated array of copies (next and prev are not
+ * valid) to be freed by the caller
+ *
+ * @returns Number of subscribers copied or ERR on failure.
+ */
+int get_subs(table_t * table, topic_t * topic, subscriber_t ** subs);
 
 /**
  * @brief Clean up the table and free the topics, subscribers, etc.
@@ -2,27 +2,68 @@
 #define BRIDGE_TCP_H
 
 #include <arpa/inet.h>  /* sockaddr_in, htons(), htonl() */
+#include <netinet/tcp.h> /* TCP_DEFER_ACCEPT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h> /* socket(), bind(), listen(), accept() */
+#include <sys/time.h>   /* struct timeval */
 #include <unistd.h>     /* read(), write() */
 
 #include "util.h"
 
-#define SOCK_LISTEN_Q_LEN (5) /* Number of connections to buffer on socket */
+#define SOCK_LISTEN_Q_LEN (4096) /* Default number of connections to buffer on socket */
 #define PORT_NUM (55555)
+#define TCP_DEFER_SEC (3) /* Seconds the kernel waits for the first bytes */
+
+/* Options of tcp_listen() */
+#define TCP_LISTEN_REUSEPORT (1 << 0) /* Share the port with other sockets */
+#define TCP_LISTEN_DEFER     (1 << 1) /* Accept only once the client sent data */
 
 /**
- * @brief Create socket, bind to available port, and listen.
+ * @brief Create socket, bind to the given address and port, and listen.
+ *
+ * With TCP_LISTEN_REUSEPORT, several sockets can listen on the same port and
+ * the kernel spreads the incoming connections over them. With TCP_LISTEN_DEFER,
+ * connections are only accepted once the client sent its first bytes (or after
+ * TCP_DEFER_SEC), so that the handler does not wait on the command.
+ *
+ * @param addr IPv4 address to bind to in host byte order (ex. INADDR_ANY)
+ * @param port Port number to bind to
+ * @param backlog Length of the accept queue (capped by net.core.somaxconn)
+ * @param flags TCP_LISTEN_* options
  *
  * @return Server socket on success. ERR on failure.
  */
-int tcp_listen();
+int tcp_listen(uint32_t addr, uint16_t port, int backlog, int flags);
+
+/**
+ * @brief Check that no other socket listens on the port, by binding to it
+ * without SO_REUSEPORT. Sockets listening with TCP_LISTEN_REUSEPORT would
+ * otherwise share it with those of another process of the same user.
+ *
+ * @param addr IPv4 address to bind to in host byte order (ex. INADDR_ANY)
+ * @param port Port number to check, or 0 to be set to one the kernel picks
+ *
+ * @return OK if the port is free. ERR if it is in use or on failure.
+ */
+int tcp_probe_port(uint32_t addr, uint16_t * port);
+
+/**
+ * @brief Steer the connections received by the given CPU to this listening
+ * socket (SO_INCOMING_CPU). Among sockets sharing a port with SO_REUSEPORT,
+ * the kernel prefers the one whose CPU matches the one handling the packet.
+ *
+ * @param sock TCP server socket
+ * @param cpu CPU the accept loop of the socket is pinned to
+ *
+ * @return OK on success. ERR on failure.
+ */
+int tcp_incoming_cpu(int sock, int cpu);
 
 /**
  * @brief Wait (block), accept new connections, and save connection client info
- * ip and port to the given address.
+ * ip and port to the given address. The client socket is close-on-exec.
  *
  * @param sock TCP server socket
  * @param csock TCP client socket
@@ -33,6 +74,29 @@ int tcp_listen();
  */
 int tcp_accept(int sock, int * csock, uint32_t * ip, uint16_t * port);
 
+/**
+ * @brief Get the port the socket is bound to, ex. to find out the one chosen by
+ * the kernel when binding to port 0.
+ *
+ * @param sock TCP socket
+ * @param port Set to the port in host byte order on success
+ *
+ * @return OK on success. ERR on failure.
+ */
+int tcp_local_port(int sock, uint16_t * port);
+
+/**
+ * @brief Connect to the given address and port, waiting at most timeout_sec
+ * for the connection to be established. The socket is close-on-exec.
+ *
+ * @param addr IPv4 address in host byte order
+ * @param port Port number
+ * @param timeout_sec Seconds to wait for the connection
+ *
+ * @return Connected socket on success. ERR on failure.
+ */
+int tcp_connect(uint32_t addr, uint16_t port, int timeout_sec);
+
 /**
  * @brief Write to the given client socket the message of specified length.
  * 
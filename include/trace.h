@@ -0,0 +1,105 @@
+#ifndef BRIDGE_TRACE_H
+#define BRIDGE_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "util.h"
+
+/*
+ * Static tracepoints on the request and fan-out path. Each probe has a name and
+ * two integer arguments: TRACE(name, arg0, arg1).
+ *
+ * When <sys/sdt.h> is available (systemtap-sdt-dev), the probes are USDT probes
+ * of the "bridge" provider. They cost a nop until a tracer attaches to them:
+ *   bpftrace -e 'usdt:./bridge:bridge:send_done { @[arg1 < 0] = count(); }'
+ *
+ * Otherwise, building with -DTRACE_RING (make trace) records the probes in an
+ * in-memory ring of timestamps, dumped from the stats port ('t'). Without
+ * either, the probes compile to nothing.
+ */
+
+#define TRACE_RING_SIZE  (65536) /* Records kept, must be a power of 2 */
+
+/**
+ * Probes, named after their USDT names (TRACE_ID_<name>)
+ */
+enum TRACE_ID {
+	TRACE_ID_accept,          /* csock, port */
+	TRACE_ID_parse,           /* csock, cmd */
+	TRACE_ID_lookup,          /* probe length, found */
+	TRACE_ID_lock_wait,       /* table, 0 */
+	TRACE_ID_lock_acquire,    /* table, 0 */
+	TRACE_ID_lock_release,    /* table, 0 */
+	TRACE_ID_heartbeat_start, /* csock, 0 */
+	TRACE_ID_heartbeat_done,  /* csock, result */
+	TRACE_ID_send_start,      /* csock, len */
+	TRACE_ID_send_done,       /* csock, result */
+	TRACE_ID_publish_done,    /* csock, subscribers */
+	TRACE_NUM_IDS,
+};
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(TRACE_RING)
+#define TRACE_USDT
+#endif
+#endif
+
+#if defined(TRACE_USDT)
+#include <sys/sdt.h>
+#define TRACE(name, a, b) DTRACE_PROBE2(bridge, name, a, b)
+#elif defined(TRACE_RING)
+#define TRACE(name, a, b) trace_record(TRACE_ID_##name, (uint64_t) (a), (uint64_t) (b))
+#else
+#define TRACE(name, a, b) ((void) 0)
+#endif
+
+/**
+ * @brief One probe hit in the trace ring.
+ *
+ * @param seq Index of the record plus one, written last (0 while being written)
+ * @param time Monotonic time (ns) of the hit
+ * @param thread Small number identifying the thread that hit the probe
+ * @param id Probe that was hit
+ * @param a First argument of the probe
+ * @param b Second argument of the probe
+ */
+typedef struct trace_record {
+    uint64_t seq;
+    uint64_t time;
+    uint32_t thread;
+    uint32_t id;
+    uint64_t a;
+    uint64_t b;
+} trace_record_t;
+
+/**
+ * @brief Record a probe hit in the trace ring, overwriting the oldest record.
+ * Wait-free, so that it can be called with the table lock held.
+ *
+ * @param id Probe that was hit
+ * @param a First argument of the probe
+ * @param b Second argument of the probe
+ */
+void trace_record(enum TRACE_ID id, uint64_t a, uint64_t b);
+
+/**
+ * @brief Copy the records in the trace ring, oldest first. Records that are
+ * being written or overwritten during the copy are skipped.
+ *
+ * @param records Array of at least TRACE_RING_SIZE records to fill
+ *
+ * @returns Number of records copied. 0 if the ring is not compiled in.
+ */
+uint64_t trace_snapshot(trace_record_t * records);
+
+/**
+ * @brief Get the name of the probe.
+ *
+ * @param id Probe
+ *
+ * @returns Name used for TRACE() and USDT.
+ */
+const char * trace_name(enum TRACE_ID id);
+
+#endif
@@ -6,17 +6,20 @@
 #include <ncurses.h>
 #include <semaphore.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "log.h"
 #include "table.h"
 #include "util.h"
 
 #define TUI_BORDERS          (2)
 #define TUI_HEADER_HEIGHT    (1)
-#define TUI_LOGGER_HEIGHT    (5) /* Also the size of logs array */
-#define TUI_LOGGER_LENGTH    (100) /* 100 characters for logs */
+#define TUI_LOGGER_HEIGHT    (LOG_RECENT_LINES)
+#define TUI_LOGGER_LENGTH    (LOG_TEXT_LEN)
 #define TUI_MIN_TABLE_HEIGHT (5)
-#define TUI_TABLE_WIDTH      (TABLE_TOPIC_LEN + 10)
+#define TUI_TABLE_WIDTH      (24) /* Longer topic names are cut */
 #define TUI_KEY_HEIGHT       (1)
+#define TUI_FRAME_NSEC       (100000000) /* Redraw at most 10 times a second */
 
 /* Status enum */
 enum Status {
@@ -24,15 +27,48 @@ enum Status {
     FINISH,
 };
 
+/**
+ * @brief Copy of the visible part of the table taken once per frame, so that
+ * drawing does not hold the table lock.
+ *
+ * @param version Table version at the time of the snapshot
+ * @param num_topics Number of topics in the table
+ * @param index Selected topic, bounded by the number of topics
+ * @param offset Topic displayed on the first row of the table
+ * @param rows Number of topics copied starting from the offset
+ * @param rows_size The size of the topics array
+ * @param ids Topic ids of the visible rows
+ * @param topics Topic names of the visible rows, interned in the table
+ * @param num_subs Number of subscribers of the selected topic
+ * @param sub_rows Number of subscribers copied
+ * @param subs_size The size of the subs array
+ * @param subs Copy of the first sub_rows subscribers of the selected topic
+ */
+typedef struct tui_snapshot {
+    uint64_t version;
+    uint64_t num_topics;
+    uint64_t index;
+    uint64_t offset;
+    int rows;
+    int rows_size;
+    uint32_t * ids;
+    const char ** topics;
+    uint64_t num_subs;
+    int sub_rows;
+    int subs_size;
+    subscriber_t * subs;
+} tui_snapshot_t;
+
 /**
  * @brief This will be used throughout the program to display logs, handle the
  * index in the UI, etc.
  * 
- * @param logs Circular buffer of logs
- * @param log_head The index of the most recent log
- * @param log_tail The index of the oldest log
+ * @param logger Logger whose recent lines are displayed
  * @param index Currently selected topic in the table
- * @param update_sem Semaphore to indicate number of updates pending
+ * @param page Number of topics that fit in the table
+ * @param redraw If set, redraw every window from scratch on the next frame
+ * @param update_sem Semaphore to wake up the UI before the next frame
+ * @param headless If set, there are no windows
  * @param status If finish is set to 1, stop all threads and clean up
  * @param ip IP address of the server
  * @param port Port number assigned to the server
@@ -41,13 +77,20 @@ enum Status {
  * @param table_scr Window to display the topic table
  * @param topic_scr Window to display the list of subscribers for the selected topic
  * @param key_scr Window to display available keys
+ * @param snap Snapshot of the table used for the last frame (UI thread only)
+ * @param drawn_log_seq Log sequence displayed on the last frame (UI thread only)
+ * @param drawn_index Selected topic displayed on the last frame (UI thread only)
+ * @param drawn_port Port displayed on the last frame (UI thread only)
+ * @param drawn_admit Limits and usage displayed on the last frame (UI thread
+ * only)
  */
 typedef struct ui {
-    char logs[TUI_LOGGER_HEIGHT][TUI_LOGGER_LENGTH+1];
-    int log_head;
-    int log_tail;
+    logger_t * logger;
     int index;
+    int page;
+    bool redraw;
     sem_t * update_sem;
+    bool headless;
     enum Status status;
     char ip[INET_ADDRSTRLEN];
     uint16_t port;
@@ -56,6 +99,11 @@ typedef struct ui {
     WINDOW * table_scr;
     WINDOW * topic_scr;
     WINDOW * key_scr;
+    tui_snapshot_t snap;
+    uint64_t drawn_log_seq;
+    int drawn_index;
+    uint16_t drawn_port;
+    admit_t drawn_admit;
 } ui_t;
 
 /**
@@ -72,54 +120,68 @@ typedef struct ui_args {
 /**
  * @brief Initialize and enter ncurses mode.
  *
+ * @param logger Logger whose recent lines are displayed
+ *
  * @returns The newly allocated UI data structure or NULL on error.
  */
-ui_t * init_tui();
+ui_t * init_tui(logger_t * logger);
 
 /**
- * @brief Add a new message to the logs to display.
- * 
- * @param ui Initialized UI data structure
- * @param message New null-terminated message to display
-*/
-void log_tui(ui_t * ui, char * message);
+ * @brief Initialize the UI data structure without ncurses.
+ *
+ * @param logger Logger used by the threads
+ *
+ * @returns The newly allocated UI data structure or NULL on error.
+ */
+ui_t * init_headless(logger_t * logger);
 
 /**
- * @brief Display the table and logs.
+ * @brief Display the table and logs. Frames are drawn at most once every
+ * TUI_FRAME_NSEC and only the windows whose content changed are redrawn.
  *
  * @param args Contains table and UI data structure
  */
 void * run_tui(void * args);
 
 /**
- * @brief Display the name and server info (IP and port) to the top.
+ * @brief Copy the visible topics and the subscribers of the selected topic
+ * from the table. Only holds the table lock for the rows that fit the screen.
+ *
+ * @param ui UI data structure with the index, offset, and page to display
+ * @param table Table storing all the topics and subscribers
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int snapshot_tui(ui_t * ui, table_t * table);
+
+/**
+ * @brief Display the name, server info (IP and port), and the usage of the
+ * limits to the top.
  * 
- * @param ui UI data structure to get the stored IP and port
+ * @param ui UI data structure to get the stored IP, port, and usage
 */
 void display_server_info(const ui_t * ui);
 
 /**
- * @brief Display the logs.
+ * @brief Display the most recent lines of the logger.
  * 
- * @param ui UI data structure to get the logs
+ * @param ui UI data structure to get the logger
 */
 void display_logs(const ui_t * ui);
 
 /**
  * @brief Display the table.
  * 
- * @param ui UI data structure
- * @param table Table storing all the topics and subscribers
+ * @param ui UI data structure with the snapshot of the table
 */
-void display_table(const ui_t * ui, const table_t * table);
+void display_table(const ui_t * ui);
 
 /**
  * @brief Display the subscribers for the currently selected topic.
  * 
- * @param ui UI data structure
- * @param table Table storing all the topics and subscribers
+ * @param ui UI data structure with the snapshot of the table
 */
-void display_subscribers(const ui_t * ui, const table_t * table);
+void display_subscribers(const ui_t * ui);
 
 /**
  * @brief Display the key options to the bottom.
@@ -137,7 +199,7 @@ void display_keys(const ui_t * ui);
 void clear_screens(const ui_t * ui, bool refresh);
 
 /**
- * @brief End Ncurses mode and free UI.
+ * @brief End Ncurses mode (if not headless) and free UI.
  * 
  * @param ui UI to free
  */
@@ -0,0 +1,61 @@
+#ifndef BRIDGE_UDS_H
+#define BRIDGE_UDS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h> /* socket(), bind(), listen(), accept4() */
+#include <sys/stat.h>   /* lstat() */
+#include <sys/types.h>  /* ssize_t */
+#include <sys/uio.h>    /* struct iovec */
+#include <sys/un.h>     /* sockaddr_un */
+#include <unistd.h>     /* unlink() */
+
+#include "util.h"
+
+/**
+ * @brief Create a Unix domain stream socket, bind it to the given path, and
+ * listen. A socket file left at the path by a previous run is removed first.
+ *
+ * @param path Path of the socket file (at most sizeof(sun_path) - 1 bytes)
+ * @param backlog Length of the accept queue
+ *
+ * @return Server socket on success. ERR on failure.
+ */
+int uds_listen(const char * path, int backlog);
+
+/**
+ * @brief Wait (block) and accept a new connection. The client socket is
+ * close-on-exec.
+ *
+ * @param sock Unix domain server socket
+ * @param csock Set to the client socket
+ *
+ * @return OK on success. ERR on failure.
+ */
+int uds_accept(int sock, int * csock);
+
+/**
+ * @brief Send a message along with a file descriptor (SCM_RIGHTS).
+ *
+ * @param csock Unix domain client socket
+ * @param fd File descriptor to pass, the receiver gets its own copy
+ * @param msg Message sent with it, at least 1 byte
+ * @param len Length of the message
+ *
+ * @return OK on success. ERR on failure.
+ */
+int uds_send_fd(int csock, int fd, const char * msg, size_t len);
+
+/**
+ * @brief Receive a message along with a file descriptor (SCM_RIGHTS).
+ *
+ * @param sock Unix domain socket
+ * @param fd Set to the received file descriptor, or ERR if none came with it
+ * @param msg Buffer for the message
+ * @param len Size of the buffer
+ *
+ * @return Number of bytes of the message received. ERR on failure or EOF.
+ */
+ssize_t uds_recv_fd(int sock, int * fd, char * msg, size_t len);
+
+#endif
@@ -11,6 +11,10 @@
 #define ERR (-1)
 #endif
 
+#ifndef MIN
+#define MIN(X,Y) (X < Y ? X : Y)
+#endif
+
 /* To enable debug logs, compile with the -DDEBUG flag to define it */
 
 #ifdef DEBUG
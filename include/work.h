@@ -0,0 +1,218 @@
+#ifndef BRIDGE_WORK_H
+#define BRIDGE_WORK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+/*
+ * Worker threads. Work items are queued in a bounded ring under a lock and
+ * taken by the first idle worker. Items of a batch are waited for together, so
+ * that a thread can spread a loop over the cores and go on once all of it is
+ * done. When the ring is full, the submitter runs the item itself. Items may
+ * also be queued to run at a given time, which the idle workers wait for.
+ */
+
+#define WORK_QUEUE_LEN    (4096) /* Items queued at most, must be a power of 2 */
+#define WORK_MAX_THREADS  (256)
+#define WORK_THRESHOLD    (1024) /* Default subscribers of a fan-out to spread it */
+#define WORK_TIMERS       (1024) /* Timed items queued at most */
+
+/**
+ * @brief Batch of work items waited for together.
+ *
+ * @param pending Number of items not done yet
+ * @param lock Mutex lock for pending
+ * @param done Signaled when pending drops to 0
+ */
+typedef struct work_batch {
+    int pending;
+    pthread_mutex_t * lock;
+    pthread_cond_t * done;
+} work_batch_t;
+
+/**
+ * @brief Work item.
+ *
+ * @param fn Function to run
+ * @param arg Argument of fn
+ * @param batch Batch to count the item done in (NULL if none)
+ * @param due Monotonic time (us) from which a timed item is run
+ */
+typedef struct work {
+    void (*fn)(void * arg);
+    void * arg;
+    work_batch_t * batch;
+    uint64_t due;
+} work_t;
+
+/**
+ * @brief Worker threads and their queue.
+ *
+ * @param queue Ring of WORK_QUEUE_LEN items
+ * @param head Next position to queue at
+ * @param tail Next position to take from
+ * @param timers Timed items, WORK_TIMERS at most, in no order
+ * @param num_timers Number of timed items
+ * @param lock Mutex lock for the queue and the timed items
+ * @param ready Signaled when an item is queued or the workers should stop
+ * @param threads The worker threads
+ * @param num_threads Number of worker threads
+ * @param threshold Subscribers of a fan-out from which it is spread over the
+ * workers
+ * @param running Number of items being run by the workers
+ * @param finish If set, the workers stop
+ * @param batches Number of batches submitted
+ * @param items Number of items run by the workers
+ * @param inline_items Number of items run by the submitter as the queue was full
+ */
+typedef struct workers {
+    work_t * queue;
+    uint64_t head;
+    uint64_t tail;
+    work_t * timers;
+    int num_timers;
+    pthread_mutex_t * lock;
+    pthread_cond_t * ready;
+    pthread_t * threads;
+    int num_threads;
+    int threshold;
+    int running;
+    bool finish;
+    uint64_t batches;
+    uint64_t items;
+    uint64_t inline_items;
+} workers_t;
+
+/**
+ * @brief Start the worker threads.
+ *
+ * @param num_threads Number of worker threads
+ * @param threshold Subscribers of a fan-out from which it is spread over them
+ *
+ * @returns The workers on success. NULL on failure.
+ */
+workers_t * init_workers(int num_threads, int threshold);
+
+/**
+ * @brief Worker thread, running the queued items until told to finish.
+ *
+ * @param args Workers it belongs to
+ */
+void * run_worker(void * args);
+
+/**
+ * @brief Queue an item.
+ *
+ * @param workers Workers to run it on
+ * @param fn Function to run
+ * @param arg Argument of fn
+ * @param batch Batch to count the item in (NULL if none), which must have been
+ * counted for it with begin_batch()
+ *
+ * @returns OK if queued. ERR if the queue is full.
+ */
+int queue_work(workers_t * workers, void (*fn)(void *), void * arg, work_batch_t * batch);
+
+/**
+ * @brief Queue an item to be run once a time has come. The items due are run
+ * before the queued ones, and all of them right away when the workers stop.
+ *
+ * @param workers Workers to run it on
+ * @param fn Function to run
+ * @param arg Argument of fn
+ * @param due Monotonic time (us) from which it is run (see now_usec())
+ *
+ * @returns OK if queued. ERR if WORK_TIMERS items are already, or if the
+ * workers stop.
+ */
+int queue_work_at(workers_t * workers, void (*fn)(void *), void * arg, uint64_t due);
+
+/**
+ * @brief Find the timed item due first. Called with the lock of the workers
+ * held.
+ *
+ * @param workers Workers to look at
+ *
+ * @returns Index of the item in timers. ERR if there is none.
+ */
+int next_timer(workers_t * workers);
+
+/**
+ * @brief Queue an item, or run it right away if the queue is full.
+ *
+ * @param workers Workers to run it on
+ * @param fn Function to run
+ * @param arg Argument of fn
+ * @param batch Batch to count the item in (NULL if none), which must have been
+ * counted for it with begin_batch()
+ */
+void submit_work(workers_t * workers, void (*fn)(void *), void * arg, work_batch_t * batch);
+
+/**
+ * @brief Check whether the workers have nothing queued (timed or not) nor
+ * running.
+ *
+ * @param workers Workers to check (NULL if none)
+ *
+ * @returns true if idle, false otherwise.
+ */
+bool workers_idle(workers_t * workers);
+
+/**
+ * @brief Initialize a batch.
+ *
+ * @param batch Batch to initialize
+ *
+ * @returns OK on success. ERR on failure.
+ */
+int init_batch(work_batch_t * batch);
+
+/**
+ * @brief Count the items about to be submitted in the batch.
+ *
+ * @param workers Workers they run on
+ * @param batch Batch to count them in
+ * @param items Number of items
+ */
+void begin_batch(workers_t * workers, work_batch_t * batch, int items);
+
+/**
+ * @brief Count an item of the batch done.
+ *
+ * @param batch Batch of the item
+ */
+void end_batch_item(work_batch_t * batch);
+
+/**
+ * @brief Wait for all the items of the batch to be done.
+ *
+ * @param batch Batch to wait for
+ */
+void wait_batch(work_batch_t * batch);
+
+/**
+ * @brief Free the lock of a batch that is not waited for anymore.
+ *
+ * @param batch Batch to clean
+ */
+void cleanup_batch(work_batch_t * batch);
+
+/**
+ * @brief Stop the worker threads once the queued items are run, and free them.
+ *
+ * @param workers Workers to clean
+ */
+void cleanup_workers(workers_t * workers);
+
+/**
+ * @brief Get the monotonic time in microseconds.
+ */
+uint64_t now_usec(void);
+
+#endif
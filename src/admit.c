@@ -0,0 +1,83 @@
+#include "admit.h"
+
+void set_admit(admit_t * admit, const config_t * config)
+{
+	memset(admit, 0, sizeof(admit_t));
+	admit->max_conns = config->max_conns;
+	admit->max_subs = config->max_subs;
+	admit->conn_bytes = config->conn_bytes;
+	admit->budget = (uint64_t) config->budget_mb << 20;
+
+	/* Nominal, the kernel may double the buffers and reading takes a stack */
+	admit->conn_cost = ADMIT_CONN_BASE + 2 * (admit->conn_bytes > 0 ? admit->conn_bytes : ADMIT_SOCK_BUF);
+}
+
+int admit_conn(admit_t * admit)
+{
+	uint64_t conns = __atomic_add_fetch(&admit->conns, 1, __ATOMIC_RELAXED);
+	if (admit->max_conns > 0 && conns > admit->max_conns) {
+		__atomic_sub_fetch(&admit->conns, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&admit->rejected, 1, __ATOMIC_RELAXED);
+		return ERR;
+	}
+
+	/* Connections are charged like buffers, but counted as rejected */
+	uint64_t mem = __atomic_add_fetch(&admit->mem, admit->conn_cost, __ATOMIC_RELAXED);
+	if (admit->budget > 0 && mem > admit->budget) {
+		__atomic_sub_fetch(&admit->mem, admit->conn_cost, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&admit->conns, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&admit->rejected, 1, __ATOMIC_RELAXED);
+		return ERR;
+	}
+
+	return OK;
+}
+
+void release_conn(admit_t * admit)
+{
+	__atomic_sub_fetch(&admit->mem, admit->conn_cost, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&admit->conns, 1, __ATOMIC_RELAXED);
+}
+
+int admit_mem(admit_t * admit, size_t bytes)
+{
+	/* Charged first so that racing threads cannot both fit in what is left */
+	uint64_t mem = __atomic_add_fetch(&admit->mem, bytes, __ATOMIC_RELAXED);
+	if (admit->budget > 0 && mem > admit->budget) {
+		__atomic_sub_fetch(&admit->mem, bytes, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&admit->shed, 1, __ATOMIC_RELAXED);
+		return ERR;
+	}
+
+	return OK;
+}
+
+void release_mem(admit_t * admit, size_t bytes)
+{
+	__atomic_sub_fetch(&admit->mem, bytes, __ATOMIC_RELAXED);
+}
+
+int admit_sock(const admit_t * admit, int sock)
+{
+	if (admit->conn_bytes == 0) {
+		return OK;
+	}
+
+	int size = admit->conn_bytes;
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1 ||
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1) {
+		return ERR;
+	}
+
+	return OK;
+}
+
+void snapshot_admit(const admit_t * admit, admit_t * copy)
+{
+	*copy = *admit;
+	copy->conns = __atomic_load_n(&admit->conns, __ATOMIC_RELAXED);
+	copy->mem = __atomic_load_n(&admit->mem, __ATOMIC_RELAXED);
+	copy->rejected = __atomic_load_n(&admit->rejected, __ATOMIC_RELAXED);
+	copy->full = __atomic_load_n(&admit->full, __ATOMIC_RELAXED);
+	copy->shed = __atomic_load_n(&admit->shed, __ATOMIC_RELAXED);
+}
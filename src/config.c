@@ -0,0 +1,298 @@
+#include "config.h"
+
+int parse_config(config_t * config, int argc, char * argv[])
+{
+	/* Defaults */
+	config->headless = false;
+	config->log_path = NULL;
+	config->backlog = SOCK_LISTEN_Q_LEN;
+	config->num_cpus = 0;
+	config->uds_path = NULL;
+	config->mcast_group = 0;
+	config->mcast_port = 0;
+	config->mcast_if = INADDR_ANY;
+	config->port = PORT_NUM;
+	config->stats_port = PORT_NUM + 1; /* STATS_PORT_NUM */
+	config->num_peers = 0;
+	config->max_conns = 0;
+	config->max_subs = 0;
+	config->conn_bytes = 0;
+	config->budget_mb = 0;
+	config->handoff_path = NULL;
+	config->fan_threshold = WORK_THRESHOLD;
+	int port;
+	bool listeners_set = false;
+
+	/* One accept loop per core by default */
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	config->listeners = nproc > 0 ? (nproc < CONFIG_MAX_LISTENERS ? nproc : CONFIG_MAX_LISTENERS) : 1;
+
+	/* And one fan-out worker and one delivery thread per core */
+	config->workers = nproc > 0 ? (nproc < WORK_MAX_THREADS ? nproc : WORK_MAX_THREADS) : 1;
+	config->actors = config->workers;
+
+	int opt;
+	while ((opt = getopt(argc, argv, CONFIG_OPTS)) != -1) {
+		switch (opt) {
+			case 'd':
+				config->headless = true;
+				break;
+			case 'l':
+				config->log_path = optarg;
+				break;
+			case 'a':
+				if (parse_int(optarg, 1, CONFIG_MAX_LISTENERS, &config->listeners) != OK) {
+					return ERR;
+				}
+				listeners_set = true;
+				break;
+			case 'b':
+				if (parse_int(optarg, 1, INT_MAX, &config->backlog) != OK) {
+					return ERR;
+				}
+				break;
+			case 'c':
+				if (parse_cpus(optarg, config) != OK) {
+					return ERR;
+				}
+				break;
+			case 'u':
+				config->uds_path = optarg;
+				break;
+			case 'g':
+				if (parse_mcast(optarg, config) != OK) {
+					return ERR;
+				}
+				break;
+			case 'p':
+				if (parse_int(optarg, 0, UINT16_MAX, &port) != OK) {
+					return ERR;
+				}
+				config->port = port;
+				break;
+			case 's':
+				if (parse_int(optarg, 0, UINT16_MAX, &port) != OK) {
+					return ERR;
+				}
+				config->stats_port = port;
+				break;
+			case 'f':
+				if (parse_peer(optarg, config) != OK) {
+					return ERR;
+				}
+				break;
+			case 'n':
+				if (parse_int(optarg, 0, INT_MAX, &config->max_conns) != OK) {
+					return ERR;
+				}
+				break;
+			case 'k':
+				if (parse_int(optarg, 0, INT_MAX, &config->max_subs) != OK) {
+					return ERR;
+				}
+				break;
+			case 'w':
+				if (parse_int(optarg, 0, CONFIG_MAX_CONN_BYTES, &config->conn_bytes) != OK) {
+					return ERR;
+				}
+				break;
+			case 'm':
+				if (parse_int(optarg, 0, INT_MAX, &config->budget_mb) != OK) {
+					return ERR;
+				}
+				break;
+			case 'r':
+				config->handoff_path = optarg;
+				break;
+			case 'j':
+				if (parse_int(optarg, 0, WORK_MAX_THREADS, &config->workers) != OK) {
+					return ERR;
+				}
+				break;
+			case 'x':
+				if (parse_int(optarg, 1, INT_MAX, &config->fan_threshold) != OK) {
+					return ERR;
+				}
+				break;
+			case 'q':
+				if (parse_int(optarg, 0, WORK_MAX_THREADS, &config->actors) != OK) {
+					return ERR;
+				}
+				break;
+			case 'h':
+			default:
+				return ERR;
+		}
+	}
+
+	/* One accept thread per given CPU unless told otherwise */
+	if (config->num_cpus > 0 && !listeners_set) {
+		config->listeners = config->num_cpus;
+	}
+
+	/* No positional arguments */
+	if (optind < argc) {
+		return ERR;
+	}
+
+	return OK;
+}
+
+int parse_int(const char * str, long min, long max, int * value)
+{
+	char * end;
+	errno = 0;
+	long ret = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || ret < min || ret > max) {
+		return ERR;
+	}
+
+	*value = ret;
+	return OK;
+}
+
+int parse_cpus(const char * str, config_t * config)
+{
+	config->num_cpus = 0;
+
+	/* Comma separated CPUs or ranges of CPUs */
+	while (*str != '\0') {
+		char * end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+		if (end == str) {
+			return ERR;
+		}
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str) {
+				return ERR;
+			}
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) {
+			return ERR;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (config->num_cpus >= CONFIG_MAX_LISTENERS) {
+				return ERR;
+			}
+			config->cpus[config->num_cpus++] = cpu;
+		}
+
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return ERR;
+		}
+		str = end;
+	}
+
+	return config->num_cpus > 0 ? OK : ERR;
+}
+
+int parse_mcast(const char * str, config_t * config)
+{
+	char buf[64];
+	if (strlen(str) >= sizeof(buf)) {
+		return ERR;
+	}
+	strcpy(buf, str);
+
+	/* Optional interface after the port */
+	char * iface = strchr(buf, '/');
+	struct in_addr addr;
+	if (iface != NULL) {
+		*iface++ = '\0';
+		if (inet_pton(AF_INET, iface, &addr) != 1) {
+			return ERR;
+		}
+		config->mcast_if = ntohl(addr.s_addr);
+	}
+
+	char * port = strchr(buf, ':');
+	int value;
+	if (port == NULL) {
+		return ERR;
+	}
+	*port++ = '\0';
+	if (inet_pton(AF_INET, buf, &addr) != 1 || !IN_MULTICAST(ntohl(addr.s_addr)) ||
+		parse_int(port, 1, UINT16_MAX, &value) != OK) {
+		return ERR;
+	}
+	config->mcast_group = ntohl(addr.s_addr);
+	config->mcast_port = value;
+
+	return OK;
+}
+
+int parse_peer(const char * str, config_t * config)
+{
+	char buf[64];
+	if (strlen(str) >= sizeof(buf) || config->num_peers >= CONFIG_MAX_PEERS) {
+		return ERR;
+	}
+	strcpy(buf, str);
+
+	char * port = strchr(buf, ':');
+	struct in_addr addr;
+	int value;
+	if (port == NULL) {
+		return ERR;
+	}
+	*port++ = '\0';
+	if (inet_pton(AF_INET, buf, &addr) != 1 || parse_int(port, 1, UINT16_MAX, &value) != OK) {
+		return ERR;
+	}
+	config->peer_ips[config->num_peers] = ntohl(addr.s_addr);
+	config->peer_ports[config->num_peers] = value;
+	config->num_peers++;
+
+	return OK;
+}
+
+void usage(const char * prog)
+{
+	fprintf(stderr,
+		"Usage : %s [-d] [-l log_file] [-a listeners] [-b backlog] [-c cpus] [-u path]\n"
+		"        [-g group:port[/ifaddr]] [-p port] [-s port] [-f host:port]...\n"
+		"        [-n conns] [-k subs] [-w bytes] [-m mib] [-r path] [-j workers] [-x subs]\n"
+		"        [-q threads]\n"
+		"  -d           Run headless (no ncurses), stop on SIGINT or SIGTERM\n"
+		"  -l log_file  Append logs to log_file (default stderr when headless)\n"
+		"  -a listeners Listening sockets on the port, one accept thread each\n"
+		"               (default one per core, at most %d)\n"
+		"  -b backlog   Accept queue length of each listening socket (default %d)\n"
+		"  -c cpus      Pin the accept threads (and their handlers) to these CPUs,\n"
+		"               ex. 0-3,8 (default unpinned, one listener per CPU given)\n"
+		"  -u path      Also listen on a Unix domain socket at path, for local clients\n"
+		"  -g group:port[/ifaddr]\n"
+		"               Offer multicast delivery, topics get groups from this one on\n"
+		"               (ex. 239.255.0.1:56000), sent from the interface at ifaddr\n"
+		"  -p port      Port to listen on (default %d, 0 for any free port)\n"
+		"  -s port      Port of the stats server on loopback (default %d, 0 for any\n"
+		"               free port)\n"
+		"  -f host:port Link to the broker at host:port to exchange the messages of\n"
+		"               the topics subscribed to on either side (repeatable, at most %d)\n"
+		"  -n conns     Most client connections at once, more are answered F at\n"
+		"               accept (default 0, no limit)\n"
+		"  -k subs      Most subscribers of a topic (default 0, no limit)\n"
+		"  -w bytes     Send and receive buffer size of each connection, at most %d\n"
+		"               (default 0, the kernel's)\n"
+		"  -m mib       Memory budget of the connections and delivery buffers in MiB,\n"
+		"               past it connections are refused and deliveries go unbuffered\n"
+		"               (default 0, no limit)\n"
+		"  -r path      Hot restart: take over the listeners, topics, and subscribers\n"
+		"               of the broker running with the same path, then wait there to\n"
+		"               hand them off to the next one\n"
+		"  -j workers   Threads the fan-out of a topic with many subscribers is spread\n"
+		"               over (default one per core, at most %d, 0 for none)\n"
+		"  -x subs      Subscribers of a topic from which its fan-out is spread\n"
+		"               (default %d)\n"
+		"  -q threads   Threads delivering the messages queued on the topics, in the\n"
+		"               order they came (default one per core, at most %d, 0 for the\n"
+		"               publishers to deliver their messages themselves)\n"
+		"  -h           Show this message\n",
+		prog, CONFIG_MAX_LISTENERS, SOCK_LISTEN_Q_LEN, PORT_NUM, PORT_NUM + 1, CONFIG_MAX_PEERS, CONFIG_MAX_CONN_BYTES,
+		WORK_MAX_THREADS, WORK_THRESHOLD, WORK_MAX_THREADS);
+}
@@ -0,0 +1,364 @@
+#include "fed.h"
+
+fed_t * init_fed(const config_t * config)
+{
+	fed_t * fed = calloc(1, sizeof(fed_t));
+	if (fed == NULL) {
+		return NULL;
+	}
+
+	/* Random so that two brokers never share one, even on the same host */
+	fed->lock = malloc(sizeof(pthread_mutex_t));
+	if (fed->lock == NULL || pthread_mutex_init(fed->lock, NULL) ||
+		getrandom(&fed->id, sizeof(fed->id), 0) != sizeof(fed->id)) {
+		free(fed->lock);
+		free(fed);
+		return NULL;
+	}
+
+	/* The brokers to dial take the first slots */
+	fed->num_outbound = config->num_peers;
+	for (int i = 0; i < FED_MAX_PEERS; i++) {
+		fed_peer_t * peer = &fed->peers[i];
+		peer->index = i;
+		peer->sock = ERR;
+		peer->lock = malloc(sizeof(pthread_mutex_t));
+		if (peer->lock == NULL || pthread_mutex_init(peer->lock, NULL)) {
+			free(peer->lock);
+			peer->lock = NULL;
+			cleanup_fed(fed);
+			return NULL;
+		}
+		if (i < config->num_peers) {
+			peer->outbound = true;
+			peer->ip = config->peer_ips[i];
+			peer->port = config->peer_ports[i];
+		}
+	}
+
+	return fed;
+}
+
+int fed_dial(fed_t * fed, fed_peer_t * peer)
+{
+	int sock = tcp_connect(peer->ip, peer->port, FED_CONNECT_SEC);
+	if (sock == ERR) {
+		return ERR;
+	}
+
+	/* L | Id, answered O | Id, or F if refused */
+	char req[1 + FED_ID_LEN], resp[1 + FED_ID_LEN];
+	req[0] = FED_MSG_LINK;
+	proto_put64(req + 1, fed->id);
+	struct timeval wait_time = { FED_CONNECT_SEC, 0 }, no_wait = { 0, 0 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait_time, sizeof(wait_time)) < 0 ||
+		tcp_write(sock, req, sizeof(req)) != OK ||
+		recv(sock, resp, sizeof(resp), MSG_WAITALL) != sizeof(resp) || resp[0] != 'O' ||
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &no_wait, sizeof(no_wait)) < 0 ||
+		fed_link(fed, peer, sock, proto_get64(resp + 1), fed->id, peer->ip, peer->port) == NULL) {
+		close(sock);
+		return ERR;
+	}
+
+	return OK;
+}
+
+fed_peer_t * fed_link(fed_t * fed, fed_peer_t * slot, int sock, uint64_t id, uint64_t initiator, uint32_t ip, uint16_t port)
+{
+	/* Linked to itself, ex. its own address given with -f */
+	if (id == fed->id) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(fed->lock);
+
+	/* One link per broker, the other one is shut down and its reader unlinks it */
+	for (int i = 0; i < FED_MAX_PEERS; i++) {
+		fed_peer_t * other = &fed->peers[i];
+		if (other == slot || other->sock == ERR || other->id != id) {
+			continue;
+		}
+		if (other->initiator < initiator) {
+			pthread_mutex_unlock(fed->lock);
+			return NULL;
+		}
+		pthread_mutex_lock(other->lock);
+		shutdown(other->sock, SHUT_RDWR);
+		pthread_mutex_unlock(other->lock);
+	}
+
+	/* Brokers that dialed take the slots after the ones that are dialed */
+	bool inbound = slot == NULL;
+	for (int i = fed->num_outbound; i < FED_MAX_PEERS && slot == NULL; i++) {
+		if (fed->peers[i].sock == ERR) {
+			slot = &fed->peers[i];
+		}
+	}
+	if (slot == NULL) {
+		pthread_mutex_unlock(fed->lock);
+		return NULL;
+	}
+
+	/* Frames are written whole, do not hold them back for the previous ones */
+	int opt = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	pthread_mutex_lock(slot->lock);
+	if (inbound) {
+		char resp[1 + FED_ID_LEN];
+		resp[0] = 'O';
+		proto_put64(resp + 1, fed->id);
+		if (tcp_write(sock, resp, sizeof(resp)) != OK) {
+			pthread_mutex_unlock(slot->lock);
+			pthread_mutex_unlock(fed->lock);
+			return NULL;
+		}
+	}
+	slot->id = id;
+	slot->initiator = initiator;
+	slot->ip = ip;
+	slot->port = port;
+	slot->gen++;
+	__atomic_store_n(&slot->sock, sock, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(slot->lock);
+
+	pthread_mutex_unlock(fed->lock);
+	return slot;
+}
+
+bool fed_linked(fed_t * fed, uint64_t id)
+{
+	bool linked = false;
+	pthread_mutex_lock(fed->lock);
+	for (int i = 0; i < FED_MAX_PEERS && !linked; i++) {
+		linked = fed->peers[i].sock != ERR && fed->peers[i].id == id;
+	}
+	pthread_mutex_unlock(fed->lock);
+	return linked;
+}
+
+void fed_unlink(fed_t * fed, table_t * table, fed_peer_t * peer)
+{
+	/* Forget its interest first, the slot is not taken again until released */
+	uint32_t bit = 1u << peer->index;
+	lock_table(table);
+	for (uint64_t i = 0; i < table->num_topics; i++) {
+		__atomic_and_fetch(&table->list[i]->peers, ~bit, __ATOMIC_RELEASE);
+	}
+	unlock_table(table);
+
+	pthread_mutex_lock(fed->lock);
+	pthread_mutex_lock(peer->lock);
+	close(peer->sock);
+	__atomic_store_n(&peer->sock, ERR, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(peer->lock);
+	pthread_mutex_unlock(fed->lock);
+}
+
+int fed_read(int sock, fed_frame_t * frame)
+{
+	/* Fixed part after the type, the topic or the data follows it */
+	char hdr[FED_MSG_LEN + 2];
+	size_t len;
+	if (recv(sock, &frame->type, 1, MSG_WAITALL) != 1) {
+		return ERR;
+	}
+	switch (frame->type) {
+		case FED_MSG_SUB:
+		case FED_MSG_UNSUB:
+			len = 1;
+			break;
+		case FED_MSG_BEGIN:
+			len = FED_MSG_LEN + 1;
+			break;
+		case FED_MSG_DATA:
+			len = FED_MSG_LEN + 2;
+			break;
+		case FED_MSG_END:
+			len = FED_MSG_LEN;
+			break;
+		default:
+			return ERR;
+	}
+	if (recv(sock, hdr, len, MSG_WAITALL) != len) {
+		return ERR;
+	}
+
+	/* Topics are checked as for clients, the peer is another broker */
+	const char * topic_len = hdr;
+	if (frame->type == FED_MSG_BEGIN || frame->type == FED_MSG_DATA || frame->type == FED_MSG_END) {
+		frame->msg = proto_get32(hdr);
+		topic_len = hdr + FED_MSG_LEN;
+	}
+	if (frame->type == FED_MSG_SUB || frame->type == FED_MSG_UNSUB || frame->type == FED_MSG_BEGIN) {
+		frame->topic_len = (uint8_t) *topic_len;
+		if (recv(sock, frame->topic, frame->topic_len, MSG_WAITALL) != frame->topic_len ||
+			check_topic(frame->topic, frame->topic_len) != OK) {
+			return ERR;
+		}
+		frame->topic[frame->topic_len] = '\0';
+	}
+
+	if (frame->type == FED_MSG_DATA) {
+		frame->len = ((uint8_t) hdr[FED_MSG_LEN] << 8) | (uint8_t) hdr[FED_MSG_LEN + 1];
+		if (frame->len > FED_DATA_LEN || recv(sock, frame->data, frame->len, MSG_WAITALL) != frame->len) {
+			return ERR;
+		}
+	}
+
+	return OK;
+}
+
+int fed_send(fed_peer_t * peer, const char * frame, size_t len)
+{
+	int ret = ERR;
+	pthread_mutex_lock(peer->lock);
+	if (peer->sock != ERR) {
+		ret = tcp_write(peer->sock, frame, len);
+		if (ret != OK) {
+			shutdown(peer->sock, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(peer->lock);
+	return ret;
+}
+
+void fed_sync(fed_t * fed, table_t * table)
+{
+	/* Nothing to send unless a topic or a link changed */
+	uint64_t version = __atomic_load_n(&table->version, __ATOMIC_ACQUIRE);
+	bool pending = false;
+	for (int p = 0; p < FED_MAX_PEERS; p++) {
+		fed_peer_t * peer = &fed->peers[p];
+		pthread_mutex_lock(peer->lock);
+		pending |= peer->sock != ERR && peer->gen != peer->synced_gen;
+		pthread_mutex_unlock(peer->lock);
+	}
+	if (version == fed->synced_version && !pending) {
+		return;
+	}
+
+	/* Topics are never freed, so copying the pointers is enough */
+	lock_table(table);
+	uint64_t num = table->num_topics;
+	topic_t ** topics = malloc(sizeof(topic_t *) * (num + 1));
+	bool * wanted = malloc(sizeof(bool) * (num + 1));
+	if (topics == NULL || wanted == NULL) {
+		unlock_table(table);
+		free(topics);
+		free(wanted);
+		return;
+	}
+	for (uint64_t i = 0; i < num; i++) {
+		topics[i] = table->list[i];
+		wanted[i] = topics[i]->num_subs > 0 || __atomic_load_n(&topics[i]->shm, __ATOMIC_ACQUIRE) != NULL;
+	}
+	unlock_table(table);
+	fed->synced_version = version;
+
+	/* New links get all the topics wanted, the others the changes */
+	char frame[2 + TABLE_TOPIC_LEN];
+	for (int p = 0; p < FED_MAX_PEERS; p++) {
+		fed_peer_t * peer = &fed->peers[p];
+		pthread_mutex_lock(peer->lock);
+		bool up = peer->sock != ERR;
+		uint64_t gen = peer->gen;
+		pthread_mutex_unlock(peer->lock);
+		if (!up) {
+			continue;
+		}
+
+		bool full = gen != peer->synced_gen;
+		for (uint64_t i = 0; i < num; i++) {
+			if (full ? wanted[i] : wanted[i] != topics[i]->announced) {
+				frame[0] = wanted[i] ? FED_MSG_SUB : FED_MSG_UNSUB;
+				frame[1] = topics[i]->len;
+				memcpy(frame + 2, topics[i]->str, topics[i]->len);
+				fed_send(peer, frame, 2 + topics[i]->len);
+			}
+		}
+		peer->synced_gen = gen;
+	}
+
+	for (uint64_t i = 0; i < num; i++) {
+		topics[i]->announced = wanted[i];
+	}
+	free(topics);
+	free(wanted);
+}
+
+uint32_t fed_begin(fed_t * fed, uint32_t peers, const char * topic, uint8_t len)
+{
+	uint32_t msg = __atomic_add_fetch(&fed->next_msg, 1, __ATOMIC_RELAXED);
+
+	char frame[2 + FED_MSG_LEN + TABLE_TOPIC_LEN];
+	frame[0] = FED_MSG_BEGIN;
+	proto_put32(frame + 1, msg);
+	frame[1 + FED_MSG_LEN] = len;
+	memcpy(frame + 2 + FED_MSG_LEN, topic, len);
+	fed_forward(fed, peers, frame, 2 + FED_MSG_LEN + len);
+
+	return msg;
+}
+
+void fed_data(fed_t * fed, uint32_t peers, uint32_t msg, const char * data, size_t len)
+{
+	char frame[1 + FED_MSG_LEN + 2 + FED_DATA_LEN];
+	frame[0] = FED_MSG_DATA;
+	proto_put32(frame + 1, msg);
+	frame[1 + FED_MSG_LEN] = (len >> 8) & 0xFF;
+	frame[2 + FED_MSG_LEN] = len & 0xFF;
+	memcpy(frame + 3 + FED_MSG_LEN, data, len);
+	fed_forward(fed, peers, frame, 3 + FED_MSG_LEN + len);
+}
+
+void fed_end(fed_t * fed, uint32_t peers, uint32_t msg)
+{
+	char frame[1 + FED_MSG_LEN];
+	frame[0] = FED_MSG_END;
+	proto_put32(frame + 1, msg);
+	fed_forward(fed, peers, frame, sizeof(frame));
+}
+
+void fed_forward(fed_t * fed, uint32_t peers, const char * frame, size_t len)
+{
+	/* A slot taken again by another broker ignores the unknown message */
+	for (int i = 0; i < FED_MAX_PEERS; i++) {
+		if (peers & (1u << i)) {
+			fed_send(&fed->peers[i], frame, len);
+		}
+	}
+}
+
+void fed_shutdown(fed_t * fed)
+{
+	pthread_mutex_lock(fed->lock);
+	for (int i = 0; i < FED_MAX_PEERS; i++) {
+		fed_peer_t * peer = &fed->peers[i];
+		pthread_mutex_lock(peer->lock);
+		if (peer->sock != ERR) {
+			shutdown(peer->sock, SHUT_RDWR);
+		}
+		pthread_mutex_unlock(peer->lock);
+	}
+	pthread_mutex_unlock(fed->lock);
+}
+
+void cleanup_fed(fed_t * fed)
+{
+	if (fed == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < FED_MAX_PEERS; i++) {
+		if (fed->peers[i].lock != NULL) {
+			pthread_mutex_destroy(fed->peers[i].lock);
+			free(fed->peers[i].lock);
+		}
+	}
+	if (fed->lock != NULL) {
+		pthread_mutex_destroy(fed->lock);
+		free(fed->lock);
+	}
+	free(fed);
+}
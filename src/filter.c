@@ -0,0 +1,104 @@
+#include "filter.h"
+
+int filter_args_len(const char * args)
+{
+	uint8_t kind = args[0], offset = args[1], len = args[2];
+	if ((kind != FILTER_PREFIX && kind != FILTER_MASK) || len == 0 || offset + len > FILTER_LEN) {
+		return ERR;
+	}
+	return kind == FILTER_MASK ? 2 * len : len;
+}
+
+void parse_filter(const char * args, filter_t * filter)
+{
+	uint8_t kind = args[0], offset = args[1], len = args[2];
+	const uint8_t * value = (const uint8_t *) args + 3;
+	const uint8_t * mask = kind == FILTER_MASK ? value + len : NULL;
+
+	memset(filter, 0, sizeof(filter_t));
+	for (int i = 0; i < len; i++) {
+		filter->mask[offset + i] = mask != NULL ? mask[i] : 0xFF;
+		filter->value[offset + i] = value[i] & filter->mask[offset + i];
+	}
+	filter->need = offset + len;
+}
+
+filter_set_t * init_filters(void)
+{
+	/* Zeroed, the first filter compares nothing */
+	filter_set_t * set = calloc(1, sizeof(filter_set_t));
+	if (set != NULL) {
+		set->num_filters = 1;
+	}
+	return set;
+}
+
+int add_filter(filter_set_t * set, const filter_t * filter)
+{
+	uint64_t mask[FILTER_WORDS], value[FILTER_WORDS];
+	memcpy(mask, filter->mask, FILTER_LEN);
+	memcpy(value, filter->value, FILTER_LEN);
+
+	for (int i = 0; i < set->num_filters; i++) {
+		bool same = set->need[i] == filter->need;
+		for (int w = 0; w < FILTER_WORDS && same; w++) {
+			same = set->mask[w][i] == mask[w] && set->value[w][i] == value[w];
+		}
+		if (same) {
+			return i;
+		}
+	}
+	if (set->num_filters == FILTER_MAX) {
+		return ERR;
+	}
+
+	/* Filled in before it is counted, fan-outs only read the counted ones */
+	int index = set->num_filters;
+	for (int w = 0; w < FILTER_WORDS; w++) {
+		set->mask[w][index] = mask[w];
+		set->value[w][index] = value[w];
+	}
+	set->need[index] = filter->need;
+	if (filter->need > set->max_need) {
+		__atomic_store_n(&set->max_need, filter->need, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&set->num_filters, index + 1, __ATOMIC_RELEASE);
+	return index;
+}
+
+void get_filter(const filter_set_t * set, int index, filter_t * filter)
+{
+	uint64_t mask[FILTER_WORDS], value[FILTER_WORDS];
+	for (int w = 0; w < FILTER_WORDS; w++) {
+		mask[w] = set->mask[w][index];
+		value[w] = set->value[w][index];
+	}
+	memcpy(filter->mask, mask, FILTER_LEN);
+	memcpy(filter->value, value, FILTER_LEN);
+	filter->need = set->need[index];
+}
+
+int eval_filters(const filter_set_t * set, const char * head, size_t len, bool * pass)
+{
+	int num = __atomic_load_n(&set->num_filters, __ATOMIC_ACQUIRE);
+	int words = (__atomic_load_n(&set->max_need, __ATOMIC_RELAXED) + 7) / 8;
+	uint64_t head_words[FILTER_WORDS] = { 0 };
+	memcpy(head_words, head, len < FILTER_LEN ? len : FILTER_LEN);
+
+	/* One word of the head against that word of every filter at a time, */
+	/* without branches, so that the inner loop runs over the whole set   */
+	uint64_t diff[FILTER_MAX] = { 0 };
+	for (int w = 0; w < words; w++) {
+		uint64_t word = head_words[w];
+		const uint64_t * mask = set->mask[w];
+		const uint64_t * value = set->value[w];
+		for (int i = 0; i < num; i++) {
+			diff[i] |= (word & mask[i]) ^ value[i];
+		}
+	}
+
+	for (int i = 0; i < num; i++) {
+		pass[i] = diff[i] == 0 && len >= set->need[i];
+	}
+	return num;
+}
@@ -0,0 +1,197 @@
+#include "handoff.h"
+
+handoff_t * init_handoff(const char * path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return NULL;
+	}
+
+	handoff_t * handoff = calloc(1, sizeof(handoff_t));
+	if (handoff == NULL) {
+		return NULL;
+	}
+	handoff->path = path;
+	handoff->sock = ERR;
+
+	return handoff;
+}
+
+int handoff_connect(const char * path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Seqpacket so that each record comes whole with its descriptor */
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return ERR;
+	}
+	struct timeval wait_time = { HANDOFF_WAIT_SEC, 0 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait_time, sizeof(wait_time)) < 0 ||
+		connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(sock);
+		return ERR;
+	}
+
+	return sock;
+}
+
+int handoff_listen(handoff_t * handoff)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, handoff->path);
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return ERR;
+	}
+
+	/* The previous broker may still be exiting, its socket file is replaced */
+	struct stat st;
+	if (lstat(handoff->path, &st) == OK && S_ISSOCK(st.st_mode)) {
+		unlink(handoff->path);
+	}
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+		close(sock);
+		return ERR;
+	}
+
+	handoff->sock = sock;
+	return OK;
+}
+
+int handoff_enter(handoff_t * handoff)
+{
+	if (handoff == NULL) {
+		return OK;
+	}
+
+	/* Counted before checking, so that once draining is set and busy read */
+	/* as 0, no request can still slip in                                 */
+	__atomic_add_fetch(&handoff->busy, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&handoff->draining, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&handoff->busy, 1, __ATOMIC_SEQ_CST);
+		return ERR;
+	}
+
+	return OK;
+}
+
+void handoff_leave(handoff_t * handoff)
+{
+	if (handoff != NULL) {
+		__atomic_sub_fetch(&handoff->busy, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+bool handoff_draining(handoff_t * handoff)
+{
+	return handoff != NULL && __atomic_load_n(&handoff->draining, __ATOMIC_SEQ_CST);
+}
+
+int handoff_send(int sock, const handoff_rec_t * rec)
+{
+	char buf[HANDOFF_REC_LEN];
+	size_t len = 0;
+	buf[len++] = rec->type;
+	if (rec->type == HANDOFF_LISTENER) {
+		buf[len++] = rec->family;
+	} else if (rec->type == HANDOFF_TOPIC) {
+		buf[len++] = rec->topic_len;
+		memcpy(buf + len, rec->topic, rec->topic_len);
+		len += rec->topic_len;
+		proto_put32(buf + len, rec->flush_bytes);
+		proto_put32(buf + len + 4, rec->flush_usec);
+		len += 8;
+	} else if (rec->type == HANDOFF_SUB) {
+		buf[len++] = rec->flags;
+		proto_put32(buf + len, rec->ip);
+		buf[len + 4] = (rec->port >> 8) & 0xFF;
+		buf[len + 5] = rec->port & 0xFF;
+		len += 6;
+		if (rec->flags & HANDOFF_FLAG_FILTER) {
+			buf[len++] = rec->filter.need;
+			memcpy(buf + len, rec->filter.mask, rec->filter.need);
+			memcpy(buf + len + rec->filter.need, rec->filter.value, rec->filter.need);
+			len += 2 * rec->filter.need;
+		}
+	}
+
+	if (rec->fd != ERR) {
+		return uds_send_fd(sock, rec->fd, buf, len);
+	}
+	return send(sock, buf, len, MSG_NOSIGNAL) == (ssize_t) len ? OK : ERR;
+}
+
+int handoff_recv(int sock, handoff_rec_t * rec)
+{
+	char buf[HANDOFF_REC_LEN];
+	ssize_t len = uds_recv_fd(sock, &rec->fd, buf, sizeof(buf));
+	if (len <= 0) {
+		return ERR;
+	}
+
+	/* Each record has a fixed size but the topic, and a descriptor or not */
+	rec->type = buf[0];
+	bool has_fd = false;
+	bool valid = false;
+	if (rec->type == HANDOFF_LISTENER) {
+		has_fd = true;
+		valid = len == 2;
+		rec->family = valid ? (uint8_t) buf[1] : 0;
+	} else if (rec->type == HANDOFF_TOPIC) {
+		rec->topic_len = len >= 2 ? (uint8_t) buf[1] : 0;
+		valid = len >= 2 && len == 2 + rec->topic_len + 8;
+		if (valid) {
+			memcpy(rec->topic, buf + 2, rec->topic_len);
+			rec->topic[rec->topic_len] = '\0';
+			rec->flush_bytes = proto_get32(buf + 2 + rec->topic_len);
+			rec->flush_usec = proto_get32(buf + 2 + rec->topic_len + 4);
+		}
+	} else if (rec->type == HANDOFF_RING) {
+		has_fd = true;
+		valid = len == 1;
+	} else if (rec->type == HANDOFF_SUB) {
+		has_fd = true;
+		rec->flags = len >= 2 ? buf[1] : 0;
+		uint8_t need = len >= 9 && (rec->flags & HANDOFF_FLAG_FILTER) ? buf[8] : 0;
+		valid = (rec->flags & HANDOFF_FLAG_FILTER) ? len >= 9 && need > 0 && need <= FILTER_LEN && len == 9 + 2 * need :
+			len == 8;
+		if (valid) {
+			rec->ip = proto_get32(buf + 2);
+			rec->port = ((uint8_t) buf[6] << 8) | (uint8_t) buf[7];
+			memset(&rec->filter, 0, sizeof(filter_t));
+			rec->filter.need = need;
+			memcpy(rec->filter.mask, buf + 9, need);
+			memcpy(rec->filter.value, buf + 9 + need, need);
+		}
+	} else if (rec->type == HANDOFF_END) {
+		valid = len == 1;
+	}
+
+	if (!valid || has_fd != (rec->fd != ERR)) {
+		if (rec->fd != ERR) {
+			close(rec->fd);
+		}
+		return ERR;
+	}
+
+	return OK;
+}
+
+void cleanup_handoff(handoff_t * handoff)
+{
+	if (handoff == NULL) {
+		return;
+	}
+
+	if (handoff->sock != ERR) {
+		close(handoff->sock);
+	}
+	free(handoff);
+}
@@ -0,0 +1,289 @@
+#include "log.h"
+
+int open_log(const char * path)
+{
+	if (path == NULL) {
+		return STDERR_FILENO;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("open(log)");
+		return ERR;
+	}
+	return fd;
+}
+
+logger_t * init_logger(int fd)
+{
+	logger_t * logger = calloc(1, sizeof(logger_t));
+	if (logger == NULL) {
+		return NULL;
+	}
+	logger->fd = fd;
+
+	/* Each slot starts with the position that will be written to it first */
+	logger->ring = malloc(sizeof(log_record_t) * LOG_RING_SIZE);
+	if (logger->ring == NULL) {
+		free(logger);
+		return NULL;
+	}
+	for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+		logger->ring[i].seq = i;
+	}
+
+	logger->lock = malloc(sizeof(pthread_mutex_t));
+	if (logger->lock == NULL || pthread_mutex_init(logger->lock, NULL)) {
+		free(logger->lock);
+		free(logger->ring);
+		free(logger);
+		return NULL;
+	}
+
+	return logger;
+}
+
+log_record_t * claim_log(logger_t * logger, uint64_t * pos)
+{
+	uint64_t head = __atomic_load_n(&logger->head, __ATOMIC_RELAXED);
+	for (;;) {
+		log_record_t * slot = &logger->ring[head & (LOG_RING_SIZE - 1)];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) seq - (int64_t) head;
+
+		/* Slot is free for this position, try to take it */
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&logger->head, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos = head;
+				return slot;
+			}
+			/* Lost the race, head now has the current value */
+			continue;
+		}
+
+		/* Consumer has not read the record a full lap ago */
+		if (diff < 0) {
+			__atomic_add_fetch(&logger->dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+
+		/* Another producer took it, catch up */
+		head = __atomic_load_n(&logger->head, __ATOMIC_RELAXED);
+	}
+}
+
+int log_msg(logger_t * logger, const char * message)
+{
+	if (logger == NULL || message == NULL) {
+		return ERR;
+	}
+
+	uint64_t pos;
+	log_record_t * slot = claim_log(logger, &pos);
+	if (slot == NULL) {
+		return ERR;
+	}
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &slot->time);
+	slot->type = LOG_TEXT;
+	slot->ip = 0;
+	slot->port = 0;
+	size_t i = 0;
+	for (; i < LOG_TEXT_LEN && message[i] != '\0'; i++) {
+		slot->text[i] = message[i];
+	}
+	if (i < LOG_TEXT_LEN) {
+		slot->text[i] = '\0';
+	}
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return OK;
+}
+
+int log_conn(logger_t * logger, enum LOG_TYPE type, uint32_t ip, uint16_t port, const char * topic)
+{
+	if (logger == NULL || topic == NULL) {
+		return ERR;
+	}
+
+	uint64_t pos;
+	log_record_t * slot = claim_log(logger, &pos);
+	if (slot == NULL) {
+		return ERR;
+	}
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &slot->time);
+	slot->type = type;
+	slot->ip = ip;
+	slot->port = port;
+	size_t i = 0;
+	for (; i < LOG_TEXT_LEN && topic[i] != '\0'; i++) {
+		slot->text[i] = topic[i];
+	}
+	if (i < LOG_TEXT_LEN) {
+		slot->text[i] = '\0';
+	}
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return OK;
+}
+
+int pop_log(logger_t * logger, log_record_t * record)
+{
+	log_record_t * slot = &logger->ring[logger->tail & (LOG_RING_SIZE - 1)];
+
+	/* Not published yet (or nothing was claimed) */
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger->tail + 1) {
+		return ERR;
+	}
+	*record = *slot;
+
+	/* Hand the slot back to the producers for the next lap */
+	__atomic_store_n(&slot->seq, logger->tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	logger->tail++;
+	return OK;
+}
+
+void format_log(const log_record_t * record, char * buf, size_t len)
+{
+	/* Parse the four fields of the IP address, none for Unix domain sockets */
+	char peer[32] = "unix";
+	if (record->ip != 0 || record->port != 0) {
+		uint32_t ip = record->ip;
+		unsigned int f4 = 0xff & ip; ip = ip >> 8;
+		unsigned int f3 = 0xff & ip; ip = ip >> 8;
+		unsigned int f2 = 0xff & ip; ip = ip >> 8;
+		unsigned int f1 = 0xff & ip;
+		snprintf(peer, sizeof(peer), "%u.%u.%u.%u:%u", f1, f2, f3, f4, record->port);
+	}
+
+	switch (record->type) {
+		case LOG_SUBSCRIBE:
+			snprintf(buf, len, "Subscribing %s to %.*s", peer, LOG_TEXT_LEN, record->text);
+			break;
+		case LOG_UNSUBSCRIBE:
+			snprintf(buf, len, "Unsubscribing %s from %.*s", peer, LOG_TEXT_LEN, record->text);
+			break;
+		case LOG_PUBLISH:
+			snprintf(buf, len, "%s publishing to %.*s", peer, LOG_TEXT_LEN, record->text);
+			break;
+		case LOG_MAP:
+			snprintf(buf, len, "Mapping %.*s for %s", LOG_TEXT_LEN, record->text, peer);
+			break;
+		case LOG_GROUP:
+			snprintf(buf, len, "Subscribing %s to %.*s over multicast", peer, LOG_TEXT_LEN, record->text);
+			break;
+		case LOG_TEXT:
+		default:
+			snprintf(buf, len, "%.*s", LOG_TEXT_LEN, record->text);
+			break;
+	}
+}
+
+void * run_logger(void * args)
+{
+	logger_t * logger = args;
+	if (logger == NULL) {
+		return NULL;
+	}
+
+	/* Sleep only when there was nothing to consume */
+	struct timespec wait_time = { 0, LOG_POLL_NSEC };
+	while (!__atomic_load_n(&logger->finish, __ATOMIC_ACQUIRE)) {
+		if (drain_logger(logger) == 0) {
+			nanosleep(&wait_time, NULL);
+		}
+	}
+
+	/* Write out what is left */
+	drain_logger(logger);
+	return NULL;
+}
+
+void add_recent(logger_t * logger, const char * line)
+{
+	pthread_mutex_lock(logger->lock);
+	snprintf(logger->recent[logger->recent_head], LOG_TEXT_LEN+1, "%s", line);
+	logger->recent_head = (logger->recent_head + 1) % LOG_RECENT_LINES;
+	logger->recent_seq++;
+	pthread_mutex_unlock(logger->lock);
+}
+
+int write_log(int fd, const char * buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return ERR;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return OK;
+}
+
+int drain_logger(logger_t * logger)
+{
+	char out[LOG_LINE_LEN * 32];
+	size_t out_len = 0;
+	int count = 0;
+
+	for (;;) {
+		/* Report drops before the records that made it after them */
+		char line[LOG_LINE_LEN];
+		uint64_t dropped = __atomic_load_n(&logger->dropped, __ATOMIC_RELAXED);
+		log_record_t record;
+		bool have = false;
+		if (dropped != logger->reported) {
+			snprintf(line, sizeof(line), "Dropped %lu logs (ring full)", dropped - logger->reported);
+			clock_gettime(CLOCK_REALTIME_COARSE, &record.time);
+			logger->reported = dropped;
+			have = true;
+		} else if (pop_log(logger, &record) == OK) {
+			format_log(&record, line, sizeof(line));
+			count++;
+			have = true;
+		}
+
+		/* Flush the batched lines when done or when the batch is full */
+		if (!have || out_len + 2 * LOG_LINE_LEN > sizeof(out)) {
+			if (out_len > 0 && logger->fd != ERR) {
+				write_log(logger->fd, out, out_len);
+			}
+			out_len = 0;
+		}
+		if (!have) {
+			break;
+		}
+
+		add_recent(logger, line);
+		if (logger->fd != ERR) {
+			struct tm tm;
+			localtime_r(&record.time.tv_sec, &tm);
+			out_len += strftime(out + out_len, sizeof(out) - out_len, "%Y-%m-%d %H:%M:%S", &tm);
+			out_len += snprintf(out + out_len, sizeof(out) - out_len, ".%03ld %s\n", record.time.tv_nsec / 1000000, line);
+		}
+	}
+
+	return count;
+}
+
+void cleanup_logger(logger_t * logger)
+{
+	if (logger == NULL) {
+		return;
+	}
+
+	if (logger->fd != ERR && logger->fd != STDERR_FILENO) {
+		close(logger->fd);
+	}
+	if (logger->lock != NULL) {
+		pthread_mutex_destroy(logger->lock);
+		free(logger->lock);
+	}
+	free(logger->ring);
+	free(logger);
+}
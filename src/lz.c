@@ -0,0 +1,145 @@
+#include "lz.h"
+
+int lz_compress(const char * src, size_t len, char * dst, size_t cap)
+{
+	/* Position of the last 4 bytes seen with each hash. Stale or colliding */
+	/* entries are caught by comparing the bytes                           */
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const uint8_t * in = (const uint8_t *) src;
+	size_t ip = 0, anchor = 0, op = 0;
+	while (ip + LZ_MF_LIMIT <= len) {
+		uint32_t h = lz_hash(src + ip);
+		size_t ref = table[h];
+		table[h] = ip;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match forward, stopping before the last literals */
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match < len - LZ_LAST_LITERALS && in[ref + match] == in[ip + match]) {
+			match++;
+		}
+
+		/* Token, literals, offset, then the rest of the match length */
+		size_t lits = ip - anchor;
+		if (op + 1 + lits / 255 + 1 + lits + 2 + (match - LZ_MIN_MATCH) / 255 + 1 > cap) {
+			return ERR;
+		}
+		char * token = dst + op++;
+		*token = (lits >= 15 ? 15 : lits) << 4;
+		if (lits >= 15) {
+			op += lz_put_len(dst + op, lits - 15);
+		}
+		memcpy(dst + op, src + anchor, lits);
+		op += lits;
+		dst[op++] = (ip - ref) & 0xFF;
+		dst[op++] = ((ip - ref) >> 8) & 0xFF;
+		size_t rest = match - LZ_MIN_MATCH;
+		*token |= rest >= 15 ? 15 : rest;
+		if (rest >= 15) {
+			op += lz_put_len(dst + op, rest - 15);
+		}
+
+		ip += match;
+		anchor = ip;
+	}
+
+	/* The last sequence is literals only */
+	size_t lits = len - anchor;
+	if (op + 1 + lits / 255 + 1 + lits > cap) {
+		return ERR;
+	}
+	dst[op++] = (lits >= 15 ? 15 : lits) << 4;
+	if (lits >= 15) {
+		op += lz_put_len(dst + op, lits - 15);
+	}
+	memcpy(dst + op, src + anchor, lits);
+	op += lits;
+
+	return op < len ? (int) op : ERR;
+}
+
+int lz_decompress(const char * src, size_t len, char * dst, size_t cap)
+{
+	const uint8_t * in = (const uint8_t *) src;
+	size_t ip = 0, op = 0;
+	while (ip < len) {
+		uint8_t token = in[ip++];
+
+		/* Literals */
+		size_t lits = token >> 4;
+		if (lits == 15) {
+			uint8_t b;
+			do {
+				if (ip >= len) {
+					return ERR;
+				}
+				b = in[ip++];
+				lits += b;
+			} while (b == 255);
+		}
+		if (lits > len - ip || lits > cap - op) {
+			return ERR;
+		}
+		memcpy(dst + op, src + ip, lits);
+		ip += lits;
+		op += lits;
+
+		/* The last sequence has no match */
+		if (ip == len) {
+			break;
+		}
+
+		/* Match, which may overlap what it copies (runs) */
+		if (len - ip < 2) {
+			return ERR;
+		}
+		size_t offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op) {
+			return ERR;
+		}
+		size_t match = token & 15;
+		if (match == 15) {
+			uint8_t b;
+			do {
+				if (ip >= len) {
+					return ERR;
+				}
+				b = in[ip++];
+				match += b;
+			} while (b == 255);
+		}
+		match += LZ_MIN_MATCH;
+		if (match > cap - op) {
+			return ERR;
+		}
+		for (size_t i = 0; i < match; i++, op++) {
+			dst[op] = dst[op - offset];
+		}
+	}
+
+	return op;
+}
+
+size_t lz_put_len(char * dst, size_t len)
+{
+	size_t n = 0;
+	while (len >= 255) {
+		dst[n++] = (char) 255;
+		len -= 255;
+	}
+	dst[n++] = len;
+	return n;
+}
+
+uint32_t lz_hash(const char * src)
+{
+	uint32_t seq;
+	memcpy(&seq, src, sizeof(seq));
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
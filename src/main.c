@@ -2,82 +2,227 @@
 
 int main(int argc, char *argv[])
 {
+	config_t config;
+	if (parse_config(&config, argc, argv) != OK) {
+		usage(argv[0]);
+		return ERR;
+	}
+
+	/* Writing to a closed connection should fail instead of killing the broker */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The broker stops by waiting for these signals, in the main thread when */
+	/* headless and in a thread of its own with the UI. They are blocked     */
+	/* before spawning threads so that only the waiting thread gets them.    */
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL)) {
+		fprintf(stderr, "Error : failed to block signals\n");
+		return ERR;
+	}
+
+	/* Logs go to the file (or stderr when headless) and the UI */
+	int log_fd = ERR;
+	if (config.headless || config.log_path != NULL) {
+		if ((log_fd = open_log(config.log_path)) == ERR) {
+			return ERR;
+		}
+	}
+	logger_t * logger = init_logger(log_fd);
+	pthread_t logger_thr;
+	if (logger == NULL || pthread_create(&logger_thr, NULL, run_logger, logger)) {
+		fprintf(stderr, "Error : failed to run logger thread\n");
+		return ERR;
+	}
+
 	/* Initialize UI and topic-subscriber table */
 	thr_args_t args = {
 		.table = init_table(),
-		.ui = init_tui(),
+		.ui = config.headless ? init_headless(logger) : init_tui(logger),
+		.config = &config,
 	};
 	if (args.table == NULL || args.ui == NULL) {
+		stop_logger(logger, logger_thr);
 		fprintf(stderr, "Error : failed to initialize\n");
 		return ERR;
 	}
-	log_tui(args.ui, "UI and table initialized...");
+	set_admit(&args.table->admit, &config);
+	log_msg(logger, "UI and table initialized...");
 
 	/* Run the server thread and detach */
 	pthread_t server_thr;
 	if (pthread_create(&server_thr, NULL, run_server, &args)) {
 		cleanup_table(args.table);
 		cleanup_ui(args.ui);
+		stop_logger(logger, logger_thr);
 		fprintf(stderr, "Error : failed to run server thread\n");
 		return ERR;
 	}
-	log_tui(args.ui, "Server thread detached and running...");
+	log_msg(logger, "Server thread detached and running...");
+
+	/* Run the stats (admin) thread */
+	pthread_t stats_thr;
+	if (pthread_create(&stats_thr, NULL, run_stats, &args)) {
+		pthread_cancel(server_thr);
+		cleanup_table(args.table);
+		cleanup_ui(args.ui);
+		stop_logger(logger, logger_thr);
+		fprintf(stderr, "Error : failed to run stats thread\n");
+		return ERR;
+	}
+	log_msg(logger, "Stats thread detached and running...");
+
+	/* Without the UI, just wait to be told to stop */
+	if (config.headless) {
+		int sig = wait_signal(&sigs);
+		args.ui->status = FINISH;
+		char temp[64];
+		snprintf(temp, sizeof(temp), "Received signal %d, shutting down...", sig);
+		log_msg(logger, temp);
+
+		pthread_cancel(server_thr);
+		pthread_cancel(stats_thr);
+		cleanup_table(args.table);
+		cleanup_ui(args.ui);
+		stop_logger(logger, logger_thr);
+		return OK;
+	}
 
 	/* Run the UI thread */
 	pthread_t ui_thr;
 	if (pthread_create(&ui_thr, NULL, run_tui, &args)) {
+		pthread_cancel(server_thr);
+		pthread_cancel(stats_thr);
 		cleanup_table(args.table);
 		cleanup_ui(args.ui);
+		stop_logger(logger, logger_thr);
 		fprintf(stderr, "Error : failed to run UI thread\n");
 		return ERR;
 	}
-	log_tui(args.ui, "UI thread detached and running...");
+	log_msg(logger, "UI thread detached and running...");
+
+	/* Run the signal thread */
+	pthread_t signal_thr;
+	signal_args_t signal_args = { .ui = args.ui, .sigs = sigs };
+	if (pthread_create(&signal_thr, NULL, run_signals, &signal_args)) {
+		pthread_cancel(server_thr);
+		pthread_cancel(stats_thr);
+		pthread_cancel(ui_thr);
+		cleanup_table(args.table);
+		cleanup_ui(args.ui);
+		stop_logger(logger, logger_thr);
+		fprintf(stderr, "Error : failed to run signal thread\n");
+		return ERR;
+	}
 
 	/* Block and handle user input */
 	handle_input(args.table, args.ui);
 
 	/* Clean up */
 	pthread_cancel(server_thr);
+	pthread_cancel(stats_thr);
 	pthread_cancel(ui_thr);
+	pthread_cancel(signal_thr);
+	pthread_join(signal_thr, NULL);
 	cleanup_table(args.table);
 	cleanup_ui(args.ui);
+	stop_logger(logger, logger_thr);
 
 	return OK;
 }
 
+void stop_logger(logger_t * logger, pthread_t logger_thr)
+{
+	/* Let the logger write out what is left before freeing it */
+	__atomic_store_n(&logger->finish, true, __ATOMIC_RELEASE);
+	pthread_join(logger_thr, NULL);
+	cleanup_logger(logger);
+}
+
+int wait_signal(const sigset_t * sigs)
+{
+	int sig;
+	while (sigwait(sigs, &sig)) {
+		/* Only fails on an invalid set, retry otherwise */
+	}
+	return sig;
+}
+
+void * run_signals(void * args)
+{
+	signal_args_t * signal_args = (signal_args_t *) args;
+
+	int sig = wait_signal(&signal_args->sigs);
+	char temp[64];
+	snprintf(temp, sizeof(temp), "Received signal %d, shutting down...", sig);
+	log_msg(signal_args->ui->logger, temp);
+	signal_args->ui->status = FINISH;
+	sem_post(signal_args->ui->update_sem);
+
+	return NULL;
+}
+
 void handle_input(table_t * table, ui_t * ui)
 {
 	if (ui == NULL || table == NULL) {
 		return;
 	}
 
+	/* Wake up every so often to notice a signal or a hand-off finishing the UI */
+	wtimeout(ui->key_scr, INPUT_WAIT_MS);
 	for (;;) {
+		if (ui->status == FINISH) {
+			return;
+		}
 		int input = wgetch(ui->key_scr);
 
 		switch (input) {
 
 			/* Increment current index */
-			case KEY_NPAGE:
 			case KEY_DOWN:
-				pthread_mutex_lock(table->lock);
-				if (ui->index < table->num_topics) {
-					pthread_mutex_unlock(table->lock);
+				lock_table(table);
+				if (ui->index + 1 < table->num_topics) {
 					ui->index++;
-					sem_post(ui->update_sem);
-					break;
 				}
-				pthread_mutex_unlock(table->lock);
+				unlock_table(table);
 				break;
 
 			/* Decrement current index */
-			case KEY_PPAGE:
 			case KEY_UP:
 				if (ui->index > 0) {
 					ui->index--;
-					sem_post(ui->update_sem);
 				}
 				break;
 
+			/* Move a page (rows in the table) down */
+			case KEY_NPAGE:
+				lock_table(table);
+				ui->index = MIN(ui->index + ui->page, (int) table->num_topics - 1);
+				if (ui->index < 0) {
+					ui->index = 0;
+				}
+				unlock_table(table);
+				break;
+
+			/* Move a page (rows in the table) up */
+			case KEY_PPAGE:
+				ui->index = ui->index > ui->page ? ui->index - ui->page : 0;
+				break;
+
+			/* Move to the first topic */
+			case KEY_HOME:
+				ui->index = 0;
+				break;
+
+			/* Move to the last topic */
+			case KEY_END:
+				lock_table(table);
+				ui->index = table->num_topics > 0 ? table->num_topics - 1 : 0;
+				unlock_table(table);
+				break;
+
 			/* Quit the program */ 
 			case 'q':
 				ui->status = FINISH;
@@ -86,7 +231,7 @@ void handle_input(table_t * table, ui_t * ui)
 
 			/* Reactive display */
 			case KEY_RESIZE:
-				sem_post(ui->update_sem);
+				ui->redraw = true;
 				break;
 
 			default:
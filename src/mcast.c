@@ -0,0 +1,136 @@
+#include "mcast.h"
+
+mcast_t * init_mcast(uint32_t base, uint16_t port, uint32_t ifaddr)
+{
+	mcast_t * mcast = calloc(1, sizeof(mcast_t));
+	if (mcast == NULL) {
+		return NULL;
+	}
+	mcast->base = base;
+	mcast->port = port;
+
+	mcast->sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (mcast->sock < 0) {
+		free(mcast);
+		return NULL;
+	}
+
+	/* Local subscribers get the datagrams too, and none leave the LAN */
+	unsigned char ttl = MCAST_TTL, loop = 1;
+	struct in_addr iface = { htonl(ifaddr) };
+	if (setsockopt(mcast->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+		setsockopt(mcast->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+		(ifaddr != INADDR_ANY && setsockopt(mcast->sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0)) {
+		perror("setsockopt(IP_MULTICAST_*)");
+		close(mcast->sock);
+		free(mcast);
+		return NULL;
+	}
+
+	return mcast;
+}
+
+mcast_topic_t * init_mcast_topic(mcast_t * mcast, uint32_t topic)
+{
+	mcast_topic_t * mt = calloc(1, sizeof(mcast_topic_t));
+	if (mt == NULL) {
+		return NULL;
+	}
+
+	mt->slots = calloc(MCAST_REPAIR_SLOTS, sizeof(mcast_slot_t));
+	mt->lock = malloc(sizeof(pthread_mutex_t));
+	if (mt->slots == NULL || mt->lock == NULL || pthread_mutex_init(mt->lock, NULL)) {
+		free(mt->slots);
+		free(mt->lock);
+		free(mt);
+		return NULL;
+	}
+
+	/* One group per topic, so that subscribers only get their topics */
+	uint32_t offset = __atomic_fetch_add(&mcast->next_group, 1, __ATOMIC_RELAXED);
+	mt->sock = mcast->sock;
+	mt->group.sin_family = AF_INET;
+	mt->group.sin_port = htons(mcast->port);
+	mt->group.sin_addr.s_addr = htonl(mcast->base + offset);
+	mt->topic = topic;
+	return mt;
+}
+
+int mcast_send(mcast_topic_t * mt, const char * data, size_t len, uint8_t flags)
+{
+	len = len > MCAST_DATA_LEN ? MCAST_DATA_LEN : len;
+
+	pthread_mutex_lock(mt->lock);
+	uint64_t seq = __atomic_add_fetch(&mt->seq, 1, __ATOMIC_RELAXED);
+	mcast_slot_t * slot = &mt->slots[seq & (MCAST_REPAIR_SLOTS - 1)];
+	slot->seq = seq;
+	slot->len = MCAST_HDR_LEN + len;
+	proto_put32(slot->data, mt->topic);
+	slot->data[MCAST_TOPIC_LEN] = flags;
+	proto_put64(slot->data + MCAST_TOPIC_LEN + 1, seq);
+	if (len > 0) {
+		memcpy(slot->data + MCAST_HDR_LEN, data, len);
+	}
+
+	/* Sent under the lock so that the group gets them in order */
+	ssize_t ret = sendto(mt->sock, slot->data, slot->len, 0, (struct sockaddr *) &mt->group, sizeof(mt->group));
+	pthread_mutex_unlock(mt->lock);
+
+	return ret < 0 ? ERR : OK;
+}
+
+int mcast_repair(mcast_topic_t * mt, int csock, uint64_t first, uint16_t count)
+{
+	count = count > MCAST_MAX_NAK ? MCAST_MAX_NAK : count;
+
+	/* Datagrams not sent yet are not answered, they will come */
+	uint64_t last = __atomic_load_n(&mt->seq, __ATOMIC_RELAXED);
+	for (uint64_t seq = first; seq < first + count && seq <= last; seq++) {
+		char buf[3 + MCAST_DGRAM_LEN];
+		size_t len;
+
+		/* Copy under the lock, write without it */
+		pthread_mutex_lock(mt->lock);
+		mcast_slot_t * slot = &mt->slots[seq & (MCAST_REPAIR_SLOTS - 1)];
+		if (seq != 0 && slot->seq == seq) {
+			buf[0] = MCAST_MSG_REPAIR;
+			buf[1] = (slot->len >> 8) & 0xFF;
+			buf[2] = slot->len & 0xFF;
+			memcpy(buf + 3, slot->data, slot->len);
+			len = 3 + slot->len;
+		} else {
+			buf[0] = MCAST_MSG_LOST;
+			proto_put64(buf + 1, seq);
+			len = 1 + 8;
+		}
+		pthread_mutex_unlock(mt->lock);
+
+		if (send(csock, buf, len, MSG_NOSIGNAL) < 0) {
+			return ERR;
+		}
+	}
+
+	return OK;
+}
+
+void cleanup_mcast_topic(mcast_topic_t * mt)
+{
+	if (mt == NULL) {
+		return;
+	}
+
+	pthread_mutex_destroy(mt->lock);
+	free(mt->lock);
+	free(mt->slots);
+	free(mt);
+}
+
+void cleanup_mcast(mcast_t * mcast)
+{
+	if (mcast == NULL) {
+		return;
+	}
+
+	close(mcast->sock);
+	free(mcast);
+}
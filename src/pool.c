@@ -0,0 +1,81 @@
+#include "pool.h"
+
+pool_t * init_pool(size_t obj_size, size_t num_objs)
+{
+	pool_t * pool = calloc(1, sizeof(pool_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->lock = malloc(sizeof(pthread_mutex_t));
+	if (pool->lock == NULL || pthread_mutex_init(pool->lock, NULL)) {
+		free(pool->lock);
+		free(pool);
+		return NULL;
+	}
+
+	/* Room for the free list pointer, and one cache line (or more) each */
+	obj_size = obj_size < sizeof(void *) ? sizeof(void *) : obj_size;
+	pool->obj_size = (obj_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+	pool->len = pool->obj_size * num_objs;
+	pool->base = mmap(NULL, pool->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pool->base == MAP_FAILED) {
+		pthread_mutex_destroy(pool->lock);
+		free(pool->lock);
+		free(pool);
+		return NULL;
+	}
+
+	/* Linking the objects touches every page from this thread */
+	pool->free_list = NULL;
+	for (size_t i = num_objs; i > 0; i--) {
+		void ** obj = (void **) (pool->base + (i - 1) * pool->obj_size);
+		*obj = pool->free_list;
+		pool->free_list = obj;
+	}
+
+	return pool;
+}
+
+void * pool_get(pool_t * pool)
+{
+	pthread_mutex_lock(pool->lock);
+	void ** obj = pool->free_list;
+	if (obj != NULL) {
+		pool->free_list = *obj;
+	}
+	pthread_mutex_unlock(pool->lock);
+
+	/* More objects in use than the pool holds, use the heap */
+	if (obj == NULL) {
+		__atomic_add_fetch(&pool->fallbacks, 1, __ATOMIC_RELAXED);
+		return malloc(pool->obj_size);
+	}
+	return obj;
+}
+
+void pool_put(pool_t * pool, void * obj)
+{
+	/* Objects from the fallback are not in the mapping */
+	if ((char *) obj < pool->base || (char *) obj >= pool->base + pool->len) {
+		free(obj);
+		return;
+	}
+
+	pthread_mutex_lock(pool->lock);
+	*(void **) obj = pool->free_list;
+	pool->free_list = obj;
+	pthread_mutex_unlock(pool->lock);
+}
+
+void cleanup_pool(pool_t * pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	munmap(pool->base, pool->len);
+	pthread_mutex_destroy(pool->lock);
+	free(pool->lock);
+	free(pool);
+}
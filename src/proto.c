@@ -0,0 +1,35 @@
+#include "proto.h"
+
+void proto_put32(char * buf, uint32_t value)
+{
+	for (int i = 3; i >= 0; i--) {
+		buf[i] = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+uint32_t proto_get32(const char * buf)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value = (value << 8) | (uint8_t) buf[i];
+	}
+	return value;
+}
+
+void proto_put64(char * buf, uint64_t value)
+{
+	for (int i = 7; i >= 0; i--) {
+		buf[i] = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+uint64_t proto_get64(const char * buf)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value = (value << 8) | (uint8_t) buf[i];
+	}
+	return value;
+}
@@ -4,47 +4,293 @@ void * run_server(void * args)
 {
 	table_t * table = ((server_args_t *) args)->table;
 	ui_t * ui = ((server_args_t *) args)->ui;
-	if (table == NULL || ui == NULL) {
+	const config_t * config = ((server_args_t *) args)->config;
+	if (table == NULL || ui == NULL || config == NULL) {
 		return NULL;
 	}
 
-	/* Detach from main thread and setup socket to listen for connections */
-	int sock;
-	if (pthread_detach(pthread_self()) || (sock = tcp_listen()) < 0) {
-		log_tui(ui, "Error : failed to initialize server");
+	/* Detach from main thread */
+	if (pthread_detach(pthread_self())) {
+		log_msg(ui->logger, "Error : failed to initialize server");
 		return NULL;
 	}
 
+	/* Workers for the fan-outs of topics with many subscribers, started */
+	/* before anything is delivered                                      */
+	if (config->workers > 0 && (table->workers = init_workers(config->workers, config->fan_threshold)) == NULL) {
+		log_msg(ui->logger, "Error : failed to start the fan-out workers, delivering inline");
+	}
+	if (config->actors > 0 && (table->actors = init_workers(config->actors, 0)) == NULL) {
+		log_msg(ui->logger, "Error : failed to start the delivery threads, publishers deliver");
+	}
+
+	/* Take over from the broker handing off on the same path, if one runs. */
+	/* Its listeners come along, with the connections waiting in them       */
+	static acceptor_args_t acceptors[CONFIG_MAX_LISTENERS + 1];
+	int num_acceptors = 0;
+	handoff_t * handoff = NULL;
+	char temp[100];
+	if (config->handoff_path != NULL) {
+		int hsock;
+		if ((handoff = init_handoff(config->handoff_path)) == NULL) {
+			log_msg(ui->logger, "Error : failed to initialize hot restart");
+		} else if ((hsock = handoff_connect(config->handoff_path)) != ERR) {
+			int ret = take_over(table, ui, hsock, acceptors, &num_acceptors);
+			close(hsock);
+			if (ret != OK) {
+				log_msg(ui->logger, "Error : failed to take over from the running broker");
+				return NULL;
+			}
+		}
+	}
+	bool took_over = num_acceptors > 0;
+
+	/* Multicast delivery, with a thread answering NAKs */
+	static repair_args_t repair_args;
+	repair_args_t * repair = NULL;
+	if (config->mcast_group != 0) {
+		repair_args.table = table;
+		repair_args.ui = ui;
+		repair_args.mcast = init_mcast(config->mcast_group, config->mcast_port, config->mcast_if);
+		repair_args.epfd = epoll_create1(EPOLL_CLOEXEC);
+		pthread_t r_thr;
+		if (repair_args.mcast == NULL || repair_args.epfd < 0 ||
+			pthread_create(&r_thr, NULL, run_repair, &repair_args) || pthread_detach(r_thr)) {
+			log_msg(ui->logger, "Error : failed to initialize multicast");
+		} else {
+			repair = &repair_args;
+		}
+	}
+
+	/* Links to other brokers, dialed and kept up by the federation thread */
+	static fed_args_t fed_args;
+	fed_t * fed = init_fed(config);
+	if (fed == NULL) {
+		log_msg(ui->logger, "Error : failed to initialize federation");
+	} else {
+		fed_args = (fed_args_t) { .table = table, .ui = ui, .fed = fed, .handoff = handoff };
+		pthread_t f_thr;
+		if (pthread_create(&f_thr, NULL, run_federation, &fed_args) || pthread_detach(f_thr)) {
+			log_msg(ui->logger, "Error : failed to create federation thread");
+		}
+		snprintf(temp, sizeof(temp), "Broker id %016lx, linking to %d broker(s)...", fed->id, config->num_peers);
+		log_msg(ui->logger, temp);
+	}
+
+	/* Setup the sockets to listen for connections, the kernel spreads the */
+	/* connections over them so that the accept loops do not contend. The  */
+	/* port is checked to be free first, as another broker listening on it */
+	/* would take part of the connections, and only a hand-off shares it   */
+	uint16_t port = config->port;
+	if (!took_over && tcp_probe_port(INADDR_ANY, &port) != OK) {
+		snprintf(temp, sizeof(temp), "Error : port %u is already in use, exiting...", config->port);
+		log_msg(ui->logger, temp);
+		ui->status = FINISH;
+		kill(getpid(), SIGTERM);
+		return NULL;
+	}
+	for (int i = 0; i < config->listeners && !took_over; i++) {
+		acceptors[i].family = AF_INET;
+		acceptors[i].sock = tcp_listen(INADDR_ANY, port, config->backlog, TCP_LISTEN_REUSEPORT | TCP_LISTEN_DEFER);
+		if (acceptors[i].sock < 0 || (i == 0 && tcp_local_port(acceptors[i].sock, &port) != OK)) {
+			log_msg(ui->logger, "Error : failed to initialize server");
+			return NULL;
+		}
+		num_acceptors++;
+	}
+
+	/* Local clients skip the TCP stack, served by the same handlers */
+	if (config->uds_path != NULL && !took_over) {
+		acceptor_args_t * acceptor = &acceptors[num_acceptors];
+		acceptor->family = AF_UNIX;
+		if ((acceptor->sock = uds_listen(config->uds_path, config->backlog)) < 0) {
+			log_msg(ui->logger, "Error : failed to listen on the Unix domain socket");
+		} else {
+			snprintf(temp, sizeof(temp), "Listening on %.80s...", config->uds_path);
+			log_msg(ui->logger, temp);
+			num_acceptors++;
+		}
+	}
+
+	int num_listeners = 0;
+	for (int i = 0; i < num_acceptors; i++) {
+		acceptors[i].table = table;
+		acceptors[i].ui = ui;
+		acceptors[i].cpu = config->num_cpus > 0 && acceptors[i].family == AF_INET ? config->cpus[i % config->num_cpus] : ERR;
+		acceptors[i].pool = NULL;
+		acceptors[i].repair = repair;
+		acceptors[i].fed = fed;
+		acceptors[i].handoff = handoff;
+		if (admit_sock(&table->admit, acceptors[i].sock) != OK) {
+			log_msg(ui->logger, "Error : failed to set the connection buffer size");
+		}
+		num_listeners += acceptors[i].family == AF_INET;
+	}
+
 	/* Display socket info (IP & port) */
-	fetch_server_info(ui, sock);
+	fetch_server_info(ui, acceptors[0].sock);
+	snprintf(temp, sizeof(temp), "Listening on %s:%u with %d listener(s), backlog %d...",
+		ui->ip, ui->port, num_listeners, config->backlog);
+	log_msg(ui->logger, temp);
+
+	admit_t * admit = &table->admit;
+	snprintf(temp, sizeof(temp), "Limits (0 for none): %lu conns, %lu subs per topic, %lu MiB...",
+		admit->max_conns, admit->max_subs, admit->budget >> 20);
+	log_msg(ui->logger, temp);
+	if (table->workers != NULL) {
+		snprintf(temp, sizeof(temp), "Fan-out over %d worker(s) from %d subscribers...",
+			table->workers->num_threads, table->workers->threshold);
+		log_msg(ui->logger, temp);
+	}
+	if (table->actors != NULL) {
+		snprintf(temp, sizeof(temp), "Messages queued per topic, delivered by %d thread(s)...", table->actors->num_threads);
+		log_msg(ui->logger, temp);
+	}
+
+	/* Wait for the broker that replaces this one */
+	static handoff_args_t handoff_args;
+	if (handoff != NULL) {
+		handoff_args = (handoff_args_t) {
+			.table = table, .ui = ui, .fed = fed, .handoff = handoff,
+			.acceptors = acceptors, .num_acceptors = num_acceptors,
+		};
+		pthread_t h_thr;
+		if (handoff_listen(handoff) != OK || pthread_create(&h_thr, NULL, run_handoff, &handoff_args) || pthread_detach(h_thr)) {
+			log_msg(ui->logger, "Error : failed to listen for hot restart");
+		} else {
+			snprintf(temp, sizeof(temp), "Hot restart on %.70s...", config->handoff_path);
+			log_msg(ui->logger, temp);
+		}
+	}
+
+	/* One accept thread per listener, the first one runs on this thread */
+	for (int i = 1; i < num_acceptors; i++) {
+		pthread_t a_thr;
+		if (pthread_create(&a_thr, NULL, run_acceptor, &acceptors[i]) || pthread_detach(a_thr)) {
+			log_msg(ui->logger, "Error : failed to create accept thread");
+			close(acceptors[i].sock);
+		}
+	}
+
+	return run_acceptor(&acceptors[0]);
+}
+
+void * run_acceptor(void * args)
+{
+	acceptor_args_t * acceptor = args;
+	table_t * table = acceptor->table;
+	ui_t * ui = acceptor->ui;
+	int sock = acceptor->sock;
+
+	/* Pin before allocating so that the pool is on the local NUMA node */
+	if (acceptor->cpu != ERR && pin_acceptor(acceptor) != OK) {
+		char temp[64];
+		snprintf(temp, sizeof(temp), "Error : failed to pin accept thread to CPU %d", acceptor->cpu);
+		log_msg(ui->logger, temp);
+	}
+	if ((acceptor->pool = init_pool(sizeof(handler_args_t), POOL_OBJS)) == NULL) {
+		log_msg(ui->logger, "Error : failed to allocate accept thread pool");
+		return NULL;
+	}
 
 	/* Block to accept incoming connections */
 	for (;;) {
-		handler_args_t * hndlr_args = malloc(sizeof(handler_args_t));
+		/* Wait for a connection before taking it, so that one that comes */
+		/* while handing off stays queued for the next broker              */
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, -1) <= 0) {
+			continue;
+		}
+		if (handoff_enter(acceptor->handoff) != OK) {
+			usleep(SERVER_RETRY_MS * 1000);
+			continue;
+		}
+
+		handler_args_t * hndlr_args = pool_get(acceptor->pool);
 		if (hndlr_args == NULL) {
-			return NULL;
+			/* Out of memory for a moment, the backlog holds the connections */
+			handoff_leave(acceptor->handoff);
+			usleep(SERVER_RETRY_MS * 1000);
+			continue;
 		}
 		hndlr_args->table = table;
 		hndlr_args->ui = ui;
+		hndlr_args->pool = acceptor->pool;
+		hndlr_args->repair = acceptor->repair;
+		hndlr_args->fed = acceptor->fed;
+		hndlr_args->handoff = acceptor->handoff;
+
+		int ret;
+		if (acceptor->family == AF_UNIX) {
+			hndlr_args->ip = 0;
+			hndlr_args->port = 0;
+			ret = uds_accept(sock, &hndlr_args->csock);
+		} else {
+			ret = tcp_accept(sock, &hndlr_args->csock, &hndlr_args->ip, &hndlr_args->port);
+		}
+		if (ret != OK) {
+			pool_put(acceptor->pool, hndlr_args);
+			handoff_leave(acceptor->handoff);
 
-		if (tcp_accept(sock, &hndlr_args->csock, &hndlr_args->ip, &hndlr_args->port) != OK) {
-			log_tui(ui, "Error : failed to accept new connection");
+			/* The client gave up before being accepted, or out of file */
+			/* descriptors for a moment. Keep serving the others        */
+			if (errno == ECONNABORTED || errno == EINTR || errno == EMFILE || errno == ENFILE) {
+				continue;
+			}
+			log_msg(ui->logger, "Error : failed to accept new connection");
 			return NULL;
 		}
+		TRACE(accept, hndlr_args->csock, hndlr_args->port);
+
+		/* Past the limits, refuse before spending a thread on it. The */
+		/* answer fits in the empty send buffer, so it never blocks    */
+		if (admit_conn(&table->admit) != OK) {
+			send(hndlr_args->csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL), MSG_DONTWAIT);
+			close(hndlr_args->csock);
+			pool_put(acceptor->pool, hndlr_args);
+			handoff_leave(acceptor->handoff);
+			continue;
+		}
 
-		/* Spawn new thread to handle client */
+		/* Spawn new thread to handle client, refusing it if there are no */
+		/* threads to be had. The others are still served                 */
 		pthread_t h_thr;
 		if (pthread_create(&h_thr, NULL, handle, hndlr_args) || pthread_detach(h_thr)) {
-			log_tui(ui, "Error : failed to create handler thread");
-			close(hndlr_args->csock);
-			free(hndlr_args);
-			return NULL;
+			log_msg(ui->logger, "Error : failed to create handler thread");
+			__atomic_add_fetch(&table->admit.rejected, 1, __ATOMIC_RELAXED);
+			send(hndlr_args->csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL), MSG_DONTWAIT);
+			close_conn(table, hndlr_args->csock);
+			pool_put(acceptor->pool, hndlr_args);
+			handoff_leave(acceptor->handoff);
 		}
 	}
 
 	return NULL;
 }
 
+int pin_acceptor(acceptor_args_t * acceptor)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(acceptor->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		return ERR;
+	}
+
+	/* Best effort, the accept loop still works without steering */
+	tcp_incoming_cpu(acceptor->sock, acceptor->cpu);
+
+	/* Report where it ended up, the node is where the pool will be */
+	unsigned int cpu, node;
+	if (getcpu(&cpu, &node) == OK) {
+		char temp[64];
+		snprintf(temp, sizeof(temp), "Accept thread pinned to CPU %u (node %u)", cpu, node);
+		log_msg(acceptor->ui->logger, temp);
+	}
+
+	return OK;
+}
+
 void fetch_server_info(ui_t * ui, int sock)
 {
     struct ifaddrs * ifaddr;
@@ -72,9 +318,6 @@ void fetch_server_info(ui_t * ui, int sock)
 		return;
 	}
 	ui->port = ntohs(sin.sin_port);
-	if (sem_post(ui->update_sem) == ERR) {
-		return;
-	}
 }
 
 void * handle(void * args)
@@ -85,76 +328,123 @@ void * handle(void * args)
     uint16_t port = hndlr_args->port;
 	table_t * table = hndlr_args->table;
 	ui_t * ui = hndlr_args->ui;
+	repair_args_t * repair = hndlr_args->repair;
+	fed_t * fed = hndlr_args->fed;
+	handoff_t * handoff = hndlr_args->handoff;
 
-	/* Free after copying all the values to local */
-	free(args);
+	/* Give back after copying all the values to local */
+	pool_put(hndlr_args->pool, args);
+
+	/* Parse command and topic out of one buffer, the data of a publish */
+	/* is likely to come with them                                      */
+	conn_t conn;
+	conn.sock = csock;
+	conn.pos = 0;
+	conn.len = 0;
+	request_t req = { .state = PARSE_CMD };
+	int ret = read_request(&conn, &req);
+	TRACE(parse, csock, req.cmd);
+
+	/* A window comes before the publish or the session it is for */
+	acks_t acks;
+	init_acks(&acks, csock, ACK_CHUNK);
+	if (ret == OK && req.cmd == CMD_WINDOW) {
+		set_window(&acks, req.args);
+		ret = read_request(&conn, &req);
+		if (ret == OK && req.cmd != CMD_PUBLISH && req.cmd != CMD_ALIAS) {
+			ret = ERR;
+		}
+	}
+
+	/* So does a filter before the subscription it is for */
+	filter_t filter;
+	bool filtered = ret == OK && req.cmd == CMD_FILTER;
+	if (filtered) {
+		parse_filter(req.args, &filter);
+		ret = read_request(&conn, &req);
+		if (ret == OK && req.cmd != CMD_SUBSCRIBE && req.cmd != CMD_COMPRESS) {
+			ret = ERR;
+		}
+	}
 
-	/* Parse command and topic */
-	enum CMD cmd = parse_cmd(csock);
-	char topic[TABLE_TOPIC_LEN+1];
-	if (cmd == CMD_UNDEFINED || parse_topic(csock, topic) != OK) {
+	/* Another broker, the connection becomes the link */
+	if (ret == OK && req.cmd == CMD_LINK) {
+		link_broker(table, ui, fed, csock, proto_get64(req.args), ip, port);
+		handoff_leave(handoff);
+		return NULL;
+	}
+
+	const char * topic = req.topic;
+	size_t len = req.len;
+	if (ret != OK || req.cmd == CMD_SEND || check_topic(topic, len) != OK) {
 		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
-		close(csock);
+		close_conn(table, csock);
+		handoff_leave(handoff);
 		return NULL;
 	}
-	log_connection(ui, ip, port, cmd, topic);
+	log_connection(ui, ip, port, req.cmd, topic);
 
 	/* Handle command */
-	switch (cmd) {
+	switch (req.cmd) {
 		case CMD_SUBSCRIBE:
-			subscribe(table, topic, csock, ip, port);
+		case CMD_COMPRESS:
+			subscribe(table, topic, len, csock, ip, port, req.cmd == CMD_COMPRESS, filtered ? &filter : NULL);
 			break;
 		case CMD_UNSUBSCRIBE:
-			unsubscribe(table, topic, csock, ip, port);
+			unsubscribe(table, topic, len, csock, ip, port);
 			break;
 		case CMD_PUBLISH:
-			publish(table, topic, csock);
+			publish(table, fed, topic, len, &conn, &acks);
+			break;
+		case CMD_MAP:
+			map_topic(table, topic, len, csock, ip, port);
+			break;
+		case CMD_GROUP:
+			subscribe_group(table, repair, topic, len, csock, ip, port);
+			break;
+		case CMD_ALIAS:
+			publish_session(table, fed, handoff, topic, len, &conn, &acks);
+			break;
+		case CMD_TUNE:
+			tune_topic(table, topic, len, csock, req.args);
 			break;
 		default:
 			tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
-			close(csock);
+			close_conn(table, csock);
 			break;
 	}
 
-	/* Signal to update the UI */
-	sem_post(ui->update_sem);
-
 	/* Not closing connection as it is needed when sending to subs */
+	handoff_leave(handoff);
 	return NULL;
 }
 
-void log_connection(ui_t * ui, uint32_t ip, uint16_t port, enum CMD cmd, char * topic)
+void log_connection(ui_t * ui, uint32_t ip, uint16_t port, enum CMD cmd, const char * topic)
 {
-	/* Parse the four fields of the IP address */
-	unsigned int f4 = 0xff & ip;
-	ip = ip >> 8;
-	unsigned int f3 = 0xff & ip;
-	ip = ip >> 8;
-	unsigned int f2 = 0xff & ip;
-	ip = ip >> 8;
-	unsigned int f1 = 0xff & ip;
-
-	char temp[200];
-	if (cmd == CMD_SUBSCRIBE) {
-		sprintf(temp, "Subscribing %u.%u.%u.%u:%u to %s", f1, f2, f3, f4, port, topic);
+	/* Only a binary record is made here, the logger thread formats it */
+	if (cmd == CMD_SUBSCRIBE || cmd == CMD_COMPRESS) {
+		log_conn(ui->logger, LOG_SUBSCRIBE, ip, port, topic);
 	} else if (cmd == CMD_UNSUBSCRIBE) {
-		sprintf(temp, "Unsubscribing %u.%u.%u.%u:%u from %s", f1, f2, f3, f4, port, topic);
-	} else if (cmd == CMD_PUBLISH) {
-		sprintf(temp, "%u.%u.%u.%u:%u publishing to %s", f1, f2, f3, f4, port, topic);
-	} else {
-		return;
+		log_conn(ui->logger, LOG_UNSUBSCRIBE, ip, port, topic);
+	} else if (cmd == CMD_PUBLISH || cmd == CMD_ALIAS) {
+		log_conn(ui->logger, LOG_PUBLISH, ip, port, topic);
+	} else if (cmd == CMD_MAP) {
+		log_conn(ui->logger, LOG_MAP, ip, port, topic);
+	} else if (cmd == CMD_GROUP) {
+		log_conn(ui->logger, LOG_GROUP, ip, port, topic);
 	}
-	log_tui(ui, temp);
 }
 
-enum CMD parse_cmd(int csock)
+enum CMD parse_cmd(char buf, bool * named)
 {
-	/* Command is only 1 byte */
-	char buf;
-
-	/* If error or EOF, return undefined */
-	if (read(csock, &buf, P_CMD_LEN) <= 0) {
-		return CMD_UNDEFINED;
+	/* Lower-case client commands are followed by a length-prefixed topic */
+	*named = false;
+	if (buf == (P_CMD_SUBSCRIBE | P_CMD_NAMED) || buf == (P_CMD_UNSUBSCRIBE | P_CMD_NAMED) ||
+		buf == (P_CMD_PUBLISH | P_CMD_NAMED) || buf == (P_CMD_MAP | P_CMD_NAMED) ||
+		buf == (P_CMD_GROUP | P_CMD_NAMED) || buf == (P_CMD_ALIAS | P_CMD_NAMED) ||
+		buf == (P_CMD_COMPRESS | P_CMD_NAMED) || buf == (P_CMD_TUNE | P_CMD_NAMED)) {
+		*named = true;
+		buf &= ~P_CMD_NAMED;
 	}
 
 	if (buf == P_CMD_SUBSCRIBE) {
@@ -166,89 +456,193 @@ enum CMD parse_cmd(int csock)
 	if (buf == P_CMD_PUBLISH) {
 		return CMD_PUBLISH;
 	}
+	if (buf == P_CMD_MAP) {
+		return CMD_MAP;
+	}
+	if (buf == P_CMD_GROUP) {
+		return CMD_GROUP;
+	}
+	if (buf == P_CMD_LINK) {
+		return CMD_LINK;
+	}
+	if (buf == P_CMD_ALIAS) {
+		return CMD_ALIAS;
+	}
+	if (buf == P_CMD_COMPRESS) {
+		return CMD_COMPRESS;
+	}
+	if (buf == P_CMD_TUNE) {
+		return CMD_TUNE;
+	}
+	if (buf == P_CMD_SEND) {
+		return CMD_SEND;
+	}
+	if (buf == P_CMD_WINDOW) {
+		return CMD_WINDOW;
+	}
+	if (buf == P_CMD_FILTER) {
+		return CMD_FILTER;
+	}
 	return CMD_UNDEFINED;
 }
 
-int parse_topic(int csock, char * topic)
+int parse_request(conn_t * conn, request_t * req)
 {
-	/* Since TCP is byte-stream, there can be cases where it reads less than */
-	/* expected although it should read more. But, I think the size is small */
-	/* enough to ignore that for now. (famouse last words)                   */
-	char buf[P_TOPIC_LEN+1] = {0};
-	size_t ret;
-	if ((ret = read(csock, buf, P_TOPIC_LEN)) < 0) {
-		return ERR;
+	for (;;) {
+		/* Fields of known length are copied as far as the buffer goes */
+		if (req->state == PARSE_TOPIC || req->state == PARSE_ARGS) {
+			char * field = req->state == PARSE_TOPIC ? req->topic : req->args;
+			size_t n = MIN(req->need - req->got, conn->len - conn->pos);
+			memcpy(field + req->got, conn->buf + conn->pos, n);
+			req->got += n;
+			conn->pos += n;
+			if (req->got < req->need) {
+				return SERVER_MORE;
+			}
+
+			/* The value and mask of a filter follow its fixed fields */
+			if (req->cmd == CMD_FILTER && req->need == P_FILTER_LEN) {
+				int more = filter_args_len(req->args);
+				if (more == ERR) {
+					return ERR;
+				}
+				req->need += more;
+				continue;
+			}
+			if (req->state == PARSE_ARGS) {
+				req->state = PARSE_CMD;
+				return OK;
+			}
+
+			/* The padding of the fixed-size topic is not part of it */
+			req->len = req->need;
+			while (!req->named && req->len > 0 && req->topic[req->len - 1] == ' ') {
+				req->len--;
+			}
+			req->topic[req->len] = '\0';
+			req->state = PARSE_ARGS;
+			req->need = req->cmd == CMD_TUNE ? P_TUNE_LEN : 0;
+			req->got = 0;
+			continue;
+		}
+
+		if (conn->pos == conn->len) {
+			return SERVER_MORE;
+		}
+		uint8_t byte = conn->buf[conn->pos++];
+
+		/* A length byte, the topic follows */
+		if (req->state == PARSE_LEN) {
+			req->state = PARSE_TOPIC;
+			req->need = byte;
+			continue;
+		}
+
+		req->cmd = parse_cmd(byte, &req->named);
+		req->topic[0] = '\0';
+		req->len = 0;
+		req->got = 0;
+		if (req->cmd == CMD_UNDEFINED) {
+			return ERR;
+		}
+		if (req->cmd == CMD_LINK || req->cmd == CMD_SEND || req->cmd == CMD_WINDOW || req->cmd == CMD_FILTER) {
+			req->state = PARSE_ARGS;
+			req->need = req->cmd == CMD_LINK ? FED_ID_LEN : req->cmd == CMD_SEND ? P_SEND_LEN :
+				req->cmd == CMD_WINDOW ? P_WINDOW_LEN : P_FILTER_LEN;
+		} else if (req->named) {
+			req->state = PARSE_LEN;
+		} else {
+			req->state = PARSE_TOPIC;
+			req->need = P_TOPIC_LEN;
+		}
 	}
+}
 
-	/* Skipping non-alphanumerical in buffer */
-	int index = 0;
-	for (int i = 0; i < ret; i++) {
-		if ((buf[i] >= '0' && buf[i] <= '9') ||
-			(buf[i] >= 'a' && buf[i] <= 'z') ||
-			(buf[i] >= 'A' && buf[i] <= 'Z') ||
-			(buf[i] == ' '))
-		{
-			topic[index++] = buf[i];
+int read_request(conn_t * conn, request_t * req)
+{
+	int ret;
+	while ((ret = parse_request(conn, req)) == SERVER_MORE) {
+		if (conn_fill(conn) <= 0) {
+			return ERR;
 		}
 	}
+	return ret;
+}
 
-	/* Pad it with spaces */
-	while (index < P_TOPIC_LEN) {
-		topic[index] = ' ';
-		index++;
+ssize_t conn_fill(conn_t * conn)
+{
+	/* Keep the bytes not parsed yet, at the start so the most fits after */
+	if (conn->pos > 0) {
+		memmove(conn->buf, conn->buf + conn->pos, conn->len - conn->pos);
+		conn->len -= conn->pos;
+		conn->pos = 0;
 	}
-	topic[index] = '\0';
-	topic[P_TOPIC_LEN] = '\0';
 
-	return OK;
+	ssize_t ret = recv(conn->sock, conn->buf + conn->len, SERVER_RECV_BUF - conn->len, 0);
+	if (ret > 0) {
+		conn->len += ret;
+	}
+	return ret;
 }
 
-void subscribe(table_t * table, char * topic, int csock, uint32_t ip, uint16_t port)
+void subscribe(table_t * table, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port, bool compress,
+	const filter_t * filter)
 {
+	topic_t * temp = set_topic(table, topic, len);
 	subscriber_t * subscriber = malloc(sizeof(subscriber_t));
-	if (subscriber == NULL) {
+	int index = FILTER_NONE;
+	if (temp == NULL || subscriber == NULL || (filter != NULL && (index = set_filter(table, temp, filter)) == ERR)) {
+		free(subscriber);
 		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
-		close(csock);
+		close_conn(table, csock);
 		return;
 	}
 	subscriber->csock = csock;
 	subscriber->ip = ip;
 	subscriber->port = port;
+	subscriber->mcast = false;
+	subscriber->compress = compress;
+	subscriber->filter = index;
 
 	/* Set a timeout used for checking if the client is alive */
 	struct timeval wait_time = { SERVER_WAIT_SEC, SERVER_WAIT_USEC };
 	if (setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &wait_time, sizeof(wait_time)) == -1) {
 		free(subscriber);
-		close(csock);
+		close_conn(table, csock);
 		return;
 	}
 
+	/* Writes are sized here already (held back, blocks), and the end of a */
+	/* message must not wait for the ack of its last frame                 */
+	int opt = 1;
+	setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
 	/* Insert to the table */
-	int ret = insert_sub(table, topic, subscriber);
+	int ret = insert_sub(table, temp->id, subscriber);
 
 	/* Adding to table returns a positive value if it already exists */
 	if (ret > 0) {
 
-		/* Free the duplicate */
+		/* Free the duplicate, its filter and compression went to the existing one */
 		free(subscriber);
 		subscriber = NULL;
 
 	} else if (ret == ERR) {
 		/* On ERR, something went wrong with the table */
 		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
-		close(csock);
+		close_conn(table, csock);
 		return;
 	}
 
 	/* On successfully adding new subscriber, send confirmation */
 	if (tcp_write(csock, SERVER_MSG_OK, strlen(SERVER_MSG_OK)) != OK) {
 		/* If unable to send confirmation, revert since client doesn't know */
-		close(csock);
-		remove_sub(table, topic, *subscriber);
+		subscriber_t temp_sub = { .csock = csock, .ip = ip, .port = port };
+		drop_sub(table, temp->id, temp_sub);
 	}
 }
 
-void unsubscribe(table_t * table, char * topic, int csock, uint32_t ip, uint16_t port)
+void unsubscribe(table_t * table, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port)
 {
 	subscriber_t temp = {
 		.next = NULL,
@@ -258,103 +652,1604 @@ void unsubscribe(table_t * table, char * topic, int csock, uint32_t ip, uint16_t
 		.port = port,
 	};
 
-	remove_sub(table, topic, temp);
+	topic_t * entry = get_topic(table, topic, len);
+	if (entry != NULL) {
+		remove_sub(table, entry->id, temp);
+	}
 
 	/* Regardless whether it exists in the table or not, send OK */
 	tcp_write(csock, SERVER_MSG_OK, strlen(SERVER_MSG_OK));
-	close(csock);
+	close_conn(table, csock);
 }
 
-void publish(table_t * table, char * topic, int csock)
+void publish(table_t * table, fed_t * fed, const char * topic, size_t len, conn_t * conn, acks_t * acks)
 {	
-	/* Get the list of subscribers to send the message to */
-	topic_t * temp = get_topic(table, topic);
+	/* Get the list of subscribers to send the message to. Without any, */
+	/* the message is done before its data is read                      */
+	int csock = conn->sock;
+	topic_t * temp = get_topic(table, topic, len);
 	if (temp == NULL) {
-		tcp_write(csock, SERVER_MSG_OK, strlen(SERVER_MSG_OK));
-		close(csock);
+		if (acks->mode == ACK_WINDOW) {
+			count_acks(acks, 0, true);
+			send_acks(acks, true);
+		} else {
+			tcp_write(csock, SERVER_MSG_OK, strlen(SERVER_MSG_OK));
+		}
+		close_conn(table, csock);
 		return;
 	}
 
-	/* Send a heartbeat to the subscribers to remove dead connections */
-	subscriber_t * subscribers = temp->subscriber;
-	while (subscribers != NULL) {
-		if (heartbeat(subscribers->csock) != OK) {
-			subscribers = subscribers->next;
-			remove_sub(table, topic, *(subscribers->prev));
-		} else {
-			subscribers = subscribers->next;
+	/* With delivery threads, the publisher is done once it is queued */
+	if (table->actors != NULL) {
+		int ret = queue_message(table, fed, temp, conn, SIZE_MAX, acks);
+		if (ret == OK) {
+			count_acks(acks, 0, true);
 		}
+		send_acks(acks, true);
+		if (ret != OK) {
+			tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		}
+		close_conn(table, csock);
+		return;
 	}
 
-	/* Read from the publisher */
-	char buf[SERVER_PF_DATA+1] = {0};
-	size_t ret;
-	while ((ret = read(csock, buf, SERVER_PF_DATA)) > 0) {
+	fanout_t fanout;
+	if (start_fanout(table, fed, temp, &fanout) != OK) {
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
 
-		/* Pass on the message to the subscribers  */
-		subscribers = temp->subscriber;
-		while (subscribers != NULL) {
-			/* If error during write, remove the unsubscribe */
-			if (propagate(subscribers->csock, buf, ret) != OK) {
-				subscribers = subscribers->next;
-				remove_sub(table, topic, *(subscribers->prev));
-			} else {
-				subscribers = subscribers->next;
+	/* Deliver from the buffer in blocks, confirming each once it is sent */
+	__atomic_add_fetch(&temp->msgs, 1, __ATOMIC_RELAXED);
+	fanout.acks = acks;
+	ssize_t ret = 1;
+	for (;;) {
+		if (conn->pos == conn->len) {
+			wait_output(table, &fanout, csock);
+			if ((ret = conn_fill(conn)) <= 0) {
+				break;
 			}
 		}
-
-		/* Send confirmation for each block sent */
-		tcp_write(csock, SERVER_MSG_OK, strlen(SERVER_MSG_OK));
+		size_t n = MIN(conn->len - conn->pos, SERVER_PF_DATA);
+		__atomic_add_fetch(&temp->bytes, n, __ATOMIC_RELAXED);
+		send_fanout(table, &fanout, conn->buf + conn->pos, n);
+		conn->pos += n;
 	}
 
 	/* If end of publish, send the terminating message */
 	if (ret == 0) {
-		subscribers = temp->subscriber;
-		while (subscribers != NULL) {
-			/* If error during write, remove the unsubscribe */
-			if (propagate(subscribers->csock, SERVER_MSG_END, strlen(SERVER_MSG_END)) != OK) {
-				subscribers = subscribers->next;
-				remove_sub(table, topic, *(subscribers->prev));
-			} else {
-				subscribers = subscribers->next;
+		end_fanout(table, &fanout);
+		count_acks(acks, 0, true);
+		send_acks(acks, true);
+	}
+
+	/* Cleanup */
+	TRACE(publish_done, csock, fanout.num_subs);
+	finish_fanout(table, &fanout);
+	close_conn(table, csock);
+}
+
+void publish_session(table_t * table, fed_t * fed, handoff_t * handoff, const char * topic, size_t len, conn_t * conn, acks_t * acks)
+{
+	int csock = conn->sock;
+	if (admit_mem(&table->admit, SERVER_MAX_ALIASES * sizeof(alias_t)) != OK) {
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+	alias_t * aliases = calloc(SERVER_MAX_ALIASES, sizeof(alias_t));
+	int num_aliases = 0;
+	char resp[1 + P_ALIAS_LEN];
+	int alias;
+	if (aliases == NULL || (alias = add_alias(table, aliases, &num_aliases, topic, len)) == ERR) {
+		free(aliases);
+		release_mem(&table->admit, SERVER_MAX_ALIASES * sizeof(alias_t));
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+	resp[0] = SERVER_MSG_OK[0];
+	resp[1] = (alias >> 8) & 0xFF;
+	resp[2] = alias & 0xFF;
+
+	/* Small frames back and forth, do not wait on Nagle */
+	int opt = 1;
+	setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	/* Messages are acknowledged whole, unless by window */
+	if (acks->mode == ACK_CHUNK) {
+		acks->mode = ACK_MESSAGE;
+	}
+	request_t req = { .state = PARSE_CMD };
+	int ret = tcp_write(csock, resp, sizeof(resp));
+	while (ret == OK) {
+		/* Acks wait while more requests are already received */
+		if (conn->pos == conn->len) {
+			send_acks(acks, false);
+		}
+		/* Only waiting between requests ends the session for a handoff */
+		int parsed;
+		while ((parsed = parse_request(conn, &req)) == SERVER_MORE &&
+			(req.state != PARSE_CMD || wait_request(handoff, csock) == OK) && conn_fill(conn) > 0) {
+		}
+		if (parsed == ERR) {
+			tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+			break;
+		}
+		if (parsed != OK) {
+			send_acks(acks, true);
+			break;
+		}
+
+		/* The steady state: Q | Alias (2) | Length (2) | Data */
+		if (req.cmd == CMD_SEND) {
+			alias = ((uint8_t) req.args[0] << 8) | (uint8_t) req.args[1];
+			size_t size = ((uint8_t) req.args[2] << 8) | (uint8_t) req.args[3];
+			if (alias >= num_aliases) {
+				send_acks(acks, true);
+				tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+				break;
+			}
+			if (send_alias(table, fed, &aliases[alias], conn, size) != OK) {
+				break;
+			}
+			count_acks(acks, size, true);
+			continue;
+		}
+
+		/* Another topic for the session, the stream is in sync even if invalid */
+		send_acks(acks, true);
+		if (req.cmd == CMD_WINDOW) {
+			set_window(acks, req.args);
+			continue;
+		}
+		if (req.cmd == CMD_ALIAS) {
+			if (check_topic(req.topic, req.len) != OK ||
+				(alias = add_alias(table, aliases, &num_aliases, req.topic, req.len)) == ERR) {
+				ret = tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+				continue;
 			}
+			resp[1] = (alias >> 8) & 0xFF;
+			resp[2] = alias & 0xFF;
+			ret = tcp_write(csock, resp, sizeof(resp));
+			continue;
 		}
+
+		/* Any other command ends the session */
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		break;
 	}
 
-	/* Cleanup */
+	for (int i = 0; i < num_aliases; i++) {
+		free(aliases[i].subs);
+	}
+	free(aliases);
+	release_mem(&table->admit, SERVER_MAX_ALIASES * sizeof(alias_t));
+	close_conn(table, csock);
+}
+
+int add_alias(table_t * table, alias_t * aliases, int * num_aliases, const char * topic, size_t len)
+{
+	topic_t * entry = set_topic(table, topic, len);
+	if (entry == NULL) {
+		return ERR;
+	}
+
+	/* Topics are never freed, so the pointer identifies the topic */
+	for (int i = 0; i < *num_aliases; i++) {
+		if (aliases[i].topic == entry) {
+			return i;
+		}
+	}
+	if (*num_aliases >= SERVER_MAX_ALIASES) {
+		return ERR;
+	}
+
+	aliases[*num_aliases] = (alias_t) { .topic = entry };
+	return (*num_aliases)++;
+}
+
+int send_alias(table_t * table, fed_t * fed, alias_t * alias, conn_t * conn, size_t len)
+{
+	if (table->actors != NULL) {
+		return queue_message(table, fed, alias->topic, conn, len, NULL);
+	}
+
+	/* Copy the subscribers again only if something changed since the last */
+	/* copy. The version is read first so that a change during the copy is */
+	/* noticed next time                                                    */
+	uint64_t version = __atomic_load_n(&table->version, __ATOMIC_ACQUIRE);
+	if (alias->subs == NULL || alias->version != version) {
+		free(alias->subs);
+		alias->num_subs = get_subs(table, alias->topic, &alias->subs);
+		if (alias->num_subs == ERR) {
+			alias->subs = NULL;
+			return ERR;
+		}
+		alias->version = version;
+	}
+
+	/* Dropped subscribers are marked in the copy and change the version. */
+	/* Filters leave subscribers out of one message only, so they get a   */
+	/* copy of their own                                                  */
+	fanout_t fanout = { .topic = alias->topic, .subs = alias->subs, .num_subs = alias->num_subs };
+	if (__atomic_load_n(&alias->topic->filters, __ATOMIC_ACQUIRE) != NULL) {
+		fanout.subs = malloc(sizeof(subscriber_t) * (alias->num_subs + 1));
+		if (fanout.subs == NULL) {
+			return ERR;
+		}
+		memcpy(fanout.subs, alias->subs, sizeof(subscriber_t) * alias->num_subs);
+	}
+	begin_fanout(table, fed, &fanout);
+
+	__atomic_add_fetch(&alias->topic->msgs, 1, __ATOMIC_RELAXED);
+	int ret = OK;
+	while (len > 0) {
+		if (conn->pos == conn->len) {
+			wait_output(table, &fanout, conn->sock);
+			if (conn_fill(conn) <= 0) {
+				ret = ERR;
+				break;
+			}
+		}
+		size_t n = MIN(MIN(len, SERVER_PF_DATA), conn->len - conn->pos);
+		__atomic_add_fetch(&alias->topic->bytes, n, __ATOMIC_RELAXED);
+		send_fanout(table, &fanout, conn->buf + conn->pos, n);
+		conn->pos += n;
+		len -= n;
+	}
+	if (ret == OK) {
+		end_fanout(table, &fanout);
+		TRACE(publish_done, conn->sock, fanout.num_subs);
+	}
+
+	/* The copy of the subscribers stays with the alias */
+	if (fanout.subs == alias->subs) {
+		fanout.subs = NULL;
+	}
+	finish_fanout(table, &fanout);
+	return ret;
+}
+
+int queue_message(table_t * table, fed_t * fed, topic_t * topic, conn_t * conn, size_t len, acks_t * acks)
+{
+	queue_msg_t * msg = open_msg(table, fed, topic);
+	if (msg == NULL) {
+		return ERR;
+	}
+	__atomic_add_fetch(&topic->msgs, 1, __ATOMIC_RELAXED);
+
+	/* Whatever was received is queued at once, so the publisher only */
+	/* waits for the subscribers once SERVER_QUEUE_MAX bytes are ahead */
+	int ret = OK;
+	while (len > 0) {
+		if (conn->pos == conn->len) {
+			send_acks(acks, false);
+			ssize_t got = conn_fill(conn);
+			if (got <= 0) {
+				ret = got == 0 && len == SIZE_MAX ? OK : ERR;
+				break;
+			}
+		}
+		size_t n = MIN(len, conn->len - conn->pos);
+		if (append_msg(table, msg, conn->buf + conn->pos, n, true) != OK) {
+			ret = ERR;
+			break;
+		}
+		__atomic_add_fetch(&topic->bytes, n, __ATOMIC_RELAXED);
+		count_acks(acks, n, false);
+		conn->pos += n;
+		len -= len != SIZE_MAX ? n : 0;
+	}
+
+	close_msg(table, msg, ret == OK);
+	return ret;
+}
+
+topic_queue_t * get_queue(table_t * table, topic_t * topic)
+{
+	topic_queue_t * queue = __atomic_load_n(&topic->queue, __ATOMIC_ACQUIRE);
+	if (queue != NULL) {
+		return queue;
+	}
+
+	queue = calloc(1, sizeof(topic_queue_t));
+	if (queue == NULL) {
+		return NULL;
+	}
+	queue->table = table;
+	queue->topic = topic;
+	queue->lock = malloc(sizeof(pthread_mutex_t));
+	queue->room = malloc(sizeof(pthread_cond_t));
+	if (queue->lock == NULL || queue->room == NULL || pthread_mutex_init(queue->lock, NULL)) {
+		free(queue->lock);
+		free(queue->room);
+		free(queue);
+		return NULL;
+	}
+	if (pthread_cond_init(queue->room, NULL)) {
+		pthread_mutex_destroy(queue->lock);
+		free(queue->lock);
+		free(queue->room);
+		free(queue);
+		return NULL;
+	}
+
+	/* Another publisher may have created it meanwhile, the first one stays */
+	topic_queue_t * other = NULL;
+	if (!__atomic_compare_exchange_n(&topic->queue, &other, queue, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_cond_destroy(queue->room);
+		pthread_mutex_destroy(queue->lock);
+		free(queue->lock);
+		free(queue->room);
+		free(queue);
+		return other;
+	}
+
+	return queue;
+}
+
+queue_msg_t * open_msg(table_t * table, fed_t * fed, topic_t * topic)
+{
+	topic_queue_t * queue = get_queue(table, topic);
+	queue_msg_t * msg = queue != NULL ? calloc(1, sizeof(queue_msg_t)) : NULL;
+	if (msg == NULL) {
+		return NULL;
+	}
+	msg->queue = queue;
+	msg->fed = fed;
+
+	/* Scheduled right away, so that the heartbeats go out while the data */
+	/* comes in if it is the first                                        */
+	pthread_mutex_lock(queue->lock);
+	if (queue->tail != NULL) {
+		queue->tail->next = msg;
+	} else {
+		queue->head = msg;
+	}
+	queue->tail = msg;
+	bool submit = schedule_queue(queue);
+	pthread_mutex_unlock(queue->lock);
+	if (submit) {
+		submit_work(table->actors, run_queue, queue, NULL);
+	}
+
+	return msg;
+}
+
+int append_msg(table_t * table, queue_msg_t * msg, const char * buf, size_t len, bool wait)
+{
+	topic_queue_t * queue = msg->queue;
+	if (admit_mem(&table->admit, sizeof(queue_chunk_t) + len) != OK) {
+		return ERR;
+	}
+	queue_chunk_t * chunk = malloc(sizeof(queue_chunk_t) + len);
+	if (chunk == NULL) {
+		release_mem(&table->admit, sizeof(queue_chunk_t) + len);
+		return ERR;
+	}
+	chunk->next = NULL;
+	chunk->len = len;
+	memcpy(chunk->data, buf, len);
+
+	/* The message being delivered never waits, as the ones behind it */
+	/* cannot make room before it is done                              */
+	pthread_mutex_lock(queue->lock);
+	while (wait && queue->bytes >= SERVER_QUEUE_MAX && queue->head != msg) {
+		pthread_cond_wait(queue->room, queue->lock);
+	}
+	if (msg->tail != NULL) {
+		msg->tail->next = chunk;
+	} else {
+		msg->head = chunk;
+	}
+	msg->tail = chunk;
+	queue->bytes += len;
+	__atomic_add_fetch(&queue->topic->backlog, len, __ATOMIC_RELAXED);
+	bool submit = schedule_queue(queue);
+	pthread_mutex_unlock(queue->lock);
+	if (submit) {
+		submit_work(table->actors, run_queue, queue, NULL);
+	}
+
+	return OK;
+}
+
+void close_msg(table_t * table, queue_msg_t * msg, bool ended)
+{
+	topic_queue_t * queue = msg->queue;
+	pthread_mutex_lock(queue->lock);
+	msg->closed = true;
+	msg->ended = ended;
+	bool submit = schedule_queue(queue);
+	pthread_mutex_unlock(queue->lock);
+	if (submit) {
+		submit_work(table->actors, run_queue, queue, NULL);
+	}
+}
+
+bool schedule_queue(topic_queue_t * queue)
+{
+	if (queue->scheduled) {
+		return false;
+	}
+
+	queue->scheduled = true;
+	return true;
+}
+
+void run_queue(void * arg)
+{
+	topic_queue_t * queue = (topic_queue_t *) arg;
+	table_t * table = queue->table;
+	for (int turn = 0; ; turn++) {
+		/* Give the other topics a turn, unless every thread is behind */
+		if (turn > 0 && turn % SERVER_QUEUE_TURN == 0 && queue_work(table->actors, run_queue, queue, NULL) == OK) {
+			return;
+		}
+
+		/* Done once the message being delivered waits for its publisher */
+		/* and nothing of it is held back past its deadline, which the    */
+		/* actor is then woken at                                          */
+		pthread_mutex_lock(queue->lock);
+		queue_msg_t * msg = queue->head;
+		queue_chunk_t * chunk = msg != NULL ? msg->head : NULL;
+		bool held = msg != NULL && msg->started && msg->fanout.olen > 0;
+		if (msg == NULL || (chunk == NULL && !msg->closed && msg->started &&
+			(!held || now_usec() < msg->fanout.deadline))) {
+			uint64_t deadline = held ? msg->fanout.deadline : 0;
+			bool wake = held && (queue->wake == 0 || deadline < queue->wake);
+			if (wake && queue_work_at(table->actors, wake_queue, queue, deadline) == OK) {
+				queue->wake = deadline;
+			} else if (wake) {
+				/* Without a timer, it is sent right away */
+				pthread_mutex_unlock(queue->lock);
+				flush_output(table, &msg->fanout, false);
+				continue;
+			}
+			queue->scheduled = false;
+			pthread_mutex_unlock(queue->lock);
+			return;
+		}
+		if (chunk != NULL) {
+			msg->head = chunk->next;
+			msg->tail = msg->head != NULL ? msg->tail : NULL;
+		}
+		bool closed = msg->closed;
+		pthread_mutex_unlock(queue->lock);
+
+		/* The subscribers are those of the topic once the message is first. */
+		/* Without memory to copy them, it is only dropped                   */
+		if (!msg->started) {
+			msg->started = true;
+			if (start_fanout(table, msg->fed, queue->topic, &msg->fanout) != OK) {
+				memset(&msg->fanout, 0, sizeof(fanout_t));
+				msg->fanout.topic = queue->topic;
+				msg->fanout.acks = NULL;
+			}
+		}
+
+		if (chunk != NULL) {
+			for (size_t pos = 0; pos < chunk->len; pos += SERVER_PF_DATA) {
+				send_fanout(table, &msg->fanout, chunk->data + pos, MIN(chunk->len - pos, SERVER_PF_DATA));
+			}
+			release_mem(&table->admit, sizeof(queue_chunk_t) + chunk->len);
+			pthread_mutex_lock(queue->lock);
+			queue->bytes -= chunk->len;
+			__atomic_sub_fetch(&queue->topic->backlog, chunk->len, __ATOMIC_RELAXED);
+			pthread_cond_broadcast(queue->room);
+			pthread_mutex_unlock(queue->lock);
+			free(chunk);
+			continue;
+		}
+
+		/* The deadline of the frames held back has passed */
+		if (!closed) {
+			flush_output(table, &msg->fanout, false);
+			continue;
+		}
+
+		if (msg->ended) {
+			end_fanout(table, &msg->fanout);
+			TRACE(publish_done, queue->topic->id, msg->fanout.num_subs);
+		}
+		finish_fanout(table, &msg->fanout);
+		pthread_mutex_lock(queue->lock);
+		queue->head = msg->next;
+		queue->tail = queue->head != NULL ? queue->tail : NULL;
+		pthread_cond_broadcast(queue->room);
+		pthread_mutex_unlock(queue->lock);
+		free(msg);
+	}
+}
+
+void wake_queue(void * arg)
+{
+	topic_queue_t * queue = (topic_queue_t *) arg;
+	pthread_mutex_lock(queue->lock);
+	queue->wake = 0;
+	bool run = schedule_queue(queue);
+	pthread_mutex_unlock(queue->lock);
+	if (run) {
+		run_queue(queue);
+	}
+}
+
+int start_fanout(table_t * table, fed_t * fed, topic_t * topic, fanout_t * fanout)
+{
+	/* Work on a copy since other threads may remove (free) subscribers */
+	fanout->topic = topic;
+	fanout->num_subs = get_subs(table, topic, &fanout->subs);
+	if (fanout->num_subs == ERR) {
+		return ERR;
+	}
+
+	begin_fanout(table, fed, fanout);
+	return OK;
+}
+
+void begin_fanout(table_t * table, fed_t * fed, fanout_t * fanout)
+{
+	topic_t * topic = fanout->topic;
+
+	/* Many subscribers are split in ranges written to by the workers */
+	fanout->workers = table->workers;
+	fanout->jobs = NULL;
+	fanout->num_jobs = 0;
+	if (fanout->workers != NULL && fanout->num_subs >= fanout->workers->threshold) {
+		int ranges = (fanout->num_subs + SERVER_FAN_MIN - 1) / SERVER_FAN_MIN;
+		fanout->num_jobs = MIN(fanout->workers->num_threads * SERVER_FAN_SLICES, ranges);
+		fanout->jobs = malloc(sizeof(fan_job_t) * fanout->num_jobs);
+		if (fanout->jobs != NULL && init_batch(&fanout->batch) != OK) {
+			free(fanout->jobs);
+			fanout->jobs = NULL;
+		}
+	}
+
+	/* Send a heartbeat to the subscribers to remove dead connections. */
+	/* Multicast subscribers are watched by the repair thread instead.  */
+	/* Those with a filter only get it if the message is for them, once */
+	/* the head of the message is in, the others right away             */
+	bool filtered = false;
+	for (int i = 0; i < fanout->num_subs; i++) {
+		filtered |= fanout->subs[i].csock != ERR && fanout->subs[i].filter != FILTER_NONE;
+	}
+	fanout->filters = __atomic_load_n(&topic->filters, __ATOMIC_ACQUIRE);
+	fanout->hlen = 0;
+	fanout->hneed = filtered && fanout->filters != NULL ? __atomic_load_n(&fanout->filters->max_need, __ATOMIC_RELAXED) : 0;
+	fanout->to = fanout->hneed > 0 ? SUBS_UNFILTERED : SUBS_ALL;
+	deliver(table, fanout, FAN_HEARTBEAT, NULL, 0, 0);
+	bool compress = false;
+	for (int i = 0; i < fanout->num_subs; i++) {
+		compress |= fanout->subs[i].csock != ERR && fanout->subs[i].compress;
+	}
+
+	/* The message is compressed once per block for all that accept it. If */
+	/* there is no memory (or budget) for the block, they get plain frames  */
+	/* like others                                                          */
+	fanout->charged = 0;
+	fanout->zbuf = NULL;
+	fanout->zlen = 0;
+	if (compress && admit_mem(&table->admit, SERVER_Z_BLOCK) == OK) {
+		fanout->charged += SERVER_Z_BLOCK;
+		fanout->zbuf = malloc(SERVER_Z_BLOCK);
+	}
+
+	/* The others get the same frames, held back in one buffer. Without */
+	/* memory (or budget) for it, each chunk is sent as it comes        */
+	bool plain = false;
+	for (int i = 0; i < fanout->num_subs; i++) {
+		plain |= fanout->subs[i].csock != ERR && !(fanout->subs[i].compress && fanout->zbuf != NULL);
+	}
+	fanout->flush_bytes = __atomic_load_n(&topic->flush_bytes, __ATOMIC_RELAXED);
+	fanout->flush_usec = __atomic_load_n(&topic->flush_usec, __ATOMIC_RELAXED);
+	size_t size = fanout->flush_bytes + SERVER_PF_SIZE + SERVER_PF_DATA;
+	fanout->obuf = NULL;
+	if (plain && fanout->flush_bytes > 0 && admit_mem(&table->admit, size) == OK) {
+		fanout->charged += size;
+		fanout->obuf = malloc(size);
+	}
+	fanout->olen = 0;
+	fanout->deadline = 0;
+	fanout->acks = NULL;
+
+	/* Local readers get each chunk once, however many there are */
+	fanout->ring = __atomic_load_n(&topic->shm, __ATOMIC_ACQUIRE);
+	fanout->group = __atomic_load_n(&topic->mcast, __ATOMIC_ACQUIRE);
+
+	/* So do the linked brokers that want the topic */
+	fanout->fed = fed;
+	fanout->peers = fed != NULL ? __atomic_load_n(&topic->peers, __ATOMIC_ACQUIRE) : 0;
+	if (fanout->peers != 0) {
+		fanout->msg = fed_begin(fed, fanout->peers, topic->str, topic->len);
+	}
+}
+
+void send_fanout(table_t * table, fanout_t * fanout, char * buf, size_t len)
+{
+	if (fanout->ring != NULL) {
+		shm_write(fanout->ring, buf, len, 0);
+	}
+	if (fanout->group != NULL) {
+		mcast_send(fanout->group, buf, len, 0);
+	}
+	if (fanout->peers != 0) {
+		fed_data(fanout->fed, fanout->peers, fanout->msg, buf, len);
+	}
+
+	/* The subscribers with a filter wait for the head of the message */
+	if (fanout->hneed > 0) {
+		size_t sent = fanout->hlen;
+		size_t n = MIN(len, fanout->hneed - fanout->hlen);
+		memcpy(fanout->head + fanout->hlen, buf, n);
+		fanout->hlen += n;
+		if (fanout->hlen == fanout->hneed) {
+			filter_fanout(table, fanout, sent);
+		}
+	}
+	send_subs(table, fanout, buf, len);
+
+	/* Chunks are acknowledged once nothing of them is held back */
+	count_acks(fanout->acks, len, false);
+	if (fanout->olen == 0 && fanout->hneed == 0) {
+		send_acks(fanout->acks, false);
+	}
+
+	/* The others get the message in blocks, each sent once it is full */
+	while (fanout->zbuf != NULL && len > 0) {
+		size_t n = MIN(len, SERVER_Z_BLOCK - fanout->zlen);
+		memcpy(fanout->zbuf + fanout->zlen, buf, n);
+		fanout->zlen += n;
+		buf += n;
+		len -= n;
+		if (fanout->zlen == SERVER_Z_BLOCK) {
+			flush_fanout(table, fanout);
+		}
+	}
+}
+
+void filter_fanout(table_t * table, fanout_t * fanout, size_t sent)
+{
+	bool pass[FILTER_MAX];
+	int num = eval_filters(fanout->filters, fanout->head, fanout->hlen, pass);
+
+	/* Left out of the copy for this message only, like the dropped ones */
+	uint64_t filtered = 0;
+	for (int i = 0; i < fanout->num_subs; i++) {
+		subscriber_t * sub = &fanout->subs[i];
+		if (sub->csock != ERR && !sub->mcast && sub->filter < num && !pass[sub->filter]) {
+			sub->csock = ERR;
+			filtered++;
+		}
+	}
+	__atomic_add_fetch(&fanout->topic->filtered, filtered, __ATOMIC_RELAXED);
+
+	/* The frames held back for the others go first, then the rest catch */
+	/* up with them, and from there on all get the same frames           */
+	flush_output(table, fanout, true);
+	fanout->to = SUBS_FILTERED;
+	deliver(table, fanout, FAN_HEARTBEAT, NULL, 0, 0);
+	if (sent > 0) {
+		send_subs(table, fanout, fanout->head, sent);
+		flush_output(table, fanout, true);
+	}
+	fanout->to = SUBS_ALL;
+	fanout->hneed = 0;
+}
+
+void send_subs(table_t * table, fanout_t * fanout, char * buf, size_t len)
+{
+	/* Hold back the frame, sending the ones before if it does not fit */
+	if (fanout->obuf != NULL) {
+		if (fanout->olen + SERVER_PF_SIZE + len > fanout->flush_bytes) {
+			flush_output(table, fanout, true);
+		}
+		if (fanout->olen == 0) {
+			fanout->deadline = now_usec() + fanout->flush_usec;
+		}
+		fanout->obuf[fanout->olen++] = (len >> 8) & 0xFF;
+		fanout->obuf[fanout->olen++] = len & 0xFF;
+		memcpy(fanout->obuf + fanout->olen, buf, len);
+		fanout->olen += len;
+	}
+
+	/* Pass on the message to the subscribers  */
+	if (fanout->obuf == NULL) {
+		deliver(table, fanout, FAN_CHUNK, buf, len, 0);
+	}
+}
+
+void flush_fanout(table_t * table, fanout_t * fanout)
+{
+	if (fanout->zbuf == NULL || fanout->zlen == 0) {
+		return;
+	}
+
+	/* Fall back to the plain block if it does not shrink */
+	char frame[SERVER_PF_SIZE + SERVER_Z_BLOCK];
+	int len = lz_compress(fanout->zbuf, fanout->zlen, frame + SERVER_PF_SIZE, fanout->zlen);
+	uint16_t size = len | SERVER_Z_FLAG;
+	if (len == ERR) {
+		len = fanout->zlen;
+		size = len;
+		memcpy(frame + SERVER_PF_SIZE, fanout->zbuf, len);
+	}
+	frame[0] = (size >> 8) & 0xFF;
+	frame[1] = size & 0xFF;
+	__atomic_add_fetch(&fanout->topic->comp_in, fanout->zlen, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&fanout->topic->comp_out, len, __ATOMIC_RELAXED);
+	fanout->zlen = 0;
+
+	deliver(table, fanout, FAN_FRAME, frame, SERVER_PF_SIZE + len, 0);
+}
+
+void flush_output(table_t * table, fanout_t * fanout, bool more)
+{
+	if (fanout->olen > 0) {
+		deliver(table, fanout, FAN_OUTPUT, fanout->obuf, fanout->olen, more ? MSG_MORE : 0);
+	}
+	fanout->olen = 0;
+	fanout->deadline = 0;
+
+	/* Not while the subscribers with a filter are still waiting */
+	if (fanout->hneed == 0) {
+		send_acks(fanout->acks, false);
+	}
+}
+
+void init_acks(acks_t * acks, int sock, enum ACK mode)
+{
+	memset(acks, 0, sizeof(acks_t));
+	acks->sock = sock;
+	acks->mode = mode;
+}
+
+void set_window(acks_t * acks, const char * args)
+{
+	acks->mode = ACK_WINDOW;
+	acks->win_bytes = proto_get32(args);
+	acks->win_msgs = proto_get32(args + 4);
+	if (acks->win_bytes == 0 && acks->win_msgs == 0) {
+		acks->win_msgs = 1;
+	}
+}
+
+void count_acks(acks_t * acks, size_t len, bool end)
+{
+	if (acks == NULL) {
+		return;
+	}
+
+	if (acks->mode == ACK_CHUNK) {
+		acks->pending += (len + SERVER_PF_DATA - 1) / SERVER_PF_DATA;
+	} else if (acks->mode == ACK_MESSAGE) {
+		acks->pending += end;
+	}
+	acks->bytes += len;
+	acks->msgs += end;
+}
+
+void send_acks(acks_t * acks, bool all)
+{
+	if (acks == NULL) {
+		return;
+	}
+
+	/* One K covers everything confirmed so far */
+	if (acks->mode == ACK_WINDOW) {
+		uint64_t bytes = acks->bytes - acks->acked_bytes;
+		uint64_t msgs = acks->msgs - acks->acked_msgs;
+		if ((bytes == 0 && msgs == 0) || (!all && (acks->win_bytes == 0 || bytes < acks->win_bytes) &&
+			(acks->win_msgs == 0 || msgs < acks->win_msgs))) {
+			return;
+		}
+		char buf[SERVER_ACK_LEN];
+		buf[0] = SERVER_MSG_ACK[0];
+		proto_put64(buf + 1, acks->msgs);
+		proto_put64(buf + 1 + 8, acks->bytes);
+		tcp_write(acks->sock, buf, sizeof(buf));
+		acks->acked_bytes = acks->bytes;
+		acks->acked_msgs = acks->msgs;
+		return;
+	}
+
+	char buf[SERVER_ACK_BATCH];
+	memset(buf, SERVER_MSG_OK[0], MIN(acks->pending, sizeof(buf)));
+	while (acks->pending > 0) {
+		size_t n = MIN(acks->pending, sizeof(buf));
+		tcp_write(acks->sock, buf, n);
+		acks->pending -= n;
+	}
+}
+
+void wait_output(table_t * table, fanout_t * fanout, int sock)
+{
+	if (fanout->olen == 0) {
+		return;
+	}
+
+	/* Rounded up so that the deadline has passed when poll() times out */
+	uint64_t now = now_usec();
+	int timeout = now < fanout->deadline ? (fanout->deadline - now + 999) / 1000 : 0;
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	if (poll(&pfd, 1, timeout) == 0) {
+		flush_output(table, fanout, false);
+	}
+}
+
+void end_fanout(table_t * table, fanout_t * fanout)
+{
+	if (fanout->ring != NULL) {
+		shm_write(fanout->ring, NULL, 0, SHM_FLAG_END);
+	}
+	if (fanout->group != NULL) {
+		mcast_send(fanout->group, NULL, 0, MCAST_FLAG_END);
+	}
+	if (fanout->peers != 0) {
+		fed_end(fanout->fed, fanout->peers, fanout->msg);
+	}
+
+	/* A message shorter than the filters look at is filtered whole */
+	if (fanout->hneed > 0) {
+		filter_fanout(table, fanout, fanout->hlen);
+	}
+	flush_fanout(table, fanout);
+
+	/* The end goes out with the held back frames, and pushes them */
+	if (fanout->obuf != NULL) {
+		size_t len = strlen(SERVER_MSG_END);
+		fanout->obuf[fanout->olen++] = (len >> 8) & 0xFF;
+		fanout->obuf[fanout->olen++] = len & 0xFF;
+		memcpy(fanout->obuf + fanout->olen, SERVER_MSG_END, len);
+		fanout->olen += len;
+		flush_output(table, fanout, false);
+	}
+
+	deliver(table, fanout, FAN_END, SERVER_MSG_END, strlen(SERVER_MSG_END), 0);
+}
+
+void finish_fanout(table_t * table, fanout_t * fanout)
+{
+	release_mem(&table->admit, fanout->charged);
+	fanout->charged = 0;
+	free(fanout->subs);
+	fanout->subs = NULL;
+	free(fanout->zbuf);
+	fanout->zbuf = NULL;
+	free(fanout->obuf);
+	fanout->obuf = NULL;
+	if (fanout->jobs != NULL) {
+		cleanup_batch(&fanout->batch);
+		free(fanout->jobs);
+		fanout->jobs = NULL;
+	}
+}
+
+void deliver(table_t * table, fanout_t * fanout, enum FAN step, char * buf, size_t len, int flags)
+{
+	fan_job_t job = {
+		.table = table, .fanout = fanout, .step = step, .buf = buf, .len = len, .flags = flags,
+		.from = 0, .to = fanout->num_subs,
+	};
+	if (fanout->jobs == NULL) {
+		deliver_range(&job);
+		return;
+	}
+
+	/* The calling thread takes the first range. Each subscriber is in one */
+	/* range, and the next write waits for this one to be done everywhere  */
+	int per = (fanout->num_subs + fanout->num_jobs - 1) / fanout->num_jobs;
+	begin_batch(fanout->workers, &fanout->batch, fanout->num_jobs - 1);
+	for (int i = fanout->num_jobs - 1; i >= 0; i--) {
+		fanout->jobs[i] = job;
+		fanout->jobs[i].from = MIN(i * per, fanout->num_subs);
+		fanout->jobs[i].to = MIN((i + 1) * per, fanout->num_subs);
+		if (i > 0) {
+			submit_work(fanout->workers, run_fan_job, &fanout->jobs[i], &fanout->batch);
+		}
+	}
+	deliver_range(&fanout->jobs[0]);
+	wait_batch(&fanout->batch);
+}
+
+void deliver_range(fan_job_t * job)
+{
+	fanout_t * fanout = job->fanout;
+	for (int i = job->from; i < job->to; i++) {
+		subscriber_t * sub = &fanout->subs[i];
+		if (sub->csock == ERR || (fanout->to == SUBS_UNFILTERED && sub->filter != FILTER_NONE) ||
+			(fanout->to == SUBS_FILTERED && sub->filter == FILTER_NONE)) {
+			continue;
+		}
+
+		/* Those that accept compressed frames get nothing else but the end */
+		bool zsub = sub->compress && fanout->zbuf != NULL;
+		int ret = OK;
+		switch (job->step) {
+			case FAN_HEARTBEAT:
+				if (sub->mcast) {
+					sub->csock = ERR;
+					continue;
+				}
+				ret = heartbeat(sub->csock);
+				break;
+			case FAN_CHUNK:
+				if (zsub) {
+					continue;
+				}
+				ret = propagate(sub->csock, job->buf, job->len);
+				break;
+			case FAN_FRAME:
+				if (!zsub) {
+					continue;
+				}
+				TRACE(send_start, sub->csock, job->len);
+				ret = tcp_write(sub->csock, job->buf, job->len);
+				TRACE(send_done, sub->csock, ret);
+				break;
+			case FAN_OUTPUT:
+				if (zsub) {
+					continue;
+				}
+				TRACE(send_start, sub->csock, job->len);
+				ret = send(sub->csock, job->buf, job->len, job->flags) < 0 ? ERR : OK;
+				TRACE(send_done, sub->csock, ret);
+				break;
+			case FAN_END:
+				if (fanout->obuf != NULL && !zsub) {
+					continue;
+				}
+				ret = propagate(sub->csock, job->buf, job->len);
+				break;
+		}
+
+		/* If error during write, remove the subscriber */
+		if (ret != OK) {
+			drop_sub(job->table, fanout->topic->id, *sub);
+			sub->csock = ERR;
+		}
+	}
+}
+
+void run_fan_job(void * arg)
+{
+	deliver_range((fan_job_t *) arg);
+}
+
+void tune_topic(table_t * table, const char * topic, size_t len, int csock, const char * args)
+{
+	topic_t * temp = NULL;
+	uint32_t bytes = proto_get32(args);
+	uint32_t usec = proto_get32(args + 4);
+	if (bytes > SERVER_FLUSH_MAX || usec > SERVER_FLUSH_MAX_USEC || (temp = set_topic(table, topic, len)) == NULL) {
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+
+	/* Deliveries read both when they start, a mix of old and new is harmless */
+	__atomic_store_n(&temp->flush_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&temp->flush_usec, usec, __ATOMIC_RELAXED);
+	tcp_write(csock, SERVER_MSG_OK, strlen(SERVER_MSG_OK));
+	close_conn(table, csock);
+}
+
+void map_topic(table_t * table, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port)
+{
+	/* File descriptors can only be passed over Unix domain sockets */
+	topic_t * temp = NULL;
+	if ((ip != 0 || port != 0) || (temp = set_topic(table, topic, len)) == NULL) {
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+
+	/* Create the ring on the first request, another thread may race to it */
+	shm_ring_t * ring = __atomic_load_n(&temp->shm, __ATOMIC_ACQUIRE);
+	if (ring == NULL) {
+		char name[32];
+		snprintf(name, sizeof(name), "bridge:%u", temp->id);
+		shm_ring_t * expected = NULL;
+		if ((ring = init_shm(name)) == NULL) {
+			tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+			close_conn(table, csock);
+			return;
+		}
+		if (!__atomic_compare_exchange_n(&temp->shm, &expected, ring, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			cleanup_shm(ring);
+			ring = expected;
+		} else {
+			/* Readers of the ring want the topic from the linked brokers too */
+			lock_table(table);
+			touch_table(table);
+			unlock_table(table);
+		}
+	}
+
+	uds_send_fd(csock, ring->fd, SERVER_MSG_OK, strlen(SERVER_MSG_OK));
+	close_conn(table, csock);
+}
+
+void subscribe_group(table_t * table, repair_args_t * repair, const char * topic, size_t len, int csock, uint32_t ip, uint16_t port)
+{
+	topic_t * temp = NULL;
+	repair_sub_t * rsub = malloc(sizeof(repair_sub_t));
+	subscriber_t * subscriber = malloc(sizeof(subscriber_t));
+	if (repair == NULL || rsub == NULL || subscriber == NULL || (temp = set_topic(table, topic, len)) == NULL) {
+		free(rsub);
+		free(subscriber);
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+
+	/* Give the topic a group on the first request, another thread may race to it */
+	mcast_topic_t * group = __atomic_load_n(&temp->mcast, __ATOMIC_ACQUIRE);
+	if (group == NULL) {
+		mcast_topic_t * expected = NULL;
+		if ((group = init_mcast_topic(repair->mcast, temp->id)) == NULL) {
+			free(rsub);
+			free(subscriber);
+			tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+			close_conn(table, csock);
+			return;
+		}
+		if (!__atomic_compare_exchange_n(&temp->mcast, &expected, group, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			cleanup_mcast_topic(group);
+			group = expected;
+		}
+	}
+
+	/* A NAK is written at once, so do not wait on a partial one for long */
+	struct timeval wait_time = { SERVER_WAIT_SEC, SERVER_WAIT_USEC };
+	setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, &wait_time, sizeof(wait_time));
+
+	*subscriber = (subscriber_t) { .csock = csock, .ip = ip, .port = port, .mcast = true };
+	*rsub = (repair_sub_t) { .csock = csock, .ip = ip, .port = port, .topic = temp };
+	if (insert_sub(table, temp->id, subscriber) != OK) {
+		free(rsub);
+		free(subscriber);
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+
+	/* Group, port, and the last sequence number so that the subscriber */
+	/* knows where the stream starts, and the id in the datagrams       */
+	char resp[1 + 4 + 2 + 8 + 4];
+	uint32_t addr = ntohl(group->group.sin_addr.s_addr);
+	uint16_t gport = ntohs(group->group.sin_port);
+	resp[0] = SERVER_MSG_OK[0];
+	resp[1] = (addr >> 24) & 0xFF;
+	resp[2] = (addr >> 16) & 0xFF;
+	resp[3] = (addr >> 8) & 0xFF;
+	resp[4] = addr & 0xFF;
+	resp[5] = (gport >> 8) & 0xFF;
+	resp[6] = gport & 0xFF;
+	proto_put64(resp + 7, __atomic_load_n(&group->seq, __ATOMIC_RELAXED));
+	proto_put32(resp + 15, temp->id);
+
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = rsub };
+	if (tcp_write(csock, resp, sizeof(resp)) != OK || epoll_ctl(repair->epfd, EPOLL_CTL_ADD, csock, &event) < 0) {
+		subscriber_t temp_sub = { .csock = csock, .ip = ip, .port = port };
+		drop_sub(table, temp->id, temp_sub);
+		free(rsub);
+	}
+}
+
+void * run_repair(void * args)
+{
+	repair_args_t * repair = args;
+
+	struct epoll_event events[64];
+	for (;;) {
+		int num = epoll_wait(repair->epfd, events, 64, -1);
+		for (int i = 0; i < num; i++) {
+			repair_sub_t * rsub = events[i].data.ptr;
+
+			/* N | First sequence (8) | Count (2) */
+			char nak[MCAST_NAK_LEN];
+			ssize_t ret = recv(rsub->csock, nak, sizeof(nak), MSG_WAITALL);
+			if (ret == sizeof(nak) && nak[0] == MCAST_MSG_NAK) {
+				uint64_t first = proto_get64(nak + 1);
+				uint16_t count = ((uint8_t) nak[9] << 8) | (uint8_t) nak[10];
+				mcast_topic_t * group = __atomic_load_n(&rsub->topic->mcast, __ATOMIC_ACQUIRE);
+				if (mcast_repair(group, rsub->csock, first, count) == OK) {
+					continue;
+				}
+			}
+
+			/* Closed, broken, or not speaking the protocol */
+			epoll_ctl(repair->epfd, EPOLL_CTL_DEL, rsub->csock, NULL);
+			subscriber_t sub = { .csock = rsub->csock, .ip = rsub->ip, .port = rsub->port };
+			drop_sub(repair->table, rsub->topic->id, sub);
+			free(rsub);
+		}
+	}
+
+	return NULL;
+}
+
+void * run_federation(void * args)
+{
+	fed_args_t * fed_args = args;
+	table_t * table = fed_args->table;
+	ui_t * ui = fed_args->ui;
+	fed_t * fed = fed_args->fed;
+
+	for (;;) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t now_ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+		/* Dial the brokers given with -f whose link is down */
+		for (int i = 0; i < fed->num_outbound; i++) {
+			fed_peer_t * peer = &fed->peers[i];
+			if (__atomic_load_n(&peer->sock, __ATOMIC_ACQUIRE) != ERR || now_ms < peer->retry_at) {
+				continue;
+			}
+			peer->retry_at = now_ms + FED_RETRY_MS;
+
+			/* The broker kept the link it dialed to this one instead. While */
+			/* handing off, links are left to the next broker               */
+			if ((peer->gen > 0 && fed_linked(fed, peer->id)) || handoff_enter(fed_args->handoff) != OK) {
+				continue;
+			}
+			if (fed_dial(fed, peer) != OK) {
+				handoff_leave(fed_args->handoff);
+				continue;
+			}
+
+			fed_args_t * link_args = malloc(sizeof(fed_args_t));
+			pthread_t l_thr;
+			if (link_args == NULL) {
+				fed_unlink(fed, table, peer);
+				handoff_leave(fed_args->handoff);
+				continue;
+			}
+			*link_args = (fed_args_t) { .table = table, .ui = ui, .fed = fed, .peer = peer, .handoff = fed_args->handoff };
+			if (pthread_create(&l_thr, NULL, run_link, link_args) || pthread_detach(l_thr)) {
+				log_msg(ui->logger, "Error : failed to create link thread");
+				fed_unlink(fed, table, peer);
+				handoff_leave(fed_args->handoff);
+				free(link_args);
+			}
+		}
+
+		/* The topics wanted here, as they change */
+		fed_sync(fed, table);
+		usleep(FED_SYNC_MS * 1000);
+	}
+
+	return NULL;
+}
+
+void * run_link(void * args)
+{
+	fed_args_t link_args = *(fed_args_t *) args;
+	free(args);
+
+	serve_link(link_args.table, link_args.ui, link_args.fed, link_args.peer);
+	handoff_leave(link_args.handoff);
+	return NULL;
+}
+
+void link_broker(table_t * table, ui_t * ui, fed_t * fed, int csock, uint64_t id, uint32_t ip, uint16_t port)
+{
+	/* The broker waits for the answer before sending frames, so none of */
+	/* them were received with the request                               */
+	fed_peer_t * peer = NULL;
+	if (fed == NULL || (peer = fed_link(fed, NULL, csock, id, id, ip, port)) == NULL) {
+		tcp_write(csock, SERVER_MSG_FAIL, strlen(SERVER_MSG_FAIL));
+		close_conn(table, csock);
+		return;
+	}
+
+	/* Links are bounded by their slots instead, and closed by fed_unlink() */
+	release_conn(&table->admit);
+
+	serve_link(table, ui, fed, peer);
+}
+
+void serve_link(table_t * table, ui_t * ui, fed_t * fed, fed_peer_t * peer)
+{
+	/* Only this thread releases the slot, so the socket stays the same */
+	int sock = peer->sock;
+	uint32_t bit = 1u << peer->index;
+	log_link(ui, peer, "Linked to");
+
+	/* Messages of the broker in flight, their frames are interleaved */
+	link_msg_t msgs[FED_MAX_INFLIGHT];
+	memset(msgs, 0, sizeof(msgs));
+	fed_frame_t frame;
+	for (;;) {
+		wait_link(table, msgs, sock);
+		if (fed_read(sock, &frame) != OK) {
+			break;
+		}
+		topic_t * topic;
+		if (frame.type == FED_MSG_SUB) {
+			if ((topic = set_topic(table, frame.topic, frame.topic_len)) != NULL) {
+				__atomic_or_fetch(&topic->peers, bit, __ATOMIC_RELEASE);
+			}
+			continue;
+		}
+		if (frame.type == FED_MSG_UNSUB) {
+			if ((topic = get_topic(table, frame.topic, frame.topic_len)) != NULL) {
+				__atomic_and_fetch(&topic->peers, ~bit, __ATOMIC_RELEASE);
+			}
+			continue;
+		}
+
+		link_msg_t * msg = NULL;
+		for (int i = 0; i < FED_MAX_INFLIGHT && msg == NULL; i++) {
+			if (frame.type == FED_MSG_BEGIN ? !msgs[i].active : (msgs[i].active && msgs[i].id == frame.msg)) {
+				msg = &msgs[i];
+			}
+		}
+
+		/* Messages are dropped if too many are in flight, or if the topic is */
+		/* unknown here (the interest was withdrawn meanwhile)                */
+		if (msg == NULL) {
+			continue;
+		}
+
+		if (frame.type == FED_MSG_BEGIN) {
+			/* Never forwarded to other brokers, so that messages cannot loop. */
+			/* With delivery threads, queued behind the local publishers'      */
+			if ((topic = get_topic(table, frame.topic, frame.topic_len)) == NULL) {
+				continue;
+			}
+			if (table->actors != NULL) {
+				if ((msg->queued = open_msg(table, NULL, topic)) == NULL) {
+					continue;
+				}
+			} else if (start_fanout(table, NULL, topic, &msg->fanout) != OK) {
+				continue;
+			}
+			msg->active = true;
+			msg->id = frame.msg;
+			__atomic_add_fetch(&topic->msgs, 1, __ATOMIC_RELAXED);
+		} else if (frame.type == FED_MSG_DATA && msg->queued != NULL) {
+			/* Not waiting for the topic, as other messages of the link may */
+			/* be ahead of this one on it. The rest of it is dropped        */
+			__atomic_add_fetch(&msg->queued->queue->topic->bytes, frame.len, __ATOMIC_RELAXED);
+			if (append_msg(table, msg->queued, frame.data, frame.len, false) != OK) {
+				close_msg(table, msg->queued, false);
+				msg->queued = NULL;
+				msg->active = false;
+			}
+		} else if (frame.type == FED_MSG_DATA) {
+			__atomic_add_fetch(&msg->fanout.topic->bytes, frame.len, __ATOMIC_RELAXED);
+			send_fanout(table, &msg->fanout, frame.data, frame.len);
+		} else if (msg->queued != NULL) {
+			close_msg(table, msg->queued, true);
+			msg->queued = NULL;
+			msg->active = false;
+		} else {
+			end_fanout(table, &msg->fanout);
+			finish_fanout(table, &msg->fanout);
+			msg->active = false;
+		}
+	}
+
+	/* Messages cut by the link going down are not ended, as for a publisher */
+	for (int i = 0; i < FED_MAX_INFLIGHT; i++) {
+		if (msgs[i].active && msgs[i].queued != NULL) {
+			close_msg(table, msgs[i].queued, false);
+		} else if (msgs[i].active) {
+			finish_fanout(table, &msgs[i].fanout);
+		}
+	}
+
+	log_link(ui, peer, "Unlinked from");
+	fed_unlink(fed, table, peer);
+}
+
+void wait_link(table_t * table, link_msg_t * msgs, int sock)
+{
+	for (;;) {
+		/* The earliest deadline of the messages holding back frames */
+		uint64_t deadline = 0;
+		for (int i = 0; i < FED_MAX_INFLIGHT; i++) {
+			fanout_t * fanout = &msgs[i].fanout;
+			if (msgs[i].active && fanout->olen > 0 && (deadline == 0 || fanout->deadline < deadline)) {
+				deadline = fanout->deadline;
+			}
+		}
+		if (deadline == 0) {
+			return;
+		}
+
+		uint64_t now = now_usec();
+		int timeout = now < deadline ? (deadline - now + 999) / 1000 : 0;
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, timeout) != 0) {
+			return;
+		}
+
+		now = now_usec();
+		for (int i = 0; i < FED_MAX_INFLIGHT; i++) {
+			fanout_t * fanout = &msgs[i].fanout;
+			if (msgs[i].active && fanout->olen > 0 && fanout->deadline <= now) {
+				flush_output(table, fanout, false);
+			}
+		}
+	}
+}
+
+void log_link(ui_t * ui, fed_peer_t * peer, const char * what)
+{
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr addr = { htonl(peer->ip) };
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+
+	char temp[100];
+	snprintf(temp, sizeof(temp), "%s broker %016lx at %s:%u", what, peer->id, ip, peer->port);
+	log_msg(ui->logger, temp);
+}
+
+void * run_handoff(void * args)
+{
+	handoff_args_t * handoff_args = args;
+	table_t * table = handoff_args->table;
+	ui_t * ui = handoff_args->ui;
+	handoff_t * handoff = handoff_args->handoff;
+
+	for (;;) {
+		int sock;
+		if (uds_accept(handoff->sock, &sock) != OK) {
+			continue;
+		}
+		struct timeval wait_time = { HANDOFF_WAIT_SEC, 0 };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait_time, sizeof(wait_time));
+		log_msg(ui->logger, "Handing off to a new broker...");
+
+		/* No new requests, and the links would deliver behind its back */
+		__atomic_store_n(&handoff->draining, true, __ATOMIC_SEQ_CST);
+		if (handoff_args->fed != NULL) {
+			fed_shutdown(handoff_args->fed);
+		}
+
+		/* Publishes and sessions end on their own, sessions between requests, */
+		/* and the messages they queued are delivered                         */
+		for (int waited = 0; __atomic_load_n(&handoff->busy, __ATOMIC_SEQ_CST) > 0 || !workers_idle(table->actors); waited++) {
+			if (waited > 0 && waited % (1000 / SERVER_RETRY_MS) == 0) {
+				char temp[64];
+				snprintf(temp, sizeof(temp), "Waiting for %lu request(s) to finish...", __atomic_load_n(&handoff->busy, __ATOMIC_SEQ_CST));
+				log_msg(ui->logger, temp);
+			}
+			usleep(SERVER_RETRY_MS * 1000);
+		}
+
+		int ret = hand_off(table, handoff_args->acceptors, handoff_args->num_acceptors, sock);
+		close(sock);
+		if (ret == OK) {
+			/* The subscribers are the new broker's now, so nothing here */
+			/* may write to them any more                                */
+			/* The signal is blocked in every thread and waited for, so the */
+			/* broker shuts down the same way as when told to stop          */
+			log_msg(ui->logger, "Handed off, exiting...");
+			ui->status = FINISH;
+			kill(getpid(), SIGTERM);
+			return NULL;
+		}
+
+		log_msg(ui->logger, "Error : failed to hand off, serving again");
+		__atomic_store_n(&handoff->draining, false, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+int hand_off(table_t * table, acceptor_args_t * acceptors, int num_acceptors, int sock)
+{
+	handoff_rec_t rec = { .fd = ERR };
+	for (int i = 0; i < num_acceptors; i++) {
+		rec = (handoff_rec_t) { .type = HANDOFF_LISTENER, .fd = acceptors[i].sock, .family = acceptors[i].family };
+		if (handoff_send(sock, &rec) != OK) {
+			return ERR;
+		}
+	}
+
+	/* In id order, so that the topics keep their ids */
+	topic_t * topic;
+	for (uint32_t id = 0; (topic = topic_by_id(table, id)) != NULL; id++) {
+		rec = (handoff_rec_t) {
+			.type = HANDOFF_TOPIC, .fd = ERR, .topic_len = topic->len,
+			.flush_bytes = __atomic_load_n(&topic->flush_bytes, __ATOMIC_RELAXED),
+			.flush_usec = __atomic_load_n(&topic->flush_usec, __ATOMIC_RELAXED),
+		};
+		memcpy(rec.topic, topic->str, topic->len);
+		if (handoff_send(sock, &rec) != OK) {
+			return ERR;
+		}
+
+		/* Readers of the ring keep reading it */
+		shm_ring_t * ring = __atomic_load_n(&topic->shm, __ATOMIC_ACQUIRE);
+		rec = (handoff_rec_t) { .type = HANDOFF_RING, .fd = ring != NULL ? ring->fd : ERR };
+		if (ring != NULL && handoff_send(sock, &rec) != OK) {
+			return ERR;
+		}
+
+		/* Multicast subscribers are not passed, the groups are not kept. */
+		/* They see their connection close and subscribe again            */
+		subscriber_t * subs;
+		int num_subs = get_subs(table, topic, &subs);
+		if (num_subs == ERR) {
+			return ERR;
+		}
+		for (int i = 0; i < num_subs; i++) {
+			if (subs[i].mcast) {
+				continue;
+			}
+			rec = (handoff_rec_t) {
+				.type = HANDOFF_SUB, .fd = subs[i].csock, .ip = subs[i].ip, .port = subs[i].port,
+				.flags = (subs[i].compress ? HANDOFF_FLAG_COMPRESS : 0) | (subs[i].filter != FILTER_NONE ? HANDOFF_FLAG_FILTER : 0),
+			};
+			if (subs[i].filter != FILTER_NONE) {
+				get_filter(topic->filters, subs[i].filter, &rec.filter);
+			}
+			if (handoff_send(sock, &rec) != OK) {
+				free(subs);
+				return ERR;
+			}
+		}
+		free(subs);
+	}
+
+	rec = (handoff_rec_t) { .type = HANDOFF_END, .fd = ERR };
+	char resp;
+	if (handoff_send(sock, &rec) != OK || recv(sock, &resp, sizeof(resp), 0) != sizeof(resp) || resp != SERVER_MSG_OK[0]) {
+		return ERR;
+	}
+
+	return OK;
+}
+
+int take_over(table_t * table, ui_t * ui, int sock, acceptor_args_t * acceptors, int * num_acceptors)
+{
+	topic_t * topic = NULL;
+	uint64_t num_topics = 0, num_subs = 0;
+	handoff_rec_t rec;
+	for (;;) {
+		if (handoff_recv(sock, &rec) != OK) {
+			return ERR;
+		}
+
+		if (rec.type == HANDOFF_LISTENER) {
+			if (*num_acceptors >= CONFIG_MAX_LISTENERS + 1) {
+				close(rec.fd);
+				return ERR;
+			}
+			acceptors[*num_acceptors].sock = rec.fd;
+			acceptors[*num_acceptors].family = rec.family;
+			(*num_acceptors)++;
+		} else if (rec.type == HANDOFF_TOPIC) {
+			if (check_topic(rec.topic, rec.topic_len) != OK || (topic = set_topic(table, rec.topic, rec.topic_len)) == NULL) {
+				return ERR;
+			}
+			topic->flush_bytes = MIN(rec.flush_bytes, SERVER_FLUSH_MAX);
+			topic->flush_usec = MIN(rec.flush_usec, SERVER_FLUSH_MAX_USEC);
+			num_topics++;
+		} else if (rec.type == HANDOFF_RING) {
+			shm_ring_t * ring = NULL;
+			if (topic == NULL || topic->shm != NULL || (ring = adopt_shm(rec.fd)) == NULL) {
+				close(rec.fd);
+				return ERR;
+			}
+			__atomic_store_n(&topic->shm, ring, __ATOMIC_RELEASE);
+		} else if (rec.type == HANDOFF_SUB) {
+			if (topic == NULL) {
+				close(rec.fd);
+				return ERR;
+			}
+
+			/* The limits of this broker apply, those past them are shed */
+			if (admit_conn(&table->admit) != OK) {
+				close(rec.fd);
+				continue;
+			}
+			subscriber_t * subscriber = malloc(sizeof(subscriber_t));
+			if (subscriber == NULL) {
+				close_conn(table, rec.fd);
+				continue;
+			}
+			*subscriber = (subscriber_t) {
+				.csock = rec.fd, .ip = rec.ip, .port = rec.port,
+				.compress = (rec.flags & HANDOFF_FLAG_COMPRESS) != 0,
+			};
+			if (((rec.flags & HANDOFF_FLAG_FILTER) && (subscriber->filter = set_filter(table, topic, &rec.filter)) == ERR) ||
+				insert_sub(table, topic->id, subscriber) != OK) {
+				free(subscriber);
+				close_conn(table, rec.fd);
+				continue;
+			}
+			num_subs++;
+		} else {
+			break;
+		}
+	}
+
+	if (tcp_write(sock, SERVER_MSG_OK, strlen(SERVER_MSG_OK)) != OK) {
+		return ERR;
+	}
+
+	char temp[100];
+	snprintf(temp, sizeof(temp), "Took over %d listener(s), %lu topic(s), and %lu subscriber(s)...", *num_acceptors, num_topics, num_subs);
+	log_msg(ui->logger, temp);
+	return OK;
+}
+
+int wait_request(handoff_t * handoff, int sock)
+{
+	if (handoff == NULL) {
+		return OK;
+	}
+
+	/* Woken up now and then to check, requests are read as soon as they come */
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	while (poll(&pfd, 1, SERVER_RETRY_MS) == 0) {
+		if (handoff_draining(handoff)) {
+			return ERR;
+		}
+	}
+
+	return OK;
+}
+
+void drop_sub(table_t * table, uint32_t id, subscriber_t sub)
+{
+	/* Only the thread that removed it closes it, so that it is closed once */
+	if (remove_sub(table, id, sub) == OK) {
+		close_conn(table, sub.csock);
+	}
+}
+
+void close_conn(table_t * table, int csock)
+{
+	release_conn(&table->admit);
 	close(csock);
 }
 
 int heartbeat(int csock)
 {
 	/* Send the heartbeat message which is just H */
+	TRACE(heartbeat_start, csock, 0);
 	if (tcp_write(csock, SERVER_MSG_HB, 1) != OK) {
+		TRACE(heartbeat_done, csock, ERR);
 		return ERR;
 	}
 
 	/* If no response within set time, return ERR */
 	char resp;
 	if (recv(csock, &resp, sizeof(resp), 0) <= 0) {
+		TRACE(heartbeat_done, csock, ERR);
 		return ERR;
 	}
 
 	/* Check the message */
-	return (resp == SERVER_MSG_HB[0] ? OK : ERR);
+	int ret = (resp == SERVER_MSG_HB[0] ? OK : ERR);
+	TRACE(heartbeat_done, csock, ret);
+	return ret;
 }
 
 int propagate(int csock, char * raw_msg, size_t len)
 {
 	char buf[SERVER_PF_SIZE + SERVER_PF_DATA + 1] = {0};
 
-	/* Convert length to 2 bytes */
-	uint16_t msg_len = htons(len);
-	buf[0] = msg_len >> 8;
-	buf[1] = msg_len & 0xFF;
+	/* Convert length to 2 bytes in network byte order (big-endian) */
+	buf[0] = (len >> 8) & 0xFF;
+	buf[1] = len & 0xFF;
 
 	/* Copy the message to buffer */
 	for (int i = 0; i < len; i++) {
 		buf[2+i] = raw_msg[i];
 	}
 
-	return tcp_write(csock, buf, len+2);
+	TRACE(send_start, csock, len);
+	int ret = tcp_write(csock, buf, len+2);
+	TRACE(send_done, csock, ret);
+	return ret;
 }
@@ -0,0 +1,181 @@
+#include "shm.h"
+
+shm_ring_t * init_shm(const char * name)
+{
+	shm_ring_t * ring = calloc(1, sizeof(shm_ring_t));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->len = sizeof(shm_header_t) + sizeof(shm_slot_t) * SHM_SLOTS;
+
+	/* Sealed so that readers can map it without fearing it shrinks */
+	ring->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	if (ftruncate(ring->fd, ring->len) < 0 ||
+		fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	void * base = mmap(NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (base == MAP_FAILED) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	ring->header = base;
+	ring->slots = (shm_slot_t *) ((char *) base + sizeof(shm_header_t));
+
+	ring->lock = malloc(sizeof(pthread_mutex_t));
+	if (ring->lock == NULL || pthread_mutex_init(ring->lock, NULL)) {
+		free(ring->lock);
+		munmap(base, ring->len);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	/* The memfd starts zeroed, so every slot has seq 0 (never written) */
+	ring->header->magic = SHM_MAGIC;
+	ring->header->version = SHM_VERSION;
+	ring->header->num_slots = SHM_SLOTS;
+	ring->header->slot_size = sizeof(shm_slot_t);
+	ring->header->head = 0;
+
+	return ring;
+}
+
+shm_ring_t * adopt_shm(int fd)
+{
+	shm_ring_t * ring = calloc(1, sizeof(shm_ring_t));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->fd = fd;
+	ring->len = sizeof(shm_header_t) + sizeof(shm_slot_t) * SHM_SLOTS;
+
+	void * base = mmap(NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		free(ring);
+		return NULL;
+	}
+	ring->header = base;
+	ring->slots = (shm_slot_t *) ((char *) base + sizeof(shm_header_t));
+
+	/* Both brokers must agree on the layout, the readers already do */
+	ring->lock = malloc(sizeof(pthread_mutex_t));
+	if (ring->header->magic != SHM_MAGIC || ring->header->version != SHM_VERSION ||
+		ring->header->num_slots != SHM_SLOTS || ring->header->slot_size != sizeof(shm_slot_t) ||
+		ring->lock == NULL || pthread_mutex_init(ring->lock, NULL)) {
+		free(ring->lock);
+		munmap(base, ring->len);
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void shm_write(shm_ring_t * ring, const char * data, uint32_t len, uint32_t flags)
+{
+	pthread_mutex_lock(ring->lock);
+	uint64_t seq = ring->header->head + 1;
+	shm_slot_t * slot = &ring->slots[(seq - 1) & (SHM_SLOTS - 1)];
+
+	/* Readers that see 0 retry, and those in the middle of a copy notice */
+	/* that the seq changed                                               */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	len = len > SHM_SLOT_DATA ? SHM_SLOT_DATA : len;
+	if (len > 0) {
+		memcpy(slot->data, data, len);
+	}
+	slot->len = len;
+	slot->flags = flags;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->header->head, seq, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(ring->lock);
+}
+
+void cleanup_shm(shm_ring_t * ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	munmap(ring->header, ring->len);
+	close(ring->fd);
+	pthread_mutex_destroy(ring->lock);
+	free(ring->lock);
+	free(ring);
+}
+
+int shm_attach(shm_reader_t * reader, int fd)
+{
+	memset(reader, 0, sizeof(shm_reader_t));
+	reader->len = sizeof(shm_header_t) + sizeof(shm_slot_t) * SHM_SLOTS;
+
+	void * base = mmap(NULL, reader->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		return ERR;
+	}
+	reader->header = base;
+	reader->slots = (const shm_slot_t *) ((const char *) base + sizeof(shm_header_t));
+
+	/* Both sides must agree on the layout */
+	if (reader->header->magic != SHM_MAGIC || reader->header->version != SHM_VERSION ||
+		reader->header->num_slots != SHM_SLOTS || reader->header->slot_size != sizeof(shm_slot_t)) {
+		munmap(base, reader->len);
+		return ERR;
+	}
+
+	reader->next = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE) + 1;
+	return OK;
+}
+
+int shm_read(shm_reader_t * reader, char * data, uint32_t * len, uint32_t * flags)
+{
+	for (;;) {
+		const shm_slot_t * slot = &reader->slots[(reader->next - 1) & (SHM_SLOTS - 1)];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		/* Not written yet (or being written) */
+		if (seq == 0 || seq < reader->next) {
+			return ERR;
+		}
+
+		if (seq == reader->next) {
+			uint32_t n = slot->len > SHM_SLOT_DATA ? SHM_SLOT_DATA : slot->len;
+			memcpy(data, slot->data, n);
+			*len = n;
+			*flags = slot->flags;
+
+			/* Not overwritten during the copy */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+				reader->next++;
+				return OK;
+			}
+		}
+
+		/* Overrun, skip to the oldest slot that is still in the ring */
+		uint64_t head = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+		uint64_t oldest = head >= SHM_SLOTS ? head - SHM_SLOTS + 1 : 1;
+		if (oldest > reader->next) {
+			reader->lost += oldest - reader->next;
+			reader->next = oldest;
+		}
+	}
+}
+
+void shm_detach(shm_reader_t * reader)
+{
+	if (reader->header != NULL) {
+		munmap((void *) reader->header, reader->len);
+		reader->header = NULL;
+	}
+}
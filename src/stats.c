@@ -0,0 +1,340 @@
+#include "stats.h"
+
+void * run_stats(void * args)
+{
+	table_t * table = ((stats_args_t *) args)->table;
+	ui_t * ui = ((stats_args_t *) args)->ui;
+	const config_t * config = ((stats_args_t *) args)->config;
+	if (table == NULL || ui == NULL || config == NULL) {
+		return NULL;
+	}
+
+	/* Detach from main thread and listen only on loopback */
+	int sock;
+	uint16_t stats_port;
+	if (pthread_detach(pthread_self())) {
+		log_msg(ui->logger, "Error : failed to initialize stats server");
+		return NULL;
+	}
+
+	/* When taking over, the port is free once the previous broker exits */
+	int tries = config->handoff_path != NULL ? STATS_TAKEOVER_SEC / STATS_WAIT_SEC : 0;
+	while ((sock = tcp_listen(INADDR_LOOPBACK, config->stats_port, SOCK_LISTEN_Q_LEN, 0)) < 0 && tries-- > 0) {
+		sleep(STATS_WAIT_SEC);
+	}
+	if (sock < 0 || tcp_local_port(sock, &stats_port) != OK) {
+		log_msg(ui->logger, "Error : failed to initialize stats server");
+		return NULL;
+	}
+	char temp[64];
+	snprintf(temp, sizeof(temp), "Stats on 127.0.0.1:%u...", stats_port);
+	log_msg(ui->logger, temp);
+
+	struct timespec prev;
+	clock_gettime(CLOCK_MONOTONIC, &prev);
+
+	/* Serve one snapshot per connection */
+	for (;;) {
+		int csock;
+		uint32_t ip;
+		uint16_t port;
+		if (tcp_accept(sock, &csock, &ip, &port) != OK) {
+			continue;
+		}
+
+		/* The request byte is optional, so do not wait on it for too long */
+		struct timeval wait_time = { STATS_WAIT_SEC, 0 };
+		setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, &wait_time, sizeof(wait_time));
+		char req = 0;
+		if (read(csock, &req, sizeof(req)) <= 0) {
+			req = 0;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double elapsed = (now.tv_sec - prev.tv_sec) + (now.tv_nsec - prev.tv_nsec) / 1e9;
+		prev = now;
+
+		/* Trace records do not need a table snapshot */
+		stats_buf_t buf = { NULL, 0, 0 };
+		if (req == STATS_REQ_TRACE) {
+			if (format_stats_trace(&buf) == OK) {
+				tcp_write(csock, buf.data, buf.len);
+			}
+			free(buf.data);
+			close(csock);
+			continue;
+		}
+
+		table_stats_t stats;
+		if (snapshot_stats(table, &stats, elapsed) == OK) {
+			int ret = (req == STATS_REQ_JSON)
+				? format_stats_json(&buf, &stats)
+				: format_stats_text(&buf, &stats);
+			if (ret == OK) {
+				tcp_write(csock, buf.data, buf.len);
+			}
+			free(stats.topics);
+		}
+
+		free(buf.data);
+		close(csock);
+	}
+
+	return NULL;
+}
+
+int snapshot_stats(table_t * table, table_stats_t * stats, double elapsed)
+{
+	memset(stats, 0, sizeof(table_stats_t));
+
+	/* Topics are never freed, so copying the pointers is enough to read them */
+	/* after releasing the lock. The slot is kept to compute the probe length */
+	/* and the subscribers are copied along, their queues read afterwards     */
+	lock_table(table);
+	uint64_t map_size = table->map_size;
+	uint64_t num_topics = table->num_topics;
+	uint64_t total_subs = 0;
+	for (uint64_t i = 0; i < map_size; i++) {
+		if (table->map[i] != NULL) {
+			total_subs += table->map[i]->num_subs;
+		}
+	}
+	topic_t ** topics = malloc(sizeof(topic_t *) * (num_topics + 1));
+	uint64_t * slots = malloc(sizeof(uint64_t) * (num_topics + 1));
+	subscriber_t * subs = malloc(sizeof(subscriber_t) * (total_subs + 1));
+	stats->topics = calloc(num_topics + 1, sizeof(topic_stats_t));
+	if (topics == NULL || slots == NULL || subs == NULL || stats->topics == NULL) {
+		unlock_table(table);
+		free(topics);
+		free(slots);
+		free(subs);
+		free(stats->topics);
+		stats->topics = NULL;
+		return ERR;
+	}
+	uint64_t num = 0, num_subs = 0;
+	for (uint64_t i = 0; i < map_size && num < num_topics; i++) {
+		if (table->map[i] != NULL) {
+			topics[num] = table->map[i];
+			slots[num] = i;
+			for (subscriber_t * sub = table->map[i]->subscriber; sub != NULL && num_subs < total_subs; sub = sub->next) {
+				subs[num_subs++] = *sub;
+				stats->topics[num].subs++;
+			}
+			num++;
+		}
+	}
+	unlock_table(table);
+
+	stats->map_size = map_size;
+	stats->num_topics = num;
+	stats->load = (double) num / map_size;
+	snapshot_admit(&table->admit, &stats->admit);
+	workers_t * workers = table->workers;
+	if (workers != NULL) {
+		stats->workers = workers->num_threads;
+		stats->threshold = workers->threshold;
+		stats->batches = __atomic_load_n(&workers->batches, __ATOMIC_RELAXED);
+		stats->items = __atomic_load_n(&workers->items, __ATOMIC_RELAXED);
+		stats->inline_items = __atomic_load_n(&workers->inline_items, __ATOMIC_RELAXED);
+	}
+	workers_t * actors = table->actors;
+	if (actors != NULL) {
+		stats->actors = actors->num_threads;
+		stats->actor_runs = __atomic_load_n(&actors->items, __ATOMIC_RELAXED);
+		stats->actor_inline = __atomic_load_n(&actors->inline_items, __ATOMIC_RELAXED);
+	}
+
+	uint64_t probe_sum = 0;
+	const subscriber_t * sub_iter = subs;
+	for (uint64_t i = 0; i < num; i++) {
+		topic_t * topic = topics[i];
+		topic_stats_t * ts = &stats->topics[i];
+
+		ts->id = topic->id;
+		ts->str = topic->str;
+		ts->msgs = __atomic_load_n(&topic->msgs, __ATOMIC_RELAXED);
+		ts->bytes = __atomic_load_n(&topic->bytes, __ATOMIC_RELAXED);
+		if (elapsed > 0) {
+			ts->msg_rate = (ts->msgs - topic->stat_msgs) / elapsed;
+			ts->byte_rate = (ts->bytes - topic->stat_bytes) / elapsed;
+		}
+		shm_ring_t * ring = __atomic_load_n(&topic->shm, __ATOMIC_ACQUIRE);
+		if (ring != NULL) {
+			ts->shm_seq = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+		}
+		mcast_topic_t * mt = __atomic_load_n(&topic->mcast, __ATOMIC_ACQUIRE);
+		if (mt != NULL) {
+			ts->mcast_seq = __atomic_load_n(&mt->seq, __ATOMIC_RELAXED);
+		}
+		ts->peers = __builtin_popcount(__atomic_load_n(&topic->peers, __ATOMIC_ACQUIRE));
+		ts->comp_in = __atomic_load_n(&topic->comp_in, __ATOMIC_RELAXED);
+		ts->comp_out = __atomic_load_n(&topic->comp_out, __ATOMIC_RELAXED);
+		ts->backlog = __atomic_load_n(&topic->backlog, __ATOMIC_RELAXED);
+		filter_set_t * set = __atomic_load_n(&topic->filters, __ATOMIC_ACQUIRE);
+		if (set != NULL) {
+			ts->filters = __atomic_load_n(&set->num_filters, __ATOMIC_ACQUIRE) - 1;
+		}
+		ts->filtered = __atomic_load_n(&topic->filtered, __ATOMIC_RELAXED);
+		topic->stat_msgs = ts->msgs;
+		topic->stat_bytes = ts->bytes;
+
+		/* Linear probing only moves forward, wrapping around the map */
+		uint64_t home = topic->hash % map_size;
+		ts->probe = (slots[i] + map_size - home) % map_size;
+		probe_sum += ts->probe;
+		if (ts->probe > stats->probe_max) {
+			stats->probe_max = ts->probe;
+		}
+
+		/* Sum the unsent bytes of the subscribers copied with the topic */
+		for (uint64_t j = 0; j < ts->subs; j++) {
+			int queued;
+			if (queued_bytes(sub_iter++, &queued) == OK) {
+				ts->queued += queued;
+			}
+		}
+	}
+	stats->probe_avg = num > 0 ? (double) probe_sum / num : 0;
+
+	free(topics);
+	free(slots);
+	free(subs);
+	return OK;
+}
+
+int queued_bytes(const subscriber_t * sub, int * queued)
+{
+	/* Read first and checked after, a descriptor reused in between is */
+	/* connected to another peer                                        */
+	if (ioctl(sub->csock, SIOCOUTQ, queued) < 0) {
+		return ERR;
+	}
+
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getpeername(sub->csock, (struct sockaddr *) &addr, &len) < 0) {
+		return ERR;
+	}
+	if (addr.ss_family == AF_UNIX) {
+		return sub->ip == 0 && sub->port == 0 ? OK : ERR;
+	}
+	struct sockaddr_in * in = (struct sockaddr_in *) &addr;
+	if (addr.ss_family != AF_INET || ntohl(in->sin_addr.s_addr) != sub->ip || ntohs(in->sin_port) != sub->port) {
+		return ERR;
+	}
+
+	return OK;
+}
+
+int format_stats_text(stats_buf_t * buf, const table_stats_t * stats)
+{
+	if (stats_printf(buf, "table size=%lu topics=%lu load=%.3f probe_avg=%.3f probe_max=%lu\n",
+		stats->map_size, stats->num_topics, stats->load, stats->probe_avg, stats->probe_max) != OK) {
+		return ERR;
+	}
+	const admit_t * admit = &stats->admit;
+	if (stats_printf(buf, "admit conns=%lu max_conns=%lu mem=%lu budget=%lu conn_cost=%lu conn_bytes=%lu max_subs=%lu rejected=%lu full=%lu shed=%lu\n",
+		admit->conns, admit->max_conns, admit->mem, admit->budget, admit->conn_cost, admit->conn_bytes, admit->max_subs,
+		admit->rejected, admit->full, admit->shed) != OK) {
+		return ERR;
+	}
+	if (stats_printf(buf, "workers threads=%lu threshold=%lu batches=%lu items=%lu inline=%lu\n",
+		stats->workers, stats->threshold, stats->batches, stats->items, stats->inline_items) != OK) {
+		return ERR;
+	}
+	if (stats_printf(buf, "actors threads=%lu runs=%lu inline=%lu\n",
+		stats->actors, stats->actor_runs, stats->actor_inline) != OK) {
+		return ERR;
+	}
+
+	for (uint64_t i = 0; i < stats->num_topics; i++) {
+		const topic_stats_t * ts = &stats->topics[i];
+		if (stats_printf(buf, "topic=\"%s\" id=%u subs=%lu msgs=%lu bytes=%lu msg_rate=%.2f byte_rate=%.2f queued=%lu backlog=%lu probe=%lu shm_seq=%lu mcast_seq=%lu peers=%lu comp_in=%lu comp_out=%lu filters=%lu filtered=%lu\n",
+			ts->str, ts->id, ts->subs, ts->msgs, ts->bytes, ts->msg_rate, ts->byte_rate, ts->queued, ts->backlog, ts->probe, ts->shm_seq, ts->mcast_seq, ts->peers, ts->comp_in, ts->comp_out, ts->filters, ts->filtered) != OK) {
+			return ERR;
+		}
+	}
+
+	return OK;
+}
+
+int format_stats_json(stats_buf_t * buf, const table_stats_t * stats)
+{
+	const admit_t * admit = &stats->admit;
+	if (stats_printf(buf, "{\"table\":{\"size\":%lu,\"topics\":%lu,\"load\":%.3f,\"probe_avg\":%.3f,\"probe_max\":%lu},"
+		"\"admit\":{\"conns\":%lu,\"max_conns\":%lu,\"mem\":%lu,\"budget\":%lu,\"conn_cost\":%lu,\"conn_bytes\":%lu,\"max_subs\":%lu,\"rejected\":%lu,\"full\":%lu,\"shed\":%lu},"
+		"\"workers\":{\"threads\":%lu,\"threshold\":%lu,\"batches\":%lu,\"items\":%lu,\"inline\":%lu},"
+		"\"actors\":{\"threads\":%lu,\"runs\":%lu,\"inline\":%lu},\"topics\":[",
+		stats->map_size, stats->num_topics, stats->load, stats->probe_avg, stats->probe_max,
+		admit->conns, admit->max_conns, admit->mem, admit->budget, admit->conn_cost, admit->conn_bytes, admit->max_subs,
+		admit->rejected, admit->full, admit->shed,
+		stats->workers, stats->threshold, stats->batches, stats->items, stats->inline_items,
+		stats->actors, stats->actor_runs, stats->actor_inline) != OK) {
+		return ERR;
+	}
+
+	/* Topics need no escaping (check_topic) */
+	for (uint64_t i = 0; i < stats->num_topics; i++) {
+		const topic_stats_t * ts = &stats->topics[i];
+		if (stats_printf(buf, "%s{\"topic\":\"%s\",\"id\":%u,\"subs\":%lu,\"msgs\":%lu,\"bytes\":%lu,\"msg_rate\":%.2f,\"byte_rate\":%.2f,\"queued\":%lu,\"backlog\":%lu,\"probe\":%lu,\"shm_seq\":%lu,\"mcast_seq\":%lu,\"peers\":%lu,\"comp_in\":%lu,\"comp_out\":%lu,\"filters\":%lu,\"filtered\":%lu}",
+			i == 0 ? "" : ",", ts->str, ts->id, ts->subs, ts->msgs, ts->bytes, ts->msg_rate, ts->byte_rate, ts->queued, ts->backlog, ts->probe, ts->shm_seq, ts->mcast_seq, ts->peers, ts->comp_in, ts->comp_out, ts->filters, ts->filtered) != OK) {
+			return ERR;
+		}
+	}
+
+	return stats_printf(buf, "]}\n");
+}
+
+int format_stats_trace(stats_buf_t * buf)
+{
+	trace_record_t * records = malloc(sizeof(trace_record_t) * TRACE_RING_SIZE);
+	if (records == NULL) {
+		return ERR;
+	}
+
+	/* Empty unless built with the trace ring (make trace) */
+	uint64_t num = trace_snapshot(records);
+	int ret = stats_printf(buf, "seq,time_ns,thread,probe,arg0,arg1\n");
+	for (uint64_t i = 0; i < num && ret == OK; i++) {
+		ret = stats_printf(buf, "%lu,%lu,%u,%s,%lu,%ld\n", records[i].seq, records[i].time,
+			records[i].thread, trace_name(records[i].id), records[i].a, (int64_t) records[i].b);
+	}
+
+	free(records);
+	return ret;
+}
+
+int stats_printf(stats_buf_t * buf, const char * fmt, ...)
+{
+	for (;;) {
+		size_t avail = buf->cap - buf->len;
+
+		va_list ap;
+		va_start(ap, fmt);
+		int ret = vsnprintf(buf->data == NULL ? NULL : buf->data + buf->len, avail, fmt, ap);
+		va_end(ap);
+		if (ret < 0) {
+			return ERR;
+		}
+
+		/* Fits (vsnprintf needs room for the null terminator) */
+		if ((size_t) ret < avail) {
+			buf->len += ret;
+			return OK;
+		}
+
+		/* Otherwise, grow and try again */
+		size_t cap = buf->cap == 0 ? STATS_BUF_INITIAL : buf->cap * 2;
+		while (cap - buf->len <= (size_t) ret) {
+			cap *= 2;
+		}
+		char * data = realloc(buf->data, cap);
+		if (data == NULL) {
+			return ERR;
+		}
+		buf->data = data;
+		buf->cap = cap;
+	}
+}
@@ -31,50 +31,93 @@ table_t * init_table()
 		table->map[i] = NULL;
 	}
 
+	/* Initialize the insertion ordered list of topics */
+	table->version = 0;
+	table->arena = NULL;
+	memset(&table->admit, 0, sizeof(admit_t));
+	table->workers = NULL;
+	table->actors = NULL;
+	table->list_size = TABLE_INITIAL_SIZE;
+	table->list = malloc(sizeof(topic_t *) * table->list_size);
+	if (table->list == NULL) {
+		return NULL;
+	}
+
     return table;
 }
 
-uint64_t hash(char * topic_str, uint64_t map_size)
+uint64_t hash(const char * topic_str, size_t len)
 {
 	uint64_t hash = TABLE_HASH_FNS_OFFSET;
 
-	for (int i = 0; i < MIN(strlen(topic_str), TABLE_TOPIC_LEN); i++) {
-		hash ^= (uint64_t)topic_str[i];
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)topic_str[i];
 		hash *= TABLE_HASH_FNV_PRIME;
 	}
 
-	return hash % map_size;
+	return hash;
+}
+
+int check_topic(const char * topic_str, size_t len)
+{
+	if (len == 0 || len > TABLE_TOPIC_LEN) {
+		return ERR;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		char c = topic_str[i];
+		if (!((c >= '0' && c <= '9') ||
+			(c >= 'a' && c <= 'z') ||
+			(c >= 'A' && c <= 'Z') ||
+			c == '-' || c == '_' || c == '.' || c == ':' || c == '/'))
+		{
+			return ERR;
+		}
+	}
+
+	return OK;
 }
 
-topic_t * get_topic(table_t * table, char * topic_str)
+topic_t * get_topic(table_t * table, const char * topic_str, size_t len)
 {
-	uint64_t index = hash(topic_str, table->map_size);
+	/* Hashed once outside of the lock, the map only compares the hashes */
+	uint64_t key = hash(topic_str, len);
 
 	/* If it breaks from the while loop, topic does not exist */
-	pthread_mutex_lock(table->lock);
+	lock_table(table);
+	uint64_t index = key % table->map_size;
+	uint64_t probe = 0;
 	while (table->map[index] != NULL) {
 
-		if (strcmp(table->map[index]->str, topic_str) == 0) {
-			pthread_mutex_unlock(table->lock);
-			return table->map[index];
+		topic_t * topic = table->map[index];
+		if (topic->hash == key && topic->len == len && memcmp(topic->str, topic_str, len) == 0) {
+			TRACE(lookup, probe, 1);
+			unlock_table(table);
+			return topic;
 		}
 
 		/* Using linear probing */
 		index++;
+		probe++;
 		if (index >= table->map_size) {
 			index = 0;
 		}
 	}
-	pthread_mutex_unlock(table->lock);
+	TRACE(lookup, probe, 0);
+	unlock_table(table);
 
 	return NULL;
 }
 
-topic_t * set_topic(table_t * table, char * topic_str)
+topic_t * set_topic(table_t * table, const char * topic_str, size_t len)
 {
+	if (len > TABLE_TOPIC_LEN) {
+		return NULL;
+	}
+
 	/* If the topic already exists, return it instead */
 	topic_t * topic;
-	if ((topic = get_topic(table, topic_str)) != NULL) {
+	if ((topic = get_topic(table, topic_str, len)) != NULL) {
 		return topic;
 	}
 
@@ -83,15 +126,57 @@ topic_t * set_topic(table_t * table, char * topic_str)
 	if (topic == NULL) {
 		return NULL;
 	}
-	topic->subscriber = NULL;
-	strncpy(topic->str, topic_str, TABLE_TOPIC_LEN);
+	memset(topic, 0, sizeof(topic_t));
+	topic->len = len;
+	topic->hash = hash(topic_str, len);
+	topic->flush_bytes = TABLE_FLUSH_BYTES;
+	topic->flush_usec = TABLE_FLUSH_USEC;
+
+	/* Another thread may have inserted the topic since the lookup */
+	lock_table(table);
+	uint64_t index = topic->hash % table->map_size;
+	while (table->map[index] != NULL) {
+		topic_t * other = table->map[index];
+		if (other->hash == topic->hash && other->len == len && memcmp(other->str, topic_str, len) == 0) {
+			unlock_table(table);
+			free(topic);
+			return other;
+		}
+		index = index + 1 >= table->map_size ? 0 : index + 1;
+	}
+
+	/* Ids are 32-bit and index the list */
+	if (table->num_topics >= UINT32_MAX) {
+		unlock_table(table);
+		free(topic);
+		return NULL;
+	}
+
+	/* Make room in the list for the new topic */
+	if (table->num_topics >= table->list_size) {
+		topic_t ** new_list = realloc(table->list, sizeof(topic_t *) * (table->list_size * 2));
+		if (new_list == NULL) {
+			unlock_table(table);
+			free(topic);
+			return NULL;
+		}
+		table->list = new_list;
+		table->list_size = table->list_size * 2;
+	}
+
+	/* Copy the name last, the arena cannot give the bytes back */
+	if ((topic->str = intern_topic(table, topic_str, len)) == NULL) {
+		unlock_table(table);
+		free(topic);
+		return NULL;
+	}
 
 	/* If table is full, double the table size and re-insert */
-	pthread_mutex_lock(table->lock);
 	if (table->num_topics + 1 >= table->map_size) {
-		topic_t ** new_map = malloc(sizeof(topic_t *) * (table->map_size * 2));
+		topic_t ** new_map = calloc(table->map_size * 2, sizeof(topic_t *));
 		if (new_map == NULL) {
-			pthread_mutex_unlock(table->lock);
+			unlock_table(table);
+			free(topic);
 			return NULL;
 		}
 
@@ -113,16 +198,50 @@ topic_t * set_topic(table_t * table, char * topic_str)
 		free(old_map);
 	}
 
+	topic->id = table->num_topics;
 	insert_topic(table, topic);
-	pthread_mutex_unlock(table->lock);
+	table->list[topic->id] = topic;
+	touch_table(table);
+	unlock_table(table);
 	return topic;
 }
 
+topic_t * topic_by_id(table_t * table, uint32_t id)
+{
+	lock_table(table);
+	topic_t * topic = id < table->num_topics ? table->list[id] : NULL;
+	unlock_table(table);
+	return topic;
+}
+
+const char * intern_topic(table_t * table, const char * topic_str, size_t len)
+{
+	/* Assumes the table mutex is locked before calling this function */
+
+	/* Start a new chunk when the name does not fit in the current one */
+	table_chunk_t * chunk = table->arena;
+	if (chunk == NULL || chunk->used + len + 1 > TABLE_ARENA_CHUNK) {
+		chunk = malloc(sizeof(table_chunk_t));
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = table->arena;
+		chunk->used = 0;
+		table->arena = chunk;
+	}
+
+	char * str = chunk->data + chunk->used;
+	memcpy(str, topic_str, len);
+	str[len] = '\0';
+	chunk->used += len + 1;
+	return str;
+}
+
 void insert_topic(table_t * table, topic_t * topic)
 {
 	/* Assumes the table mutex is locked before calling this function */
 
-	uint64_t index = hash(topic->str, table->map_size);
+	uint64_t index = topic->hash % table->map_size;
 
 	for(;;) {
 
@@ -141,27 +260,58 @@ void insert_topic(table_t * table, topic_t * topic)
 	}	
 }
 
-int insert_sub(table_t * table, char * topic_str, subscriber_t * new_sub)
+void touch_table(table_t * table)
+{
+	/* Assumes the table mutex is locked before calling this function */
+	__atomic_add_fetch(&table->version, 1, __ATOMIC_RELEASE);
+}
+
+void lock_table(table_t * table)
+{
+	TRACE(lock_wait, table, 0);
+	pthread_mutex_lock(table->lock);
+	TRACE(lock_acquire, table, 0);
+}
+
+void unlock_table(table_t * table)
+{
+	TRACE(lock_release, table, 0);
+	pthread_mutex_unlock(table->lock);
+}
+
+int insert_sub(table_t * table, uint32_t id, subscriber_t * new_sub)
 {
-	/* Get the topic or create if it does not exist */
-	topic_t * topic = set_topic(table, topic_str);
+	topic_t * topic = topic_by_id(table, id);
 	if (topic == NULL) {
 		return ERR;
 	}
 
+	/* Subscriber list is shared with the publishers and the stats snapshot */
+	lock_table(table);
+
 	/* First subscriber to add */
 	if (topic->subscriber == NULL) {
 		topic->subscriber = new_sub;
+		topic->num_subs = 1;
 		new_sub->prev = NULL;
 		new_sub->next = NULL;
+		touch_table(table);
+		unlock_table(table);
 		return OK;
 	}
 
 	/* Iterate to the end and check if it already exists in the list */
 	subscriber_t * iter = topic->subscriber;
 	for (;;) {
-		/* Already subscribed */
+		/* Already subscribed, the filter and compression of the new         */
+		/* subscription replace the old ones from the next message on         */
 		if (iter->csock == new_sub->csock && iter->ip == new_sub->ip && iter->port == new_sub->port) {
+			if (iter->filter != new_sub->filter || iter->compress != new_sub->compress) {
+				iter->filter = new_sub->filter;
+				iter->compress = new_sub->compress;
+				touch_table(table);
+			}
+			unlock_table(table);
 			return 1;
 		}
 		/* Last subscriber */
@@ -171,21 +321,32 @@ int insert_sub(table_t * table, char * topic_str, subscriber_t * new_sub)
 		iter = iter->next;
 	}
 
+	/* The topic is full */
+	if (table->admit.max_subs > 0 && topic->num_subs >= table->admit.max_subs) {
+		__atomic_add_fetch(&table->admit.full, 1, __ATOMIC_RELAXED);
+		unlock_table(table);
+		return ERR;
+	}
+
 	/* Append to the end of the subscriber list */
 	iter->next = new_sub;
 	new_sub->prev = iter;
 	new_sub->next = NULL;
+	topic->num_subs++;
+	touch_table(table);
+	unlock_table(table);
 	return OK;
 }
 
-void remove_sub(table_t * table, char * topic_str, subscriber_t sub)
+int remove_sub(table_t * table, uint32_t id, subscriber_t sub)
 {
-	topic_t * topic = get_topic(table, topic_str);
-	if (topic == NULL || topic->subscriber == NULL) {
-		return;
+	topic_t * topic = topic_by_id(table, id);
+	if (topic == NULL) {
+		return ERR;
 	}
 
 	/* Iterate to the given subscriber */
+	lock_table(table);
 	subscriber_t * iter = topic->subscriber;
 	for (;;) {
 		if (iter == NULL) {
@@ -199,7 +360,8 @@ void remove_sub(table_t * table, char * topic_str, subscriber_t sub)
 
 	/* Subscriber not found in given topic */
 	if (iter == NULL) {
-		return;
+		unlock_table(table);
+		return ERR;
 	}
 
 	/* Unlink the subscriber and free it */
@@ -207,14 +369,61 @@ void remove_sub(table_t * table, char * topic_str, subscriber_t sub)
 		topic->subscriber = NULL;
 	} else if (iter->prev == NULL) {
 		topic->subscriber = iter->next;
+		iter->next->prev = NULL;
 	} else if (iter->next == NULL) {
 		iter->prev->next = NULL;
 	} else {
 		iter->prev->next = iter->next;
 		iter->next->prev = iter->prev;
 	}
+	topic->num_subs--;
+	touch_table(table);
+	unlock_table(table);
 
 	free(iter);
+	return OK;
+}
+
+int set_filter(table_t * table, topic_t * topic, const filter_t * filter)
+{
+	lock_table(table);
+	if (topic->filters == NULL) {
+		if (admit_mem(&table->admit, sizeof(filter_set_t)) != OK) {
+			unlock_table(table);
+			return ERR;
+		}
+		filter_set_t * set = init_filters();
+		if (set == NULL) {
+			release_mem(&table->admit, sizeof(filter_set_t));
+			unlock_table(table);
+			return ERR;
+		}
+
+		/* Fan-outs load it without the lock */
+		__atomic_store_n(&topic->filters, set, __ATOMIC_RELEASE);
+	}
+	int index = add_filter(topic->filters, filter);
+	unlock_table(table);
+
+	return index;
+}
+
+int get_subs(table_t * table, topic_t * topic, subscriber_t ** subs)
+{
+	lock_table(table);
+	*subs = malloc(sizeof(subscriber_t) * (topic->num_subs + 1));
+	if (*subs == NULL) {
+		unlock_table(table);
+		return ERR;
+	}
+
+	int num = 0;
+	for (subscriber_t * iter = topic->subscriber; iter != NULL; iter = iter->next) {
+		(*subs)[num++] = *iter;
+	}
+	unlock_table(table);
+
+	return num;
 }
 
 void cleanup_table(table_t * table)
@@ -255,6 +464,9 @@ void cleanup_table(table_t * table)
 				// close(list->csock);
 			}
 
+			cleanup_shm(table->map[i]->shm);
+			cleanup_mcast_topic(table->map[i]->mcast);
+			free(table->map[i]->filters);
 			free(table->map[i]);
 			table->map[i] = NULL;
 		}
@@ -262,5 +474,15 @@ void cleanup_table(table_t * table)
 		table->map = NULL;
 	}
 
+	free(table->list);
+	table->list = NULL;
+
+	/* The names go with the arena */
+	while (table->arena != NULL) {
+		table_chunk_t * next = table->arena->next;
+		free(table->arena);
+		table->arena = next;
+	}
+
 	free(table);
 }
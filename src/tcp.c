@@ -1,9 +1,9 @@
 #include "tcp.h"
 
-int tcp_listen()
+int tcp_listen(uint32_t addr_ip, uint16_t port, int backlog, int flags)
 {
 	/* Create TCP socket for IPv4 */
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (sock < 0) {
 		perror("socket()");
 		return ERR;
@@ -13,15 +13,31 @@ int tcp_listen()
 	int opt = 1;
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
 		perror("setsockopt()");
+		close(sock);
+		return ERR;
+	}
+
+	/* Let the other listeners of the broker bind to the same port */
+	if ((flags & TCP_LISTEN_REUSEPORT) && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		perror("setsockopt(SO_REUSEPORT)");
+		close(sock);
+		return ERR;
+	}
+
+	/* Not waking up the accept loop until there is a command to read */
+	int defer = TCP_DEFER_SEC;
+	if ((flags & TCP_LISTEN_DEFER) && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0) {
+		perror("setsockopt(TCP_DEFER_ACCEPT)");
+		close(sock);
 		return ERR;
 	}
 
-	/* Bind socket to any available port */
+	/* Bind socket to the given address and port */
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(struct sockaddr_in));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(PORT_NUM);
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(addr_ip);
 	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 		perror("bind()");
 		close(sock);
@@ -29,7 +45,7 @@ int tcp_listen()
 	}
 
 	/* Set as passive socket */
-	if (listen(sock, SOCK_LISTEN_Q_LEN) < 0) {
+	if (listen(sock, backlog) < 0) {
 		perror("listen()");
 		close(sock);
 		return ERR;
@@ -38,13 +54,48 @@ int tcp_listen()
 	return sock;
 }
 
+int tcp_probe_port(uint32_t addr_ip, uint16_t * port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return ERR;
+	}
+
+	/* Connections of a previous broker left in TIME_WAIT do not count */
+	int opt = 1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(*port);
+	addr.sin_addr.s_addr = htonl(addr_ip);
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+		bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		tcp_local_port(sock, port) != OK) {
+		close(sock);
+		return ERR;
+	}
+
+	close(sock);
+	return OK;
+}
+
+int tcp_incoming_cpu(int sock, int cpu)
+{
+	if (setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+		return ERR;
+	}
+
+	return OK;
+}
+
 int tcp_accept(int sock, int * csock, uint32_t * ip, uint16_t * port)
 {
 	struct sockaddr_in caddr;
 	socklen_t caddrlen = sizeof(caddr);
 
-	/* Block until new connection requested */
-	*csock = accept(sock, (struct sockaddr *) &caddr, &caddrlen);
+	/* Block until new connection requested. Client sockets stay blocking */
+	/* since the handler threads use blocking reads and writes            */
+	*csock = accept4(sock, (struct sockaddr *) &caddr, &caddrlen, SOCK_CLOEXEC);
 	if (*csock < 0) {
 		return ERR;
 	}
@@ -54,6 +105,42 @@ int tcp_accept(int sock, int * csock, uint32_t * ip, uint16_t * port)
 	return OK;
 }
 
+int tcp_local_port(int sock, uint16_t * port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(sock, (struct sockaddr *) &addr, &len) < 0) {
+		return ERR;
+	}
+
+	*port = ntohs(addr.sin_port);
+	return OK;
+}
+
+int tcp_connect(uint32_t addr_ip, uint16_t port, int timeout_sec)
+{
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return ERR;
+	}
+
+	/* connect() gives up after the send timeout, which is reset after */
+	struct timeval wait_time = { timeout_sec, 0 }, no_wait = { 0, 0 };
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(addr_ip);
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &wait_time, sizeof(wait_time)) < 0 ||
+		connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &no_wait, sizeof(no_wait)) < 0) {
+		close(sock);
+		return ERR;
+	}
+
+	return sock;
+}
+
 int tcp_write(int csock, const char * msg, size_t len)
 {
 	if (write(csock, msg, len) < 0) {
@@ -0,0 +1,80 @@
+#include "trace.h"
+
+#if defined(TRACE_RING)
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_head = 0;
+static uint32_t trace_threads = 0;
+static __thread uint32_t trace_thread = 0;
+#endif
+
+void trace_record(enum TRACE_ID id, uint64_t a, uint64_t b)
+{
+#if defined(TRACE_RING)
+	/* Number the threads on their first probe, cheaper than gettid() */
+	if (trace_thread == 0) {
+		trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* Claim a slot, the oldest record in it is overwritten */
+	uint64_t index = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	trace_record_t * record = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+
+	/* Mark it as being written, fill it, then publish it */
+	__atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	record->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	record->thread = trace_thread;
+	record->id = id;
+	record->a = a;
+	record->b = b;
+	__atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+uint64_t trace_snapshot(trace_record_t * records)
+{
+	uint64_t num = 0;
+#if defined(TRACE_RING)
+	uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+	for (uint64_t index = start; index < head; index++) {
+		trace_record_t * record = &trace_ring[index & (TRACE_RING_SIZE - 1)];
+
+		/* Copy, then check the record did not change during the copy */
+		uint64_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		if (seq != index + 1) {
+			continue;
+		}
+		records[num] = *record;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		records[num].seq = seq;
+		num++;
+	}
+#endif
+	return num;
+}
+
+const char * trace_name(enum TRACE_ID id)
+{
+	static const char * names[TRACE_NUM_IDS] = {
+		[TRACE_ID_accept] = "accept",
+		[TRACE_ID_parse] = "parse",
+		[TRACE_ID_lookup] = "lookup",
+		[TRACE_ID_lock_wait] = "lock_wait",
+		[TRACE_ID_lock_acquire] = "lock_acquire",
+		[TRACE_ID_lock_release] = "lock_release",
+		[TRACE_ID_heartbeat_start] = "heartbeat_start",
+		[TRACE_ID_heartbeat_done] = "heartbeat_done",
+		[TRACE_ID_send_start] = "send_start",
+		[TRACE_ID_send_done] = "send_done",
+		[TRACE_ID_publish_done] = "publish_done",
+	};
+	return (id < TRACE_NUM_IDS && names[id] != NULL) ? names[id] : "unknown";
+}
@@ -1,6 +1,6 @@
 #include "tui.h"
 
-ui_t * init_tui()
+ui_t * init_tui(logger_t * logger)
 {
 	/* Initialize ncurses mode */
 	initscr();
@@ -12,13 +12,22 @@ ui_t * init_tui()
 	}
 
 	/* Initialize UI and its fields */
-	ui_t * ui = malloc(sizeof(ui_t));
+	ui_t * ui = calloc(1, sizeof(ui_t));
 	if (ui == NULL) {
 		perror("malloc(ui_t)");
 		return NULL;
 	}
 	ui->index = 0;
+	ui->page = 1;
+	ui->redraw = true;
+	ui->headless = false;
+	ui->logger = logger;
 	ui->status = START;
+	memset(&ui->snap, 0, sizeof(tui_snapshot_t));
+	ui->drawn_log_seq = 0;
+	ui->drawn_index = 0;
+	ui->drawn_port = 0;
+	memset(&ui->drawn_admit, 0, sizeof(admit_t));
 
 	/* Initialize the semaphore for indicating refresh */
 	ui->update_sem = malloc(sizeof(sem_t));
@@ -28,15 +37,6 @@ ui_t * init_tui()
 		return NULL;
 	}
 
-	/* Initialize the logs */
-	ui->log_head = 0;
-	ui->log_tail = 0;
-	for (int i = 0; i < TUI_LOGGER_HEIGHT; i++) {
-		for (int j = 0; j < TUI_LOGGER_LENGTH; j++) {
-			memset(ui->logs[i], 0, TUI_LOGGER_LENGTH+1);
-		}
-	}
-
 	/* Allocate new windows for logging, table, and keys */
 	int width = getmaxx(stdscr);
 	int height = getmaxy(stdscr);
@@ -87,36 +87,18 @@ ui_t * init_tui()
 	return ui;
 }
 
-void log_tui(ui_t * ui, char * message)
+ui_t * init_headless(logger_t * logger)
 {
-	if (ui == NULL || message == NULL) {
-		return;
-	}
-
-	/* If there is something at tail, clear it before overwriting */
-	if (ui->logs[ui->log_head][0] != 0) {
-		memset(ui->logs[ui->log_head], 0, TUI_LOGGER_LENGTH+1);
-	}
-
-	/* If the oldest message needs to be cleared, increment the tail */
-	if (ui->log_head == ui->log_tail) {
-		ui->log_tail++;
-		if (ui->log_tail >= TUI_LOGGER_HEIGHT) {
-			ui->log_tail = 0;
-		}
-	}
-
-	/* Copy in length of whatever is shorter */
-	strncpy(ui->logs[ui->log_head], message, MIN(TUI_LOGGER_LENGTH, strlen(message)));
-
-	/* If it goes beyond, wrap around */
-	ui->log_head++;
-	if (ui->log_head >= TUI_LOGGER_HEIGHT) {
-		ui->log_head = 0;
+	ui_t * ui = calloc(1, sizeof(ui_t));
+	if (ui == NULL) {
+		perror("calloc(ui_t)");
+		return NULL;
 	}
+	ui->headless = true;
+	ui->logger = logger;
+	ui->status = START;
 
-	/* Signal to update */
-	sem_post(ui->update_sem);
+	return ui;
 }
 
 void * run_tui(void * args)
@@ -132,17 +114,33 @@ void * run_tui(void * args)
 		return NULL;
 	}
 
-	/* Refresh the UI when needed */
+	struct timespec next;
+	clock_gettime(CLOCK_REALTIME, &next);
+
+	/* Refresh the UI at most once per frame */
 	for (;;) {
 		/* Check status and quit if FINISH */
 		if (ui->status == FINISH) {
 			return NULL;
 		}
 
-		/* Wait for update */
-		sem_wait(ui->update_sem);
-		if (ui->status == FINISH) {
-			return NULL;
+		/* Wait for the next frame. Posting only wakes up to check the status */
+		while (sem_timedwait(ui->update_sem, &next) == OK) {
+			if (ui->status == FINISH) {
+				return NULL;
+			}
+		}
+
+		/* Schedule the next frame, skipping the ones that were missed */
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		next.tv_nsec += TUI_FRAME_NSEC;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		if (next.tv_sec < now.tv_sec || (next.tv_sec == now.tv_sec && next.tv_nsec < now.tv_nsec)) {
+			next = now;
 		}
 
 		/* There should be enough space to display topics and subscribers */
@@ -152,31 +150,142 @@ void * run_tui(void * args)
 			clear_screens(ui, true);
 			mvwprintw(ui->title_scr, 0, 1, "Screen too small to display topics and subscribers...");
 			wrefresh(ui->title_scr);
+			ui->redraw = true;
 			continue;
 		}
+		ui->page = getmaxy(ui->table_scr) - TUI_BORDERS;
+
+		/* Clearing makes the next refresh repaint the whole screen */
+		bool redraw = ui->redraw;
+		if (redraw) {
+			ui->redraw = false;
+			clear_screens(ui, false);
+		}
 
-		display_server_info(ui);
-		display_logs(ui);
-		display_table(ui, table);
-		display_subscribers(ui, table);
-		display_keys(ui);
+		/* Only redraw the windows whose content changed since the last frame */
+		uint64_t version = __atomic_load_n(&table->version, __ATOMIC_ACQUIRE);
+		int index = ui->index;
+		if (redraw || version != ui->snap.version || index != ui->drawn_index) {
+			if (snapshot_tui(ui, table) == OK) {
+				ui->drawn_index = index;
+				display_table(ui);
+				display_subscribers(ui);
+			}
+		}
+		uint64_t log_seq = __atomic_load_n(&ui->logger->recent_seq, __ATOMIC_RELAXED);
+		if (redraw || log_seq != ui->drawn_log_seq) {
+			ui->drawn_log_seq = log_seq;
+			display_logs(ui);
+		}
+		admit_t admit;
+		snapshot_admit(&table->admit, &admit);
+		if (redraw || ui->port != ui->drawn_port || memcmp(&admit, &ui->drawn_admit, sizeof(admit_t)) != 0) {
+			ui->drawn_port = ui->port;
+			ui->drawn_admit = admit;
+			display_server_info(ui);
+			display_keys(ui);
+		}
+
+		/* Send all the changed windows to the terminal at once */
+		doupdate();
 	}
 }
 
+int snapshot_tui(ui_t * ui, table_t * table)
+{
+	tui_snapshot_t * snap = &ui->snap;
+	int rows = ui->page;
+	int sub_rows = getmaxy(ui->topic_scr) - TUI_BORDERS;
+
+	/* Grow the snapshot if the screen got bigger */
+	if (rows > snap->rows_size) {
+		uint32_t * ids = realloc(snap->ids, sizeof(uint32_t) * rows);
+		if (ids == NULL) {
+			return ERR;
+		}
+		snap->ids = ids;
+		const char ** topics = realloc(snap->topics, sizeof(char *) * rows);
+		if (topics == NULL) {
+			return ERR;
+		}
+		snap->topics = topics;
+		snap->rows_size = rows;
+	}
+	if (sub_rows > snap->subs_size) {
+		subscriber_t * subs = realloc(snap->subs, sizeof(subscriber_t) * sub_rows);
+		if (subs == NULL) {
+			return ERR;
+		}
+		snap->subs = subs;
+		snap->subs_size = sub_rows;
+	}
+
+	lock_table(table);
+	snap->version = table->version;
+	snap->num_topics = table->num_topics;
+	snap->rows = 0;
+	snap->num_subs = 0;
+	snap->sub_rows = 0;
+	if (snap->num_topics == 0) {
+		unlock_table(table);
+		snap->index = 0;
+		snap->offset = 0;
+		return OK;
+	}
+
+	/* Scroll just enough for the selected topic to be on the screen */
+	snap->index = ui->index < snap->num_topics ? ui->index : snap->num_topics - 1;
+	if (snap->index < snap->offset) {
+		snap->offset = snap->index;
+	} else if (snap->index >= snap->offset + rows) {
+		snap->offset = snap->index - rows + 1;
+	}
+
+	/* Copy only the visible rows, names are never freed so they are not copied */
+	while (snap->rows < rows && snap->offset + snap->rows < snap->num_topics) {
+		topic_t * topic = table->list[snap->offset + snap->rows];
+		snap->ids[snap->rows] = topic->id;
+		snap->topics[snap->rows] = topic->str;
+		snap->rows++;
+	}
+
+	/* Copy the subscribers of the selected topic that fit on the screen */
+	topic_t * topic = table->list[snap->index];
+	snap->num_subs = topic->num_subs;
+	for (subscriber_t * sub = topic->subscriber; sub != NULL && snap->sub_rows < sub_rows; sub = sub->next) {
+		snap->subs[snap->sub_rows++] = *sub;
+	}
+	unlock_table(table);
+
+	return OK;
+}
+
 void display_server_info(const ui_t * ui)
 {
-	/* Clear the previous stuff on screen */
-	wclear(ui->title_scr);
+	/* Erase the previous stuff on screen */
+	werase(ui->title_scr);
 
 	/* Display at the top */
 	mvwprintw(ui->title_scr, 0, 1, "Bridge - %s:%u", ui->ip, ui->port);
-	wrefresh(ui->title_scr);
+
+	/* Then what is used of the limits, only the usage if there is none */
+	const admit_t * admit = &ui->drawn_admit;
+	wprintw(ui->title_scr, "  Conns %lu", admit->conns);
+	if (admit->max_conns > 0) {
+		wprintw(ui->title_scr, "/%lu", admit->max_conns);
+	}
+	wprintw(ui->title_scr, "  Mem %.1f", admit->mem / 1048576.0);
+	if (admit->budget > 0) {
+		wprintw(ui->title_scr, "/%lu", admit->budget >> 20);
+	}
+	wprintw(ui->title_scr, " MiB  Rejected %lu  Full %lu  Shed %lu", admit->rejected, admit->full, admit->shed);
+	wnoutrefresh(ui->title_scr);
 }
 
 void display_logs(const ui_t * ui)
 {
-	/* Clear the previous stuff on screen */
-	wclear(ui->log_scr);
+	/* Erase the previous stuff on screen */
+	werase(ui->log_scr);
 
 	/* Border */
 	box(ui->log_scr, 0, 0);
@@ -184,115 +293,83 @@ void display_logs(const ui_t * ui)
 	/* Title */
 	mvwprintw(ui->log_scr, 0, 2, "Logs");
 
-	/* Print the actual logs */
+	/* Print the actual logs, oldest first */
+	logger_t * logger = ui->logger;
+	pthread_mutex_lock(logger->lock);
 	for (int i = 0; i < TUI_LOGGER_HEIGHT; i++) {
-		int index = (ui->log_tail + i) % TUI_LOGGER_HEIGHT;
+		int index = (logger->recent_head + i) % TUI_LOGGER_HEIGHT;
 
 		/* Empty, skip */
-		if (ui->logs[index][0] == 0) {
+		if (logger->recent[index][0] == 0) {
 			continue;
 		}
 
 		wmove(ui->log_scr, i+1, 1);
-		wprintw(ui->log_scr, ui->logs[index]);
+		wprintw(ui->log_scr, "%s", logger->recent[index]);
 	}
+	pthread_mutex_unlock(logger->lock);
 
-	wrefresh(ui->log_scr);
+	wnoutrefresh(ui->log_scr);
 }
 
-void display_table(const ui_t * ui, const table_t * table)
+void display_table(const ui_t * ui)
 {
-	/* Clear the previous stuff on screen */
-	wclear(ui->table_scr);
+	const tui_snapshot_t * snap = &ui->snap;
+
+	/* Erase the previous stuff on screen */
+	werase(ui->table_scr);
 
 	/* Border */
 	box(ui->table_scr, 0, 0);
 
 	/* Title */
-	mvwprintw(ui->table_scr, 0, 2, "Table (%ld)", table->num_topics);
+	mvwprintw(ui->table_scr, 0, 2, "Table (%lu)", snap->num_topics);
 
-	/* Return if nothing in table */
-	if (table->num_topics == 0) {
-		wrefresh(ui->table_scr);
-		return;
-	}
-
-	/* Print the entries in the table */
-	int num = 0;
-	for (int i = 0; i < table->map_size; i++) {
-		if (table->map[i] == NULL) {
-			continue;
-		}
+	/* Print the visible entries in the table */
+	for (int i = 0; i < snap->rows; i++) {
 
 		/* Highlight the current selection */
-		if (num == ui->index) {
+		bool selected = snap->offset + i == snap->index;
+		if (selected) {
 			wattron(ui->table_scr, A_STANDOUT);
 		}
 
-		/* Adding 1s since border */
-		pthread_mutex_lock(table->lock);
-		mvwprintw(ui->table_scr, num+1, 1, table->map[i]->str);
-		pthread_mutex_unlock(table->lock);
-		if (num == ui->index) {
+		/* Adding 1s since border, cutting long names at the border */
+		mvwprintw(ui->table_scr, i+1, 1, "%4u %.*s", snap->ids[i], TUI_TABLE_WIDTH - TUI_BORDERS - 5, snap->topics[i]);
+		if (selected) {
 			wattroff(ui->table_scr, A_STANDOUT);
 		}
-		num++;
 	}
 
-	wrefresh(ui->table_scr);
+	wnoutrefresh(ui->table_scr);
 }
 
-void display_subscribers(const ui_t * ui, const table_t * table)
+void display_subscribers(const ui_t * ui)
 {
-	/* Clear the previous stuff on screen */
-	wclear(ui->topic_scr);
+	const tui_snapshot_t * snap = &ui->snap;
+
+	/* Erase the previous stuff on screen */
+	werase(ui->topic_scr);
 
 	/* Border */
 	box(ui->topic_scr, 0, 0);
 
-	/* Return if nothing in table */
-	if (table->num_topics == 0) {
-		wrefresh(ui->topic_scr);
-		return;
-	}
-
-	/* Iterate to the currently selected topic */
-	int topic_num = 0, count = 0;
-	for (int i = 0; i < table->map_size; i++) {
-		if (table->map[i] == NULL) {
-			continue;
-		}
-
-		/* Print all the subscribers to the topic */
-		if (topic_num == ui->index) {
-			pthread_mutex_lock(table->lock);
-			subscriber_t * subscriber = table->map[i]->subscriber;
-			while (subscriber != NULL) {
-
-				uint32_t ip = subscriber->ip;
-				unsigned int f4 = 0xff & ip; ip = ip >> 8;
-				unsigned int f3 = 0xff & ip; ip = ip >> 8;
-				unsigned int f2 = 0xff & ip; ip = ip >> 8;
-				unsigned int f1 = 0xff & ip;
+	/* Print the subscribers of the selected topic that were copied */
+	for (int i = 0; i < snap->sub_rows; i++) {
+		uint32_t ip = snap->subs[i].ip;
+		unsigned int f4 = 0xff & ip; ip = ip >> 8;
+		unsigned int f3 = 0xff & ip; ip = ip >> 8;
+		unsigned int f2 = 0xff & ip; ip = ip >> 8;
+		unsigned int f1 = 0xff & ip;
 
-				/* Adding 1s since border */
-				mvwprintw(ui->topic_scr, count+1, 1, "[%d] %u.%u.%u.%u : %u", subscriber->csock, f1, f2, f3, f4, subscriber->port);
-
-				subscriber = subscriber->next;
-				count++;
-			}
-			pthread_mutex_unlock(table->lock);
-			break;
-		}
-
-		/* If not current selected topic, increment */
-		topic_num++;
+		/* Adding 1s since border */
+		mvwprintw(ui->topic_scr, i+1, 1, "[%d] %u.%u.%u.%u : %u", snap->subs[i].csock, f1, f2, f3, f4, snap->subs[i].port);
 	}
 
 	/* Title */
-	mvwprintw(ui->topic_scr, 0, 2, "Subscribers (%d)", count);
+	mvwprintw(ui->topic_scr, 0, 2, "Subscribers (%lu)", snap->num_subs);
 
-	wrefresh(ui->topic_scr);
+	wnoutrefresh(ui->topic_scr);
 }
 
 void display_keys(const ui_t * ui)
@@ -307,11 +384,19 @@ void display_keys(const ui_t * ui)
 	wattron(ui->key_scr, A_STANDOUT);
 	waddstr(ui->key_scr, " Move Down ");
 	wattroff(ui->key_scr, A_STANDOUT);
+	waddstr(ui->key_scr, " PgUp/PgDn ");
+	wattron(ui->key_scr, A_STANDOUT);
+	waddstr(ui->key_scr, " Page ");
+	wattroff(ui->key_scr, A_STANDOUT);
+	waddstr(ui->key_scr, " Home/End ");
+	wattron(ui->key_scr, A_STANDOUT);
+	waddstr(ui->key_scr, " First/Last ");
+	wattroff(ui->key_scr, A_STANDOUT);
 	waddstr(ui->key_scr, " q ");
 	wattron(ui->key_scr, A_STANDOUT);
 	waddstr(ui->key_scr, " Quit ");
 	wattroff(ui->key_scr, A_STANDOUT);
-	wrefresh(ui->key_scr);
+	wnoutrefresh(ui->key_scr);
 }
 
 void clear_screens(const ui_t * ui, bool refresh)
@@ -333,6 +418,12 @@ void clear_screens(const ui_t * ui, bool refresh)
 
 void cleanup_ui(ui_t * ui)
 {
+	/* Nothing from ncurses to clean in headless mode */
+	if (ui != NULL && ui->headless) {
+		free(ui);
+		return;
+	}
+
 	/* End curses mode */
 	endwin();
 
@@ -357,11 +448,20 @@ void cleanup_ui(ui_t * ui)
 			delwin(ui->table_scr);
 			ui->table_scr = NULL;
 		}
+		if (ui->topic_scr != NULL) {
+			delwin(ui->topic_scr);
+			ui->topic_scr = NULL;
+		}
 		if (ui->key_scr != NULL) {
 			delwin(ui->key_scr);
 			ui->key_scr = NULL;
 		}
 
+		/* Free the snapshot */
+		free(ui->snap.ids);
+		free(ui->snap.topics);
+		free(ui->snap.subs);
+
 		free(ui);
 	}
 }
@@ -0,0 +1,107 @@
+#include "uds.h"
+
+int uds_listen(const char * path, int backlog)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error : socket path is too long\n");
+		return ERR;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Stream socket since the protocol is parsed as a byte-stream */
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket()");
+		return ERR;
+	}
+
+	/* Remove the socket file of a previous run, but nothing else */
+	struct stat st;
+	if (lstat(path, &st) == OK && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind()");
+		close(sock);
+		return ERR;
+	}
+
+	if (listen(sock, backlog) < 0) {
+		perror("listen()");
+		close(sock);
+		return ERR;
+	}
+
+	return sock;
+}
+
+int uds_send_fd(int csock, int fd, const char * msg, size_t len)
+{
+	struct iovec iov = { (void *) msg, len };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr mhdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&mhdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(csock, &mhdr, MSG_NOSIGNAL) < 0) {
+		return ERR;
+	}
+
+	return OK;
+}
+
+ssize_t uds_recv_fd(int sock, int * fd, char * msg, size_t len)
+{
+	struct iovec iov = { msg, len };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	struct msghdr mhdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t ret = recvmsg(sock, &mhdr, MSG_CMSG_CLOEXEC);
+	if (ret <= 0) {
+		return ERR;
+	}
+
+	*fd = ERR;
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&mhdr);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	return ret;
+}
+
+int uds_accept(int sock, int * csock)
+{
+	/* Block until new connection requested */
+	*csock = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+	if (*csock < 0) {
+		return ERR;
+	}
+
+	return OK;
+}
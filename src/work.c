@@ -0,0 +1,258 @@
+#include "work.h"
+
+workers_t * init_workers(int num_threads, int threshold)
+{
+	workers_t * workers = calloc(1, sizeof(workers_t));
+	if (workers == NULL) {
+		return NULL;
+	}
+
+	workers->queue = malloc(sizeof(work_t) * WORK_QUEUE_LEN);
+	workers->timers = malloc(sizeof(work_t) * WORK_TIMERS);
+	workers->threads = malloc(sizeof(pthread_t) * num_threads);
+	workers->lock = malloc(sizeof(pthread_mutex_t));
+	workers->ready = malloc(sizeof(pthread_cond_t));
+	if (workers->queue == NULL || workers->timers == NULL || workers->threads == NULL || workers->lock == NULL ||
+		workers->ready == NULL || pthread_mutex_init(workers->lock, NULL)) {
+		free(workers->queue);
+		free(workers->timers);
+		free(workers->threads);
+		free(workers->lock);
+		free(workers->ready);
+		free(workers);
+		return NULL;
+	}
+
+	/* Timed waits are on the clock of now_usec() */
+	pthread_condattr_t attr;
+	if (pthread_condattr_init(&attr) || pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+		pthread_cond_init(workers->ready, &attr)) {
+		pthread_condattr_destroy(&attr);
+		pthread_mutex_destroy(workers->lock);
+		free(workers->queue);
+		free(workers->timers);
+		free(workers->threads);
+		free(workers->lock);
+		free(workers->ready);
+		free(workers);
+		return NULL;
+	}
+	pthread_condattr_destroy(&attr);
+	workers->threshold = threshold;
+
+	/* Keep the threads that could be started */
+	for (int i = 0; i < num_threads; i++) {
+		if (pthread_create(&workers->threads[i], NULL, run_worker, workers)) {
+			break;
+		}
+		workers->num_threads++;
+	}
+	if (workers->num_threads == 0) {
+		cleanup_workers(workers);
+		return NULL;
+	}
+
+	return workers;
+}
+
+void * run_worker(void * args)
+{
+	workers_t * workers = (workers_t *) args;
+
+	pthread_mutex_lock(workers->lock);
+	for (;;) {
+		/* The timed items due go first, and all of them once finishing */
+		int next = next_timer(workers);
+		work_t work;
+		if (next != ERR && (workers->finish || workers->timers[next].due <= now_usec())) {
+			work = workers->timers[next];
+			workers->timers[next] = workers->timers[--workers->num_timers];
+		} else if (workers->head != workers->tail) {
+			work = workers->queue[workers->tail++ & (WORK_QUEUE_LEN - 1)];
+		} else if (workers->finish) {
+			break;
+		} else if (next != ERR) {
+			uint64_t due = workers->timers[next].due;
+			struct timespec until = { .tv_sec = due / 1000000, .tv_nsec = (due % 1000000) * 1000 };
+			pthread_cond_timedwait(workers->ready, workers->lock, &until);
+			continue;
+		} else {
+			pthread_cond_wait(workers->ready, workers->lock);
+			continue;
+		}
+		workers->items++;
+		workers->running++;
+		pthread_mutex_unlock(workers->lock);
+
+		work.fn(work.arg);
+		if (work.batch != NULL) {
+			end_batch_item(work.batch);
+		}
+
+		pthread_mutex_lock(workers->lock);
+		workers->running--;
+	}
+	pthread_mutex_unlock(workers->lock);
+
+	return NULL;
+}
+
+int queue_work(workers_t * workers, void (*fn)(void *), void * arg, work_batch_t * batch)
+{
+	pthread_mutex_lock(workers->lock);
+	bool queued = workers->head - workers->tail < WORK_QUEUE_LEN;
+	if (queued) {
+		workers->queue[workers->head++ & (WORK_QUEUE_LEN - 1)] = (work_t) { .fn = fn, .arg = arg, .batch = batch };
+		pthread_cond_signal(workers->ready);
+	}
+	pthread_mutex_unlock(workers->lock);
+
+	return queued ? OK : ERR;
+}
+
+int queue_work_at(workers_t * workers, void (*fn)(void *), void * arg, uint64_t due)
+{
+	pthread_mutex_lock(workers->lock);
+	bool queued = workers->num_timers < WORK_TIMERS && !workers->finish;
+	if (queued) {
+		workers->timers[workers->num_timers++] = (work_t) { .fn = fn, .arg = arg, .batch = NULL, .due = due };
+
+		/* Every idle worker may be waiting for a later one */
+		pthread_cond_broadcast(workers->ready);
+	}
+	pthread_mutex_unlock(workers->lock);
+
+	return queued ? OK : ERR;
+}
+
+int next_timer(workers_t * workers)
+{
+	int next = ERR;
+	for (int i = 0; i < workers->num_timers; i++) {
+		if (next == ERR || workers->timers[i].due < workers->timers[next].due) {
+			next = i;
+		}
+	}
+
+	return next;
+}
+
+void submit_work(workers_t * workers, void (*fn)(void *), void * arg, work_batch_t * batch)
+{
+	/* Every worker is behind, the submitter does it instead of waiting */
+	if (queue_work(workers, fn, arg, batch) != OK) {
+		__atomic_add_fetch(&workers->inline_items, 1, __ATOMIC_RELAXED);
+		fn(arg);
+		if (batch != NULL) {
+			end_batch_item(batch);
+		}
+	}
+}
+
+bool workers_idle(workers_t * workers)
+{
+	if (workers == NULL) {
+		return true;
+	}
+
+	pthread_mutex_lock(workers->lock);
+	bool idle = workers->head == workers->tail && workers->num_timers == 0 && workers->running == 0;
+	pthread_mutex_unlock(workers->lock);
+
+	return idle;
+}
+
+int init_batch(work_batch_t * batch)
+{
+	batch->pending = 0;
+	batch->lock = malloc(sizeof(pthread_mutex_t));
+	batch->done = malloc(sizeof(pthread_cond_t));
+	if (batch->lock == NULL || batch->done == NULL || pthread_mutex_init(batch->lock, NULL)) {
+		free(batch->lock);
+		free(batch->done);
+		batch->lock = NULL;
+		batch->done = NULL;
+		return ERR;
+	}
+	if (pthread_cond_init(batch->done, NULL)) {
+		pthread_mutex_destroy(batch->lock);
+		free(batch->lock);
+		free(batch->done);
+		batch->lock = NULL;
+		batch->done = NULL;
+		return ERR;
+	}
+
+	return OK;
+}
+
+void begin_batch(workers_t * workers, work_batch_t * batch, int items)
+{
+	__atomic_add_fetch(&workers->batches, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(batch->lock);
+	batch->pending += items;
+	pthread_mutex_unlock(batch->lock);
+}
+
+void end_batch_item(work_batch_t * batch)
+{
+	pthread_mutex_lock(batch->lock);
+	if (--batch->pending == 0) {
+		pthread_cond_signal(batch->done);
+	}
+	pthread_mutex_unlock(batch->lock);
+}
+
+void wait_batch(work_batch_t * batch)
+{
+	pthread_mutex_lock(batch->lock);
+	while (batch->pending > 0) {
+		pthread_cond_wait(batch->done, batch->lock);
+	}
+	pthread_mutex_unlock(batch->lock);
+}
+
+void cleanup_batch(work_batch_t * batch)
+{
+	if (batch->lock == NULL) {
+		return;
+	}
+
+	pthread_mutex_destroy(batch->lock);
+	pthread_cond_destroy(batch->done);
+	free(batch->lock);
+	free(batch->done);
+	batch->lock = NULL;
+	batch->done = NULL;
+}
+
+void cleanup_workers(workers_t * workers)
+{
+	if (workers == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(workers->lock);
+	workers->finish = true;
+	pthread_cond_broadcast(workers->ready);
+	pthread_mutex_unlock(workers->lock);
+	for (int i = 0; i < workers->num_threads; i++) {
+		pthread_join(workers->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(workers->lock);
+	pthread_cond_destroy(workers->ready);
+	free(workers->lock);
+	free(workers->ready);
+	free(workers->queue);
+	free(workers->timers);
+	free(workers->threads);
+	free(workers);
+}
+
+uint64_t now_usec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}